@@ -0,0 +1,60 @@
+<?php
+// gitrefresh.php -- Peteramati script for refreshing stale repositories
+// HotCRP and Peteramati are Copyright (c) 2006-2015 Eddie Kohler and others
+// Distributed under an MIT-like license; see LICENSE
+
+$ConfSiteBase = preg_replace(',/batch/[^/]+,', '', __FILE__);
+require_once("$ConfSiteBase/src/init.php");
+require_once("$ConfSiteBase/lib/getopt.php");
+
+$arg = getopt_rest($argv, "hfj:", array("help", "force", "jobs:", "per-host:"));
+if (isset($arg["h"]) || isset($arg["help"]) || count($arg["_"])) {
+    fwrite(STDOUT, "Usage: php batch/gitrefresh.php [-f] [-j JOBS] [--per-host N]\n");
+    exit(0);
+}
+
+// Overlapping runs (say, from cron while a long refresh is still going)
+// would fetch the same repositories, so only one runs at a time.
+$lockf = @fopen("$ConfSitePATH/log/gitrefresh.lock", "c");
+if (!$lockf) {
+    fwrite(STDERR, "$ConfSitePATH/log/gitrefresh.lock: cannot open\n");
+    exit(1);
+} else if (!flock($lockf, LOCK_EX | LOCK_NB))
+    exit(0);
+
+// A repository's deadline is its pset's next deadline. Deadlines that
+// passed within the hour still count, so last-minute pushes get fetched.
+function repo_refresh_deadline($pset) {
+    global $Now;
+    $deadline = 0;
+    if ($pset)
+        foreach (array($pset->deadline, $pset->deadline_college, $pset->deadline_extension) as $d)
+            if (is_int($d) && $d >= $Now - 3600 && (!$deadline || $d < $deadline))
+                $deadline = $d;
+    return $deadline;
+}
+
+$command = escapeshellarg("$ConfSitePATH/jail/pa-gitfetch") . " schedule";
+if (isset($arg["f"]) || isset($arg["force"]))
+    $command .= " -f";
+if (($jobs = @$arg["j"] ? : @$arg["jobs"]))
+    $command .= " -j " . escapeshellarg($jobs);
+if (($per_host = @$arg["per-host"]))
+    $command .= " --per-host " . escapeshellarg($per_host);
+
+$result = Dbl::qe("select repoid, cacheid, url, lastpset from Repository where snapcheckat<? order by lastpset desc, snapcheckat asc", $Now - 900);
+$lines = "";
+while (($row = edb_row($result)))
+    $lines .= "$row[0] $row[1] $row[2] " . repo_refresh_deadline(@Pset::$all[$row[3]]) . "\n";
+Dbl::free($result);
+if ($lines === "")
+    exit(0);
+
+$proc = proc_open($command, array(0 => array("pipe", "r")), $pipes);
+if (!$proc) {
+    fwrite(STDERR, "$command: cannot run\n");
+    exit(1);
+}
+fwrite($pipes[0], $lines);
+fclose($pipes[0]);
+exit(proc_close($proc));
@@ -0,0 +1,974 @@
+// gitobj.cc -- read objects from a git repository without running git
+
+#include "gitobj.hh"
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <errno.h>
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <zlib.h>
+#include <algorithm>
+
+// delta bases kept in memory, so chains sharing a base inflate it once
+static const size_t base_cache_limit = 64 << 20;
+
+static inline uint32_t sha1_rol(uint32_t x, int n) {
+    return (x << n) | (x >> (32 - n));
+}
+
+void sha1_context::transform(const unsigned char* block) {
+    uint32_t w[80];
+    for (int i = 0; i != 16; ++i)
+        w[i] = (uint32_t(block[4*i]) << 24) | (uint32_t(block[4*i+1]) << 16)
+            | (uint32_t(block[4*i+2]) << 8) | uint32_t(block[4*i+3]);
+    for (int i = 16; i != 80; ++i)
+        w[i] = sha1_rol(w[i-3] ^ w[i-8] ^ w[i-14] ^ w[i-16], 1);
+    uint32_t a = h_[0], b = h_[1], c = h_[2], d = h_[3], e = h_[4];
+    for (int i = 0; i != 80; ++i) {
+        uint32_t f, k;
+        if (i < 20)
+            f = (b & c) | (~b & d), k = 0x5A827999;
+        else if (i < 40)
+            f = b ^ c ^ d, k = 0x6ED9EBA1;
+        else if (i < 60)
+            f = (b & c) | (b & d) | (c & d), k = 0x8F1BBCDC;
+        else
+            f = b ^ c ^ d, k = 0xCA62C1D6;
+        uint32_t t = sha1_rol(a, 5) + f + e + k + w[i];
+        e = d, d = c, c = sha1_rol(b, 30), b = a, a = t;
+    }
+    h_[0] += a, h_[1] += b, h_[2] += c, h_[3] += d, h_[4] += e;
+}
+
+void sha1_context::update(const void* data, size_t n) {
+    const unsigned char* p = static_cast<const unsigned char*>(data);
+    size_t used = len_ % 64;
+    len_ += n;
+    if (used) {
+        size_t take = std::min(n, 64 - used);
+        memcpy(block_ + used, p, take);
+        p += take, n -= take;
+        if (used + take != 64)
+            return;
+        transform(block_);
+    }
+    for (; n >= 64; p += 64, n -= 64)
+        transform(p);
+    memcpy(block_, p, n);
+}
+
+std::string sha1_context::hexdigest() {
+    uint64_t bitlen = len_ * 8;
+    unsigned char pad[72] = { 0x80 };
+    size_t padlen = (len_ % 64 < 56 ? 56 : 120) - len_ % 64;
+    for (int i = 0; i != 8; ++i)
+        pad[padlen + i] = bitlen >> (56 - 8 * i);
+    update(pad, padlen + 8);
+    char buf[41];
+    for (int i = 0; i != 5; ++i)
+        sprintf(&buf[8*i], "%08x", (unsigned) h_[i]);
+    return std::string(buf, 40);
+}
+
+bool gitoid::parse(const char* s, size_t len) {
+    if (len != 40)
+        return false;
+    for (int i = 0; i != 40; ++i) {
+        char ch = s[i];
+        int v;
+        if (ch >= '0' && ch <= '9')
+            v = ch - '0';
+        else if (ch >= 'a' && ch <= 'f')
+            v = ch - 'a' + 10;
+        else if (ch >= 'A' && ch <= 'F')
+            v = ch - 'A' + 10;
+        else
+            return false;
+        if (i & 1)
+            b[i / 2] |= v;
+        else
+            b[i / 2] = v << 4;
+    }
+    return true;
+}
+
+std::string gitoid::hex() const {
+    static const char digits[] = "0123456789abcdef";
+    std::string s(40, '0');
+    for (int i = 0; i != 20; ++i) {
+        s[2 * i] = digits[b[i] >> 4];
+        s[2 * i + 1] = digits[b[i] & 15];
+    }
+    return s;
+}
+
+static bool read_file(const std::string& fn, std::string& data) {
+    int fd = ::open(fn.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd == -1)
+        return false;
+    data.clear();
+    char buf[65536];
+    ssize_t nr;
+    while ((nr = ::read(fd, buf, sizeof(buf))) > 0
+           || (nr == -1 && errno == EINTR))
+        if (nr > 0)
+            data.append(buf, nr);
+    int saved_errno = errno;
+    close(fd);
+    errno = saved_errno;
+    return nr == 0;
+}
+
+static bool is_dir(const std::string& fn) {
+    struct stat st;
+    return stat(fn.c_str(), &st) == 0 && S_ISDIR(st.st_mode);
+}
+
+static const unsigned char* map_file(const std::string& fn, size_t& len) {
+    int fd = ::open(fn.c_str(), O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if (fd == -1 || fstat(fd, &st) != 0 || st.st_size == 0) {
+        if (fd >= 0)
+            close(fd);
+        return nullptr;
+    }
+    void* p = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (p == MAP_FAILED)
+        return nullptr;
+    len = st.st_size;
+    return (const unsigned char*) p;
+}
+
+static inline uint32_t get_be32(const unsigned char* p) {
+    return ((uint32_t) p[0] << 24) | ((uint32_t) p[1] << 16)
+        | ((uint32_t) p[2] << 8) | p[3];
+}
+
+// Inflate `len` bytes at `p` into exactly `size` bytes. `consumed`, if
+// nonnull, gets the number of compressed bytes used. A `size` that `len`
+// bytes could not inflate to (deflate expands at most 1032:1) fails before
+// anything is allocated.
+static bool inflate_exact(const unsigned char* p, size_t len, size_t size,
+                          std::string& out, size_t* consumed = nullptr) {
+    if (size / 1032 > len)
+        return false;
+    // one spare byte detects overlong data and lets empty objects finish
+    out.resize(size + 1);
+    z_stream z;
+    memset(&z, 0, sizeof(z));
+    if (inflateInit(&z) != Z_OK)
+        return false;
+    z.next_in = const_cast<unsigned char*>(p);
+    z.avail_in = len;
+    z.next_out = (unsigned char*) &out[0];
+    z.avail_out = size + 1;
+    int r;
+    do {
+        r = inflate(&z, Z_FINISH);
+    } while (r == Z_OK);
+    bool ok = r == Z_STREAM_END && z.total_out == size;
+    out.resize(size);
+    if (consumed)
+        *consumed = z.total_in;
+    inflateEnd(&z);
+    return ok;
+}
+
+static bool apply_delta(const std::string& base, const unsigned char* d,
+                        size_t len, std::string& out) {
+    const unsigned char* end = d + len;
+    auto varint = [&](size_t& v) {
+        v = 0;
+        for (int shift = 0; d != end; shift += 7) {
+            unsigned char c = *d++;
+            v |= (size_t) (c & 0x7F) << shift;
+            if (!(c & 0x80))
+                return true;
+        }
+        return false;
+    };
+    size_t srclen, dstlen;
+    if (!varint(srclen) || !varint(dstlen) || srclen != base.length())
+        return false;
+    out.clear();
+    out.reserve(dstlen);
+    while (d != end) {
+        unsigned char op = *d++;
+        if (op & 0x80) {
+            size_t off = 0, n = 0;
+            for (int i = 0; i != 4; ++i)
+                if (op & (1 << i)) {
+                    if (d == end)
+                        return false;
+                    off |= (size_t) *d++ << (8 * i);
+                }
+            for (int i = 0; i != 3; ++i)
+                if (op & (0x10 << i)) {
+                    if (d == end)
+                        return false;
+                    n |= (size_t) *d++ << (8 * i);
+                }
+            if (n == 0)
+                n = 0x10000;
+            if (off + n > base.length() || off + n < off)
+                return false;
+            out.append(base, off, n);
+        } else if (op) {
+            if ((size_t) (end - d) < op)
+                return false;
+            out.append((const char*) d, op);
+            d += op;
+        } else
+            return false;
+    }
+    return out.length() == dstlen;
+}
+
+
+gitrepo::~gitrepo() {
+    for (auto& p : packs_) {
+        munmap(const_cast<unsigned char*>(p.idx), p.idxlen);
+        munmap(const_cast<unsigned char*>(p.data), p.datalen);
+    }
+    if (graph_.data)
+        munmap(const_cast<unsigned char*>(graph_.data), graph_.len);
+}
+
+bool gitrepo::fail(const std::string& msg) {
+    error_ = msg;
+    return false;
+}
+
+bool gitrepo::open(const std::string& dir) {
+    std::string d = dir;
+    while (d.length() > 1 && d.back() == '/')
+        d.pop_back();
+    if (is_dir(d + "/.git/objects"))
+        gitdir_ = d + "/.git";
+    else if (is_dir(d + "/objects"))
+        gitdir_ = d;
+    else {
+        errno = ENOENT;
+        return fail(dir + ": Not a git repository");
+    }
+    add_objdir(gitdir_ + "/objects", 0);
+    open_graph();
+    return true;
+}
+
+void gitrepo::add_objdir(const std::string& dir, int depth) {
+    if (depth > 5 || std::find(objdirs_.begin(), objdirs_.end(), dir) != objdirs_.end())
+        return;
+    objdirs_.push_back(dir);
+
+    // packs, newest first since new objects are likelier to be wanted
+    std::vector<std::pair<time_t, std::string> > idxs;
+    if (DIR* dirp = opendir((dir + "/pack").c_str())) {
+        while (struct dirent* de = readdir(dirp)) {
+            size_t l = strlen(de->d_name);
+            struct stat st;
+            std::string fn = dir + "/pack/" + de->d_name;
+            if (l > 4 && memcmp(de->d_name + l - 4, ".idx", 4) == 0
+                && stat(fn.c_str(), &st) == 0)
+                idxs.push_back(std::make_pair(st.st_mtime, fn));
+        }
+        closedir(dirp);
+    }
+    std::sort(idxs.begin(), idxs.end(),
+              [](const std::pair<time_t, std::string>& a,
+                 const std::pair<time_t, std::string>& b) {
+                  return a.first > b.first;
+              });
+    for (auto& it : idxs) {
+        pack p;
+        p.path = it.second.substr(0, it.second.length() - 4) + ".pack";
+        p.idx = map_file(it.second, p.idxlen);
+        p.data = p.idx ? map_file(p.path, p.datalen) : nullptr;
+        if (p.data && p.idxlen >= 8 + 1024 && p.datalen >= 32
+            && memcmp(p.idx, "\377tOc", 4) == 0 && get_be32(p.idx + 4) == 2
+            && memcmp(p.data, "PACK", 4) == 0) {
+            p.nobjects = get_be32(p.idx + 8 + 255 * 4);
+            if (p.idxlen >= 8 + 1024 + (size_t) p.nobjects * 28 + 40) {
+                packs_.push_back(p);
+                continue;
+            }
+        }
+        if (p.idx)
+            munmap(const_cast<unsigned char*>(p.idx), p.idxlen);
+        if (p.data)
+            munmap(const_cast<unsigned char*>(p.data), p.datalen);
+    }
+
+    // alternates
+    std::string alternates;
+    if (read_file(dir + "/info/alternates", alternates)) {
+        size_t pos = 0;
+        while (pos < alternates.length()) {
+            size_t nl = alternates.find('\n', pos);
+            if (nl == std::string::npos)
+                nl = alternates.length();
+            std::string alt = alternates.substr(pos, nl - pos);
+            if (!alt.empty() && alt[0] != '#')
+                add_objdir(alt[0] == '/' ? alt : dir + "/" + alt, depth + 1);
+            pos = nl + 1;
+        }
+    }
+}
+
+// A single-file commit-graph gives each commit's tree, parents, commit
+// time, and generation number without inflating it. Split graphs and
+// graphs that do not parse are ignored.
+void gitrepo::open_graph() {
+    commit_graph& g = graph_;
+    g.data = map_file(gitdir_ + "/objects/info/commit-graph", g.len);
+    if (!g.data)
+        return;
+    const unsigned char* end = g.data + g.len;
+    unsigned nchunks = g.len >= 8 ? g.data[6] : 0;
+    if (g.len < 8 + 12 * (size_t) (nchunks + 1)
+        || memcmp(g.data, "CGPH", 4) != 0 || g.data[4] != 1
+        || g.data[5] != 1 || g.data[7] != 0) {
+        munmap(const_cast<unsigned char*>(g.data), g.len);
+        g = commit_graph();
+        return;
+    }
+    for (unsigned i = 0; i != nchunks; ++i) {
+        const unsigned char* c = g.data + 8 + 12 * i;
+        uint64_t off = ((uint64_t) get_be32(c + 4) << 32) | get_be32(c + 8);
+        uint64_t next = ((uint64_t) get_be32(c + 16) << 32) | get_be32(c + 20);
+        if (off > g.len || next > g.len || next < off)
+            break;
+        const unsigned char* p = g.data + off;
+        if (memcmp(c, "OIDF", 4) == 0 && next - off == 1024)
+            g.fanout = p;
+        else if (memcmp(c, "OIDL", 4) == 0)
+            g.oids = p;
+        else if (memcmp(c, "CDAT", 4) == 0)
+            g.cdat = p;
+        else if (memcmp(c, "EDGE", 4) == 0) {
+            g.edges = p;
+            g.nedges = (next - off) / 4;
+        }
+    }
+    if (g.fanout)
+        g.ncommits = get_be32(g.fanout + 255 * 4);
+    if (!g.fanout || !g.oids || !g.cdat
+        || g.oids + 20 * (size_t) g.ncommits > end
+        || g.cdat + 36 * (size_t) g.ncommits > end) {
+        munmap(const_cast<unsigned char*>(g.data), g.len);
+        g = commit_graph();
+    }
+}
+
+bool gitrepo::graph_commit(const gitoid& oid, gitcommit& commit) {
+    const commit_graph& g = graph_;
+    if (!g.data)
+        return false;
+    uint32_t lo = oid.b[0] ? get_be32(g.fanout + 4 * (oid.b[0] - 1)) : 0;
+    uint32_t hi = get_be32(g.fanout + 4 * oid.b[0]);
+    while (lo < hi) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        int cmp = memcmp(g.oids + 20 * (size_t) mid, oid.b, 20);
+        if (cmp < 0)
+            lo = mid + 1;
+        else if (cmp > 0)
+            hi = mid;
+        else {
+            const unsigned char* d = g.cdat + 36 * (size_t) mid;
+            auto add_parent = [&](uint32_t pos) {
+                if (pos >= g.ncommits)
+                    return false;
+                gitoid p;
+                memcpy(p.b, g.oids + 20 * (size_t) pos, 20);
+                commit.parents.push_back(p);
+                return true;
+            };
+            memcpy(commit.tree.b, d, 20);
+            commit.parents.clear();
+            uint32_t p1 = get_be32(d + 20), p2 = get_be32(d + 24);
+            if (p1 != 0x70000000U && !add_parent(p1))
+                return false;
+            if (p2 & 0x80000000U) {
+                // octopus: the rest of the parents are in the EDGE chunk
+                for (size_t e = p2 & 0x7FFFFFFFU; ; ++e) {
+                    if (e >= g.nedges)
+                        return false;
+                    uint32_t x = get_be32(g.edges + 4 * e);
+                    if (!add_parent(x & 0x7FFFFFFFU))
+                        return false;
+                    if (x & 0x80000000U)
+                        break;
+                }
+            } else if (p2 != 0x70000000U && !add_parent(p2))
+                return false;
+            uint32_t hi32 = get_be32(d + 28), lo32 = get_be32(d + 32);
+            commit.generation = hi32 >> 2;
+            commit.time = ((int64_t) (hi32 & 3) << 32) | lo32;
+            commit.full = false;
+            return true;
+        }
+    }
+    return false;
+}
+
+bool gitrepo::read_ref(const std::string& name, gitoid& oid, int depth) {
+    if (depth > 5)
+        return false;
+    std::string data;
+    if (read_file(gitdir_ + "/" + name, data)) {
+        while (!data.empty() && isspace((unsigned char) data.back()))
+            data.pop_back();
+        if (data.compare(0, 5, "ref: ") == 0)
+            return read_ref(data.substr(5), oid, depth + 1);
+        return oid.parse(data);
+    }
+    if (read_file(gitdir_ + "/packed-refs", data)) {
+        size_t pos = 0;
+        while (pos < data.length()) {
+            size_t nl = data.find('\n', pos);
+            if (nl == std::string::npos)
+                nl = data.length();
+            if (nl - pos == 41 + name.length() && data[pos + 40] == ' '
+                && data.compare(pos + 41, name.length(), name) == 0)
+                return oid.parse(data.data() + pos, 40);
+            pos = nl + 1;
+        }
+    }
+    return false;
+}
+
+bool gitrepo::resolve(const std::string& name, gitoid& oid) {
+    if (oid.parse(name))
+        return true;
+    if (name.empty() || name.find("..") != std::string::npos || name[0] == '/')
+        return fail(name + ": Bad revision");
+    static const char* const prefixes[] = {
+        "", "refs/", "refs/tags/", "refs/heads/", "refs/remotes/"
+    };
+    for (auto prefix : prefixes)
+        if (read_ref(prefix + name, oid, 0))
+            return true;
+    if (name.length() >= 4 && name.length() < 40
+        && std::all_of(name.begin(), name.end(), [](char ch) { return isxdigit((unsigned char) ch); }))
+        return resolve_prefix(name, oid);
+    return fail(name + ": Unknown revision");
+}
+
+// Resolve an abbreviated object ID, as git does: the prefix must match
+// exactly one object, loose or packed.
+bool gitrepo::resolve_prefix(const std::string& name, gitoid& oid) {
+    std::string hex = name;
+    for (auto& ch : hex)
+        ch = tolower((unsigned char) ch);
+    // `lo` is the prefix padded with zeros, `hi` with ones
+    gitoid lo, hi;
+    std::string pad = hex;
+    pad.resize(40, '0');
+    lo.parse(pad);
+    pad = hex;
+    pad.resize(40, 'f');
+    hi.parse(pad);
+
+    bool found = false;
+    auto match = [&](const unsigned char* b) {
+        if (found && memcmp(oid.b, b, 20) == 0)
+            return true;
+        if (found)
+            return false;
+        memcpy(oid.b, b, 20);
+        found = true;
+        return true;
+    };
+
+    for (auto& dir : objdirs_) {
+        DIR* d = opendir((dir + "/" + hex.substr(0, 2)).c_str());
+        if (!d)
+            continue;
+        while (struct dirent* de = readdir(d)) {
+            gitoid x;
+            if (strlen(de->d_name) == 38
+                && strncmp(de->d_name, hex.c_str() + 2, hex.length() - 2) == 0
+                && x.parse(hex.substr(0, 2) + de->d_name)
+                && !match(x.b)) {
+                closedir(d);
+                return fail(name + ": Ambiguous revision");
+            }
+        }
+        closedir(d);
+    }
+
+    for (auto& p : packs_) {
+        const unsigned char* fanout = p.idx + 8;
+        uint32_t l = lo.b[0] ? get_be32(fanout + 4 * (lo.b[0] - 1)) : 0;
+        uint32_t h = get_be32(fanout + 4 * lo.b[0]);
+        const unsigned char* oids = fanout + 1024;
+        // find the first object at or after `lo`
+        while (l < h) {
+            uint32_t mid = l + (h - l) / 2;
+            if (memcmp(oids + 20 * (size_t) mid, lo.b, 20) < 0)
+                l = mid + 1;
+            else
+                h = mid;
+        }
+        for (; l < p.nobjects && memcmp(oids + 20 * (size_t) l, hi.b, 20) <= 0; ++l)
+            if (!match(oids + 20 * (size_t) l))
+                return fail(name + ": Ambiguous revision");
+    }
+
+    if (!found)
+        return fail(name + ": Unknown revision");
+    return true;
+}
+
+bool gitrepo::read_loose(const gitoid& oid, gitobj_type& type,
+                         std::string& data, bool& found) {
+    std::string hex = oid.hex(), z;
+    found = false;
+    for (auto& dir : objdirs_)
+        if (read_file(dir + "/" + hex.substr(0, 2) + "/" + hex.substr(2), z)) {
+            found = true;
+            break;
+        }
+    if (!found)
+        return false;
+
+    // inflate header, then the rest once its size is known
+    std::string hdr;
+    z_stream zs;
+    memset(&zs, 0, sizeof(zs));
+    if (inflateInit(&zs) != Z_OK)
+        return fail(hex + ": inflate failed");
+    char buf[64];
+    zs.next_in = (unsigned char*) &z[0];
+    zs.avail_in = z.length();
+    zs.next_out = (unsigned char*) buf;
+    zs.avail_out = sizeof(buf);
+    int r = inflate(&zs, Z_SYNC_FLUSH);
+    char* nul = (char*) memchr(buf, 0, sizeof(buf) - zs.avail_out);
+    size_t size;
+    char typebuf[16];
+    if ((r != Z_OK && r != Z_STREAM_END) || !nul
+        || sscanf(buf, "%15s %zu", typebuf, &size) != 2) {
+        inflateEnd(&zs);
+        return fail(hex + ": Corrupt loose object");
+    }
+    if (strcmp(typebuf, "commit") == 0)
+        type = gitobj_commit;
+    else if (strcmp(typebuf, "tree") == 0)
+        type = gitobj_tree;
+    else if (strcmp(typebuf, "blob") == 0)
+        type = gitobj_blob;
+    else if (strcmp(typebuf, "tag") == 0)
+        type = gitobj_tag;
+    else
+        type = gitobj_none;
+    size_t have = (sizeof(buf) - zs.avail_out) - (nul + 1 - buf);
+    data.assign(nul + 1, std::min(have, size));
+    if (have < size) {
+        data.resize(size);
+        zs.next_out = (unsigned char*) &data[have];
+        zs.avail_out = size - have;
+        do {
+            r = inflate(&zs, Z_FINISH);
+        } while (r == Z_OK);
+    }
+    bool ok = r == Z_STREAM_END && zs.total_out == size + (nul + 1 - buf);
+    inflateEnd(&zs);
+    if (!ok || type == gitobj_none)
+        return fail(hex + ": Corrupt loose object");
+    return true;
+}
+
+bool gitrepo::find_packed(const gitoid& oid, size_t& packno, uint64_t& offset) {
+    for (packno = 0; packno != packs_.size(); ++packno) {
+        const pack& p = packs_[packno];
+        const unsigned char* fanout = p.idx + 8;
+        uint32_t lo = oid.b[0] ? get_be32(fanout + 4 * (oid.b[0] - 1)) : 0;
+        uint32_t hi = get_be32(fanout + 4 * oid.b[0]);
+        const unsigned char* oids = fanout + 1024;
+        while (lo < hi) {
+            uint32_t mid = lo + (hi - lo) / 2;
+            int cmp = memcmp(oids + 20 * (size_t) mid, oid.b, 20);
+            if (cmp == 0) {
+                const unsigned char* offs = oids + 24 * (size_t) p.nobjects;
+                uint32_t o = get_be32(offs + 4 * (size_t) mid);
+                if (o & 0x80000000U) {
+                    const unsigned char* large = offs + 4 * (size_t) p.nobjects
+                        + 8 * (size_t) (o & 0x7FFFFFFFU);
+                    if (large + 8 > p.idx + p.idxlen)
+                        return false;
+                    offset = ((uint64_t) get_be32(large) << 32) | get_be32(large + 4);
+                } else
+                    offset = o;
+                return offset < p.datalen;
+            } else if (cmp < 0)
+                lo = mid + 1;
+            else
+                hi = mid;
+        }
+    }
+    return false;
+}
+
+bool gitrepo::read_packed(size_t packno, uint64_t offset, gitobj_type& type,
+                          std::string& data, int depth) {
+    const pack& p = packs_[packno];
+    uint64_t key = ((uint64_t) packno << 48) | offset;
+    auto it = base_cache_.find(key);
+    if (it != base_cache_.end()) {
+        type = it->second.type;
+        data = it->second.data;
+        return true;
+    }
+    if (depth > 10000)
+        return fail(p.path + ": Delta chain too long");
+
+    const unsigned char* s = p.data + offset;
+    const unsigned char* end = p.data + p.datalen - 20;
+    if (s >= end)
+        return fail(p.path + ": Bad offset");
+    unsigned char c = *s++;
+    int t = (c >> 4) & 7;
+    size_t size = c & 15;
+    for (int shift = 4; c & 0x80; shift += 7) {
+        if (s == end || shift > 57)
+            return fail(p.path + ": Bad object header");
+        c = *s++;
+        size |= (size_t) (c & 0x7F) << shift;
+    }
+
+    if (t >= gitobj_commit && t <= gitobj_tag) {
+        type = (gitobj_type) t;
+        if (!inflate_exact(s, end - s, size, data))
+            return fail(p.path + ": Corrupt object");
+        return true;
+    }
+
+    // deltas
+    std::string base, delta;
+    if (t == 6) {               // OFS_DELTA
+        if (s == end)
+            return fail(p.path + ": Bad delta");
+        c = *s++;
+        uint64_t rel = c & 0x7F;
+        while (c & 0x80) {
+            if (s == end)
+                return fail(p.path + ": Bad delta");
+            c = *s++;
+            rel = ((rel + 1) << 7) | (c & 0x7F);
+        }
+        if (rel == 0 || rel > offset
+            || !read_packed(packno, offset - rel, type, base, depth + 1))
+            return false;
+        if (base.length() < 1 << 20 || base_cache_size_ < base_cache_limit / 2) {
+            if (base_cache_size_ + base.length() > base_cache_limit) {
+                base_cache_.clear();
+                base_cache_size_ = 0;
+            }
+            base_cache_size_ += base.length();
+            base_cache_[((uint64_t) packno << 48) | (offset - rel)] = cached_base{type, base};
+        }
+    } else if (t == 7) {        // REF_DELTA
+        gitoid baseoid;
+        if (end - s < 20)
+            return fail(p.path + ": Bad delta");
+        memcpy(baseoid.b, s, 20);
+        s += 20;
+        if (!read(baseoid, type, base, depth + 1))
+            return false;
+    } else
+        return fail(p.path + ": Bad object type");
+    if (!inflate_exact(s, end - s, size, delta)
+        || !apply_delta(base, (const unsigned char*) delta.data(), delta.length(), data))
+        return fail(p.path + ": Corrupt delta");
+    return true;
+}
+
+bool gitrepo::contains(const gitoid& oid) {
+    size_t packno;
+    uint64_t offset;
+    if (find_packed(oid, packno, offset))
+        return true;
+    std::string hex = oid.hex();
+    struct stat st;
+    for (auto& dir : objdirs_)
+        if (stat((dir + "/" + hex.substr(0, 2) + "/" + hex.substr(2)).c_str(), &st) == 0)
+            return true;
+    return false;
+}
+
+bool gitrepo::read(const gitoid& oid, gitobj_type& type, std::string& data) {
+    return read(oid, type, data, 0);
+}
+
+// `depth` counts the deltas being resolved, so a REF_DELTA cycle fails
+// rather than recursing forever.
+bool gitrepo::read(const gitoid& oid, gitobj_type& type, std::string& data,
+                   int depth) {
+    size_t packno;
+    uint64_t offset;
+    if (find_packed(oid, packno, offset))
+        return read_packed(packno, offset, type, data, depth);
+    bool found;
+    if (read_loose(oid, type, data, found))
+        return true;
+    else if (!found)
+        return fail(oid.hex() + ": No such object");
+    return false;
+}
+
+bool gitrepo::parse_tree(const std::string& data,
+                         std::vector<gittree_entry>& entries) {
+    entries.clear();
+    const char* s = data.data();
+    const char* end = s + data.length();
+    while (s != end) {
+        gittree_entry e;
+        e.mode = 0;
+        while (s != end && *s >= '0' && *s <= '7')
+            e.mode = e.mode * 8 + (*s++ - '0');
+        if (s == end || *s != ' ')
+            return false;
+        const char* name = s + 1;
+        const char* nul = (const char*) memchr(name, 0, end - name);
+        if (!nul || end - nul < 21)
+            return false;
+        e.name.assign(name, nul - name);
+        memcpy(e.oid.b, nul + 1, 20);
+        entries.push_back(std::move(e));
+        s = nul + 21;
+    }
+    return true;
+}
+
+bool gitrepo::read_tree(const gitoid& oid, std::vector<gittree_entry>& entries) {
+    gitobj_type type;
+    std::string data;
+    if (!read(oid, type, data))
+        return false;
+    if (type != gitobj_tree)
+        return fail(oid.hex() + ": Not a tree");
+    if (!parse_tree(data, entries))
+        return fail(oid.hex() + ": Corrupt tree");
+    return true;
+}
+
+bool gitrepo::commit_tree(const gitoid& oid, gitoid& tree) {
+    gitoid cur = oid;
+    for (int depth = 0; depth != 10; ++depth) {
+        gitobj_type type;
+        std::string data;
+        if (!read(cur, type, data))
+            return false;
+        if (type == gitobj_tree) {
+            tree = cur;
+            return true;
+        } else if (type == gitobj_commit) {
+            if (data.compare(0, 5, "tree ") != 0 || !tree.parse(data.data() + 5, 40))
+                return fail(cur.hex() + ": Corrupt commit");
+            return true;
+        } else if (type == gitobj_tag) {
+            if (data.compare(0, 7, "object ") != 0 || !cur.parse(data.data() + 7, 40))
+                return fail(cur.hex() + ": Corrupt tag");
+        } else
+            return fail(cur.hex() + ": Not a commit");
+    }
+    return fail(oid.hex() + ": Too many tags");
+}
+
+// Parse a `Name <email> time zone` identity.
+static void parse_ident(const char* s, const char* end, std::string& name,
+                        std::string& email, int64_t& time) {
+    const char* lt = (const char*) memchr(s, '<', end - s);
+    const char* gt = lt ? (const char*) memchr(lt, '>', end - lt) : nullptr;
+    if (!gt)
+        return;
+    const char* ne = lt;
+    while (ne != s && ne[-1] == ' ')
+        --ne;
+    name.assign(s, ne - s);
+    email.assign(lt + 1, gt - lt - 1);
+    time = strtoll(gt + 1, nullptr, 10);
+}
+
+bool gitrepo::read_commit(const gitoid& oid, gitcommit& commit,
+                          bool graph_ok) {
+    if (graph_ok && graph_commit(oid, commit))
+        return true;
+    gitoid cur = oid;
+    std::string data;
+    for (int depth = 0; ; ++depth) {
+        gitobj_type type;
+        if (depth == 10)
+            return fail(oid.hex() + ": Too many tags");
+        if (!read(cur, type, data))
+            return false;
+        if (type == gitobj_commit)
+            break;
+        else if (type != gitobj_tag)
+            return fail(cur.hex() + ": Not a commit");
+        else if (data.compare(0, 7, "object ") != 0 || !cur.parse(data.data() + 7, 40))
+            return fail(cur.hex() + ": Corrupt tag");
+    }
+
+    commit = gitcommit();
+    commit.full = true;
+    const char* s = data.data();
+    const char* end = s + data.length();
+    bool have_tree = false;
+    while (s != end && *s != '\n') {
+        const char* nl = (const char*) memchr(s, '\n', end - s);
+        if (!nl)
+            nl = end;
+        const char* sp = (const char*) memchr(s, ' ', nl - s);
+        size_t klen = sp ? sp - s : 0;
+        gitoid x;
+        if (klen == 4 && memcmp(s, "tree", 4) == 0
+            && x.parse(sp + 1, nl - sp - 1)) {
+            commit.tree = x;
+            have_tree = true;
+        } else if (klen == 6 && memcmp(s, "parent", 6) == 0
+                   && x.parse(sp + 1, nl - sp - 1))
+            commit.parents.push_back(x);
+        else if (klen == 6 && memcmp(s, "author", 6) == 0)
+            parse_ident(sp + 1, nl, commit.author_name, commit.author_email,
+                        commit.author_time);
+        else if (klen == 9 && memcmp(s, "committer", 9) == 0) {
+            std::string name, email;
+            parse_ident(sp + 1, nl, name, email, commit.time);
+        }
+        s = nl == end ? end : nl + 1;
+    }
+    if (!have_tree)
+        return fail(cur.hex() + ": Corrupt commit");
+
+    // the subject is the first paragraph, lines joined by spaces
+    while (s != end && *s == '\n')
+        ++s;
+    while (s != end && *s != '\n') {
+        const char* nl = (const char*) memchr(s, '\n', end - s);
+        if (!nl)
+            nl = end;
+        const char* e = nl;
+        while (e != s && isspace((unsigned char) e[-1]))
+            --e;
+        if (!commit.subject.empty())
+            commit.subject.push_back(' ');
+        commit.subject.append(s, e - s);
+        s = nl == end ? end : nl + 1;
+    }
+    gitcommit g;
+    if (graph_commit(cur, g))
+        commit.generation = g.generation;
+    return true;
+}
+
+bool gitrepo::lookup_path(const gitoid& tree, const std::string& path,
+                          gittree_entry& entry) {
+    entry.mode = 040000;
+    entry.oid = tree;
+    entry.name.clear();
+    size_t pos = 0;
+    std::vector<gittree_entry> entries;
+    while (pos < path.length()) {
+        size_t slash = path.find('/', pos);
+        if (slash == std::string::npos)
+            slash = path.length();
+        if (slash != pos) {
+            if (!entry.is_tree())
+                return fail(path + ": Not a directory");
+            if (!read_tree(entry.oid, entries))
+                return false;
+            std::string comp = path.substr(pos, slash - pos);
+            auto it = std::find_if(entries.begin(), entries.end(),
+                                   [&](const gittree_entry& e) {
+                                       return e.name == comp;
+                                   });
+            if (it == entries.end())
+                return fail(path + ": No such file or directory");
+            entry = *it;
+        }
+        pos = slash + 1;
+    }
+    return true;
+}
+
+// Write `data` to `fn` by way of a temporary file. New files and
+// directories take their permission bits from the enclosing directory,
+// so group-shared repositories stay writable by the group.
+static bool write_file_atomic(const std::string& fn, const std::string& data,
+                              mode_t mode_mask) {
+    size_t slash = fn.rfind('/');
+    std::string dir = fn.substr(0, slash);
+    struct stat st;
+    if (stat(dir.c_str(), &st) != 0) {
+        std::string parent = dir.substr(0, dir.rfind('/'));
+        if (stat(parent.c_str(), &st) != 0
+            || (mkdir(dir.c_str(), st.st_mode & 0777) != 0 && errno != EEXIST)
+            || chmod(dir.c_str(), st.st_mode & 07777) != 0)
+            return false;
+    }
+    std::string tmp = dir + "/.tmp_XXXXXX";
+    int fd = mkostemp(&tmp[0], O_CLOEXEC);
+    if (fd == -1)
+        return false;
+    bool ok = fchmod(fd, st.st_mode & mode_mask) == 0;
+    for (size_t w = 0; ok && w < data.length(); ) {
+        ssize_t nw = ::write(fd, data.data() + w, data.length() - w);
+        if (nw > 0)
+            w += nw;
+        else if (nw == 0 || errno != EINTR)
+            ok = false;
+    }
+    ok = close(fd) == 0 && ok;
+    if (!ok || rename(tmp.c_str(), fn.c_str()) != 0) {
+        int saved_errno = errno;
+        unlink(tmp.c_str());
+        errno = saved_errno;
+        return false;
+    }
+    return true;
+}
+
+bool gitrepo::write(gitobj_type type, const std::string& data, gitoid& oid) {
+    static const char* const names[] = {
+        "none", "commit", "tree", "blob", "tag"
+    };
+    std::string obj = std::string(names[type]) + " "
+        + std::to_string(data.length());
+    obj.push_back('\0');
+    obj += data;
+    sha1_context ctx;
+    ctx.update(obj);
+    oid.parse(ctx.hexdigest());
+    if (contains(oid))
+        return true;
+
+    // git writes loose objects at its fastest compression level, too
+    uLongf zlen = compressBound(obj.length());
+    std::string z(zlen, '\0');
+    if (compress2((Bytef*) &z[0], &zlen, (const Bytef*) obj.data(),
+                  obj.length(), Z_BEST_SPEED) != Z_OK)
+        return fail(oid.hex() + ": deflate failed");
+    z.resize(zlen);
+    std::string hex = oid.hex();
+    std::string fn = objdirs_[0] + "/" + hex.substr(0, 2) + "/" + hex.substr(2);
+    if (!write_file_atomic(fn, z, 0444))
+        return fail(fn + ": " + strerror(errno));
+    return true;
+}
+
+bool gitrepo::write_ref(const std::string& name, const gitoid& oid) {
+    if (name.compare(0, 5, "refs/") != 0 || name.find("..") != std::string::npos)
+        return fail(name + ": Bad ref name");
+    std::string fn = gitdir_ + "/" + name;
+    if (!write_file_atomic(fn, oid.hex() + "\n", 0666))
+        return fail(fn + ": " + strerror(errno));
+    return true;
+}
@@ -0,0 +1,188 @@
+// gitobj.hh -- read objects from a git repository without running git
+//
+// Reads loose objects and version-2 pack indexes directly, resolving
+// OFS_DELTA and REF_DELTA chains. Packs and indexes are memory-mapped, as
+// is the commit-graph file if there is one. New objects are written loose.
+// SHA-1 repositories only. Errors are reported through error().
+
+#ifndef PA_GITOBJ_HH
+#define PA_GITOBJ_HH
+#include <stdint.h>
+#include <string.h>
+#include <string>
+#include <vector>
+#include <unordered_map>
+
+// SHA-1, for object IDs and cache keys
+class sha1_context {
+  public:
+    sha1_context() {
+        h_[0] = 0x67452301;
+        h_[1] = 0xEFCDAB89;
+        h_[2] = 0x98BADCFE;
+        h_[3] = 0x10325476;
+        h_[4] = 0xC3D2E1F0;
+        len_ = 0;
+    }
+    void update(const void* data, size_t n);
+    void update(const std::string& str) {
+        update(str.data(), str.length());
+    }
+    std::string hexdigest();
+  private:
+    uint32_t h_[5];
+    uint64_t len_;
+    unsigned char block_[64];
+    void transform(const unsigned char* block);
+};
+
+struct gitoid {
+    unsigned char b[20];
+
+    bool parse(const char* s, size_t len);
+    bool parse(const std::string& s) {
+        return parse(s.data(), s.length());
+    }
+    std::string hex() const;
+    bool operator==(const gitoid& x) const {
+        return memcmp(b, x.b, sizeof(b)) == 0;
+    }
+    bool operator!=(const gitoid& x) const {
+        return !(*this == x);
+    }
+    bool operator<(const gitoid& x) const {
+        return memcmp(b, x.b, sizeof(b)) < 0;
+    }
+};
+
+struct gitoid_hash {
+    size_t operator()(const gitoid& x) const {
+        size_t h;
+        memcpy(&h, x.b, sizeof(h));
+        return h;
+    }
+};
+
+enum gitobj_type {
+    gitobj_none = 0, gitobj_commit = 1, gitobj_tree = 2, gitobj_blob = 3,
+    gitobj_tag = 4
+};
+
+struct gittree_entry {
+    unsigned mode;
+    std::string name;
+    gitoid oid;
+
+    bool is_tree() const {
+        return mode == 040000;
+    }
+    bool is_symlink() const {
+        return mode == 0120000;
+    }
+    bool is_submodule() const {
+        return mode == 0160000;
+    }
+};
+
+struct gitcommit {
+    gitoid tree;
+    std::vector<gitoid> parents;
+    int64_t time = 0;           // committer time
+    uint32_t generation = 0;    // from the commit-graph; 0 if unknown
+    bool full = false;          // false if only graph data is present
+    std::string author_name;
+    std::string author_email;
+    int64_t author_time = 0;
+    std::string subject;
+};
+
+class gitrepo {
+  public:
+    gitrepo() = default;
+    gitrepo(const gitrepo&) = delete;
+    gitrepo& operator=(const gitrepo&) = delete;
+    ~gitrepo();
+
+    // Open the repository at `dir`, which may be a work tree or bare.
+    bool open(const std::string& dir);
+    const std::string& gitdir() const {
+        return gitdir_;
+    }
+    const std::string& error() const {
+        return error_;
+    }
+
+    // Resolve a full hex object ID, a ref name (`HEAD`, `master`,
+    // `refs/heads/master`, ...), or a unique object ID prefix of at least
+    // 4 hex digits.
+    bool resolve(const std::string& name, gitoid& oid);
+    bool contains(const gitoid& oid);
+    bool read(const gitoid& oid, gitobj_type& type, std::string& data);
+    bool read_tree(const gitoid& oid, std::vector<gittree_entry>& entries);
+    // Return the tree of a commit, peeling tags.
+    bool commit_tree(const gitoid& oid, gitoid& tree);
+    // Parse a commit, peeling tags. If `graph_ok` and the commit-graph
+    // has the commit, only its tree, parents, time, and generation are
+    // filled in, and `commit.full` is false.
+    bool read_commit(const gitoid& oid, gitcommit& commit,
+                     bool graph_ok = false);
+    // Look up slash-separated `path` below `tree`.
+    bool lookup_path(const gitoid& tree, const std::string& path,
+                     gittree_entry& entry);
+    // Store an object as a loose object, unless the repository already
+    // has it, and set `oid` to its ID.
+    bool write(gitobj_type type, const std::string& data, gitoid& oid);
+    // Point ref `name` (like `refs/heads/master`) at `oid`.
+    bool write_ref(const std::string& name, const gitoid& oid);
+
+    static bool parse_tree(const std::string& data,
+                           std::vector<gittree_entry>& entries);
+
+  private:
+    struct pack {
+        std::string path;
+        const unsigned char* idx;
+        size_t idxlen;
+        const unsigned char* data;
+        size_t datalen;
+        uint32_t nobjects;
+    };
+    struct cached_base {
+        gitobj_type type;
+        std::string data;
+    };
+    struct commit_graph {
+        const unsigned char* data = nullptr;
+        size_t len = 0;
+        const unsigned char* fanout = nullptr;
+        const unsigned char* oids = nullptr;
+        const unsigned char* cdat = nullptr;
+        const unsigned char* edges = nullptr;
+        size_t nedges = 0;
+        uint32_t ncommits = 0;
+    };
+
+    std::string gitdir_;
+    std::vector<std::string> objdirs_;
+    std::vector<pack> packs_;
+    commit_graph graph_;
+    std::unordered_map<uint64_t, cached_base> base_cache_;
+    size_t base_cache_size_ = 0;
+    std::string error_;
+
+    bool fail(const std::string& msg);
+    void add_objdir(const std::string& dir, int depth);
+    bool read_ref(const std::string& name, gitoid& oid, int depth);
+    bool resolve_prefix(const std::string& name, gitoid& oid);
+    bool read_loose(const gitoid& oid, gitobj_type& type, std::string& data,
+                    bool& found);
+    bool find_packed(const gitoid& oid, size_t& packno, uint64_t& offset);
+    bool read_packed(size_t packno, uint64_t offset, gitobj_type& type,
+                     std::string& data, int depth);
+    bool read(const gitoid& oid, gitobj_type& type, std::string& data,
+              int depth);
+    void open_graph();
+    bool graph_commit(const gitoid& oid, gitcommit& commit);
+};
+
+#endif
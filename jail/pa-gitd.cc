@@ -0,0 +1,1825 @@
+// pa-gitd.cc -- Peteramati git query daemon
+// Peteramati is Copyright (c) 2013-2015 Eddie Kohler and others
+// Distributed under an MIT-like license; see LICENSE
+//
+// Answers the read-only git queries that web pages make (`ls-tree`,
+// `log`, `show`, `cat-file`, `rev-parse`, `diff --name-only`, and
+// pa-gitd's own `diff-records` and `blob`) from a Unix socket, so a page
+// view need not start a shell and a git process against a cold
+// repository. Open repositories stay in an LRU cache with their pack
+// indexes and commit-graph memory-mapped; each also keeps an LRU cache of
+// parsed commits and trees. A repository is reopened when its packs or
+// commit-graph change.
+//
+// A client connects, writes `REPODIR`, then git's arguments (without
+// `git`), each terminated by a NUL byte, and shuts down its write side.
+// The reply is `ok\n` followed by what git would print to standard output,
+// `error MESSAGE\n` if git would fail, or `unsupported MESSAGE\n` for
+// requests git would accept but pa-gitd does not implement, which clients
+// should pass to git.
+//
+// Only repositories below `--root` are served. `--workers` processes
+// accept connections on the one socket, each with its own caches, so a
+// slow client or an expensive `log` or `diff` holds up only one of them.
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/time.h>
+#include <sys/sendfile.h>
+#include <sys/wait.h>
+#include <sys/prctl.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <getopt.h>
+#include <limits.h>
+#include <ctype.h>
+#include <algorithm>
+#include <list>
+#include <memory>
+#include <queue>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+#include "gitobj.hh"
+
+static const size_t max_request = 65536;
+static size_t max_repos = 32;
+static int nworkers = 4;
+static size_t commit_cache_size = 200000;
+static size_t tree_cache_size = 20000;
+static std::string root_dir;
+static std::string blob_cache_dir;
+static off_t blob_cache_size = (off_t) 1024 << 20;
+
+
+// error helpers
+
+static __attribute__((noreturn))
+void die(const char* fmt, ...) {
+    va_list val;
+    va_start(val, fmt);
+    vfprintf(stderr, fmt, val);
+    va_end(val);
+    exit(1);
+}
+
+static __attribute__((noreturn))
+void perror_die(const std::string& message) {
+    die("%s: %s\n", message.c_str(), strerror(errno));
+}
+
+
+// LRU cache
+
+template <typename K, typename V, typename H = std::hash<K> >
+class lru_cache {
+  public:
+    explicit lru_cache(size_t capacity)
+        : capacity_(capacity) {
+    }
+
+    V* find(const K& key) {
+        auto it = map_.find(key);
+        if (it == map_.end())
+            return nullptr;
+        order_.splice(order_.begin(), order_, it->second);
+        return &it->second->second;
+    }
+    V& insert(const K& key, V value) {
+        auto it = map_.find(key);
+        if (it != map_.end()) {
+            it->second->second = std::move(value);
+            order_.splice(order_.begin(), order_, it->second);
+            return it->second->second;
+        }
+        while (map_.size() >= capacity_ && !order_.empty()) {
+            map_.erase(order_.back().first);
+            order_.pop_back();
+        }
+        order_.emplace_front(key, std::move(value));
+        map_[key] = order_.begin();
+        return order_.front().second;
+    }
+    void set_capacity(size_t capacity) {
+        capacity_ = capacity;
+    }
+    void erase(const K& key) {
+        auto it = map_.find(key);
+        if (it != map_.end()) {
+            order_.erase(it->second);
+            map_.erase(it);
+        }
+    }
+
+  private:
+    typedef std::list<std::pair<K, V> > list_type;
+    size_t capacity_;
+    list_type order_;
+    std::unordered_map<K, typename list_type::iterator, H> map_;
+};
+
+
+// cached repositories
+
+struct cachedrepo {
+    gitrepo repo;
+    std::string stamp;
+    lru_cache<gitoid, gitcommit, gitoid_hash> commits;
+    lru_cache<gitoid, std::vector<gittree_entry>, gitoid_hash> trees;
+
+    cachedrepo()
+        : commits(commit_cache_size), trees(tree_cache_size) {
+    }
+
+    bool commit(const gitoid& oid, gitcommit& c, bool full);
+    bool tree(const gitoid& oid, std::vector<gittree_entry>& entries);
+    bool path_oid(const gitoid& tree, const std::string& path, gitoid& oid);
+};
+
+static lru_cache<std::string, std::unique_ptr<cachedrepo> > repos(32);
+
+static bool oid_zero(const gitoid& oid) {
+    return std::all_of(oid.b, oid.b + 20, [](unsigned char b) { return b == 0; });
+}
+
+bool cachedrepo::commit(const gitoid& oid, gitcommit& c, bool full) {
+    if (gitcommit* x = commits.find(oid))
+        if (x->full || !full) {
+            c = *x;
+            return true;
+        }
+    if (!repo.read_commit(oid, c, !full))
+        return false;
+    commits.insert(oid, c);
+    return true;
+}
+
+bool cachedrepo::tree(const gitoid& oid, std::vector<gittree_entry>& entries) {
+    if (auto* x = trees.find(oid)) {
+        entries = *x;
+        return true;
+    }
+    if (!repo.read_tree(oid, entries))
+        return false;
+    trees.insert(oid, entries);
+    return true;
+}
+
+// Set `oid` to the object at `path` below `tree`, or to zeros if there
+// is none.
+bool cachedrepo::path_oid(const gitoid& tree, const std::string& path,
+                          gitoid& oid) {
+    oid = tree;
+    std::vector<gittree_entry> entries;
+    size_t pos = 0;
+    while (pos < path.length()) {
+        size_t slash = path.find('/', pos);
+        if (slash == std::string::npos)
+            slash = path.length();
+        if (slash != pos) {
+            if (!this->tree(oid, entries))
+                return false;
+            auto it = std::find_if(entries.begin(), entries.end(),
+                                   [&](const gittree_entry& e) {
+                                       return e.name.length() == slash - pos
+                                           && path.compare(pos, slash - pos, e.name) == 0;
+                                   });
+            if (it == entries.end() || (slash != path.length() && !it->is_tree())) {
+                memset(oid.b, 0, sizeof(oid.b));
+                return true;
+            }
+            oid = it->oid;
+        }
+        pos = slash + 1;
+    }
+    return true;
+}
+
+// Return a token that changes when `gitdir`'s packs or commit-graph do.
+static std::string repo_stamp(const std::string& gitdir) {
+    std::string stamp;
+    for (auto fn : { "/objects/pack", "/objects/info/commit-graph" }) {
+        struct stat st;
+        char buf[64];
+        if (stat((gitdir + fn).c_str(), &st) == 0)
+            sprintf(buf, "%lld.%ld/", (long long) st.st_mtim.tv_sec,
+                    st.st_mtim.tv_nsec);
+        else
+            strcpy(buf, "-/");
+        stamp += buf;
+    }
+    return stamp;
+}
+
+static cachedrepo* open_repo(const std::string& dir, std::string& error) {
+    if (dir.empty() || dir[0] != '/' || (dir + "/").find("/../") != std::string::npos
+        || dir.length() <= root_dir.length()
+        || dir.compare(0, root_dir.length(), root_dir) != 0) {
+        error = dir + ": Repository not allowed";
+        return nullptr;
+    }
+    if (auto* x = repos.find(dir)) {
+        if (repo_stamp((*x)->repo.gitdir()) == (*x)->stamp)
+            return x->get();
+        repos.erase(dir);
+    }
+    std::unique_ptr<cachedrepo> cr(new cachedrepo);
+    if (!cr->repo.open(dir)) {
+        error = cr->repo.error();
+        return nullptr;
+    }
+    cr->stamp = repo_stamp(cr->repo.gitdir());
+    return repos.insert(dir, std::move(cr)).get();
+}
+
+
+// commands
+
+struct request {
+    cachedrepo* cr;
+    std::vector<std::string> args;
+    std::string out;
+    // A reply can continue with `body`, or with `body_size` bytes of
+    // `body_fd`, after `out`.
+    std::string body;
+    int body_fd = -1;
+    off_t body_size = 0;
+    std::string error;
+    bool is_unsupported = false;
+
+    request() = default;
+    request(const request&) = delete;
+    request& operator=(const request&) = delete;
+    ~request() {
+        if (body_fd >= 0)
+            close(body_fd);
+    }
+
+    bool fail(const std::string& msg) {
+        error = msg;
+        return false;
+    }
+    bool unsupported(const std::string& msg) {
+        is_unsupported = true;
+        return fail(msg);
+    }
+    bool repo_fail() {
+        return fail(cr->repo.error());
+    }
+    // Resolve `REV` or `REV:PATH`.
+    bool resolve(const std::string& spec, gitoid& oid, std::string* path = nullptr);
+};
+
+bool request::resolve(const std::string& spec, gitoid& oid,
+                      std::string* path) {
+    size_t colon = spec.find(':');
+    std::string rev = spec.substr(0, colon);
+    if (!cr->repo.resolve(rev, oid)) {
+        // git understands revision expressions that we don't
+        if (rev.find_first_of("~^@{}") != std::string::npos || colon == 0)
+            return unsupported(rev + ": Revision expressions are not supported");
+        return repo_fail();
+    }
+    if (colon == std::string::npos)
+        return true;
+    gitoid tree;
+    if (!cr->repo.commit_tree(oid, tree))
+        return repo_fail();
+    std::string p = spec.substr(colon + 1);
+    if (!cr->path_oid(tree, p, oid))
+        return repo_fail();
+    if (oid_zero(oid))
+        return fail("path '" + p + "' does not exist in '" + spec.substr(0, colon) + "'");
+    if (path)
+        *path = p;
+    return true;
+}
+
+static const char* type_name(gitobj_type t) {
+    static const char* const names[] = {
+        "none", "commit", "tree", "blob", "tag"
+    };
+    return names[t];
+}
+
+static void append_tree_entry(std::string& out, const gittree_entry& e,
+                              const std::string& path) {
+    char buf[64];
+    sprintf(buf, "%06o %s ", e.mode,
+            e.is_tree() ? "tree" : (e.is_submodule() ? "commit" : "blob"));
+    out += buf;
+    out += e.oid.hex();
+    out += '\t';
+    out += path;
+    out += '\n';
+}
+
+static bool cmd_rev_parse(request& r) {
+    if (r.args.size() != 2 || r.args[1][0] == '-')
+        return r.unsupported("rev-parse: Only `rev-parse REV` is supported");
+    gitoid oid;
+    if (!r.resolve(r.args[1], oid))
+        return false;
+    r.out = oid.hex() + "\n";
+    return true;
+}
+
+static bool cmd_cat_file(request& r) {
+    if (r.args.size() != 3)
+        return r.unsupported("cat-file: Only `cat-file (-t | -s | -p | TYPE) OBJECT` is supported");
+    const std::string& mode = r.args[1];
+    gitoid oid;
+    gitobj_type type;
+    std::string data;
+    if (!r.resolve(r.args[2], oid))
+        return false;
+    if (!r.cr->repo.read(oid, type, data))
+        return r.repo_fail();
+    if (mode == "-t")
+        r.out = std::string(type_name(type)) + "\n";
+    else if (mode == "-s")
+        r.out = std::to_string(data.length()) + "\n";
+    else if (mode == "-p" && type == gitobj_tree) {
+        std::vector<gittree_entry> entries;
+        if (!gitrepo::parse_tree(data, entries))
+            return r.fail(oid.hex() + ": Corrupt tree");
+        for (auto& e : entries)
+            append_tree_entry(r.out, e, e.name);
+    } else if (mode == "-p" || mode == type_name(type))
+        r.out.swap(data);
+    else if (mode == "blob" || mode == "tree" || mode == "commit" || mode == "tag")
+        return r.fail(r.args[2] + ": bad file");
+    else
+        return r.unsupported("cat-file " + mode + ": Unsupported");
+    return true;
+}
+
+static bool cmd_show(request& r) {
+    if (r.args.size() != 2 || r.args[1][0] == '-'
+        || r.args[1].find(':') == std::string::npos)
+        return r.unsupported("show: Only `show REV:PATH` is supported");
+    gitoid oid;
+    gitobj_type type;
+    if (!r.resolve(r.args[1], oid))
+        return false;
+    if (!r.cr->repo.read(oid, type, r.out))
+        return r.repo_fail();
+    if (type == gitobj_tree) {
+        std::vector<gittree_entry> entries;
+        if (!gitrepo::parse_tree(r.out, entries))
+            return r.fail(oid.hex() + ": Corrupt tree");
+        r.out = "tree " + r.args[1] + "\n\n";
+        for (auto& e : entries)
+            r.out += e.name + (e.is_tree() ? "/\n" : "\n");
+    } else if (type != gitobj_blob)
+        return r.unsupported("show: Unsupported object type");
+    return true;
+}
+
+// Does the entry at `path` match a pathspec? Set `descend` if it is a
+// directory some pathspec lies below.
+static bool pathspec_match(const std::vector<std::string>& specs,
+                           const std::string& path, bool& descend) {
+    descend = false;
+    if (specs.empty())
+        return true;
+    bool match = false;
+    for (auto& s : specs) {
+        // `DIR/` names DIR's contents, not DIR
+        if (s.back() == '/' && s.length() == path.length() + 1
+            && s.compare(0, path.length(), path) == 0)
+            match = descend = true;
+        else if (s.back() == '/' && s.length() <= path.length()
+                 && path.compare(0, s.length(), s) == 0)
+            match = true;
+        else if (s.length() <= path.length()
+            && path.compare(0, s.length(), s) == 0
+            && (s.length() == path.length() || path[s.length()] == '/'))
+            match = true;
+        else if (s.length() > path.length()
+                 && s.compare(0, path.length(), path) == 0
+                 && s[path.length()] == '/')
+            match = descend = true;
+    }
+    return match;
+}
+
+static bool ls_tree(request& r, const gitoid& tree, const std::string& prefix,
+                    const std::vector<std::string>& specs, bool recursive,
+                    bool name_only) {
+    std::vector<gittree_entry> entries;
+    if (!r.cr->tree(tree, entries))
+        return r.repo_fail();
+    for (auto& e : entries) {
+        std::string path = prefix + e.name;
+        bool descend;
+        if (!pathspec_match(specs, path, descend))
+            continue;
+        if (e.is_tree() && (recursive || descend)) {
+            if (!ls_tree(r, e.oid, path + "/", specs, recursive, name_only))
+                return false;
+        } else if (name_only)
+            r.out += path + "\n";
+        else
+            append_tree_entry(r.out, e, path);
+    }
+    return true;
+}
+
+static bool cmd_ls_tree(request& r) {
+    bool recursive = false, name_only = false;
+    size_t i = 1;
+    for (; i < r.args.size() && r.args[i][0] == '-'; ++i)
+        if (r.args[i] == "-r")
+            recursive = true;
+        else if (r.args[i] == "--name-only")
+            name_only = true;
+        else
+            return r.unsupported("ls-tree " + r.args[i] + ": Unsupported");
+    if (i == r.args.size())
+        return r.unsupported("ls-tree: Missing TREEISH");
+    gitoid oid, tree;
+    if (!r.resolve(r.args[i], oid))
+        return false;
+    if (!r.cr->repo.commit_tree(oid, tree))
+        return r.repo_fail();
+    std::vector<std::string> specs;
+    for (++i; i < r.args.size(); ++i)
+        if (!r.args[i].empty())
+            specs.push_back(r.args[i]);
+    return ls_tree(r, tree, std::string(), specs, recursive, name_only);
+}
+
+static bool log_format(request& r, const std::string& fmt, const gitoid& oid,
+                       const gitcommit& c) {
+    for (size_t i = 0; i < fmt.length(); ++i) {
+        if (fmt[i] != '%' || i + 1 == fmt.length()) {
+            r.out += fmt[i];
+            continue;
+        }
+        char ch = fmt[++i];
+        if (ch == 'H')
+            r.out += oid.hex();
+        else if (ch == 'h')
+            r.out += oid.hex().substr(0, 7);
+        else if (ch == 'T')
+            r.out += c.tree.hex();
+        else if (ch == 'P') {
+            for (size_t j = 0; j != c.parents.size(); ++j)
+                r.out += (j ? " " : "") + c.parents[j].hex();
+        } else if (ch == 'c' && i + 1 < fmt.length() && fmt[i + 1] == 't') {
+            r.out += std::to_string((long long) c.time);
+            ++i;
+        } else if (ch == 'a' && i + 1 < fmt.length()
+                   && (fmt[i + 1] == 'e' || fmt[i + 1] == 'n' || fmt[i + 1] == 't')) {
+            ++i;
+            if (fmt[i] == 'e')
+                r.out += c.author_email;
+            else if (fmt[i] == 'n')
+                r.out += c.author_name;
+            else
+                r.out += std::to_string((long long) c.author_time);
+        } else if (ch == 's')
+            r.out += c.subject;
+        else if (ch == 'n')
+            r.out += '\n';
+        else if (ch == '%')
+            r.out += '%';
+        else
+            return r.unsupported(std::string("log format %") + ch + ": Unsupported");
+    }
+    r.out += '\n';
+    return true;
+}
+
+// `git log` with path limiting uses git's default history simplification:
+// a commit is shown if it differs from all its parents at the paths; a
+// merge that matches a parent follows only that parent. `--simplify-merges`
+// (which also implies topological order) is left to git.
+static bool cmd_log(request& r) {
+    long limit = -1;
+    std::string fmt = "%H";
+    std::vector<std::string> revs, paths;
+    size_t i = 1;
+    for (; i < r.args.size() && r.args[i] != "--"; ++i) {
+        const std::string& a = r.args[i];
+        if (a.compare(0, 2, "-n") == 0 && a.length() > 2)
+            limit = strtol(a.c_str() + 2, nullptr, 10);
+        else if (a.compare(0, 9, "--format=") == 0)
+            fmt = a.substr(9);
+        else if (a.compare(0, 17, "--pretty=tformat:") == 0)
+            fmt = a.substr(17);
+        else if (a[0] == '-')
+            return r.unsupported("log " + a + ": Unsupported");
+        else
+            revs.push_back(a);
+    }
+    for (++i; i < r.args.size(); ++i) {
+        std::string s = r.args[i];
+        while (s.length() > 1 && s.back() == '/')
+            s.pop_back();
+        paths.push_back(s);
+    }
+    if (revs.empty())
+        revs.push_back("HEAD");
+    bool need_text = fmt.find("%a") != std::string::npos
+        || fmt.find("%s") != std::string::npos;
+
+    // newest first, like git's default order; commits with equal times
+    // come out in the order they were queued (negated index)
+    typedef std::pair<int64_t, int64_t> queue_key;
+    std::priority_queue<queue_key> queue;
+    std::vector<std::pair<gitoid, gitcommit> > pending;
+    std::unordered_set<gitoid, gitoid_hash> seen;
+    auto push = [&](const gitoid& oid) {
+        if (!seen.insert(oid).second)
+            return true;
+        gitcommit c;
+        if (!r.cr->commit(oid, c, false))
+            return r.repo_fail();
+        pending.push_back(std::make_pair(oid, std::move(c)));
+        queue.push(queue_key(pending.back().second.time,
+                             -(int64_t) (pending.size() - 1)));
+        return true;
+    };
+    auto path_oids = [&](const gitcommit& c, std::vector<gitoid>& oids) {
+        oids.resize(paths.size());
+        for (size_t j = 0; j != paths.size(); ++j)
+            if (!r.cr->path_oid(c.tree, paths[j], oids[j]))
+                return r.repo_fail();
+        return true;
+    };
+
+    for (auto& rev : revs) {
+        gitoid oid;
+        if (!r.resolve(rev, oid) || !push(oid))
+            return false;
+    }
+    long shown = 0;
+    std::vector<gitoid> oids, poids;
+    while (!queue.empty() && (limit < 0 || shown < limit)) {
+        size_t idx = -queue.top().second;
+        queue.pop();
+        gitoid oid = pending[idx].first;
+        gitcommit c = pending[idx].second;
+
+        bool show = true;
+        std::vector<gitoid> follow = c.parents;
+        if (!paths.empty()) {
+            if (!path_oids(c, oids))
+                return false;
+            if (c.parents.empty())
+                show = !std::all_of(oids.begin(), oids.end(), oid_zero);
+            for (auto& p : c.parents) {
+                gitcommit pc;
+                if (!r.cr->commit(p, pc, false) || !path_oids(pc, poids))
+                    return r.repo_fail();
+                if (poids == oids) {
+                    show = false;
+                    follow.assign(1, p);
+                    break;
+                }
+            }
+        }
+        if (show) {
+            if (need_text && !c.full && !r.cr->commit(oid, c, true))
+                return r.repo_fail();
+            if (!log_format(r, fmt, oid, c))
+                return false;
+            ++shown;
+        }
+        for (auto& p : follow)
+            if (!push(p))
+                return false;
+    }
+    return true;
+}
+
+// tree and file diffs
+//
+// `diff --name-only A B [-- PATH...]` lists changed files like git does.
+// `diff-records [-w] [--max-lines=N] A B -- FILE...` is pa-gitd's own: it
+// diffs each FILE between commits A and B and prints a JSON array of
+// `{"file", "blineno", "diff"}` objects, where `diff` is the list of
+// `[TYPE, ALINE, BLINE, TEXT]` records that DiffInfo wants (TYPE is `@`,
+// ` `, `-`, or `+`), with three lines of context like `git diff`. A file
+// stops after N+1 records. Per-file results are cached by blob pair and
+// options, since many students' diffs share a handout base.
+
+static const int diff_context = 3;
+static lru_cache<std::string, std::string> diff_cache(4096);
+
+// Compare tree entry names like git's `df_name_compare`.
+static int tree_name_compare(const gittree_entry& a, const gittree_entry& b) {
+    size_t len = std::min(a.name.length(), b.name.length());
+    int cmp = memcmp(a.name.data(), b.name.data(), len);
+    if (cmp || a.name.length() == b.name.length())
+        return cmp;
+    unsigned char ca = len < a.name.length() ? a.name[len] : (a.is_tree() ? '/' : 0);
+    unsigned char cb = len < b.name.length() ? b.name[len] : (b.is_tree() ? '/' : 0);
+    return ca < cb ? -1 : (ca > cb ? 1 : 0);
+}
+
+static bool diff_tree_names(request& r, const gitoid* ta, const gitoid* tb,
+                            const std::string& prefix,
+                            const std::vector<std::string>& specs) {
+    std::vector<gittree_entry> ea, eb;
+    if ((ta && !r.cr->tree(*ta, ea)) || (tb && !r.cr->tree(*tb, eb)))
+        return r.repo_fail();
+    auto ia = ea.begin(), ib = eb.begin();
+    while (ia != ea.end() || ib != eb.end()) {
+        int cmp = ia == ea.end() ? 1 : (ib == eb.end() ? -1 : tree_name_compare(*ia, *ib));
+        const gittree_entry* a = cmp <= 0 ? &*ia : nullptr;
+        const gittree_entry* b = cmp >= 0 ? &*ib : nullptr;
+        if (a)
+            ++ia;
+        if (b)
+            ++ib;
+        std::string path = prefix + (a ? a : b)->name;
+        bool descend;
+        if (!pathspec_match(specs, path, descend)
+            || (a && b && a->oid == b->oid && a->mode == b->mode))
+            continue;
+        // a file on one side and a directory on the other are unrelated
+        const gittree_entry* fa = a && !a->is_tree() ? a : nullptr;
+        const gittree_entry* fb = b && !b->is_tree() ? b : nullptr;
+        if (fa || fb)
+            r.out += path + "\n";
+        const gittree_entry* da = a && a->is_tree() ? a : nullptr;
+        const gittree_entry* db = b && b->is_tree() ? b : nullptr;
+        if ((da || db)
+            && !diff_tree_names(r, da ? &da->oid : nullptr,
+                                db ? &db->oid : nullptr, path + "/", specs))
+            return false;
+    }
+    return true;
+}
+
+struct diffside {
+    std::vector<const char*> lines;
+    std::vector<size_t> lens;       // including newline, if any
+    std::vector<int> ids;
+    bool binary = false;
+    bool absent = false;
+};
+
+static void diff_split(const std::string& data, diffside& s) {
+    s.binary = memchr(data.data(), 0, std::min(data.length(), (size_t) 8000)) != nullptr;
+    for (size_t pos = 0; pos < data.length(); ) {
+        size_t nl = data.find('\n', pos);
+        nl = nl == std::string::npos ? data.length() : nl + 1;
+        s.lines.push_back(data.data() + pos);
+        s.lens.push_back(nl - pos);
+        pos = nl;
+    }
+}
+
+static void diff_intern(diffside& a, diffside& b, bool ignore_ws) {
+    std::unordered_map<std::string, int> ids;
+    std::string key;
+    for (diffside* s : { &a, &b })
+        for (size_t i = 0; i != s->lines.size(); ++i) {
+            const char* l = s->lines[i];
+            size_t n = s->lens[i];
+            if (ignore_ws) {
+                key.clear();
+                for (size_t j = 0; j != n; ++j)
+                    if (!isspace((unsigned char) l[j]))
+                        key.push_back(l[j]);
+            } else
+                key.assign(l, n);
+            auto it = ids.insert(std::make_pair(key, (int) ids.size())).first;
+            s->ids.push_back(it->second);
+        }
+}
+
+// Line diffs follow git's xdiff so hunks line up with what `git diff`
+// would show: lines that occur only on one side are set aside first, then
+// the rest goes through Myers's divide-and-conquer search, with xdiff's
+// cutoffs for expensive diffs. `chg1` and `chg2` have a sentinel on each
+// side, so index 1 is line 0.
+struct myers {
+    std::vector<int> ha1, ha2;      // records left after discarding
+    std::vector<int> rindex1, rindex2;
+    std::vector<char>* chg1;
+    std::vector<char>* chg2;
+    std::vector<long> kvd;
+    long* kvdf;
+    long* kvdb;
+    long mxcost;
+
+    enum { snake_cnt = 20, heur_min = 256, k_heur = 4, simscan_window = 100,
+           kpdis_run = 4, max_eqlimit = 1024, max_cost_min = 256 };
+
+    void diff(const std::vector<int>& a, const std::vector<int>& b,
+              std::vector<char>& c1, std::vector<char>& c2);
+    void compare(long off1, long lim1, long off2, long lim2, bool need_min);
+    void split(long off1, long lim1, long off2, long lim2, bool need_min,
+               long& i1, long& i2, bool& min_lo, bool& min_hi);
+
+    static long bogosqrt(long n) {
+        long i;
+        for (i = 1; n > 0; n >>= 2)
+            i <<= 1;
+        return i;
+    }
+    static bool clean_mmatch(const std::vector<char>& dis, long i, long s, long e);
+};
+
+// A line with many matches is set aside too if it sits in a run of lines
+// that mostly have none.
+bool myers::clean_mmatch(const std::vector<char>& dis, long i, long s, long e) {
+    s = std::max(s, i - simscan_window);
+    e = std::min(e, i + simscan_window);
+    long r, rdis0 = 0, rpdis0 = 1, rdis1 = 0, rpdis1 = 1;
+    for (r = 1; i - r >= s; ++r) {
+        if (!dis[i - r])
+            ++rdis0;
+        else if (dis[i - r] == 2)
+            ++rpdis0;
+        else
+            break;
+    }
+    if (rdis0 == 0)
+        return false;
+    for (r = 1; i + r <= e; ++r) {
+        if (!dis[i + r])
+            ++rdis1;
+        else if (dis[i + r] == 2)
+            ++rpdis1;
+        else
+            break;
+    }
+    if (rdis1 == 0)
+        return false;
+    rdis1 += rdis0;
+    rpdis1 += rpdis0;
+    return rpdis1 * kpdis_run < rpdis1 + rdis1;
+}
+
+void myers::diff(const std::vector<int>& a, const std::vector<int>& b,
+                 std::vector<char>& c1, std::vector<char>& c2) {
+    chg1 = &c1;
+    chg2 = &c2;
+    long n1 = a.size(), n2 = b.size(), dstart = 0, dend1, dend2;
+    while (dstart < std::min(n1, n2) && a[dstart] == b[dstart])
+        ++dstart;
+    for (dend1 = n1 - 1, dend2 = n2 - 1;
+         dend1 >= dstart && dend2 >= dstart && a[dend1] == b[dend2];
+         --dend1, --dend2)
+        /* do nothing */;
+
+    std::unordered_map<int, std::pair<long, long> > count;
+    for (int id : a)
+        ++count[id].first;
+    for (int id : b)
+        ++count[id].second;
+    std::vector<char> dis1(n1 + 1, 1), dis2(n2 + 1, 1);
+    long mlim = std::min(bogosqrt(n1), (long) max_eqlimit);
+    for (long i = dstart; i <= dend1; ++i) {
+        long nm = count[a[i]].second;
+        dis1[i] = nm == 0 ? 0 : (nm >= mlim ? 2 : 1);
+    }
+    mlim = std::min(bogosqrt(n2), (long) max_eqlimit);
+    for (long i = dstart; i <= dend2; ++i) {
+        long nm = count[b[i]].first;
+        dis2[i] = nm == 0 ? 0 : (nm >= mlim ? 2 : 1);
+    }
+    for (long i = dstart; i <= dend1; ++i)
+        if (dis1[i] == 1 || (dis1[i] == 2 && !clean_mmatch(dis1, i, dstart, dend1))) {
+            rindex1.push_back(i);
+            ha1.push_back(a[i]);
+        } else
+            c1[i + 1] = 1;
+    for (long i = dstart; i <= dend2; ++i)
+        if (dis2[i] == 1 || (dis2[i] == 2 && !clean_mmatch(dis2, i, dstart, dend2))) {
+            rindex2.push_back(i);
+            ha2.push_back(b[i]);
+        } else
+            c2[i + 1] = 1;
+
+    long nr1 = ha1.size(), nr2 = ha2.size(), ndiags = nr1 + nr2 + 3;
+    kvd.assign(2 * ndiags + 2, 0);
+    kvdf = kvd.data() + nr2 + 1;
+    kvdb = kvdf + ndiags;
+    mxcost = std::max(bogosqrt(ndiags), (long) max_cost_min);
+    compare(0, nr1, 0, nr2, false);
+}
+
+void myers::compare(long off1, long lim1, long off2, long lim2,
+                    bool need_min) {
+    while (off1 < lim1 && off2 < lim2 && ha1[off1] == ha2[off2])
+        ++off1, ++off2;
+    while (off1 < lim1 && off2 < lim2 && ha1[lim1 - 1] == ha2[lim2 - 1])
+        --lim1, --lim2;
+    if (off1 == lim1)
+        for (; off2 < lim2; ++off2)
+            (*chg2)[rindex2[off2] + 1] = 1;
+    else if (off2 == lim2)
+        for (; off1 < lim1; ++off1)
+            (*chg1)[rindex1[off1] + 1] = 1;
+    else {
+        long i1, i2;
+        bool min_lo, min_hi;
+        split(off1, lim1, off2, lim2, need_min, i1, i2, min_lo, min_hi);
+        compare(off1, i1, off2, i2, min_lo);
+        compare(i1, lim1, i2, lim2, min_hi);
+    }
+}
+
+// Find a point on an optimal path through the box by running Myers's
+// search from both corners at once. Unless `need_min`, settle for a
+// good-looking snake, or the furthest-reaching path, once the search gets
+// expensive.
+void myers::split(long off1, long lim1, long off2, long lim2, bool need_min,
+                  long& s1, long& s2, bool& min_lo, bool& min_hi) {
+    const int* h1 = ha1.data();
+    const int* h2 = ha2.data();
+    long dmin = off1 - lim2, dmax = lim1 - off2;
+    long fmid = off1 - off2, bmid = lim1 - lim2;
+    bool odd = (fmid - bmid) & 1;
+    long fmin = fmid, fmax = fmid, bmin = bmid, bmax = bmid;
+    long d, i1, i2, prev1;
+    kvdf[fmid] = off1;
+    kvdb[bmid] = lim1;
+    min_lo = min_hi = true;
+
+    for (long ec = 1; ; ++ec) {
+        bool got_snake = false;
+
+        if (fmin > dmin)
+            kvdf[--fmin - 1] = -1;
+        else
+            ++fmin;
+        if (fmax < dmax)
+            kvdf[++fmax + 1] = -1;
+        else
+            --fmax;
+        for (d = fmax; d >= fmin; d -= 2) {
+            i1 = kvdf[d - 1] >= kvdf[d + 1] ? kvdf[d - 1] + 1 : kvdf[d + 1];
+            prev1 = i1;
+            i2 = i1 - d;
+            while (i1 < lim1 && i2 < lim2 && h1[i1] == h2[i2])
+                ++i1, ++i2;
+            if (i1 - prev1 > snake_cnt)
+                got_snake = true;
+            kvdf[d] = i1;
+            if (odd && bmin <= d && d <= bmax && kvdb[d] <= i1) {
+                s1 = i1, s2 = i2;
+                return;
+            }
+        }
+
+        if (bmin > dmin)
+            kvdb[--bmin - 1] = LONG_MAX;
+        else
+            ++bmin;
+        if (bmax < dmax)
+            kvdb[++bmax + 1] = LONG_MAX;
+        else
+            --bmax;
+        for (d = bmax; d >= bmin; d -= 2) {
+            i1 = kvdb[d - 1] < kvdb[d + 1] ? kvdb[d - 1] : kvdb[d + 1] - 1;
+            prev1 = i1;
+            i2 = i1 - d;
+            while (i1 > off1 && i2 > off2 && h1[i1 - 1] == h2[i2 - 1])
+                --i1, --i2;
+            if (prev1 - i1 > snake_cnt)
+                got_snake = true;
+            kvdb[d] = i1;
+            if (!odd && fmin <= d && d <= fmax && i1 <= kvdf[d]) {
+                s1 = i1, s2 = i2;
+                return;
+            }
+        }
+
+        if (need_min)
+            continue;
+
+        if (got_snake && ec > heur_min) {
+            long best = 0;
+            for (d = fmax; d >= fmin; d -= 2) {
+                long dd = d > fmid ? d - fmid : fmid - d;
+                i1 = kvdf[d];
+                i2 = i1 - d;
+                long v = (i1 - off1) + (i2 - off2) - dd;
+                if (v > k_heur * ec && v > best
+                    && off1 + snake_cnt <= i1 && i1 < lim1
+                    && off2 + snake_cnt <= i2 && i2 < lim2)
+                    for (long k = 1; h1[i1 - k] == h2[i2 - k]; ++k)
+                        if (k == snake_cnt) {
+                            best = v;
+                            s1 = i1, s2 = i2;
+                            break;
+                        }
+            }
+            if (best > 0) {
+                min_hi = false;
+                return;
+            }
+            for (d = bmax; d >= bmin; d -= 2) {
+                long dd = d > bmid ? d - bmid : bmid - d;
+                i1 = kvdb[d];
+                i2 = i1 - d;
+                long v = (lim1 - i1) + (lim2 - i2) - dd;
+                if (v > k_heur * ec && v > best
+                    && off1 < i1 && i1 <= lim1 - snake_cnt
+                    && off2 < i2 && i2 <= lim2 - snake_cnt)
+                    for (long k = 0; h1[i1 + k] == h2[i2 + k]; ++k)
+                        if (k == snake_cnt - 1) {
+                            best = v;
+                            s1 = i1, s2 = i2;
+                            break;
+                        }
+            }
+            if (best > 0) {
+                min_lo = false;
+                return;
+            }
+        }
+
+        if (ec >= mxcost) {
+            long fbest = -1, fbest1 = -1;
+            for (d = fmax; d >= fmin; d -= 2) {
+                i1 = std::min(kvdf[d], lim1);
+                i2 = i1 - d;
+                if (lim2 < i2)
+                    i1 = lim2 + d, i2 = lim2;
+                if (fbest < i1 + i2)
+                    fbest = i1 + i2, fbest1 = i1;
+            }
+            long bbest = LONG_MAX, bbest1 = LONG_MAX;
+            for (d = bmax; d >= bmin; d -= 2) {
+                i1 = std::max(off1, kvdb[d]);
+                i2 = i1 - d;
+                if (i2 < off2)
+                    i1 = off2 + d, i2 = off2;
+                if (i1 + i2 < bbest)
+                    bbest = i1 + i2, bbest1 = i1;
+            }
+            if ((lim1 + lim2) - bbest < fbest - (off1 + off2)) {
+                s1 = fbest1, s2 = fbest - fbest1;
+                min_hi = false;
+            } else {
+                s1 = bbest1, s2 = bbest - bbest1;
+                min_lo = false;
+            }
+            return;
+        }
+    }
+}
+
+// Slide groups of changed lines to where git would put them: as far down
+// as possible, then up to line up with a change in the other file, or else
+// to the position git's indent heuristic prefers. `chg` and `ochg` have a
+// zero sentinel on each side, so index 1 is line 0.
+struct diffgroup {
+    int start, end;
+};
+
+struct diffcompact {
+    const std::vector<int>& ids;
+    const diffside& side;
+    std::vector<char>& chg;
+    int n;
+
+    diffcompact(const std::vector<int>& ids_, const diffside& side_,
+                std::vector<char>& chg_)
+        : ids(ids_), side(side_), chg(chg_), n(ids_.size()) {
+    }
+    bool changed(int i) const {
+        return chg[i + 1];
+    }
+    void init(diffgroup& g) const {
+        g.start = g.end = 0;
+        while (changed(g.end))
+            ++g.end;
+    }
+    bool next(diffgroup& g) const {
+        if (g.end == n)
+            return false;
+        g.start = g.end + 1;
+        for (g.end = g.start; changed(g.end); ++g.end)
+            /* do nothing */;
+        return true;
+    }
+    bool previous(diffgroup& g) const {
+        if (g.start == 0)
+            return false;
+        g.end = g.start - 1;
+        for (g.start = g.end; changed(g.start - 1); --g.start)
+            /* do nothing */;
+        return true;
+    }
+    bool slide_down(diffgroup& g) {
+        if (g.end >= n || ids[g.start] != ids[g.end])
+            return false;
+        chg[g.start++ + 1] = 0;
+        chg[g.end++ + 1] = 1;
+        while (changed(g.end))
+            ++g.end;
+        return true;
+    }
+    bool slide_up(diffgroup& g) {
+        if (g.start <= 0 || ids[g.start - 1] != ids[g.end - 1])
+            return false;
+        chg[--g.start + 1] = 1;
+        chg[--g.end + 1] = 0;
+        while (changed(g.start - 1))
+            --g.start;
+        return true;
+    }
+
+    // indent heuristic
+    int indent(int i) const {
+        int ret = 0;
+        for (size_t j = 0; j != side.lens[i]; ++j) {
+            char c = side.lines[i][j];
+            if (!isspace((unsigned char) c))
+                return ret;
+            else if (c == ' ')
+                ++ret;
+            else if (c == '\t')
+                ret += 8 - ret % 8;
+            if (ret >= 200)
+                return 200;
+        }
+        return -1;
+    }
+    void score_split(int split, int& effective_indent, int& penalty) const;
+};
+
+void diffcompact::score_split(int split, int& effective_indent,
+                              int& penalty) const {
+    bool eof = split >= n;
+    int ind = eof ? -1 : indent(split);
+    int pre_blank = 0, pre_indent = -1;
+    for (int i = split - 1; i >= 0; --i) {
+        if ((pre_indent = indent(i)) != -1)
+            break;
+        if (++pre_blank == 20) {
+            pre_indent = 0;
+            break;
+        }
+    }
+    int post_blank = 0, post_indent = -1;
+    for (int i = split + 1; i < n; ++i) {
+        if ((post_indent = indent(i)) != -1)
+            break;
+        if (++post_blank == 20) {
+            post_indent = 0;
+            break;
+        }
+    }
+
+    if (pre_indent == -1 && pre_blank == 0)
+        penalty += 1;
+    if (eof)
+        penalty += 21;
+    int pblank = ind == -1 ? 1 + post_blank : 0;
+    int total_blank = pre_blank + pblank;
+    penalty += -30 * total_blank + 6 * pblank;
+    if (ind == -1)
+        ind = post_indent;
+    bool any_blanks = total_blank != 0;
+    effective_indent += ind;
+    if (ind == -1 || pre_indent == -1 || ind == pre_indent)
+        /* no adjustment */;
+    else if (ind > pre_indent)
+        penalty += any_blanks ? 10 : -4;
+    else if (post_indent != -1 && post_indent > ind)
+        penalty += any_blanks ? 17 : 24;
+    else
+        penalty += any_blanks ? 17 : 23;
+}
+
+static void diff_compact(diffcompact& x, diffcompact& o) {
+    diffgroup g, go;
+    x.init(g);
+    o.init(go);
+    while (1) {
+        if (g.end != g.start) {
+            int groupsize, earliest_end, end_matching_other;
+            do {
+                groupsize = g.end - g.start;
+                end_matching_other = -1;
+                while (x.slide_up(g))
+                    o.previous(go);
+                earliest_end = g.end;
+                if (go.end > go.start)
+                    end_matching_other = g.end;
+                while (x.slide_down(g)) {
+                    o.next(go);
+                    if (go.end > go.start)
+                        end_matching_other = g.end;
+                }
+            } while (groupsize != g.end - g.start);
+
+            if (g.end == earliest_end)
+                /* no shifting possible */;
+            else if (end_matching_other != -1) {
+                while (go.end == go.start && x.slide_up(g))
+                    o.previous(go);
+            } else {
+                int shift = std::max(earliest_end, std::max(g.end - groupsize - 1, g.end - 100));
+                int best_shift = -1, best_indent = 0, best_penalty = 0;
+                for (; shift <= g.end; ++shift) {
+                    int ei = 0, pen = 0;
+                    x.score_split(shift, ei, pen);
+                    x.score_split(shift - groupsize, ei, pen);
+                    int cmp = 60 * ((ei > best_indent) - (ei < best_indent))
+                        + (pen - best_penalty);
+                    if (best_shift == -1 || cmp <= 0) {
+                        best_indent = ei;
+                        best_penalty = pen;
+                        best_shift = shift;
+                    }
+                }
+                while (g.end > best_shift && x.slide_up(g))
+                    o.previous(go);
+            }
+        }
+        if (!x.next(g) || !o.next(go))
+            break;
+    }
+}
+
+static void json_append_string(std::string& out, const char* s, size_t n) {
+    out.push_back('"');
+    for (size_t i = 0; i != n; ) {
+        unsigned char ch = s[i];
+        if (ch == '"' || ch == '\\') {
+            out.push_back('\\');
+            out.push_back(ch);
+        } else if (ch == '\n')
+            out += "\\n";
+        else if (ch == '\t')
+            out += "\\t";
+        else if (ch < 0x20 || ch == 0x7F) {
+            char buf[8];
+            sprintf(buf, "\\u%04x", ch);
+            out += buf;
+        } else if (ch < 0x80)
+            out.push_back(ch);
+        else {
+            // copy valid UTF-8; replace invalid bytes with U+FFFD
+            int len = ch >= 0xF0 && ch < 0xF5 ? 4 : (ch >= 0xE0 ? 3 : (ch >= 0xC2 && ch < 0xE0 ? 2 : 0));
+            bool ok = len > 0 && i + len <= n;
+            for (int j = 1; ok && j < len; ++j)
+                ok = (s[i + j] & 0xC0) == 0x80;
+            if (ok && len == 3)
+                ok = !(ch == 0xE0 && (unsigned char) s[i + 1] < 0xA0)
+                    && !(ch == 0xED && (unsigned char) s[i + 1] >= 0xA0);
+            if (ok && len == 4)
+                ok = !(ch == 0xF0 && (unsigned char) s[i + 1] < 0x90)
+                    && !(ch == 0xF4 && (unsigned char) s[i + 1] >= 0x90);
+            if (ok) {
+                out.append(s + i, len);
+                i += len;
+            } else {
+                out += "\xEF\xBF\xBD";
+                ++i;
+            }
+            continue;
+        }
+        ++i;
+    }
+    out.push_back('"');
+}
+
+// Append the records for one file. Returns the final B line number, as
+// DiffInfo expects, or -1 if there is no diff.
+static long diff_records(std::string& out, const std::string& path,
+                         diffside& a, diffside& b, bool ignore_ws,
+                         size_t max_lines) {
+    size_t nrecords = 0;
+    auto record = [&](char type, long aline, long bline, const char* s, size_t n) {
+        if (nrecords > max_lines)
+            return;
+        out += nrecords ? ",[\"" : "[\"";
+        out.push_back(type);
+        out += "\",";
+        out += aline < 0 ? "null" : std::to_string(aline);
+        out += ",";
+        out += bline < 0 ? "null" : std::to_string(bline);
+        out += ",";
+        if (n && s[n - 1] == '\n')
+            --n;
+        json_append_string(out, s, n);
+        out += "]";
+        ++nrecords;
+    };
+
+    if (a.binary || b.binary) {
+        std::string msg = "Binary files " + (a.absent ? "/dev/null" : "a/" + path)
+            + " and " + (b.absent ? "/dev/null" : "b/" + path) + " differ";
+        record('@', -1, -1, msg.data(), msg.length());
+        return -2;
+    }
+
+    diff_intern(a, b, ignore_ws);
+    int na = a.ids.size(), nb = b.ids.size();
+    std::vector<char> dela(na + 2, 0), insb(nb + 2, 0);
+    myers().diff(a.ids, b.ids, dela, insb);
+    diffcompact xa(a.ids, a, dela), xb(b.ids, b, insb);
+    diff_compact(xa, xb);
+    diff_compact(xb, xa);
+
+    // collect changes as runs [i, i2) x [j, j2)
+    struct change {
+        int i, i2, j, j2;
+    };
+    std::vector<change> changes;
+    for (int i = 0, j = 0; i < na || j < nb; ) {
+        if (i < na && j < nb && !dela[i + 1] && !insb[j + 1]) {
+            ++i, ++j;
+            continue;
+        }
+        change c = { i, i, j, j };
+        while (c.i2 < na && dela[c.i2 + 1])
+            ++c.i2;
+        while (c.j2 < nb && insb[c.j2 + 1])
+            ++c.j2;
+        changes.push_back(c);
+        i = c.i2, j = c.j2;
+    }
+    if (changes.empty())
+        return -1;
+
+    long bline = 0;
+    for (size_t h = 0; h < changes.size() && nrecords <= max_lines; ) {
+        // extend the hunk over changes separated by few unchanged lines
+        size_t e = h + 1;
+        while (e < changes.size()
+               && changes[e].i - changes[e - 1].i2 <= 2 * diff_context)
+            ++e;
+        int i0 = std::max(changes[h].i - diff_context, 0);
+        int j0 = changes[h].j - (changes[h].i - i0);
+        int i1 = std::min(changes[e - 1].i2 + diff_context, na);
+        int j1 = changes[e - 1].j2 + (i1 - changes[e - 1].i2);
+
+        char hdr[128];
+        int la = i1 - i0, lb = j1 - j0;
+        long sa = la ? i0 + 1 : i0, sb = lb ? j0 + 1 : j0;
+        char ra[48], rb[48];
+        sprintf(ra, la == 1 ? "%ld" : "%ld,%d", sa, la);
+        sprintf(rb, lb == 1 ? "%ld" : "%ld,%d", sb, lb);
+        sprintf(hdr, "@@ -%s +%s @@", ra, rb);
+        std::string header = hdr;
+        // function context, like git's default: the nearest earlier line
+        // that starts with a letter, `_`, or `$`
+        for (int k = i0 - 1; k >= 0; --k) {
+            unsigned char ch = a.lens[k] ? a.lines[k][0] : 0;
+            if (isalpha(ch) || ch == '_' || ch == '$') {
+                size_t n = std::min(a.lens[k], (size_t) 80);
+                while (n && isspace((unsigned char) a.lines[k][n - 1]))
+                    --n;
+                header += " ";
+                header.append(a.lines[k], n);
+                break;
+            }
+        }
+        record('@', -1, -1, header.data(), header.length());
+
+        long al = sa, bl = sb;
+        int i = i0, j = j0;
+        for (size_t c = h; c <= e; ++c) {
+            int ci = c < e ? changes[c].i : i1;
+            for (; i < ci; ++i, ++j) {
+                // -w shows context from the new side, like git
+                if (ignore_ws)
+                    record(' ', al, bl, b.lines[j], b.lens[j]);
+                else
+                    record(' ', al, bl, a.lines[i], a.lens[i]);
+                ++al, ++bl;
+            }
+            if (c == e)
+                break;
+            for (; i < changes[c].i2; ++i, ++al)
+                record('-', al, bl, a.lines[i], a.lens[i]);
+            for (; j < changes[c].j2; ++j, ++bl)
+                record('+', al, bl, b.lines[j], b.lens[j]);
+        }
+        bline = bl;
+        h = e;
+    }
+    return bline;
+}
+
+static bool diff_side(request& r, const gitoid& tree, const std::string& path,
+                      std::string& data, diffside& s, gitoid& oid) {
+    std::vector<gittree_entry> entries;
+    size_t slash = path.rfind('/');
+    gitoid dir;
+    if (!r.cr->path_oid(tree, slash == std::string::npos ? "" : path.substr(0, slash), dir))
+        return r.repo_fail();
+    s.absent = true;
+    if (oid_zero(dir))
+        return true;
+    if (!r.cr->tree(dir, entries))
+        return r.repo_fail();
+    std::string name = slash == std::string::npos ? path : path.substr(slash + 1);
+    for (auto& e : entries)
+        if (e.name == name && !e.is_tree()) {
+            s.absent = false;
+            oid = e.oid;
+            if (e.is_submodule())
+                data = "Subproject commit " + e.oid.hex() + "\n";
+            else {
+                gitobj_type type;
+                if (!r.cr->repo.read(e.oid, type, data))
+                    return r.repo_fail();
+            }
+        }
+    return true;
+}
+
+static bool cmd_diff_records(request& r) {
+    bool ignore_ws = false;
+    size_t max_lines = 16384;
+    std::vector<std::string> revs, paths;
+    size_t i = 1;
+    for (; i < r.args.size() && r.args[i] != "--"; ++i) {
+        const std::string& a = r.args[i];
+        if (a == "-w")
+            ignore_ws = true;
+        else if (a.compare(0, 12, "--max-lines=") == 0)
+            max_lines = strtoul(a.c_str() + 12, nullptr, 10);
+        else if (a[0] == '-')
+            return r.unsupported("diff-records " + a + ": Unsupported");
+        else
+            revs.push_back(a);
+    }
+    if (revs.size() != 2)
+        return r.unsupported("diff-records: Need two revisions");
+    paths.assign(r.args.begin() + std::min(i + 1, r.args.size()), r.args.end());
+    gitoid ca, cb, ta, tb;
+    if (!r.resolve(revs[0], ca) || !r.resolve(revs[1], cb))
+        return false;
+    if (!r.cr->repo.commit_tree(ca, ta) || !r.cr->repo.commit_tree(cb, tb))
+        return r.repo_fail();
+
+    r.out = "[";
+    bool first = true;
+    for (auto& path : paths) {
+        std::string da, db;
+        diffside sa, sb;
+        gitoid oa, ob;
+        memset(oa.b, 0, sizeof(oa.b));
+        memset(ob.b, 0, sizeof(ob.b));
+        if (!diff_side(r, ta, path, da, sa, oa) || !diff_side(r, tb, path, db, sb, ob))
+            return false;
+        if ((sa.absent && sb.absent) || (oa == ob && !sa.absent && !sb.absent))
+            continue;
+
+        // the path matters only to binary messages
+        std::string key = oa.hex() + ob.hex() + (ignore_ws ? "w" : "-")
+            + std::to_string(max_lines);
+        diff_split(da, sa);
+        diff_split(db, sb);
+        if (sa.binary || sb.binary)
+            key += path;
+        std::string* body = diff_cache.find(key);
+        if (!body) {
+            std::string records;
+            long bline = diff_records(records, path, sa, sb, ignore_ws, max_lines);
+            std::string x = "\"blineno\":";
+            x += bline == -2 ? "null" : std::to_string(bline);
+            x += ",\"diff\":[" + records + "]";
+            body = &diff_cache.insert(key, bline == -1 ? std::string() : x);
+        }
+        if (body->empty())
+            continue;
+        r.out += first ? "{\"file\":" : ",\n{\"file\":";
+        json_append_string(r.out, path.data(), path.length());
+        r.out += "," + *body + "}";
+        first = false;
+    }
+    r.out += "]\n";
+    return true;
+}
+
+static bool cmd_diff(request& r) {
+    std::vector<std::string> revs, specs;
+    bool name_only = false;
+    size_t i = 1;
+    for (; i < r.args.size() && r.args[i] != "--"; ++i)
+        if (r.args[i] == "--name-only")
+            name_only = true;
+        else if (r.args[i][0] == '-')
+            return r.unsupported("diff " + r.args[i] + ": Unsupported");
+        else
+            revs.push_back(r.args[i]);
+    if (!name_only || revs.size() != 2)
+        return r.unsupported("diff: Only `diff --name-only A B` is supported");
+    for (++i; i < r.args.size(); ++i)
+        if (!r.args[i].empty())
+            specs.push_back(r.args[i]);
+    gitoid ca, cb, ta, tb;
+    if (!r.resolve(revs[0], ca) || !r.resolve(revs[1], cb))
+        return false;
+    if (!r.cr->repo.commit_tree(ca, ta) || !r.cr->repo.commit_tree(cb, tb))
+        return r.repo_fail();
+    return diff_tree_names(r, &ta, &tb, std::string(), specs);
+}
+
+// blob downloads
+//
+// `blob REV:PATH` is pa-gitd's own command for file downloads. Its reply is
+// `ok\n`, a `SIZE CONTENT-TYPE\n` line, and then the blob's SIZE bytes,
+// written in bounded chunks so the client can pass them on as they arrive.
+// With `--blob-cache DIR`, blobs of at least 64 KiB are also kept
+// decompressed in DIR, named by object ID; later requests for them skip the
+// object store and go out with sendfile(). The cache holds at most
+// `--blob-cache-size` megabytes, dropping the least recently sent blobs.
+
+static const off_t blob_cache_min = 65536;
+static const size_t blob_chunk = 1 << 20;
+
+class blob_cache {
+  public:
+    void open(const std::string& dir, off_t limit);
+    // Return a file descriptor for the cached blob `oid`, or -1.
+    int find(const gitoid& oid, off_t& size);
+    // Cache `data` as blob `oid`. Return a file descriptor for it, or -1.
+    int add(const gitoid& oid, const std::string& data);
+
+  private:
+    typedef std::list<std::pair<gitoid, off_t> > list_type;
+    std::string dir_;
+    off_t limit_ = 0;
+    off_t size_ = 0;
+    list_type order_;
+    std::unordered_map<gitoid, list_type::iterator, gitoid_hash> map_;
+
+    void insert(const gitoid& oid, off_t size);
+    void erase(const gitoid& oid);
+};
+
+static blob_cache blobs;
+
+void blob_cache::open(const std::string& dir, off_t limit) {
+    dir_ = dir;
+    limit_ = limit;
+    if (mkdir(dir_.c_str(), 0700) != 0 && errno != EEXIST)
+        perror_die(dir_);
+    DIR* d = opendir(dir_.c_str());
+    if (!d)
+        perror_die(dir_);
+    while (struct dirent* de = readdir(d)) {
+        std::string path = dir_ + "/" + de->d_name;
+        gitoid oid;
+        struct stat st;
+        if (strncmp(de->d_name, ".tmp", 4) == 0)
+            unlink(path.c_str());
+        else if (oid.parse(de->d_name, strlen(de->d_name))
+                 && stat(path.c_str(), &st) == 0 && S_ISREG(st.st_mode))
+            insert(oid, st.st_size);
+    }
+    closedir(d);
+}
+
+void blob_cache::insert(const gitoid& oid, off_t size) {
+    order_.emplace_front(oid, size);
+    map_[oid] = order_.begin();
+    size_ += size;
+    while (size_ > limit_ && order_.size() > 1) {
+        std::string path = dir_ + "/" + order_.back().first.hex();
+        unlink(path.c_str());
+        erase(order_.back().first);
+    }
+}
+
+void blob_cache::erase(const gitoid& oid) {
+    auto it = map_.find(oid);
+    if (it != map_.end()) {
+        size_ -= it->second->second;
+        order_.erase(it->second);
+        map_.erase(it);
+    }
+}
+
+int blob_cache::find(const gitoid& oid, off_t& size) {
+    if (dir_.empty())
+        return -1;
+    std::string path = dir_ + "/" + oid.hex();
+    int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    auto it = map_.find(oid);
+    if (fd == -1) {
+        erase(oid);
+        return -1;
+    } else if (it == map_.end()) {
+        // another worker cached it, and counts it against its own share
+        struct stat st;
+        if (fstat(fd, &st) != 0) {
+            close(fd);
+            return -1;
+        }
+        size = st.st_size;
+        return fd;
+    }
+    order_.splice(order_.begin(), order_, it->second);
+    size = it->second->second;
+    return fd;
+}
+
+int blob_cache::add(const gitoid& oid, const std::string& data) {
+    if (dir_.empty() || (off_t) data.length() < blob_cache_min
+        || (off_t) data.length() > limit_)
+        return -1;
+    std::string tmp = dir_ + "/.tmpXXXXXX";
+    int fd = mkostemp(&tmp[0], O_CLOEXEC);
+    if (fd == -1)
+        return -1;
+    size_t w = 0;
+    while (w < data.length()) {
+        ssize_t n = write(fd, data.data() + w, std::min(data.length() - w, blob_chunk));
+        if (n > 0)
+            w += n;
+        else if (n == 0 || errno != EINTR)
+            break;
+    }
+    if (w != data.length()
+        || rename(tmp.c_str(), (dir_ + "/" + oid.hex()).c_str()) != 0) {
+        unlink(tmp.c_str());
+        close(fd);
+        return -1;
+    }
+    erase(oid);
+    insert(oid, data.length());
+    return fd;
+}
+
+// Choose a content type the way raw.php does.
+static const char* blob_content_type(const std::string& path,
+                                     const char* head, size_t headlen) {
+    size_t slash = path.rfind('/');
+    std::string name = path.substr(slash == std::string::npos ? 0 : slash + 1);
+    size_t dot = name.rfind('.');
+    std::string ext = dot == std::string::npos ? "" : name.substr(dot + 1);
+    std::transform(ext.begin(), ext.end(), ext.begin(), ::tolower);
+    auto starts = [&](const char* magic) {
+        size_t n = strlen(magic);
+        return headlen >= n && memcmp(head, magic, n) == 0;
+    };
+    if (ext == "pdf" && starts("%PDF-"))
+        return "application/pdf";
+    else if (ext == "txt" || strcasecmp(name.c_str(), "README") == 0)
+        return "text/plain";
+    else if (ext == "png" && starts("\x89PNG\x0d\x0a\x1a\x0a"))
+        return "image/png";
+    else if (ext == "gif" && (starts("GIF87a") || starts("GIF89a")))
+        return "image/gif";
+    else if (ext == "html")
+        return "text/html";
+    else
+        return "application/octet-stream";
+}
+
+static bool cmd_blob(request& r) {
+    if (r.args.size() != 2 || r.args[1].find(':') == std::string::npos)
+        return r.unsupported("blob: Only `blob REV:PATH` is supported");
+    gitoid oid;
+    std::string path;
+    if (!r.resolve(r.args[1], oid, &path))
+        return false;
+    char head[8];
+    size_t headlen;
+    off_t size;
+    if ((r.body_fd = blobs.find(oid, size)) >= 0) {
+        ssize_t n = pread(r.body_fd, head, sizeof(head), 0);
+        headlen = n > 0 ? n : 0;
+    } else {
+        gitobj_type type;
+        if (!r.cr->repo.read(oid, type, r.body))
+            return r.repo_fail();
+        if (type != gitobj_blob)
+            return r.fail(r.args[1] + ": bad file");
+        size = r.body.length();
+        headlen = std::min(r.body.length(), sizeof(head));
+        memcpy(head, r.body.data(), headlen);
+        if ((r.body_fd = blobs.add(oid, r.body)) >= 0)
+            std::string().swap(r.body);
+    }
+    r.body_size = size;
+    r.out = std::to_string(size) + " " + blob_content_type(path, head, headlen) + "\n";
+    return true;
+}
+
+
+static void handle_request(request& r) {
+    bool ok = false;
+    if (r.args.size() < 2)
+        r.unsupported("Missing command");
+    else if (!(r.cr = open_repo(r.args[0], r.error)))
+        /* error set */;
+    else {
+        r.args.erase(r.args.begin());
+        const std::string& cmd = r.args[0];
+        if (cmd == "rev-parse")
+            ok = cmd_rev_parse(r);
+        else if (cmd == "cat-file")
+            ok = cmd_cat_file(r);
+        else if (cmd == "show")
+            ok = cmd_show(r);
+        else if (cmd == "ls-tree")
+            ok = cmd_ls_tree(r);
+        else if (cmd == "log")
+            ok = cmd_log(r);
+        else if (cmd == "diff")
+            ok = cmd_diff(r);
+        else if (cmd == "diff-records")
+            ok = cmd_diff_records(r);
+        else if (cmd == "blob")
+            ok = cmd_blob(r);
+        else
+            r.unsupported(cmd + ": Unsupported command");
+    }
+    if (ok)
+        r.out.insert(0, "ok\n");
+    else {
+        std::replace(r.error.begin(), r.error.end(), '\n', ' ');
+        r.body.clear();
+        r.out = (r.is_unsupported ? "unsupported " : "error ") + r.error + "\n";
+    }
+}
+
+
+// server
+
+static bool write_all(int fd, const std::string& s) {
+    for (size_t w = 0; w < s.length(); ) {
+        ssize_t n = write(fd, s.data() + w, std::min(s.length() - w, blob_chunk));
+        if (n > 0)
+            w += n;
+        else if (n == 0 || errno != EINTR)
+            return false;
+    }
+    return true;
+}
+
+static void serve_connection(int fd) {
+    struct timeval tv = { 10, 0 };
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+
+    std::string data;
+    char buf[8192];
+    while (data.length() < max_request) {
+        ssize_t n = read(fd, buf, sizeof(buf));
+        if (n > 0)
+            data.append(buf, n);
+        else if (n == 0)
+            break;
+        else if (errno != EINTR)
+            return;
+    }
+
+    request r;
+    size_t pos = 0;
+    while (pos < data.length()) {
+        size_t nul = data.find('\0', pos);
+        if (nul == std::string::npos)
+            break;
+        r.args.push_back(data.substr(pos, nul - pos));
+        pos = nul + 1;
+    }
+    if (data.length() >= max_request || pos != data.length())
+        r.args.clear();
+    handle_request(r);
+
+    if (!write_all(fd, r.out) || !write_all(fd, r.body))
+        return;
+    for (off_t off = 0; r.body_fd >= 0 && off < r.body_size; ) {
+        ssize_t n = sendfile(fd, r.body_fd, &off, std::min((size_t) (r.body_size - off), blob_chunk));
+        if (n == 0 || (n == -1 && errno != EINTR))
+            break;
+    }
+}
+
+static __attribute__((noreturn)) void usage() {
+    fprintf(stderr, "Usage: pa-gitd --root DIR [--workers N] [--max-repos N] [--blob-cache DIR] SOCKET\n\
+Answer git queries for the repositories below DIR on Unix socket SOCKET.\n\
+\n\
+      --root DIR            only serve repositories below DIR (required)\n\
+      --workers N           serve N connections at once (default 4)\n\
+      --max-repos N         keep at most N repositories open per worker\n\
+                            (default 32)\n\
+      --blob-cache DIR      keep large downloaded blobs in DIR\n\
+      --blob-cache-size MB  limit the blob cache to MB megabytes (default 1024)\n");
+    exit(1);
+}
+
+static struct option longoptions[] = {
+    { "root", required_argument, NULL, 'r' },
+    { "workers", required_argument, NULL, 'w' },
+    { "max-repos", required_argument, NULL, 'm' },
+    { "blob-cache", required_argument, NULL, 'b' },
+    { "blob-cache-size", required_argument, NULL, 's' },
+    { "help", no_argument, NULL, 'H' },
+    { NULL, 0, NULL, 0 }
+};
+
+int main(int argc, char** argv) {
+    int ch;
+    while ((ch = getopt_long(argc, argv, "", longoptions, NULL)) != -1) {
+        if (ch == 'r') {
+            root_dir = optarg;
+            while (root_dir.length() > 1 && root_dir.back() == '/')
+                root_dir.pop_back();
+            root_dir += "/";
+        } else if (ch == 'w') {
+            char* end;
+            long n = strtol(optarg, &end, 10);
+            if (end == optarg || *end || n <= 0 || n > 256)
+                usage();
+            nworkers = n;
+        } else if (ch == 'm') {
+            char* end;
+            long n = strtol(optarg, &end, 10);
+            if (end == optarg || *end || n <= 0)
+                usage();
+            max_repos = n;
+        } else if (ch == 'b')
+            blob_cache_dir = optarg;
+        else if (ch == 's') {
+            char* end;
+            long n = strtol(optarg, &end, 10);
+            if (end == optarg || *end || n <= 0)
+                usage();
+            blob_cache_size = (off_t) n << 20;
+        } else
+            usage();
+    }
+    if (optind + 1 != argc || root_dir.empty() || root_dir[0] != '/')
+        usage();
+    repos.set_capacity(max_repos);
+    // each worker keeps its share of the blob cache
+    if (!blob_cache_dir.empty())
+        blobs.open(blob_cache_dir, blob_cache_size / nworkers);
+
+    struct sockaddr_un sun;
+    memset(&sun, 0, sizeof(sun));
+    sun.sun_family = AF_UNIX;
+    if (strlen(argv[optind]) >= sizeof(sun.sun_path))
+        die("%s: Socket name too long\n", argv[optind]);
+    strcpy(sun.sun_path, argv[optind]);
+    int lfd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (lfd == -1)
+        perror_die("socket");
+    unlink(sun.sun_path);
+    mode_t old_umask = umask(007);
+    if (bind(lfd, (struct sockaddr*) &sun, sizeof(sun)) != 0)
+        perror_die(sun.sun_path);
+    umask(old_umask);
+    if (listen(lfd, 128) != 0)
+        perror_die(sun.sun_path);
+    signal(SIGPIPE, SIG_IGN);
+
+    // start the workers, and restart any that die
+    pid_t parent = getpid();
+    std::vector<std::pair<pid_t, time_t> > workers(nworkers, std::make_pair(-1, 0));
+    while (1) {
+        for (auto& w : workers) {
+            if (w.first > 0)
+                continue;
+            // a worker that keeps dying should not spin
+            if (w.second != 0 && time(NULL) - w.second < 1)
+                sleep(1);
+            w.second = time(NULL);
+            if ((w.first = fork()) == 0)
+                goto worker;
+            else if (w.first == -1)
+                perror_die("fork");
+        }
+        pid_t p = waitpid(-1, nullptr, 0);
+        for (auto& w : workers)
+            if (w.first == p)
+                w.first = -1;
+    }
+
+ worker:
+    // workers exit with the parent
+    prctl(PR_SET_PDEATHSIG, SIGTERM);
+    if (getppid() != parent)
+        exit(0);
+    while (1) {
+        int fd = accept4(lfd, nullptr, nullptr, SOCK_CLOEXEC);
+        if (fd >= 0) {
+            serve_connection(fd);
+            close(fd);
+        } else if (errno != EINTR && errno != ECONNABORTED && errno != EMFILE
+                   && errno != ENFILE)
+            perror_die("accept");
+    }
+}
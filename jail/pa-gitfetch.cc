@@ -0,0 +1,720 @@
+// pa-gitfetch.cc -- Peteramati repository fetch scheduler
+// Peteramati is Copyright (c) 2013-2015 Eddie Kohler and others
+// Distributed under an MIT-like license; see LICENSE
+//
+// `pa-gitfetch schedule` reads `REPOID CACHEID URL DEADLINE` lines from
+// standard input and runs `src/gitfetch REPOID CACHEID URL` for each, many
+// at once. Repositories with a DEADLINE (a Unix time; 0 means none) go
+// first, earliest deadline first; the rest keep their input order. At most
+// `--per-host` fetches talk to one host at a time, and fetches that share
+// a cache directory run one after another, since git fetches into one
+// repository would race on FETCH_HEAD. Each fetch's latency is printed as
+// it finishes, with a summary at the end.
+//
+// `pa-gitfetch heads REPODIR REV...` prints the REVs that are not
+// ancestors of other REVs, newest commit first. gitfetch uses it to
+// compute a repository's distinct heads. It answers from a reachability
+// index that each run extends with the new heads.
+//
+// `pa-gitfetch truncate REPODIR REV DIR` stores a commit whose tree is
+// REV's DIR as branch `truncated_COMMIT` of REPODIR.
+
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/time.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <time.h>
+#include <getopt.h>
+#include <algorithm>
+#include <map>
+#include <queue>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+#include "gitobj.hh"
+
+
+// error helpers
+
+static __attribute__((noreturn))
+void die(const char* fmt, ...) {
+    va_list val;
+    va_start(val, fmt);
+    vfprintf(stderr, fmt, val);
+    va_end(val);
+    exit(1);
+}
+
+static __attribute__((noreturn))
+void perror_die(const std::string& message) {
+    die("%s: %s\n", message.c_str(), strerror(errno));
+}
+
+static double timestamp() {
+    struct timeval tv;
+    gettimeofday(&tv, nullptr);
+    return tv.tv_sec + tv.tv_usec / 1000000.;
+}
+
+
+// reachability index
+//
+// `heads` keeps an index in GITDIR/pa-reach, so a run only looks at
+// commits that arrived since the last one. The index holds the generation
+// number of each commit it has seen, and for each head a bitmap of the
+// heads that are its ancestors (itself included). "Is head A an ancestor of
+// head B" is then one bit test. A new head's generation follows from its
+// parents'. Its bitmap is the union of the bitmaps of the nearest indexed
+// heads below it. Existing heads are searched for the new head only when
+// they are newer than it, as after a force push.
+//
+// The file is a `pa-reach 1 NCOMMITS NHEADS\n` line, then NCOMMITS
+// records of a 20-byte object ID and a native-endian 32-bit generation,
+// then NHEADS records of an object ID and (NHEADS + 63) / 64 64-bit bitmap
+// words.
+
+class reachindex {
+  public:
+    explicit reachindex(gitrepo& repo)
+        : repo_(repo) {
+    }
+
+    bool load(const std::string& path);
+    bool save(const std::string& path) const;
+    bool changed() const {
+        return changed_;
+    }
+    uint32_t generation(const gitoid& oid);
+    void add_head(const gitoid& oid);
+    // Return true if head `a` is an ancestor of head `b`, or equal to it.
+    bool is_ancestor(const gitoid& a, const gitoid& b) const {
+        size_t ai = headidx_.at(a), bi = headidx_.at(b);
+        return (bits_[bi][ai / 64] >> (ai % 64)) & 1;
+    }
+
+  private:
+    enum walkstep { walk_expand, walk_prune, walk_stop };
+
+    gitrepo& repo_;
+    std::unordered_map<gitoid, uint32_t, gitoid_hash> gen_;
+    std::vector<gitoid> heads_;
+    std::unordered_map<gitoid, size_t, gitoid_hash> headidx_;
+    std::vector<std::vector<uint64_t> > bits_;
+    bool changed_ = false;
+
+    void read_parents(const gitoid& oid, gitcommit& c);
+    template <typename F> void walk(const gitoid& start, uint32_t min_gen, F f);
+};
+
+struct headwalk_item {
+    uint32_t generation;
+    gitoid oid;
+
+    bool operator<(const headwalk_item& x) const {
+        return generation < x.generation;
+    }
+};
+
+bool reachindex::load(const std::string& path) {
+    FILE* f = fopen(path.c_str(), "r");
+    if (!f)
+        return false;
+    unsigned long ncommits, nheads;
+    bool ok = fscanf(f, "pa-reach 1 %lu %lu", &ncommits, &nheads) == 2
+        && fgetc(f) == '\n';
+    for (unsigned long i = 0; ok && i != ncommits; ++i) {
+        gitoid oid;
+        uint32_t gen;
+        ok = fread(oid.b, sizeof(oid.b), 1, f) == 1
+            && fread(&gen, sizeof(gen), 1, f) == 1;
+        if (ok)
+            gen_[oid] = gen;
+    }
+    size_t nwords = (nheads + 63) / 64;
+    for (unsigned long i = 0; ok && i != nheads; ++i) {
+        gitoid oid;
+        std::vector<uint64_t> bits(nwords);
+        ok = fread(oid.b, sizeof(oid.b), 1, f) == 1
+            && fread(bits.data(), sizeof(uint64_t), nwords, f) == nwords
+            && gen_.count(oid);
+        if (ok) {
+            headidx_[oid] = heads_.size();
+            heads_.push_back(oid);
+            bits_.push_back(std::move(bits));
+        }
+    }
+    fclose(f);
+    if (!ok) {
+        // start over
+        gen_.clear();
+        heads_.clear();
+        headidx_.clear();
+        bits_.clear();
+    }
+    return ok;
+}
+
+bool reachindex::save(const std::string& path) const {
+    std::string tmp = path + ".tmpXXXXXX";
+    int fd = mkstemp(&tmp[0]);
+    if (fd == -1)
+        return false;
+    mode_t mask = umask(0);
+    umask(mask);
+    fchmod(fd, 0666 & ~mask);
+    FILE* f = fdopen(fd, "w");
+    fprintf(f, "pa-reach 1 %zu %zu\n", gen_.size(), heads_.size());
+    for (auto& g : gen_) {
+        fwrite(g.first.b, sizeof(g.first.b), 1, f);
+        fwrite(&g.second, sizeof(g.second), 1, f);
+    }
+    for (size_t i = 0; i != heads_.size(); ++i) {
+        fwrite(heads_[i].b, sizeof(heads_[i].b), 1, f);
+        fwrite(bits_[i].data(), sizeof(uint64_t), bits_[i].size(), f);
+    }
+    bool ok = !ferror(f);
+    ok = fclose(f) == 0 && ok;
+    if (!ok || rename(tmp.c_str(), path.c_str()) != 0) {
+        unlink(tmp.c_str());
+        return false;
+    }
+    return true;
+}
+
+void reachindex::read_parents(const gitoid& oid, gitcommit& c) {
+    if (!repo_.read_commit(oid, c, true))
+        die("%s: %s\n", oid.hex().c_str(), repo_.error().c_str());
+}
+
+uint32_t reachindex::generation(const gitoid& oid) {
+    auto it = gen_.find(oid);
+    if (it != gen_.end())
+        return it->second;
+    // depth-first, so each new commit is read once; the commit-graph's
+    // generations are the same numbers, so use them where present
+    std::vector<std::pair<gitoid, gitcommit> > stack;
+    stack.emplace_back(oid, gitcommit());
+    read_parents(oid, stack.back().second);
+    while (!stack.empty()) {
+        gitoid c = stack.back().first;
+        if (stack.back().second.generation) {
+            gen_[c] = stack.back().second.generation;
+            stack.pop_back();
+            continue;
+        }
+        uint32_t g = 0;
+        const gitoid* missing = nullptr;
+        for (auto& p : stack.back().second.parents) {
+            auto pit = gen_.find(p);
+            if (pit == gen_.end()) {
+                missing = &p;
+                break;
+            }
+            g = std::max(g, pit->second);
+        }
+        if (missing) {
+            gitoid p = *missing;
+            stack.emplace_back(p, gitcommit());
+            read_parents(p, stack.back().second);
+        } else {
+            gen_[c] = g + 1;
+            stack.pop_back();
+        }
+    }
+    changed_ = true;
+    return gen_[oid];
+}
+
+// Visit the ancestors of `start` with generation at least `min_gen`,
+// highest generation first. `f(oid)` says whether to visit a commit's
+// parents, skip them, or stop.
+template <typename F>
+void reachindex::walk(const gitoid& start, uint32_t min_gen, F f) {
+    std::priority_queue<headwalk_item> q;
+    std::unordered_set<gitoid, gitoid_hash> seen;
+    auto push_parents = [&](const gitoid& oid) {
+        gitcommit c;
+        read_parents(oid, c);
+        for (auto& p : c.parents) {
+            uint32_t g = generation(p);
+            if (g >= min_gen && seen.insert(p).second)
+                q.push(headwalk_item{g, p});
+        }
+    };
+    push_parents(start);
+    while (!q.empty()) {
+        gitoid oid = q.top().oid;
+        q.pop();
+        walkstep step = f(oid);
+        if (step == walk_stop)
+            break;
+        else if (step == walk_expand)
+            push_parents(oid);
+    }
+}
+
+void reachindex::add_head(const gitoid& oid) {
+    if (headidx_.count(oid))
+        return;
+    uint32_t gen = generation(oid);
+    uint32_t min_gen = UINT32_MAX;
+    for (auto& h : heads_)
+        min_gen = std::min(min_gen, gen_[h]);
+
+    size_t idx = heads_.size(), nwords = idx / 64 + 1;
+    heads_.push_back(oid);
+    headidx_[oid] = idx;
+    for (auto& b : bits_)
+        b.resize(nwords);
+    bits_.emplace_back(nwords);
+    bits_[idx][idx / 64] |= uint64_t(1) << (idx % 64);
+    changed_ = true;
+
+    // ancestors: the union of the nearest indexed heads below
+    if (idx > 0)
+        walk(oid, min_gen, [&](const gitoid& c) {
+                auto it = headidx_.find(c);
+                if (it == headidx_.end())
+                    return walk_expand;
+                for (size_t w = 0; w != nwords; ++w)
+                    bits_[idx][w] |= bits_[it->second][w];
+                return walk_prune;
+            });
+
+    // descendants: newer heads that reach this one, lowest first, so a
+    // search can stop at a head that has been settled already
+    std::vector<size_t> newer;
+    for (size_t i = 0; i != idx; ++i)
+        if (gen_[heads_[i]] > gen)
+            newer.push_back(i);
+    std::sort(newer.begin(), newer.end(), [&](size_t a, size_t b) {
+            return gen_[heads_[a]] < gen_[heads_[b]];
+        });
+    for (size_t i : newer) {
+        bool found = false;
+        walk(heads_[i], gen, [&](const gitoid& c) {
+                auto it = headidx_.find(c);
+                if (it == headidx_.end())
+                    return walk_expand;
+                found = (bits_[it->second][idx / 64] >> (idx % 64)) & 1;
+                return found ? walk_stop : walk_prune;
+            });
+        if (found)
+            bits_[i][idx / 64] |= uint64_t(1) << (idx % 64);
+    }
+}
+
+static int heads_main(const std::string& repodir,
+                      const std::vector<std::string>& revs) {
+    gitrepo repo;
+    if (!repo.open(repodir))
+        die("%s: %s\n", repodir.c_str(), repo.error().c_str());
+    reachindex index(repo);
+    std::string indexpath = repo.gitdir() + "/pa-reach";
+    index.load(indexpath);
+
+    std::vector<gitoid> heads;
+    std::unordered_set<gitoid, gitoid_hash> seen;
+    for (auto& rev : revs) {
+        gitoid oid;
+        if (!repo.resolve(rev, oid))
+            die("%s: %s\n", rev.c_str(), repo.error().c_str());
+        if (seen.insert(oid).second)
+            heads.push_back(oid);
+    }
+    // oldest first, so each new head finds its ancestors indexed
+    std::vector<gitoid> order(heads);
+    std::sort(order.begin(), order.end(), [&](const gitoid& a, const gitoid& b) {
+            return index.generation(a) < index.generation(b);
+        });
+    for (auto& h : order)
+        index.add_head(h);
+    if (index.changed() && !index.save(indexpath))
+        fprintf(stderr, "%s: %s\n", indexpath.c_str(), strerror(errno));
+
+    std::vector<std::pair<int64_t, gitoid> > distinct;
+    for (auto& h : heads) {
+        bool reached = false;
+        for (auto& k : heads)
+            if (k != h && index.is_ancestor(h, k)) {
+                reached = true;
+                break;
+            }
+        if (!reached) {
+            gitcommit c;
+            if (!repo.read_commit(h, c, true))
+                die("%s: %s\n", h.hex().c_str(), repo.error().c_str());
+            distinct.emplace_back(c.time, h);
+        }
+    }
+    std::sort(distinct.begin(), distinct.end(), [](const std::pair<int64_t, gitoid>& a,
+                                                   const std::pair<int64_t, gitoid>& b) {
+            return a.first > b.first || (a.first == b.first && b.second < a.second);
+        });
+    std::string out;
+    for (auto& h : distinct)
+        out += (out.empty() ? "" : " ") + h.second.hex();
+    printf("%s\n", out.c_str());
+    return 0;
+}
+
+
+// truncated handouts
+//
+// When a pset's files live in a subdirectory DIR of the handout but at the
+// top of students' repositories, diffs use a "truncated" handout commit
+// whose tree is the handout's DIR subtree. `truncate REPODIR REV DIR`
+// makes that commit, with REV's author and committer so the result is the
+// same every time, and stores it as branch `truncated_COMMIT` (COMMIT is
+// REV's commit ID). The subtree is shared, so only the commit object is
+// new. An existing branch is reused, so each handout commit is converted
+// once. The branch name is printed.
+
+static int truncate_main(const std::string& repodir, const std::string& rev,
+                         std::string dir) {
+    gitrepo repo;
+    if (!repo.open(repodir))
+        die("%s: %s\n", repodir.c_str(), repo.error().c_str());
+    gitoid oid;
+    gitobj_type type;
+    std::string data;
+    if (!repo.resolve(rev, oid))
+        die("%s: %s\n", rev.c_str(), repo.error().c_str());
+    for (int depth = 0; ; ++depth) {
+        if (!repo.read(oid, type, data))
+            die("%s: %s\n", rev.c_str(), repo.error().c_str());
+        if (type == gitobj_commit)
+            break;
+        else if (type != gitobj_tag || depth == 10
+                 || data.compare(0, 7, "object ") != 0
+                 || !oid.parse(data.data() + 7, 40))
+            die("%s: Not a commit\n", rev.c_str());
+    }
+
+    std::string branch = "truncated_" + oid.hex();
+    gitoid existing;
+    if (repo.resolve("refs/heads/" + branch, existing)) {
+        printf("%s\n", branch.c_str());
+        return 0;
+    }
+
+    while (!dir.empty() && dir.back() == '/')
+        dir.pop_back();
+    gitcommit c;
+    gittree_entry e;
+    if (!repo.read_commit(oid, c) || !repo.lookup_path(c.tree, dir, e))
+        die("%s: %s\n", rev.c_str(), repo.error().c_str());
+    if (!e.is_tree())
+        die("%s:%s: Not a directory\n", rev.c_str(), dir.c_str());
+
+    std::string commit = "tree " + e.oid.hex() + "\n";
+    for (size_t pos = 0; pos < data.length() && data[pos] != '\n'; ) {
+        size_t nl = std::min(data.find('\n', pos), data.length());
+        if (data.compare(pos, 7, "author ") == 0
+            || data.compare(pos, 10, "committer ") == 0)
+            commit += data.substr(pos, nl - pos) + "\n";
+        pos = nl + 1;
+    }
+    commit += "\nTruncated version of " + oid.hex() + "\n";
+    gitoid toid;
+    if (!repo.write(gitobj_commit, commit, toid)
+        || !repo.write_ref("refs/heads/" + branch, toid))
+        die("%s\n", repo.error().c_str());
+    printf("%s\n", branch.c_str());
+    return 0;
+}
+
+
+// fetch scheduler
+
+struct fetchjob {
+    std::string repoid;
+    std::string cacheid;
+    std::string url;
+    std::string host;
+    long deadline;
+    pid_t pid = -1;
+    double start = 0;
+    int nkills = 0;
+};
+
+static int njobs = 8;
+static int per_host = 4;
+static double fetch_timeout = 600;
+static double kill_grace = 10;
+static bool force;
+static std::string gitfetch_path;
+
+// Return the host part of a git URL: `ssh://[USER@]HOST[:PORT]/PATH`,
+// `[USER@]HOST:PATH`, or a local path (host "").
+static std::string url_host(const std::string& url) {
+    size_t start, end;
+    size_t scheme = url.find("://");
+    if (scheme != std::string::npos) {
+        start = scheme + 3;
+        end = std::min(url.find('/', start), url.length());
+        size_t at = url.rfind('@', end);
+        if (at != std::string::npos && at >= start)
+            start = at + 1;
+        end = std::min(url.find(':', start), end);
+    } else {
+        size_t colon = url.find(':');
+        if (colon == std::string::npos || url.find('/') < colon)
+            return std::string();
+        size_t at = url.rfind('@', colon);
+        start = at == std::string::npos ? 0 : at + 1;
+        end = colon;
+    }
+    return url.substr(start, end - start);
+}
+
+static std::string log_time() {
+    char buf[64];
+    time_t now = time(nullptr);
+    strftime(buf, sizeof(buf), "%d/%b/%Y:%H:%M:%S %z", localtime(&now));
+    return buf;
+}
+
+static pid_t start_fetch(fetchjob& j, const sigset_t& oldmask) {
+    std::vector<const char*> argv;
+    argv.push_back(gitfetch_path.c_str());
+    if (force)
+        argv.push_back("-f");
+    argv.push_back(j.repoid.c_str());
+    argv.push_back(j.cacheid.c_str());
+    argv.push_back(j.url.c_str());
+    argv.push_back(nullptr);
+
+    pid_t pid = fork();
+    if (pid == 0) {
+        // own process group, so a timeout can stop git and ssh too
+        setpgid(0, 0);
+        sigprocmask(SIG_SETMASK, &oldmask, nullptr);
+        int nullfd = open("/dev/null", O_RDONLY);
+        if (nullfd >= 0) {
+            dup2(nullfd, STDIN_FILENO);
+            close(nullfd);
+        }
+        execv(argv[0], (char**) argv.data());
+        fprintf(stderr, "%s: %s\n", argv[0], strerror(errno));
+        _exit(127);
+    } else if (pid < 0)
+        perror_die("fork");
+    setpgid(pid, pid);
+    return pid;
+}
+
+static int schedule_main() {
+    std::vector<fetchjob> pending;
+    char* line = nullptr;
+    size_t linecap = 0;
+    while (getline(&line, &linecap, stdin) > 0) {
+        char repoid[64], cacheid[64], url[1024];
+        long deadline = 0;
+        int n = sscanf(line, "%63s %63s %1023s %ld", repoid, cacheid, url, &deadline);
+        if (n < 3) {
+            if (strspn(line, " \t\r\n") != strlen(line))
+                fprintf(stderr, "pa-gitfetch: bad line %s", line);
+            continue;
+        }
+        fetchjob j;
+        j.repoid = repoid;
+        j.cacheid = cacheid;
+        j.url = url;
+        j.host = url_host(j.url);
+        j.deadline = deadline;
+        pending.push_back(std::move(j));
+    }
+    free(line);
+    std::stable_sort(pending.begin(), pending.end(), [](const fetchjob& a, const fetchjob& b) {
+            if ((a.deadline > 0) != (b.deadline > 0))
+                return a.deadline > 0;
+            return a.deadline < b.deadline;
+        });
+
+    sigset_t mask, oldmask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &mask, &oldmask);
+
+    std::unordered_map<pid_t, fetchjob> running;
+    std::map<std::string, int> host_running;
+    std::unordered_set<std::string> cache_running;
+    std::vector<double> latencies;
+    int nfailed = 0;
+    double begin = timestamp();
+
+    while (!pending.empty() || !running.empty()) {
+        for (auto it = pending.begin();
+             it != pending.end() && (int) running.size() < njobs; ) {
+            if (host_running[it->host] >= per_host
+                || cache_running.count(it->cacheid)) {
+                ++it;
+                continue;
+            }
+            it->start = timestamp();
+            it->pid = start_fetch(*it, oldmask);
+            ++host_running[it->host];
+            cache_running.insert(it->cacheid);
+            running[it->pid] = std::move(*it);
+            it = pending.erase(it);
+        }
+
+        // wait for a child to exit or the next timeout
+        double now = timestamp(), wake = now + 3600;
+        for (auto& r : running)
+            wake = std::min(wake, r.second.start + fetch_timeout
+                            + r.second.nkills * kill_grace);
+        struct timespec ts;
+        double delay = std::max(wake - now, 0.);
+        ts.tv_sec = (time_t) delay;
+        ts.tv_nsec = (long) ((delay - ts.tv_sec) * 1000000000);
+        siginfo_t si;
+        if (sigtimedwait(&mask, &si, &ts) == -1 && errno != EAGAIN
+            && errno != EINTR)
+            perror_die("sigtimedwait");
+
+        int status;
+        pid_t pid;
+        while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+            auto it = running.find(pid);
+            if (it == running.end())
+                continue;
+            fetchjob& j = it->second;
+            double latency = timestamp() - j.start;
+            latencies.push_back(latency);
+            std::string result;
+            if (j.nkills)
+                result = " timed out";
+            else if (WIFEXITED(status) && WEXITSTATUS(status) != 0)
+                result = " exit " + std::to_string(WEXITSTATUS(status));
+            else if (WIFSIGNALED(status))
+                result = " signal " + std::to_string(WTERMSIG(status));
+            if (!result.empty())
+                ++nfailed;
+            printf("[%s] pa-gitfetch %s %s: %.3fs%s\n", log_time().c_str(),
+                   j.repoid.c_str(), j.host.empty() ? "local" : j.host.c_str(),
+                   latency, result.c_str());
+            fflush(stdout);
+            --host_running[j.host];
+            cache_running.erase(j.cacheid);
+            running.erase(it);
+        }
+
+        // stop fetches that ran too long: SIGTERM, then SIGKILL
+        now = timestamp();
+        for (auto& r : running) {
+            fetchjob& j = r.second;
+            if (now >= j.start + fetch_timeout + j.nkills * kill_grace
+                && j.nkills < 2) {
+                kill(-j.pid, j.nkills ? SIGKILL : SIGTERM);
+                ++j.nkills;
+            }
+        }
+    }
+
+    if (!latencies.empty()) {
+        std::sort(latencies.begin(), latencies.end());
+        double sum = 0;
+        for (double l : latencies)
+            sum += l;
+        printf("[%s] pa-gitfetch: %zu repositories, %d failed, %.3fs elapsed; latency mean %.3fs, median %.3fs, 90th %.3fs, max %.3fs\n",
+               log_time().c_str(), latencies.size(), nfailed,
+               timestamp() - begin, sum / latencies.size(),
+               latencies[latencies.size() / 2],
+               latencies[latencies.size() * 9 / 10], latencies.back());
+    }
+    return nfailed ? 1 : 0;
+}
+
+
+static __attribute__((noreturn)) void usage() {
+    fprintf(stderr, "Usage: pa-gitfetch schedule [-f] [-j N] [--per-host N] [--timeout T] [--gitfetch PROG]\n\
+       pa-gitfetch heads REPODIR REV...\n\
+       pa-gitfetch truncate REPODIR REV DIR\n\
+\n\
+`schedule` fetches the repositories named by `REPOID CACHEID URL DEADLINE`\n\
+lines on standard input, running PROG (default src/gitfetch) for each.\n\
+\n\
+  -f, --force          pass `-f` to PROG\n\
+  -j, --jobs N         run at most N fetches at once (default 8)\n\
+      --per-host N     run at most N fetches per host at once (default 4)\n\
+      --timeout T      stop fetches after T seconds (default 600)\n\
+      --gitfetch PROG  run PROG instead of src/gitfetch\n\
+\n\
+`heads` prints the REVs that are not ancestors of other REVs.\n\
+`truncate` stores REV's DIR as the commit of branch `truncated_COMMIT`.\n");
+    exit(1);
+}
+
+static struct option longoptions[] = {
+    { "force", no_argument, NULL, 'f' },
+    { "jobs", required_argument, NULL, 'j' },
+    { "per-host", required_argument, NULL, 'P' },
+    { "timeout", required_argument, NULL, 'T' },
+    { "gitfetch", required_argument, NULL, 'G' },
+    { "help", no_argument, NULL, 'H' },
+    { NULL, 0, NULL, 0 }
+};
+
+static int positive_int(const char* arg) {
+    char* end;
+    long n = strtol(arg, &end, 10);
+    if (end == arg || *end || n <= 0 || n > 100000)
+        usage();
+    return n;
+}
+
+int main(int argc, char** argv) {
+    if (argc >= 3 && strcmp(argv[1], "heads") == 0)
+        return heads_main(argv[2], std::vector<std::string>(argv + 3, argv + argc));
+    if (argc == 5 && strcmp(argv[1], "truncate") == 0)
+        return truncate_main(argv[2], argv[3], argv[4]);
+    if (argc < 2 || strcmp(argv[1], "schedule") != 0)
+        usage();
+
+    ++optind;
+    int ch;
+    while ((ch = getopt_long(argc, argv, "fj:", longoptions, NULL)) != -1) {
+        if (ch == 'f')
+            force = true;
+        else if (ch == 'j')
+            njobs = positive_int(optarg);
+        else if (ch == 'P')
+            per_host = positive_int(optarg);
+        else if (ch == 'T') {
+            char* end;
+            fetch_timeout = strtod(optarg, &end);
+            if (end == optarg || *end || fetch_timeout <= 0)
+                usage();
+        } else if (ch == 'G')
+            gitfetch_path = optarg;
+        else
+            usage();
+    }
+    if (optind != argc)
+        usage();
+
+    if (gitfetch_path.empty()) {
+        // src/gitfetch next to this program's jail/ directory
+        char buf[4096];
+        ssize_t n = readlink("/proc/self/exe", buf, sizeof(buf) - 1);
+        if (n <= 0)
+            perror_die("/proc/self/exe");
+        std::string dir(buf, n);
+        dir = dir.substr(0, dir.rfind('/'));
+        gitfetch_path = dir.substr(0, dir.rfind('/')) + "/src/gitfetch";
+    }
+    if (access(gitfetch_path.c_str(), X_OK) != 0)
+        perror_die(gitfetch_path);
+    return schedule_main();
+}
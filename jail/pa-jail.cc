@@ -8,6 +8,14 @@
 #include <sys/mount.h>
 #include <sys/select.h>
 #include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#include <sys/file.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <pthread.h>
+#include <time.h>
 #include <unistd.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -24,25 +32,58 @@
 #include <assert.h>
 #include <getopt.h>
 #include <fnmatch.h>
+#include <elf.h>
+#include <stdint.h>
+#include <limits.h>
+#include <algorithm>
+#include <deque>
+#include <functional>
 #include <string>
 #include <unordered_map>
 #include <vector>
 #include <iostream>
+#include "gitobj.hh"
 #include <sys/ioctl.h>
 #if __linux__
 #include <mntent.h>
+#include <sys/sysmacros.h>
 #include <sched.h>
+#include <stddef.h>
+#include <sys/ptrace.h>
+#include <sys/prctl.h>
+#include <sys/uio.h>
+#include <sys/user.h>
+#include <linux/audit.h>
+#include <linux/filter.h>
+#include <linux/seccomp.h>
+#include <linux/fs.h>
+#include <sys/quota.h>
+#if __has_include(<linux/openat2.h>)
+#include <linux/openat2.h>
+#endif
+#include <linux/sched.h>
+#include <sys/vfs.h>
+#if __has_include(<linux/btrfs.h>)
+#include <linux/btrfs.h>
+#include <linux/btrfs_tree.h>
+#include <linux/magic.h>
+#endif
 #elif __APPLE__
 #include <sys/param.h>
 #include <sys/ucred.h>
 #include <sys/mount.h>
 #endif
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 
 #define ROOT 0
 
 #define FLAG_CP 1        // copy even if source is symlink
 #define FLAG_BIND 2
 #define FLAG_BIND_RO 4
+#define FLAG_BUILDCACHE 8
+#define FLAG_ELF 16
 
 #ifndef O_PATH
 #define O_PATH 0
@@ -55,12 +96,136 @@ namespace std { template <> struct hash<devino> {
     }
 }; }
 
+// path arena
+//
+// Every path the jail builder touches is interned as a chain of
+// components: a node records its parent and its name, and an
+// open-addressing table keyed on (parent, name) finds children. Lookups
+// and parent walks allocate nothing. Per-path state that used to live in
+// string-keyed maps lives in the nodes.
+
+class path_arena {
+  public:
+    typedef uint32_t index_type;
+    static constexpr index_type root = 0;
+    static constexpr int dir_unknown = INT_MIN;
+
+    struct node {
+        index_type parent;
+        uint32_t name_pos;
+        uint32_t name_len;
+        int dst;                // handle_copy/handle_mount state, 0 if none
+        int dir;                // v_ensuredir result, or dir_unknown
+        int fd;                 // cached directory fd, or -1
+        bool anchor;            // `fd` is never flushed
+        bool beneath;           // `fd` is at or below a jail anchor
+    };
+
+    path_arena();
+
+    index_type find(index_type base, const char* s, size_t len);
+    index_type find(const std::string& s) {
+        return find(root, s.data(), s.length());
+    }
+    index_type parent(index_type i) const {
+        return nodes_[i].parent;
+    }
+    node& operator[](index_type i) {
+        return nodes_[i];
+    }
+    std::string name(index_type i) const {
+        return names_.substr(nodes_[i].name_pos, nodes_[i].name_len);
+    }
+    std::string path(index_type i) const;
+
+  private:
+    std::vector<node> nodes_;
+    std::string names_;
+    std::vector<index_type> slots_; // node index + 1, or 0 if empty
+
+    static size_t hash(index_type parent, const char* s, size_t len);
+    index_type child(index_type parent, const char* s, size_t len);
+};
+
+path_arena::path_arena()
+    : slots_(1024, 0) {
+    nodes_.push_back(node{root, 0, 0, 0, dir_unknown, -1, false, false});
+}
+
+size_t path_arena::hash(index_type parent, const char* s, size_t len) {
+    uint32_t h = 2166136261U ^ (parent * 2654435761U);
+    for (size_t i = 0; i != len; ++i)
+        h = (h ^ (unsigned char) s[i]) * 16777619U;
+    return h;
+}
+
+path_arena::index_type path_arena::child(index_type parent, const char* s,
+                                         size_t len) {
+    size_t mask = slots_.size() - 1;
+    size_t pos = hash(parent, s, len) & mask;
+    for (; slots_[pos]; pos = (pos + 1) & mask) {
+        const node& n = nodes_[slots_[pos] - 1];
+        if (n.parent == parent && n.name_len == len
+            && memcmp(names_.data() + n.name_pos, s, len) == 0)
+            return slots_[pos] - 1;
+    }
+
+    index_type i = nodes_.size();
+    nodes_.push_back(node{parent, (uint32_t) names_.length(), (uint32_t) len,
+                          0, dir_unknown, -1, false, false});
+    names_.append(s, len);
+    slots_[pos] = i + 1;
+
+    // keep the load factor under 1/2
+    if (nodes_.size() * 2 > slots_.size()) {
+        std::vector<index_type> slots(slots_.size() * 2, 0);
+        mask = slots.size() - 1;
+        for (index_type j = 1; j != nodes_.size(); ++j) {
+            const node& n = nodes_[j];
+            pos = hash(n.parent, names_.data() + n.name_pos, n.name_len) & mask;
+            while (slots[pos])
+                pos = (pos + 1) & mask;
+            slots[pos] = j + 1;
+        }
+        slots_.swap(slots);
+    }
+    return i;
+}
+
+path_arena::index_type path_arena::find(index_type base, const char* s,
+                                        size_t len) {
+    const char* end = s + len;
+    while (s != end) {
+        const char* slash = (const char*) memchr(s, '/', end - s);
+        if (!slash)
+            slash = end;
+        if (slash != s)
+            base = child(base, s, slash - s);
+        s = slash + (slash != end);
+    }
+    return base;
+}
+
+std::string path_arena::path(index_type i) const {
+    if (i == root)
+        return "/";
+    size_t len = 0;
+    for (index_type j = i; j != root; j = nodes_[j].parent)
+        len += nodes_[j].name_len + 1;
+    std::string s(len, '/');
+    for (index_type j = i; j != root; j = nodes_[j].parent) {
+        len -= nodes_[j].name_len;
+        memcpy(&s[len], names_.data() + nodes_[j].name_pos, nodes_[j].name_len);
+        --len;
+    }
+    return s;
+}
+
 static uid_t caller_owner;
 static gid_t caller_group;
 
-static std::unordered_map<std::string, int> dirtable;
-static std::unordered_map<std::string, int> dst_table;
-static std::unordered_map<devino, std::string> devino_table;
+static path_arena jail_paths;
+static std::unordered_map<devino, path_arena::index_type> devino_table;
 static int exit_value = 0;
 static bool verbose = false;
 static bool dryrun = false;
@@ -73,9 +238,21 @@ static std::string pidfilename;
 static int pidfd = -1;
 static volatile sig_atomic_t got_sigterm = 0;
 static int sigpipe[2];
+static std::vector<std::string> jail_env;
+static std::string buildcache_dir;
+static off_t buildcache_size;
+static std::string buildcache_key;
+static uid_t buildcache_owner = ROOT;
+static gid_t buildcache_group = ROOT;
+static std::vector<std::string> tmp_mountopts;
+static int usagefd = -1;
+static int multi_dirfd = -1;
+static int multi_parallel = 4;
+static double kill_grace = 1;
 
 enum jailaction {
-    do_start, do_add, do_run, do_rm, do_mv
+    do_start, do_add, do_run, do_rm, do_mv, do_trace, do_du, do_sched,
+    do_checkout, do_overlay, do_clone
 };
 
 
@@ -132,6 +309,36 @@ static std::string path_parentdir(const std::string& path) {
     return path.substr(0, npos);
 }
 
+// returns an absolute path without `.`, `..`, or repeated slashes, or an
+// empty string if a `..` prefix does not exist
+static std::string path_normalize(std::string path) {
+    // resolve `..` against the real parent directory, since the prefix
+    // might include symbolic links
+    size_t dotdot;
+    while ((dotdot = path.find("/../")) != std::string::npos
+           || (path.length() >= 3
+               && path.compare(path.length() - 3, 3, "/..") == 0
+               && (dotdot = path.length() - 3, true))) {
+        char* rp = realpath(path.substr(0, dotdot).c_str(), nullptr);
+        if (!rp)
+            return std::string();
+        std::string parent = path_parentdir(rp);
+        free(rp);
+        path = parent + path.substr(std::min(dotdot + 4, path.length()));
+    }
+    std::string out;
+    for (size_t pos = 0; pos < path.length(); ) {
+        size_t slash = path.find('/', pos);
+        if (slash == std::string::npos)
+            slash = path.length();
+        std::string comp = path.substr(pos, slash - pos);
+        if (!comp.empty() && comp != ".")
+            out += "/" + comp;
+        pos = slash + 1;
+    }
+    return out.empty() ? std::string("/") : out;
+}
+
 static std::string shell_quote(const std::string& argument) {
     std::string quoted;
     size_t last = 0;
@@ -185,6 +392,127 @@ static const char* gid_to_name(gid_t g) {
     return buf;
 }
 
+// directory fd cache
+//
+// Jail construction works relative to cached O_PATH directory fds, not
+// absolute paths. The jail directory and skeleton directory are anchors;
+// directories below an anchor are opened one component at a time with
+// RESOLVE_BENEATH | RESOLVE_NO_SYMLINKS. A component that is a symlink
+// (like a jail's `/bin -> usr/bin`) is reopened from the anchor with
+// RESOLVE_IN_ROOT, so symlinks inside the jail resolve as they will
+// after chroot and can never redirect an operation outside it. Other
+// paths, such as manifest sources, resolve from `/` as usual. The cache
+// is trimmed only while no caller holds a borrowed fd (see dirfd_pin).
+
+static std::vector<path_arena::index_type> dirfd_cached;
+static const size_t dirfd_max = 256;
+static int dirfd_pins = 0;
+
+// Hold one of these while using an fd from dirfd_parent() across further
+// dirfd_parent() calls, so the fd stays open.
+struct dirfd_pin {
+    dirfd_pin() {
+        ++dirfd_pins;
+    }
+    ~dirfd_pin() {
+        --dirfd_pins;
+    }
+    dirfd_pin(const dirfd_pin&) = delete;
+    dirfd_pin& operator=(const dirfd_pin&) = delete;
+};
+
+static void dirfd_flush() {
+    assert(dirfd_pins == 0);
+    for (auto n : dirfd_cached) {
+        close(jail_paths[n].fd);
+        jail_paths[n].fd = -1;
+    }
+    dirfd_cached.clear();
+}
+
+static void dirfd_anchor(const std::string& dir, int fd) {
+    auto& node = jail_paths[jail_paths.find(dir)];
+    if (node.fd >= 0 && !node.anchor)
+        dirfd_flush();
+    node.fd = fd;
+    node.anchor = node.beneath = true;
+}
+
+static int dirfd_open(int parentfd, const char* name, bool beneath,
+                      bool in_root) {
+#if __linux__ && defined(SYS_openat2) && defined(RESOLVE_BENEATH)
+    static bool have_openat2 = true;
+    if (beneath && have_openat2) {
+        struct open_how how;
+        memset(&how, 0, sizeof(how));
+        how.flags = O_PATH | O_DIRECTORY | O_CLOEXEC;
+        if (in_root)
+            how.resolve = RESOLVE_IN_ROOT | RESOLVE_NO_MAGICLINKS;
+        else
+            how.resolve = RESOLVE_BENEATH | RESOLVE_NO_SYMLINKS;
+        int fd = syscall(SYS_openat2, parentfd, name, &how, sizeof(how));
+        if (fd >= 0 || errno != ENOSYS)
+            return fd;
+        have_openat2 = false;
+    }
+#endif
+    return openat(parentfd, name, O_PATH | O_DIRECTORY | O_CLOEXEC
+                  | (beneath && !in_root ? O_NOFOLLOW : 0));
+}
+
+static int dirfd_open_in_root(path_arena::index_type n) {
+    auto a = jail_paths.parent(n);
+    while (!jail_paths[a].anchor)
+        a = jail_paths.parent(a);
+    std::string rel = jail_paths.path(n).substr(jail_paths.path(a).length());
+    return dirfd_open(jail_paths[a].fd, rel.c_str() + (rel[0] == '/'),
+                      true, true);
+}
+
+static int dirfd_get(path_arena::index_type n) {
+    auto& node = jail_paths[n];
+    if (node.fd >= 0)
+        return node.fd;
+    if (n == path_arena::root) {
+        node.fd = open("/", O_PATH | O_DIRECTORY | O_CLOEXEC);
+        node.anchor = true;
+        return node.fd;
+    }
+    auto p = jail_paths.parent(n);
+    int parentfd = dirfd_get(p);
+    if (parentfd < 0)
+        return -1;
+    std::string name = jail_paths.name(n);
+    bool beneath = jail_paths[p].beneath;
+    int fd = dirfd_open(parentfd, name.c_str(), beneath, false);
+    if (fd == -1 && beneath && (errno == ELOOP || errno == ENOTDIR))
+        fd = dirfd_open_in_root(n);
+    if (fd >= 0) {
+        // `node` may have moved if the arena grew
+        jail_paths[n].fd = fd;
+        jail_paths[n].beneath = beneath;
+        dirfd_cached.push_back(n);
+    }
+    return fd;
+}
+
+// Return an fd for the directory containing `path` and set `name` to
+// `path`'s last component. Returns -1 on error.
+static int dirfd_parent(const char* path, const char*& name) {
+    if (dirfd_cached.size() >= dirfd_max && dirfd_pins == 0)
+        dirfd_flush();
+    size_t len = strlen(path);
+    while (len > 1 && path[len - 1] == '/')
+        --len;
+    auto n = jail_paths.find(path_arena::root, path, len);
+    if (n == path_arena::root || path[0] != '/') {
+        name = path;
+        return AT_FDCWD;
+    }
+    name = (const char*) memrchr(path, '/', len) + 1;
+    return dirfd_get(jail_paths.parent(n));
+}
+
 
 static int v_fchmod(int fd, mode_t mode, const std::string& pathname) {
     if (verbose)
@@ -195,7 +523,11 @@ static int v_fchmod(int fd, mode_t mode, const std::string& pathname) {
 static int x_lchown(const char* path, uid_t owner, gid_t group) {
     if (verbose)
         fprintf(verbosefile, "chown -h %s:%s %s\n", uid_to_name(owner), gid_to_name(group), path);
-    if (!dryrun && lchown(path, owner, group) != 0)
+    const char* name;
+    int dirfd;
+    if (!dryrun
+        && ((dirfd = dirfd_parent(path, name)) == -1
+            || fchownat(dirfd, name, owner, group, AT_SYMLINK_NOFOLLOW) != 0))
         return perror_fail("chown %s: %s\n", path);
     return 0;
 }
@@ -219,7 +551,11 @@ static int x_fchown(int fd, uid_t owner, gid_t group, const std::string& path) {
 static int v_mkdir(const char* pathname, mode_t mode) {
     if (verbose)
         fprintf(verbosefile, "mkdir -m 0%o %s\n", mode, pathname);
-    return dryrun ? 0 : mkdir(pathname, mode);
+    if (dryrun)
+        return 0;
+    const char* name;
+    int dirfd = dirfd_parent(pathname, name);
+    return dirfd == -1 ? -1 : mkdirat(dirfd, name, mode);
 }
 
 static int v_mkdirat(int dirfd, const char* component, mode_t mode, const std::string& pathname) {
@@ -230,11 +566,14 @@ static int v_mkdirat(int dirfd, const char* component, mode_t mode, const std::s
 
 static int v_ensuredir(std::string pathname, mode_t mode, bool nolink) {
     pathname = path_noendslash(pathname);
-    auto it = dirtable.find(pathname);
-    if (it != dirtable.end())
-        return it->second;
+    auto pn = jail_paths.find(pathname);
+    if (jail_paths[pn].dir != path_arena::dir_unknown)
+        return jail_paths[pn].dir;
     struct stat st;
-    int r = (nolink ? lstat : stat)(pathname.c_str(), &st);
+    const char* name;
+    int dirfd = dirfd_parent(pathname.c_str(), name);
+    int r = dirfd == -1 ? -1
+        : fstatat(dirfd, name, &st, nolink ? AT_SYMLINK_NOFOLLOW : 0);
     if (r == 0 && !S_ISDIR(st.st_mode)) {
         errno = ENOTDIR;
         r = -1;
@@ -246,17 +585,36 @@ static int v_ensuredir(std::string pathname, mode_t mode, bool nolink) {
             && v_mkdir(pathname.c_str(), mode) == 0)
             r = 1;
     }
-    dirtable.insert(std::make_pair(pathname, r == 1 ? 0 : r));
+    jail_paths[pn].dir = r == 1 ? 0 : r;
     return r;
 }
 
+static int x_cp_p(const std::string& src, const std::string& dst);
+
 static int x_link(const char* oldpath, const char* newpath) {
     if (verbose)
         fprintf(verbosefile, "rm -f %s\nln %s %s\n", newpath, oldpath, newpath);
     if (!dryrun) {
-        if (unlink(newpath) == -1 && errno != ENOENT)
+        dirfd_pin pin;
+        const char* newname;
+        int newdirfd = dirfd_parent(newpath, newname);
+        if (newdirfd == -1
+            || (unlinkat(newdirfd, newname, 0) == -1 && errno != ENOENT))
             return perror_fail("rm %s: %s\n", newpath);
-        if (link(oldpath, newpath) != 0)
+        const char* oldname;
+        int olddirfd = dirfd_parent(oldpath, oldname);
+        int r = olddirfd == -1 ? -1
+            : linkat(olddirfd, oldname, newdirfd, newname, 0);
+        // cannot link across project quotas; copy, but say so, since
+        // the skeleton then saves no space
+        if (r != 0 && errno == EXDEV) {
+            static bool warned = false;
+            if (!warned && !quiet)
+                fprintf(stderr, "%s: Cannot link across project quotas, copying skeleton files\n", newpath);
+            warned = true;
+            return x_cp_p(oldpath, newpath);
+        }
+        else if (r != 0)
             return perror_fail("ln %s: %s\n", (std::string(oldpath) + " " + std::string(newpath)).c_str());
     }
     return 0;
@@ -265,15 +623,20 @@ static int x_link(const char* oldpath, const char* newpath) {
 static int x_chmod(const char* path, mode_t mode) {
     if (verbose)
         fprintf(verbosefile, "chmod 0%o %s\n", mode, path);
-    if (!dryrun && chmod(path, mode) != 0)
+    const char* name;
+    int dirfd;
+    if (!dryrun
+        && ((dirfd = dirfd_parent(path, name)) == -1
+            || fchmodat(dirfd, name, mode, 0) != 0))
         return perror_fail("chmod %s: %s\n", path);
     return 0;
 }
 
-static bool x_mknod_eexist_ok(const char* path, mode_t mode, dev_t dev) {
+static bool x_mknod_eexist_ok(int dirfd, const char* name, mode_t mode, dev_t dev) {
     struct stat st;
     int old_errno = errno;
-    bool ok = stat(path, &st) == 0 && st.st_mode == mode && st.st_rdev == dev;
+    bool ok = fstatat(dirfd, name, &st, 0) == 0
+        && st.st_mode == mode && st.st_rdev == dev;
     errno = old_errno;
     return ok;
 }
@@ -294,16 +657,21 @@ static const char* dev_name(mode_t m, dev_t d) {
 static int x_mknod(const char* path, mode_t mode, dev_t dev) {
     if (verbose)
         fprintf(verbosefile, "mknod -m 0%o %s %s\n", mode, path, dev_name(mode, dev));
-    if (!dryrun && mknod(path, mode, dev) != 0
-        && (errno != EEXIST || !x_mknod_eexist_ok(path, mode, dev)))
+    const char* name;
+    int dirfd;
+    if (!dryrun
+        && ((dirfd = dirfd_parent(path, name)) == -1
+            || (mknodat(dirfd, name, mode, dev) != 0
+                && (errno != EEXIST
+                    || !x_mknod_eexist_ok(dirfd, name, mode, dev)))))
         return perror_fail("mknod %s: %s\n", path);
     return 0;
 }
 
-static bool x_symlink_eexist_ok(const char* oldpath, const char* newpath) {
+static bool x_symlink_eexist_ok(const char* oldpath, int dirfd, const char* name) {
     char lnkbuf[4096];
     int old_errno = errno;
-    ssize_t r = readlink(newpath, lnkbuf, sizeof(lnkbuf));
+    ssize_t r = readlinkat(dirfd, name, lnkbuf, sizeof(lnkbuf));
     bool answer = (size_t) r == (size_t) strlen(oldpath) && memcmp(lnkbuf, oldpath, r) == 0;
     errno = old_errno;
     return answer;
@@ -312,8 +680,13 @@ static bool x_symlink_eexist_ok(const char* oldpath, const char* newpath) {
 static int x_symlink(const char* oldpath, const char* newpath) {
     if (verbose)
         fprintf(verbosefile, "ln -s %s %s\n", oldpath, newpath);
-    if (!dryrun && symlink(oldpath, newpath) != 0
-        && (errno != EEXIST || !x_symlink_eexist_ok(oldpath, newpath)))
+    const char* name;
+    int dirfd;
+    if (!dryrun
+        && ((dirfd = dirfd_parent(newpath, name)) == -1
+            || (symlinkat(oldpath, dirfd, name) != 0
+                && (errno != EEXIST
+                    || !x_symlink_eexist_ok(oldpath, dirfd, name)))))
         return perror_fail("symlink %s: %s\n", (std::string(oldpath) + " " + newpath).c_str());
     return 0;
 }
@@ -334,6 +707,28 @@ static std::pair<pid_t, int> x_waitpid(pid_t child, int flags) {
     }
 }
 
+// Fork, and if the kernel has clone3, set `*pidfd` to a pidfd for the
+// child (otherwise -1). The pidfd becomes readable the moment the child
+// exits, so the parent can select on it rather than poll waitpid.
+static pid_t x_fork_pidfd(int* pidfd) {
+    *pidfd = -1;
+#if __linux__ && defined(SYS_clone3) && defined(CLONE_PIDFD)
+    static bool have_clone3 = true;
+    if (have_clone3) {
+        struct clone_args ca;
+        memset(&ca, 0, sizeof(ca));
+        ca.flags = CLONE_PIDFD;
+        ca.pidfd = (uintptr_t) pidfd;
+        ca.exit_signal = SIGCHLD;
+        pid_t p = syscall(SYS_clone3, &ca, sizeof(ca));
+        if (p != -1 || errno != ENOSYS)
+            return p;
+        have_clone3 = false;
+    }
+#endif
+    return fork();
+}
+
 
 // jailmaking
 
@@ -560,11 +955,10 @@ static int handle_mount(std::string src, std::string dst, bool in_child) {
         // already mounted
         return 0;
 
-    auto xit = dst_table.find(dst);
-    if (xit != dst_table.end()
-        && xit->second > 1)
+    auto& dn = jail_paths[jail_paths.find(dst)];
+    if (dn.dst > 1)
         return 0;
-    dst_table[dst] = 2;
+    dn.dst = 2;
 
     if (in_child)
         v_ensuredir(dst, 0555, true);
@@ -587,6 +981,8 @@ static int handle_mount(std::string src, std::string dst, bool in_child) {
     if (r == 0 && (msx.opts & MS_BIND))
         r = msx.x_mount(dst, msx.opts | MS_REMOUNT);
 #endif
+    // cached directory fds below `dst` now refer to covered directories
+    dirfd_flush();
     if (r != 0)
         return perror_fail("mount %s: %s\n", dst.c_str());
     return 0;
@@ -599,14 +995,16 @@ static int handle_umount(const mount_table_type::iterator& it) {
         fprintf(stderr, "umount %s: %s\n", it->first.c_str(), strerror(errno));
         exit(1);
     }
+    dirfd_flush();
     if (dryrun)
-        dst_table[it->first.c_str()] = 3;
+        jail_paths[jail_paths.find(it->first)].dst = 3;
     return 0;
 }
 
 
 static int handle_copy(std::string src, std::string subdst,
-                       int flags, dev_t jaildev);
+                       int flags, dev_t jaildev,
+                       const struct stat* srcst = nullptr);
 
 static void handle_symlink_dst(std::string dst, std::string src,
                                std::string lnk, dev_t jaildev)
@@ -646,6 +1044,44 @@ static void handle_symlink_dst(std::string dst, std::string src,
         handle_copy(src, dst.substr(root.length()), 0, jaildev);
 }
 
+// Copy the contents of `srcfd` to the empty file `dstfd`: by reflink,
+// in-kernel, or by reading and writing, whichever works first.
+static bool x_copy_data(int srcfd, int dstfd) {
+#ifdef FICLONE
+    if (ioctl(dstfd, FICLONE, srcfd) == 0)
+        return true;
+#endif
+    bool use_read = false;
+    char buf[65536];
+    while (1) {
+        ssize_t n = -1;
+#if __linux__
+        if (!use_read) {
+            n = copy_file_range(srcfd, nullptr, dstfd, nullptr, 1 << 30, 0);
+            if (n == -1 && (errno == EXDEV || errno == ENOSYS
+                            || errno == EINVAL || errno == EOPNOTSUPP)) {
+                use_read = true;
+                continue;
+            }
+        } else
+#endif
+        if ((n = read(srcfd, buf, sizeof(buf))) > 0) {
+            for (ssize_t w = 0; w < n; ) {
+                ssize_t nw = write(dstfd, buf + w, n - w);
+                if (nw == -1 && errno != EINTR) {
+                    n = -1;
+                    break;
+                }
+                w += nw > 0 ? nw : 0;
+            }
+        }
+        if (n == 0)
+            return true;
+        else if (n == -1 && errno != EINTR)
+            return false;
+    }
+}
+
 static int x_cp_p(const std::string& src, const std::string& dst) {
     if (verbose)
         fprintf(verbosefile, "rm -f %s\ncp -p %s %s\n",
@@ -653,27 +1089,50 @@ static int x_cp_p(const std::string& src, const std::string& dst) {
     if (dryrun)
         return 0;
 
-    int r = unlink(dst.c_str());
-    if (r == -1 && errno != ENOENT)
+    dirfd_pin pin;
+    const char* dstname;
+    int dstdirfd = dirfd_parent(dst.c_str(), dstname);
+    if (dstdirfd == -1
+        || (unlinkat(dstdirfd, dstname, 0) == -1 && errno != ENOENT))
         return perror_fail("rm %s: %s\n", dst.c_str());
 
-    pid_t child = fork();
-    if (child == 0) {
-        const char* args[6] = {
-            "/bin/cp", "-p", src.c_str(), dst.c_str(), NULL
-        };
-        execv("/bin/cp", (char**) args);
-        exit(1);
-    } else if (child < 0)
-        return perror_fail("%s: %s\n", "fork");
+    const char* srcname;
+    int srcdirfd = dirfd_parent(src.c_str(), srcname);
+    int srcfd = srcdirfd == -1 ? -1
+        : openat(srcdirfd, srcname, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+    struct stat ss;
+    if (srcfd == -1 || fstat(srcfd, &ss) != 0) {
+        perror_fail("%s: %s\n", src.c_str());
+        if (srcfd >= 0)
+            close(srcfd);
+        return 1;
+    }
+    int dstfd = openat(dstdirfd, dstname,
+                       O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW | O_CLOEXEC,
+                       0600);
+    if (dstfd == -1) {
+        close(srcfd);
+        return perror_fail("%s: %s\n", dst.c_str());
+    }
 
-    int status = x_waitpid(child, 0).second;
-    if (status == 0)
-        return 0;
-    else if (status != -1)
-        return perror_fail("/bin/cp %s: Bad exit status\n", dst.c_str());
-    else
-        return perror_fail("/bin/cp %s: Did not exit\n", dst.c_str());
+    bool ok = x_copy_data(srcfd, dstfd);
+
+    // preserve ownership, mode, and times, like `cp -p`
+    struct timespec ts[2] = { ss.st_atim, ss.st_mtim };
+    if (ok
+        && (fchown(dstfd, ss.st_uid, ss.st_gid) != 0
+            || fchmod(dstfd, ss.st_mode & 07777) != 0
+            || futimens(dstfd, ts) != 0))
+        ok = false;
+    int saved_errno = errno;
+    close(srcfd);
+    close(dstfd);
+    if (!ok) {
+        unlinkat(dstdirfd, dstname, 0);
+        errno = saved_errno;
+        return perror_fail("cp %s: %s\n", dst.c_str());
+    }
+    return 0;
 }
 
 #define DO_COPY_SKELETON 1
@@ -682,7 +1141,10 @@ static int x_cp_p(const std::string& src, const std::string& dst) {
 static int do_copy(const std::string& dst, const std::string& src,
                    const struct stat& ss, int flags, dev_t jaildev) {
     struct stat ds;
-    int r = lstat(dst.c_str(), &ds);
+    const char* dstname;
+    int dstdirfd = dirfd_parent(dst.c_str(), dstname);
+    int r = dstdirfd == -1 ? -1
+        : fstatat(dstdirfd, dstname, &ds, AT_SYMLINK_NOFOLLOW);
     if (r == 0
         && ss.st_mode == ds.st_mode
         && ss.st_uid == ds.st_uid
@@ -695,7 +1157,7 @@ static int do_copy(const std::string& dst, const std::string& src,
             || ss.st_mtime == ds.st_mtime)) {
         if (S_ISREG(ss.st_mode)) {
             auto di = std::make_pair(ss.st_dev, ss.st_ino);
-            devino_table.insert(std::make_pair(di, dst));
+            devino_table.insert(std::make_pair(di, jail_paths.find(dst)));
         }
         return 0;
     }
@@ -706,8 +1168,8 @@ static int do_copy(const std::string& dst, const std::string& src,
             auto di = std::make_pair(ss.st_dev, ss.st_ino);
             auto it = devino_table.find(di);
             if (it != devino_table.end())
-                return x_link(it->second.c_str(), dst.c_str());
-            devino_table.insert(std::make_pair(di, dst));
+                return x_link(jail_paths.path(it->second).c_str(), dst.c_str());
+            devino_table.insert(std::make_pair(di, jail_paths.find(dst)));
         }
         return x_cp_p(src, dst);
     } else if (S_ISDIR(ss.st_mode)) {
@@ -729,7 +1191,10 @@ static int do_copy(const std::string& dst, const std::string& src,
             return 1;
     } else if (S_ISLNK(ss.st_mode)) {
         char lnkbuf[4096];
-        ssize_t r = readlink(src.c_str(), lnkbuf, sizeof(lnkbuf));
+        const char* srcname;
+        int srcdirfd = dirfd_parent(src.c_str(), srcname);
+        ssize_t r = srcdirfd == -1 ? -1
+            : readlinkat(srcdirfd, srcname, lnkbuf, sizeof(lnkbuf));
         if (r == -1)
             return perror_fail("readlink %s: %s\n", src.c_str());
         else if (r == sizeof(lnkbuf))
@@ -748,8 +1213,8 @@ static int do_copy(const std::string& dst, const std::string& src,
 }
 
 static int handle_copy(std::string src, std::string subdst,
-                       int flags, dev_t jaildev) {
-    static std::string last_parentdir;
+                       int flags, dev_t jaildev, const struct stat* srcst) {
+    static path_arena::index_type last_parent = path_arena::root;
 
     assert(subdst[0] == '/');
     assert(subdst.length() == 1 || subdst[1] != '/');
@@ -763,27 +1228,38 @@ static int handle_copy(std::string src, std::string subdst,
     while (subdst.length() > 1 && subdst.back() == '/')
         subdst = subdst.substr(0, subdst.length() - 1);
 
-    std::string dst = dstroot + subdst;
-    if (dst_table.find(dst) != dst_table.end())
+    static path_arena::index_type root_node = path_arena::root;
+    static std::string root_node_path;
+    if (root_node_path != dstroot) {
+        root_node_path = dstroot;
+        root_node = jail_paths.find(dstroot);
+    }
+    auto dn = jail_paths.find(root_node, subdst.data(), subdst.length());
+    if (jail_paths[dn].dst)
         return 1;
-    dst_table[dst] = 1;
+    jail_paths[dn].dst = 1;
 
+    std::string dst = dstroot + subdst;
     struct stat ss;
 
-    std::string dst_parentdir = path_noendslash(path_parentdir(dst));
-    if (dst_parentdir != last_parentdir
-        && dst_parentdir.length() > dstroot.length()) {
-        last_parentdir = dst_parentdir;
-        if (dst_table.find(last_parentdir) == dst_table.end()) {
+    auto pn = jail_paths.parent(dn);
+    if (pn != last_parent && dn != root_node && pn != root_node) {
+        last_parent = pn;
+        if (!jail_paths[pn].dst) {
             int r = handle_copy(path_noendslash(path_parentdir(src)),
-                                last_parentdir.substr(dstroot.length()),
+                                jail_paths.path(pn).substr(dstroot.length()),
                                 0, jaildev);
             if (r != 0)
                 return r;
         }
     }
 
-    if (lstat(src.c_str(), &ss) != 0)
+    const char* srcname;
+    int srcdirfd;
+    if (srcst)
+        ss = *srcst;
+    else if ((srcdirfd = dirfd_parent(src.c_str(), srcname)) == -1
+             || fstatat(srcdirfd, srcname, &ss, AT_SYMLINK_NOFOLLOW) != 0)
         return perror_fail("lstat %s: %s\n", src.c_str());
 
     // set up skeleton directory version
@@ -798,145 +1274,1006 @@ static int handle_copy(std::string src, std::string subdst,
     return 0;
 }
 
-static int construct_jail(dev_t jaildev, std::string& str) {
-    // prepare root
-    if (x_chmod(dstroot.c_str(), 0755)
-        || x_lchown(dstroot.c_str(), 0, 0))
-        return 1;
-    dst_table[dstroot + "/"] = 1;
+// glob and recursive manifest entries
+//
+// An entry whose source contains `*`, `?`, or `[` is a glob; `**` matches
+// any number of directories. `DIR/...` copies DIR and everything below it.
+// `[exclude=PATTERN]` flags prune matches; a PATTERN without a slash is
+// also matched against each file's basename. `[elf]` applies to every
+// matching regular file. A trailing `[...]` is read as flags only if it
+// follows whitespace and names only known flags, so `lib/foo[12]` is a
+// pattern. Expansion walks directories
+// with getdents64 and hands each entry's fstatat() result to handle_copy,
+// which then needs no lstat() of its own. Walks do not cross mount points,
+// and do not open a directory unless something below it could match.
+
+static bool glob_match(const char* pat, const char* pat_end,
+                       const char* str, const char* str_end) {
+    // match one component at a time, so `*` never crosses a slash
+    const char* pslash = std::find(pat, pat_end, '/');
+    if (pslash - pat == 2 && pat[0] == '*' && pat[1] == '*') {
+        if (pslash == pat_end)
+            return true;
+        for (const char* s = str; ; ++s) {
+            if (glob_match(pslash + 1, pat_end, s, str_end))
+                return true;
+            s = std::find(s, str_end, '/');
+            if (s == str_end)
+                return false;
+        }
+    }
+    const char* sslash = std::find(str, str_end, '/');
+    std::string pcomp(pat, pslash), scomp(str, sslash);
+    if (fnmatch(pcomp.c_str(), scomp.c_str(), 0) != 0)
+        return false;
+    if (pslash == pat_end || sslash == str_end)
+        return pslash == pat_end && sslash == str_end;
+    return glob_match(pslash + 1, pat_end, sslash + 1, str_end);
+}
 
-    // Mounts
-    populate_mount_table();
+static bool glob_match(const std::string& pat, const std::string& str) {
+    return glob_match(pat.data(), pat.data() + pat.length(),
+                      str.data(), str.data() + str.length());
+}
 
-    // Read a line at a time
-    std::string cursrcdir("/"), curdstsubdir("/");
-    int base_flags = 0;
+// Return true if some path below directory `dir` might match `pat`.
+static bool glob_match_below(const char* pat, const char* pat_end,
+                             const char* dir, const char* dir_end) {
+    const char* pslash = std::find(pat, pat_end, '/');
+    if (pslash - pat == 2 && pat[0] == '*' && pat[1] == '*')
+        return true;
+    if (pslash == pat_end)
+        return false;
+    const char* dslash = std::find(dir, dir_end, '/');
+    std::string pcomp(pat, pslash), dcomp(dir, dslash);
+    if (fnmatch(pcomp.c_str(), dcomp.c_str(), 0) != 0)
+        return false;
+    if (dslash == dir_end)
+        return true;
+    return glob_match_below(pslash + 1, pat_end, dslash + 1, dir_end);
+}
 
-    const char* pos = str.data(), *endpos = pos + str.length();
-    while (pos < endpos) {
-        while (pos < endpos && isspace((unsigned char) *pos))
-            ++pos;
-        const char* line = pos;
-        while (pos < endpos && *pos != '\n')
-            ++pos;
-        const char* endline = pos;
-        while (line < endline && isspace((unsigned char) endline[-1]))
-            --endline;
-        if (line == endline || line[0] == '#')
-            continue;
+static bool glob_match_below(const std::string& pat, const std::string& dir) {
+    return glob_match_below(pat.data(), pat.data() + pat.length(),
+                            dir.data(), dir.data() + dir.length());
+}
 
-        // 'directory:'
-        if (endline[-1] == ':') {
-            if (line + 2 == endline && line[0] == '.')
-                cursrcdir = std::string("/");
-            else if (line + 2 > endline && line[0] == '.' && line[1] == '/')
-                cursrcdir = std::string(line + 1, endline - 1);
-            else
-                cursrcdir = std::string(line, endline - 1);
-            if (cursrcdir[0] != '/')
-                cursrcdir = std::string("/") + cursrcdir;
-            while (cursrcdir.length() > 1 && cursrcdir[cursrcdir.length() - 1] == '/' && cursrcdir[cursrcdir.length() - 2] == '/')
-                cursrcdir = cursrcdir.substr(0, cursrcdir.length() - 1);
-            if (cursrcdir[cursrcdir.length() - 1] != '/')
-                cursrcdir += '/';
-            curdstsubdir = cursrcdir;
-            assert(curdstsubdir.back() == '/');
-            continue;
-        }
+struct globwalk {
+    std::string pattern;        // relative to srcbase; empty means all
+    std::vector<std::string> excludes;
+    int flags;
+    dev_t jaildev;
+    dev_t srcdev;
+    size_t depth_limit;
+
+    bool excluded(const std::string& rel, const char* name) const {
+        for (auto& x : excludes)
+            if (glob_match(x, rel)
+                || (x.find('/') == std::string::npos
+                    && fnmatch(x.c_str(), name, 0) == 0))
+                return true;
+        return false;
+    }
+    void walk(int dirfd, const std::string& src, const std::string& dst,
+              const std::string& rel, size_t depth);
+};
 
-        // '[FLAGS]'
-        int flags = base_flags;
-        if (endline[-1] == ']') {
-            // skip ' [FLAGS]'
-            for (--endline; line < endline && endline[-1] != '['; --endline)
-                /* do nothing */;
-            if (line == endline)
+static void handle_elf_closure(const std::string& src, dev_t jaildev);
+
+struct linux_dirent64_ {
+    uint64_t d_ino;
+    int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+
+void globwalk::walk(int dirfd, const std::string& src, const std::string& dst,
+                    const std::string& rel, size_t depth) {
+    std::vector<std::string> subdirs;
+    char buf[32768];
+    while (1) {
+#if __linux__
+        long n = syscall(SYS_getdents64, dirfd, buf, sizeof(buf));
+#else
+        long n = -1;
+        errno = ENOSYS;
+#endif
+        if (n == 0)
+            break;
+        else if (n < 0) {
+            perror_fail("getdents %s: %s\n", src.c_str());
+            break;
+        }
+        for (long pos = 0; pos < n; ) {
+            linux_dirent64_* de = reinterpret_cast<linux_dirent64_*>(buf + pos);
+            pos += de->d_reclen;
+            const char* name = de->d_name;
+            if (name[0] == '.' && (name[1] == 0 || (name[1] == '.' && name[2] == 0)))
                 continue;
-            const char* opts = endline;
-            do {
-                --endline;
-            } while (line < endline && isspace((unsigned char) endline[-1]));
-            // parse flags
-            while (1) {
-                while (isspace((unsigned char) *opts) || *opts == ',')
-                    ++opts;
-                if (*opts == ']')
-                    break;
-                const char* optstart = opts;
-                ++opts;
-                while (*opts != ']' && *opts != ','
-                       && !isspace((unsigned char) *opts))
-                    ++opts;
-                if (opts - optstart == 2 && memcmp(optstart, "cp", 2) == 0)
-                    flags |= FLAG_CP;
-                if (opts - optstart == 4 && memcmp(optstart, "bind", 4) == 0)
-                    flags |= FLAG_BIND;
-                if (opts - optstart == 7 && memcmp(optstart, "bind-ro", 7) == 0)
-                    flags |= FLAG_BIND_RO;
+            std::string erel = rel + name;
+            if (excluded(erel, name))
+                continue;
+            struct stat st;
+            if (fstatat(dirfd, name, &st, AT_SYMLINK_NOFOLLOW) != 0) {
+                perror_fail("lstat %s: %s\n", (src + name).c_str());
+                continue;
+            }
+            if (pattern.empty() || glob_match(pattern, erel)) {
+                handle_copy(src + name, dst + name, flags, jaildev, &st);
+                if ((flags & FLAG_ELF) && S_ISREG(st.st_mode))
+                    handle_elf_closure(src + name, jaildev);
             }
+            if (S_ISDIR(st.st_mode) && st.st_dev == srcdev
+                && depth + 1 < depth_limit
+                && (pattern.empty() || glob_match_below(pattern, erel)))
+                subdirs.push_back(name);
         }
+    }
 
-        std::string src, dst;
-        const char* arrow = (const char*) memmem(line, endline - line, " <- ", 4);
-        if (arrow)
-            src = std::string(arrow + 4, endline);
-        else if (line[0] == '/')
-            src = std::string(line, endline);
-        else
-            src = cursrcdir + std::string(line, endline);
-        if (!arrow)
-            arrow = endline;
-        dst = curdstsubdir + std::string(line + (line[0] == '/'), arrow);
-
-        // act on flags
-        if (flags & (FLAG_BIND | FLAG_BIND_RO)) {
-            mountslot ms(src.c_str(), "none",
-                         flags & FLAG_BIND_RO ? "bind,rec,ro" : "bind,rec");
-            ms.wanted = true;
-            populate_mount_table();
-            mount_table[src] = ms;
-            v_ensuredir(dstroot + dst, 0555, true);
-            handle_mount(src, dstroot + dst, false);
-        } else
-            handle_copy(src, dst, flags, jaildev);
+    for (auto& name : subdirs) {
+        int subdirfd = openat(dirfd, name.c_str(), O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+        if (subdirfd == -1) {
+            perror_fail("%s: %s\n", (src + name).c_str());
+            continue;
+        }
+        walk(subdirfd, src + name + "/", dst + name + "/", rel + name + "/", depth + 1);
+        close(subdirfd);
     }
+}
 
-    return exit_value;
+static bool is_glob_pattern(const std::string& s) {
+    return s.find_first_of("*?[") != std::string::npos
+        || (s.length() >= 4 && s.compare(s.length() - 4, 4, "/...") == 0);
 }
 
+static void handle_glob(const std::string& src, std::string dst, bool arrow,
+                        const std::vector<std::string>& excludes,
+                        int flags, dev_t jaildev) {
+    globwalk gw;
+    gw.excludes = excludes;
+    gw.flags = flags;
+    gw.jaildev = jaildev;
+    gw.depth_limit = (size_t) -1;
+
+    // split into a literal base directory and a pattern
+    std::string srcbase, dstbase;
+    bool recursive = src.length() >= 4
+        && src.compare(src.length() - 4, 4, "/...") == 0;
+    if (recursive) {
+        srcbase = src.substr(0, src.length() - 3);
+        dstbase = dst.substr(0, dst.length() - (arrow ? 0 : 3));
+    } else {
+        size_t meta = src.find_first_of("*?[");
+        size_t slash = src.rfind('/', meta);
+        srcbase = src.substr(0, slash + 1);
+        gw.pattern = src.substr(slash + 1);
+        if (!arrow)
+            dstbase = dst.substr(0, dst.length() - gw.pattern.length());
+        else
+            dstbase = dst;
+        if (gw.pattern.find("**") == std::string::npos)
+            gw.depth_limit = std::count(gw.pattern.begin(), gw.pattern.end(), '/') + 1;
+    }
+    dstbase = path_endslash(dstbase);
 
-// pa-jail.conf
+    int dirfd = open(srcbase.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    struct stat st;
+    if (dirfd == -1 || fstat(dirfd, &st) != 0) {
+        perror_fail("%s: %s\n", srcbase.c_str());
+        if (dirfd >= 0)
+            close(dirfd);
+        return;
+    }
+    gw.srcdev = st.st_dev;
+    if (recursive)
+        handle_copy(src.substr(0, src.length() - 4),
+                    dstbase.substr(0, dstbase.length() - 1), flags, jaildev, &st);
+    gw.walk(dirfd, srcbase, dstbase, std::string(), 0);
+    close(dirfd);
+}
 
-struct pajailconf {
-    pajailconf();
+// build cache
+//
+// A `[buildcache]` manifest entry bind-mounts a persistent directory into
+// the jail and configures ccache to use it. ccache keys objects by compiler
+// content and preprocessed input. The directory named in the manifest must
+// be owned and writable only by root. Many students usually share one jail
+// user, so the run must also give `--buildcache-key` (the runner passes the
+// repository); only the `uUID-KEY` subdirectory for that user and key is
+// mounted, so one student's builds cannot poison another's. If the jail
+// has ccache's compiler links in /usr/lib/ccache, that directory goes first
+// in PATH; otherwise only builds that run ccache themselves use the cache.
+// The jail could ignore ccache's own size limit, so pa-jail enforces the
+// cap from outside: before each run a low-priority background process,
+// running as the cache's owner, evicts least-recently-used files.
+
+#define BUILDCACHE_DEFAULT_SIZE ((off_t) 1 << 30)
+
+static off_t parse_size(const std::string& str) {
+    char* end;
+    double d = strtod(str.c_str(), &end);
+    if (end == str.c_str() || d < 0)
+        return -1;
+    if (*end == 'k' || *end == 'K')
+        d *= 1 << 10, ++end;
+    else if (*end == 'm' || *end == 'M')
+        d *= 1 << 20, ++end;
+    else if (*end == 'g' || *end == 'G')
+        d *= 1 << 30, ++end;
+    return *end ? -1 : (off_t) d;
+}
 
-    bool allow_jail(const std::string& dir) const {
-        return allows_type("jail", dir);
-    }
-    bool allow_skeleton(const std::string& dir) const {
-        return allows_type("skeleton", dir);
-    }
-    const std::string& allowance_dir() const {
-        return allowance_dir_;
+static void add_buildcache_env(const std::string& src, const std::string& dst) {
+    buildcache_dir = src;
+    char buf[64];
+    sprintf(buf, "CCACHE_MAXSIZE=%lldk", (long long) (buildcache_size >> 10));
+    jail_env.push_back("CCACHE_DIR=" + dst);
+    jail_env.push_back(buf);
+    jail_env.push_back("CCACHE_COMPILERCHECK=content");
+    jail_env.push_back("CCACHE_NODIRECT=1");
+    jail_env.push_back("CCACHE_NOHASHDIR=1");
+    jail_env.push_back("CCACHE_UMASK=077");
+}
+
+// Return the cache directory for the jail user and `--buildcache-key`
+// below `src`, creating it if necessary, or an empty string on error.
+static std::string buildcache_subdir(const std::string& src) {
+    if (buildcache_owner == ROOT || buildcache_key.empty()) {
+        fprintf(stderr, "%s: [buildcache] needs a jail user and --buildcache-key\n", src.c_str());
+        exit_value = 1;
+        return std::string();
     }
-    std::string allowance_dir_fail_message() const {
-        if (!allowance_dir_.empty())
-            return "  (disabled under " + allowance_dir_ + ")\n";
-        else
-            return std::string();
+    std::string name = "u" + std::to_string((unsigned long) buildcache_owner)
+        + "-" + buildcache_key;
+    std::string sub = path_endslash(src) + name;
+    if (verbose)
+        fprintf(verbosefile, "mkdir -m 0700 %s\n", sub.c_str());
+    if (dryrun)
+        return sub;
+
+    int dirfd = open(src.c_str(), O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    struct stat st;
+    if (dirfd == -1 || fstat(dirfd, &st) != 0) {
+        perror_fail("%s: %s\n", src.c_str());
+        sub.clear();
+    } else if (st.st_uid != ROOT || (st.st_mode & (S_IWGRP | S_IWOTH))) {
+        fprintf(stderr, "%s: buildcache directory must be owned and writable only by root\n", src.c_str());
+        exit_value = 1;
+        sub.clear();
+    } else if ((mkdirat(dirfd, name.c_str(), 0700) != 0 && errno != EEXIST)
+               || fstatat(dirfd, name.c_str(), &st, AT_SYMLINK_NOFOLLOW) != 0) {
+        perror_fail("%s: %s\n", sub.c_str());
+        sub.clear();
+    } else if (!S_ISDIR(st.st_mode)) {
+        fprintf(stderr, "%s: Not a directory\n", sub.c_str());
+        exit_value = 1;
+        sub.clear();
+    } else if ((st.st_uid != buildcache_owner || st.st_gid != buildcache_group
+                || (st.st_mode & 07777) != 0700)
+               && (fchownat(dirfd, name.c_str(), buildcache_owner, buildcache_group,
+                            AT_SYMLINK_NOFOLLOW) != 0
+                   || fchmodat(dirfd, name.c_str(), 0700, 0) != 0)) {
+        perror_fail("%s: %s\n", sub.c_str());
+        sub.clear();
     }
-private:
-    char buf[8192];
-    size_t len;
-    mutable std::string allowance_dir_;
+    if (dirfd >= 0)
+        close(dirfd);
+    return sub;
+}
 
-    std::pair<const char*, const char*> take_word(size_t& pos) const;
-    bool allows_type(const char* type, const std::string& dir) const;
+struct buildcache_entry {
+    time_t used;
+    off_t size;
+    std::string path;           // relative to the cache directory
+    bool operator<(const buildcache_entry& x) const {
+        return used < x.used;
+    }
 };
 
-static bool writable_only_by_root(const struct stat& st) {
-    return st.st_uid == ROOT
-        && (st.st_gid == ROOT || !(st.st_mode & S_IWGRP))
+static void scan_buildcache(int dirfd, const std::string& dirname,
+                            std::vector<buildcache_entry>& entries,
+                            off_t& total) {
+    DIR* dir = fdopendir(dirfd);
+    if (!dir)
+        return;
+    while (struct dirent* de = readdir(dir)) {
+        if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0)
+            continue;
+        struct stat st;
+        if (fstatat(dirfd, de->d_name, &st, AT_SYMLINK_NOFOLLOW) != 0)
+            continue;
+        std::string path = dirname + de->d_name;
+        if (S_ISDIR(st.st_mode)) {
+            int subdirfd = openat(dirfd, de->d_name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+            if (subdirfd >= 0)
+                scan_buildcache(subdirfd, path + "/", entries, total);
+        } else {
+            buildcache_entry e;
+            e.used = std::max(st.st_atime, st.st_mtime);
+            e.size = st.st_blocks * 512;
+            e.path = path;
+            entries.push_back(e);
+            total += e.size;
+        }
+    }
+    closedir(dir);
+}
+
+static void trim_buildcache() {
+    if (buildcache_dir.empty())
+        return;
+    if (verbose)
+        fprintf(verbosefile, "trim-buildcache %s %lld &\n",
+                buildcache_dir.c_str(), (long long) buildcache_size);
+    if (dryrun)
+        return;
+
+    // double fork so the trimmer is never our child
+    pid_t p = fork();
+    if (p != 0) {
+        if (p > 0)
+            x_waitpid(p, 0);
+        return;
+    } else if (fork() == 0) {
+        // hold nothing of the run's: not the pty, pid file, or sockets
+        int nullfd = open("/dev/null", O_RDWR);
+        if (nullfd < 0 || dup2(nullfd, 0) < 0 || dup2(nullfd, 1) < 0
+            || dup2(nullfd, 2) < 0)
+            _exit(1);
+#ifdef SYS_close_range
+        if (syscall(SYS_close_range, 3U, ~0U, 0) != 0)
+#endif
+        {
+            long maxfd = sysconf(_SC_OPEN_MAX);
+            for (int fd = 3; fd < (maxfd > 0 ? maxfd : 1024); ++fd)
+                close(fd);
+        }
+        // the cache is writable by its owner, so trim as its owner
+        if (setresgid(buildcache_group, buildcache_group, buildcache_group) != 0
+            || setgroups(0, NULL) != 0
+            || setresuid(buildcache_owner, buildcache_owner, buildcache_owner) != 0)
+            _exit(1);
+        if (setpriority(PRIO_PROCESS, 0, 19) != 0) {
+            /* ignore */;
+        }
+#ifdef SYS_ioprio_set
+        syscall(SYS_ioprio_set, 1 /* IOPRIO_WHO_PROCESS */, 0,
+                3 << 13 /* IOPRIO_CLASS_IDLE */);
+#endif
+        std::vector<buildcache_entry> entries;
+        off_t total = 0;
+        int dirfd = open(buildcache_dir.c_str(), O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+        if (dirfd < 0)
+            _exit(1);
+        scan_buildcache(dup(dirfd), std::string(), entries, total);
+        // evict down to 90% of the cap, oldest first; paths are resolved
+        // one component at a time without following symlinks
+        std::sort(entries.begin(), entries.end());
+        off_t goal = buildcache_size - buildcache_size / 10;
+        for (auto it = entries.begin(); total > buildcache_size && it != entries.end(); ++it) {
+            int fd = dup(dirfd);
+            size_t pos = 0, slash;
+            while (fd >= 0 && (slash = it->path.find('/', pos)) != std::string::npos) {
+                int subfd = openat(fd, it->path.substr(pos, slash - pos).c_str(),
+                                   O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+                close(fd);
+                fd = subfd;
+                pos = slash + 1;
+            }
+            bool unlinked = fd >= 0
+                && unlinkat(fd, it->path.c_str() + pos, 0) == 0;
+            if (fd >= 0)
+                close(fd);
+            if (unlinked && (total -= it->size) <= goal)
+                break;
+        }
+    }
+    _exit(0);
+}
+
+// ELF dependency closure
+//
+// A `[elf]` manifest entry copies the file plus everything the dynamic
+// loader would need to run it: PT_INTERP and the transitive DT_NEEDED
+// closure, resolved through DT_RPATH, DT_RUNPATH, /etc/ld.so.cache, and
+// the default library directories. `#!` scripts contribute their
+// interpreter. `$LIB` expands to the library directories used for the
+// object's architecture. A dependency that cannot be found fails the jail
+// build. Each object's resolved dependencies are memoized in memory and in
+// `.pa-jail-elfcache` under the jail's enabled directory, keyed by device,
+// inode, size, and mtime.
+
+struct elfobject {
+    bool ok;
+    unsigned char eclass;
+    unsigned short machine;
+    std::string interp;
+    std::vector<std::string> needed;
+    std::string rpath;
+    std::string runpath;
+    elfobject() : ok(false), eclass(0), machine(0) {}
+};
+
+struct elfdeps {
+    dev_t dev;
+    ino_t ino;
+    off_t size;
+    time_t mtime;
+    bool complete = true;       // false if a dependency was missing
+    std::vector<std::string> deps;
+};
+
+static bool writable_only_by_root(const struct stat& st);
+
+static std::string elfcache_file;
+static std::unordered_map<std::string, elfdeps> elfdeps_table;
+static bool elfdeps_dirty = false;
+static std::unordered_map<std::string, std::vector<std::string> > ldcache_table;
+static time_t ldcache_mtime = -1;
+
+template <typename Ehdr, typename Phdr, typename Dyn>
+static bool read_elf_headers(int fd, elfobject& eo) {
+    Ehdr eh;
+    if (pread(fd, &eh, sizeof(eh), 0) != (ssize_t) sizeof(eh)
+        || eh.e_phentsize != sizeof(Phdr)
+        || eh.e_phnum == 0 || eh.e_phnum > 256)
+        return false;
+    eo.machine = eh.e_machine;
+    std::vector<Phdr> ph(eh.e_phnum);
+    ssize_t phsize = sizeof(Phdr) * eh.e_phnum;
+    if (pread(fd, ph.data(), phsize, eh.e_phoff) != phsize)
+        return false;
+
+    const Phdr* dynamic = nullptr;
+    for (auto& p : ph)
+        if (p.p_type == PT_INTERP && p.p_filesz < 4096) {
+            std::vector<char> buf(p.p_filesz + 1, 0);
+            if (pread(fd, buf.data(), p.p_filesz, p.p_offset) != (ssize_t) p.p_filesz)
+                return false;
+            eo.interp = buf.data();
+        } else if (p.p_type == PT_DYNAMIC)
+            dynamic = &p;
+    if (!dynamic) {
+        eo.ok = true;
+        return true;
+    }
+
+    std::vector<Dyn> dyn(dynamic->p_filesz / sizeof(Dyn));
+    ssize_t dynsize = dyn.size() * sizeof(Dyn);
+    if (pread(fd, dyn.data(), dynsize, dynamic->p_offset) != dynsize)
+        return false;
+    uint64_t strtab = 0, strsz = 0;
+    std::vector<uint64_t> needed;
+    uint64_t rpath = -1, runpath = -1;
+    for (auto& d : dyn)
+        if (d.d_tag == DT_NULL)
+            break;
+        else if (d.d_tag == DT_NEEDED)
+            needed.push_back(d.d_un.d_val);
+        else if (d.d_tag == DT_STRTAB)
+            strtab = d.d_un.d_ptr;
+        else if (d.d_tag == DT_STRSZ)
+            strsz = d.d_un.d_val;
+        else if (d.d_tag == DT_RPATH)
+            rpath = d.d_un.d_val;
+        else if (d.d_tag == DT_RUNPATH)
+            runpath = d.d_un.d_val;
+
+    // map the string table's address to a file offset
+    off_t stroff = -1;
+    for (auto& p : ph)
+        if (p.p_type == PT_LOAD && strtab >= p.p_vaddr
+            && strtab + strsz <= p.p_vaddr + p.p_filesz)
+            stroff = p.p_offset + (strtab - p.p_vaddr);
+    if (stroff < 0 || strsz == 0 || strsz > (1 << 24))
+        return false;
+    std::vector<char> str(strsz + 1, 0);
+    if (pread(fd, str.data(), strsz, stroff) != (ssize_t) strsz)
+        return false;
+    for (auto n : needed)
+        if (n < strsz)
+            eo.needed.push_back(&str[n]);
+    if (rpath < strsz)
+        eo.rpath = &str[rpath];
+    if (runpath < strsz)
+        eo.runpath = &str[runpath];
+    eo.ok = true;
+    return true;
+}
+
+static elfobject read_elf(const std::string& path) {
+    elfobject eo;
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd == -1)
+        return eo;
+    unsigned char ident[EI_NIDENT];
+    if (pread(fd, ident, EI_NIDENT, 0) == EI_NIDENT) {
+        if (memcmp(ident, ELFMAG, SELFMAG) == 0) {
+            eo.eclass = ident[EI_CLASS];
+            if (eo.eclass == ELFCLASS64)
+                read_elf_headers<Elf64_Ehdr, Elf64_Phdr, Elf64_Dyn>(fd, eo);
+            else if (eo.eclass == ELFCLASS32)
+                read_elf_headers<Elf32_Ehdr, Elf32_Phdr, Elf32_Dyn>(fd, eo);
+        } else if (ident[0] == '#' && ident[1] == '!') {
+            char buf[256];
+            ssize_t nr = pread(fd, buf, sizeof(buf) - 1, 2);
+            buf[std::max(nr, (ssize_t) 0)] = 0;
+            char* s = buf + strspn(buf, " \t");
+            s[strcspn(s, " \t\r\n")] = 0;
+            if (s[0] == '/')
+                eo.interp = s;
+            eo.ok = true;
+        }
+    }
+    close(fd);
+    return eo;
+}
+
+static void load_ldcache() {
+    struct stat st;
+    if (ldcache_mtime != -1)
+        return;
+    ldcache_mtime = 0;
+    int fd = open("/etc/ld.so.cache", O_RDONLY | O_CLOEXEC);
+    if (fd == -1 || fstat(fd, &st) != 0 || st.st_size < 48) {
+        if (fd >= 0)
+            close(fd);
+        return;
+    }
+    ldcache_mtime = st.st_mtime;
+    std::string data(st.st_size, '\0');
+    ssize_t nr = pread(fd, &data[0], st.st_size, 0);
+    close(fd);
+    if (nr != st.st_size)
+        return;
+
+    // skip an old-format ("ld.so-1.7.0") prefix
+    size_t hdr = 0;
+    if (data.compare(0, 11, "ld.so-1.7.0") == 0) {
+        uint32_t nold;
+        memcpy(&nold, &data[12], 4);
+        hdr = (16 + nold * 12 + 7) & ~7;
+    }
+    if (hdr + 48 > data.size()
+        || data.compare(hdr, 20, "glibc-ld.so.cache1.1") != 0)
+        return;
+    uint32_t nlibs;
+    memcpy(&nlibs, &data[hdr + 20], 4);
+    for (uint32_t i = 0; i != nlibs; ++i) {
+        size_t epos = hdr + 48 + i * 24;
+        if (epos + 24 > data.size())
+            break;
+        uint32_t key, value;
+        memcpy(&key, &data[epos + 4], 4);
+        memcpy(&value, &data[epos + 8], 4);
+        if (hdr + key < data.size() && hdr + value < data.size())
+            ldcache_table[&data[hdr + key]].push_back(&data[hdr + value]);
+    }
+}
+
+static void load_elfcache() {
+    static bool loaded = false;
+    if (loaded || elfcache_file.empty())
+        return;
+    loaded = true;
+    load_ldcache();
+    FILE* f = fopen(elfcache_file.c_str(), "r");
+    if (!f)
+        return;
+    struct stat st;
+    char line[BUFSIZ * 4];
+    long long ldmtime;
+    if (fstat(fileno(f), &st) != 0
+        || !writable_only_by_root(st)
+        || !fgets(line, sizeof(line), f)
+        || sscanf(line, "pa-jail-elfcache 1 %lld", &ldmtime) != 1
+        || ldmtime != (long long) ldcache_mtime) {
+        fclose(f);
+        return;
+    }
+    while (fgets(line, sizeof(line), f)) {
+        line[strcspn(line, "\n")] = 0;
+        std::vector<std::string> fields;
+        for (char* s = line; s; ) {
+            char* tab = strchr(s, '\t');
+            fields.push_back(tab ? std::string(s, tab) : std::string(s));
+            s = tab ? tab + 1 : nullptr;
+        }
+        if (fields.size() < 5)
+            continue;
+        elfdeps ed;
+        ed.dev = strtoull(fields[1].c_str(), nullptr, 10);
+        ed.ino = strtoull(fields[2].c_str(), nullptr, 10);
+        ed.size = strtoll(fields[3].c_str(), nullptr, 10);
+        ed.mtime = strtoll(fields[4].c_str(), nullptr, 10);
+        ed.deps.assign(fields.begin() + 5, fields.end());
+        elfdeps_table[fields[0]] = ed;
+    }
+    fclose(f);
+}
+
+static void save_elfcache() {
+    if (!elfdeps_dirty || elfcache_file.empty() || dryrun)
+        return;
+    // a private temporary, so concurrent jail builds don't collide
+    std::string tmp = elfcache_file + ".XXXXXX";
+    int fd = mkostemp(&tmp[0], O_CLOEXEC);
+    if (fd >= 0 && fchmod(fd, 0644) != 0) {
+        close(fd);
+        unlink(tmp.c_str());
+        fd = -1;
+    }
+    FILE* f = fd >= 0 ? fdopen(fd, "w") : nullptr;
+    if (!f)
+        return;
+    fprintf(f, "pa-jail-elfcache 1 %lld\n", (long long) ldcache_mtime);
+    for (auto& it : elfdeps_table) {
+        if (!it.second.complete)
+            continue;
+        fprintf(f, "%s\t%llu\t%llu\t%lld\t%lld", it.first.c_str(),
+                (unsigned long long) it.second.dev,
+                (unsigned long long) it.second.ino,
+                (long long) it.second.size, (long long) it.second.mtime);
+        for (auto& d : it.second.deps)
+            fprintf(f, "\t%s", d.c_str());
+        fputc('\n', f);
+    }
+    if (fclose(f) == 0)
+        rename(tmp.c_str(), elfcache_file.c_str());
+    else
+        unlink(tmp.c_str());
+    elfdeps_dirty = false;
+}
+
+// Return the directories `$LIB` may name for `eo`'s architecture: the
+// multiarch directory (Debian) and the biarch one (Red Hat).
+static std::vector<std::string> elf_libdirs(const elfobject& eo) {
+    const char* triplet = nullptr;
+    switch (eo.machine) {
+    case EM_X86_64:
+        triplet = eo.eclass == ELFCLASS64 ? "lib/x86_64-linux-gnu" : "lib/x86_64-linux-gnux32";
+        break;
+    case EM_386:
+        triplet = "lib/i386-linux-gnu";
+        break;
+    case EM_AARCH64:
+        triplet = "lib/aarch64-linux-gnu";
+        break;
+    case EM_ARM:
+        triplet = "lib/arm-linux-gnueabihf";
+        break;
+    }
+    std::vector<std::string> dirs;
+    if (triplet)
+        dirs.push_back(triplet);
+    dirs.push_back(eo.eclass == ELFCLASS64 ? "lib64" : "lib");
+    if (eo.eclass == ELFCLASS64)
+        dirs.push_back("lib");
+    return dirs;
+}
+
+// Expand `$ORIGIN` and `$LIB` in a search path element. `$LIB` can
+// produce several candidates.
+static std::vector<std::string> elf_expand(const std::string& dir,
+                                           const std::string& origin,
+                                           const elfobject& eo) {
+    std::vector<std::string> out(1, dir);
+    for (size_t i = 0; i != out.size(); ) {
+        size_t pos = out[i].find('$');
+        if (pos == std::string::npos) {
+            ++i;
+            continue;
+        }
+        size_t len = 1;
+        std::vector<std::string> repls(1, std::string());
+        const char* names[] = { "ORIGIN", "{ORIGIN}", "LIB", "{LIB}" };
+        for (int n = 0; n != 4; ++n)
+            if (out[i].compare(pos + 1, strlen(names[n]), names[n]) == 0) {
+                len += strlen(names[n]);
+                if (n < 2)
+                    repls[0] = origin;
+                else
+                    repls = elf_libdirs(eo);
+                break;
+            }
+        std::string d = out[i];
+        out.erase(out.begin() + i);
+        for (auto it = repls.rbegin(); it != repls.rend(); ++it)
+            out.insert(out.begin() + i,
+                       std::string(d).replace(pos, len, *it));
+    }
+    return out;
+}
+
+static bool elf_compatible(const std::string& path, const elfobject& parent) {
+    elfobject eo = read_elf(path);
+    return eo.ok && eo.eclass == parent.eclass && eo.machine == parent.machine;
+}
+
+static std::string elf_resolve(const std::string& name, const elfobject& eo,
+                               const std::string& origin) {
+    if (name.find('/') != std::string::npos)
+        return name[0] == '/' ? name : origin + "/" + name;
+
+    std::vector<std::string> dirs;
+    std::string paths = eo.runpath.empty() ? eo.rpath : eo.runpath;
+    for (size_t pos = 0; pos <= paths.length() && !paths.empty(); ) {
+        size_t colon = paths.find(':', pos);
+        if (colon == std::string::npos)
+            colon = paths.length();
+        if (colon != pos)
+            for (auto& d : elf_expand(paths.substr(pos, colon - pos), origin, eo))
+                dirs.push_back(d);
+        pos = colon + 1;
+    }
+    for (auto& d : dirs) {
+        std::string path = path_endslash(d) + name;
+        if (access(path.c_str(), F_OK) == 0 && elf_compatible(path, eo))
+            return path;
+    }
+
+    auto it = ldcache_table.find(name);
+    if (it != ldcache_table.end())
+        for (auto& path : it->second)
+            if (elf_compatible(path, eo))
+                return path;
+
+    static const char* const defaults[] = {
+        "/lib64/", "/usr/lib64/", "/lib/", "/usr/lib/",
+        "/lib/x86_64-linux-gnu/", "/usr/lib/x86_64-linux-gnu/",
+        "/lib/aarch64-linux-gnu/", "/usr/lib/aarch64-linux-gnu/"
+    };
+    for (auto d : defaults) {
+        std::string path = d + name;
+        if (access(path.c_str(), F_OK) == 0 && elf_compatible(path, eo))
+            return path;
+    }
+    return std::string();
+}
+
+static const std::vector<std::string>* elf_direct_deps(const std::string& path) {
+    struct stat st;
+    if (stat(path.c_str(), &st) != 0 || !S_ISREG(st.st_mode))
+        return nullptr;
+    auto it = elfdeps_table.find(path);
+    if (it != elfdeps_table.end()
+        && it->second.complete
+        && it->second.dev == st.st_dev && it->second.ino == st.st_ino
+        && it->second.size == st.st_size && it->second.mtime == st.st_mtime)
+        return &it->second.deps;
+
+    elfobject eo = read_elf(path);
+    elfdeps& ed = elfdeps_table[path];
+    ed.dev = st.st_dev;
+    ed.ino = st.st_ino;
+    ed.size = st.st_size;
+    ed.mtime = st.st_mtime;
+    ed.complete = true;
+    ed.deps.clear();
+    if (eo.ok) {
+        if (!eo.interp.empty())
+            ed.deps.push_back(eo.interp);
+        std::string origin = path_noendslash(path_parentdir(path));
+        for (auto& n : eo.needed) {
+            std::string dep = elf_resolve(n, eo, origin);
+            // copy `$ORIGIN/..` dependencies by their real location
+            if (!dep.empty())
+                dep = path_normalize(dep);
+            if (!dep.empty())
+                ed.deps.push_back(dep);
+            else {
+                fprintf(stderr, "%s: Cannot find library %s\n", path.c_str(), n.c_str());
+                ed.complete = false;
+                exit_value = 1;
+            }
+        }
+    }
+    elfdeps_dirty = true;
+    return &ed.deps;
+}
+
+static void handle_elf_closure(const std::string& src, dev_t jaildev) {
+    load_elfcache();
+    load_ldcache();
+    static std::unordered_map<std::string, int> seen;
+    std::vector<std::string> stack(1, src);
+    while (!stack.empty()) {
+        std::string path = stack.back();
+        stack.pop_back();
+        if (!seen.insert(std::make_pair(path, 1)).second)
+            continue;
+        if (path != src)
+            handle_copy(path, path, 0, jaildev);
+        if (const std::vector<std::string>* deps = elf_direct_deps(path))
+            stack.insert(stack.end(), deps->rbegin(), deps->rend());
+    }
+}
+
+static int construct_jail(dev_t jaildev, std::string& str) {
+    // prepare root
+    if (x_chmod(dstroot.c_str(), 0755)
+        || x_lchown(dstroot.c_str(), 0, 0))
+        return 1;
+    jail_paths[jail_paths.find(dstroot)].dst = 1;
+
+    // Mounts
+    populate_mount_table();
+
+    // Read a line at a time
+    std::string cursrcdir("/"), curdstsubdir("/");
+    int base_flags = 0;
+
+    const char* pos = str.data(), *endpos = pos + str.length();
+    while (pos < endpos) {
+        while (pos < endpos && isspace((unsigned char) *pos))
+            ++pos;
+        const char* line = pos;
+        while (pos < endpos && *pos != '\n')
+            ++pos;
+        const char* endline = pos;
+        while (line < endline && isspace((unsigned char) endline[-1]))
+            --endline;
+        if (line == endline || line[0] == '#')
+            continue;
+
+        // 'directory:'
+        if (endline[-1] == ':') {
+            if (line + 2 == endline && line[0] == '.')
+                cursrcdir = std::string("/");
+            else if (line + 2 > endline && line[0] == '.' && line[1] == '/')
+                cursrcdir = std::string(line + 1, endline - 1);
+            else
+                cursrcdir = std::string(line, endline - 1);
+            if (cursrcdir[0] != '/')
+                cursrcdir = std::string("/") + cursrcdir;
+            while (cursrcdir.length() > 1 && cursrcdir[cursrcdir.length() - 1] == '/' && cursrcdir[cursrcdir.length() - 2] == '/')
+                cursrcdir = cursrcdir.substr(0, cursrcdir.length() - 1);
+            if (cursrcdir[cursrcdir.length() - 1] != '/')
+                cursrcdir += '/';
+            curdstsubdir = cursrcdir;
+            assert(curdstsubdir.back() == '/');
+            continue;
+        }
+
+        // ' [FLAGS]': the bracket must follow whitespace and hold only
+        // known flags; otherwise it is part of the name (a glob class)
+        int flags = base_flags;
+        std::vector<std::string> excludes;
+        const char* lbrack = endline - 1;
+        while (line < lbrack && *lbrack != '[')
+            --lbrack;
+        if (endline[-1] == ']' && *lbrack == '[' && line < lbrack
+            && isspace((unsigned char) lbrack[-1])) {
+            int fflags = 0;
+            std::vector<std::string> fexcludes;
+            off_t fbuildcache_size = BUILDCACHE_DEFAULT_SIZE;
+            bool known = true;
+            for (const char* opts = lbrack + 1; known; ) {
+                while (isspace((unsigned char) *opts) || *opts == ',')
+                    ++opts;
+                if (*opts == ']')
+                    break;
+                const char* optstart = opts;
+                ++opts;
+                while (*opts != ']' && *opts != ','
+                       && !isspace((unsigned char) *opts))
+                    ++opts;
+                size_t optlen = opts - optstart;
+                if (optlen == 2 && memcmp(optstart, "cp", 2) == 0)
+                    fflags |= FLAG_CP;
+                else if (optlen == 4 && memcmp(optstart, "bind", 4) == 0)
+                    fflags |= FLAG_BIND;
+                else if (optlen == 7 && memcmp(optstart, "bind-ro", 7) == 0)
+                    fflags |= FLAG_BIND_RO;
+                else if (optlen == 3 && memcmp(optstart, "elf", 3) == 0)
+                    fflags |= FLAG_ELF;
+                else if (optlen > 8 && memcmp(optstart, "exclude=", 8) == 0)
+                    fexcludes.push_back(std::string(optstart + 8, opts));
+                else if (optlen >= 10 && memcmp(optstart, "buildcache", 10) == 0
+                         && (optlen == 10 || optstart[10] == '=')) {
+                    fflags |= FLAG_BUILDCACHE;
+                    if (optlen > 11
+                        && (fbuildcache_size = parse_size(std::string(optstart + 11, opts))) <= 0) {
+                        fprintf(stderr, "%.*s: Bad buildcache size\n", (int) optlen, optstart);
+                        exit_value = 1;
+                        fflags &= ~FLAG_BUILDCACHE;
+                    }
+                } else
+                    known = false;
+            }
+            if (known) {
+                flags |= fflags;
+                excludes.swap(fexcludes);
+                if (fflags & FLAG_BUILDCACHE)
+                    buildcache_size = fbuildcache_size;
+                endline = lbrack;
+                while (line < endline && isspace((unsigned char) endline[-1]))
+                    --endline;
+                if (line == endline)
+                    continue;
+            }
+        }
+
+        std::string src, dst;
+        const char* arrow = (const char*) memmem(line, endline - line, " <- ", 4);
+        if (arrow)
+            src = std::string(arrow + 4, endline);
+        else if (line[0] == '/')
+            src = std::string(line, endline);
+        else
+            src = cursrcdir + std::string(line, endline);
+        if (!arrow)
+            arrow = endline;
+        dst = curdstsubdir + std::string(line + (line[0] == '/'), arrow);
+
+        // act on flags
+        if (flags & FLAG_BUILDCACHE) {
+            src = buildcache_subdir(src);
+            if (src.empty())
+                continue;
+            mountslot ms(src.c_str(), "none", "bind,nosuid,nodev");
+            ms.wanted = true;
+            populate_mount_table();
+            mount_table[src] = ms;
+            v_ensuredir(dstroot + dst, 0555, true);
+            handle_mount(src, dstroot + dst, false);
+            add_buildcache_env(src, dst);
+        } else if (flags & (FLAG_BIND | FLAG_BIND_RO)) {
+            mountslot ms(src.c_str(), "none",
+                         flags & FLAG_BIND_RO ? "bind,rec,ro" : "bind,rec");
+            ms.wanted = true;
+            populate_mount_table();
+            mount_table[src] = ms;
+            v_ensuredir(dstroot + dst, 0555, true);
+            handle_mount(src, dstroot + dst, false);
+        } else if (is_glob_pattern(src))
+            handle_glob(src, dst, arrow != endline, excludes, flags, jaildev);
+        else {
+            handle_copy(src, dst, flags, jaildev);
+            if (flags & FLAG_ELF)
+                handle_elf_closure(src, jaildev);
+        }
+    }
+
+    save_elfcache();
+    return exit_value;
+}
+
+
+// pa-jail.conf
+
+struct pajailconf {
+    pajailconf();
+
+    bool allow_jail(const std::string& dir) const {
+        return allows_type("jail", dir);
+    }
+    bool allow_skeleton(const std::string& dir) const {
+        return allows_type("skeleton", dir);
+    }
+    const std::string& allowance_dir() const {
+        return allowance_dir_;
+    }
+    int number(const char* name) const;
+    std::string allowance_dir_fail_message() const {
+        if (!allowance_dir_.empty())
+            return "  (disabled under " + allowance_dir_ + ")\n";
+        else
+            return std::string();
+    }
+private:
+    char buf[8192];
+    size_t len;
+    mutable std::string allowance_dir_;
+
+    std::pair<const char*, const char*> take_word(size_t& pos) const;
+    bool allows_type(const char* type, const std::string& dir) const;
+};
+
+static bool writable_only_by_root(const struct stat& st) {
+    return st.st_uid == ROOT
+        && (st.st_gid == ROOT || !(st.st_mode & S_IWGRP))
         && !(st.st_mode & S_IWOTH);
 }
 
@@ -997,6 +2334,24 @@ static bool check_dirmatch_prefix(const std::string& pattern,
                    FNM_PATHNAME | FNM_PERIOD) == 0;
 }
 
+int pajailconf::number(const char* name) const {
+    size_t pos = 0, namelen = strlen(name);
+    int value = -1;
+    while (pos < len) {
+        auto action = take_word(pos);
+        auto arg = take_word(pos);
+        while (pos < len && buf[pos] != '\n')
+            take_word(pos);
+        while (pos < len && buf[pos] == '\n')
+            ++pos;
+        if (action.second - action.first == (ssize_t) namelen
+            && memcmp(action.first, name, namelen) == 0
+            && arg.first != arg.second)
+            value = atoi(std::string(arg.first, arg.second).c_str());
+    }
+    return value;
+}
+
 bool pajailconf::allows_type(const char* type, const std::string& dir) const {
     size_t pos = 0, typelen = strlen(type);
     int allowed_globally = -1, allowed_locally = -1;
@@ -1091,10 +2446,242 @@ static std::string absolute(const std::string& dir) {
     return std::string(buf) + dir;
 }
 
-struct jaildirinfo {
-    std::string dir;
-    std::string parent;
+
+// project quotas
+//
+// If the jail file system has project quota accounting enabled, each jail
+// directory is assigned its own project ID, with FS_XFLAG_PROJINHERIT so
+// that everything created below it is charged to the jail. Usage and
+// limits then come from the quota subsystem in O(1). IDs are allocated
+// from a counter in `.pa-jail-projid` in the jail's enabled directory,
+// skipping IDs that are still charged for anything. A directory keeps its
+// ID across runs, and its limits are reset on every run.
+
+#define PROJID_FIRST 100000U
+
+#if __linux__ && defined(FS_IOC_FSGETXATTR) && defined(PRJQUOTA)
+# define HAVE_PROJECT_QUOTA 1
+#endif
+
+struct jailusage {
+    uint32_t projid = 0;
+    unsigned long long bytes = 0;
+    unsigned long long inodes = 0;
+    unsigned long long bytes_limit = 0;
+    unsigned long long inodes_limit = 0;
+};
+
+static uint32_t jail_projid;
+static int jail_quotafd = -1;
+
+#if HAVE_PROJECT_QUOTA
+static int quota_ctl(int fd, int cmd, uint32_t id, void* addr) {
+# ifdef SYS_quotactl_fd
+    int r = syscall(SYS_quotactl_fd, fd, QCMD(cmd, PRJQUOTA), id, addr);
+    if (r == 0 || errno != ENOSYS)
+        return r;
+# endif
+    // older kernels need the block device of the containing mount
+    struct stat st;
+    if (fstat(fd, &st) != 0)
+        return -1;
+    populate_mount_table();
+    for (auto& m : mount_table) {
+        struct stat mst;
+        if (stat(m.first.c_str(), &mst) == 0 && mst.st_dev == st.st_dev
+            && m.second.fsname[0] == '/')
+            return quotactl(QCMD(cmd, PRJQUOTA), m.second.fsname.c_str(),
+                            id, (caddr_t) addr);
+    }
+    errno = ENODEV;
+    return -1;
+}
+#endif
+
+static bool jail_usage(int fd, uint32_t projid, jailusage& u) {
+#if HAVE_PROJECT_QUOTA
+    struct if_dqblk dq;
+    if (projid == 0 || quota_ctl(fd, Q_GETQUOTA, projid, &dq) != 0)
+        return false;
+    u.projid = projid;
+    u.bytes = dq.dqb_curspace;
+    u.inodes = dq.dqb_curinodes;
+    u.bytes_limit = dq.dqb_bhardlimit * QIF_DQBLKSIZE;
+    u.inodes_limit = dq.dqb_ihardlimit;
+    return true;
+#else
+    (void) fd, (void) projid, (void) u;
+    return false;
+#endif
+}
+
+static uint32_t jail_project(int fd) {
+#if HAVE_PROJECT_QUOTA
+    struct fsxattr fsx;
+    if (ioctl(fd, FS_IOC_FSGETXATTR, &fsx) == 0
+        && (fsx.fsx_xflags & FS_XFLAG_PROJINHERIT))
+        return fsx.fsx_projid;
+#else
+    (void) fd;
+#endif
+    return 0;
+}
+
+#if HAVE_PROJECT_QUOTA
+// Allocate an unused project ID using the counter file `counter`.
+// Returns 0 on failure.
+static uint32_t allocate_projid(int fd, const std::string& counter) {
+    int cfd = open(counter.c_str(), O_RDWR | O_CREAT | O_NOFOLLOW | O_CLOEXEC, 0644);
+    if (cfd == -1 || flock(cfd, LOCK_EX) != 0) {
+        perror_fail("%s: %s\n", counter.c_str());
+        if (cfd >= 0)
+            close(cfd);
+        return 0;
+    }
+    char buf[32];
+    ssize_t nr = pread(cfd, buf, sizeof(buf) - 1, 0);
+    buf[std::max(nr, (ssize_t) 0)] = 0;
+    unsigned long next = strtoul(buf, nullptr, 10);
+    uint32_t projid = 0;
+    for (int tries = 0; tries != 1000 && projid == 0; ++tries) {
+        if (next < PROJID_FIRST || next > 0xFFFFFFFEUL)
+            next = PROJID_FIRST;
+        struct if_dqblk dq;
+        if (quota_ctl(fd, Q_GETQUOTA, next, &dq) != 0
+            ? errno == ESRCH || errno == ENOENT
+            : dq.dqb_curspace == 0 && dq.dqb_curinodes == 0)
+            projid = next;
+        ++next;
+    }
+    int len = sprintf(buf, "%lu\n", next);
+    if (projid == 0)
+        fprintf(stderr, "%s: No free project IDs\n", counter.c_str());
+    else if (pwrite(cfd, buf, len, 0) != len || ftruncate(cfd, len) != 0) {
+        perror_fail("%s: %s\n", counter.c_str());
+        projid = 0;
+    }
+    close(cfd);
+    return projid;
+}
+#endif
+
+// Assign a project ID to the jail directory `fd` and apply limits (zero
+// means none). Does nothing if project quotas are not enabled. Returns the
+// project ID.
+static uint32_t assign_jail_project(int fd, const std::string& dir,
+                                    const std::string& permdir,
+                                    off_t bytes_limit, off_t inodes_limit) {
+#if HAVE_PROJECT_QUOTA
+    struct if_dqinfo dqi;
+    if (quota_ctl(fd, Q_GETINFO, 0, &dqi) != 0)
+        return 0;
+
+    struct fsxattr fsx;
+    if (ioctl(fd, FS_IOC_FSGETXATTR, &fsx) != 0)
+        return 0;
+    uint32_t projid = fsx.fsx_projid;
+    if (projid == 0 || !(fsx.fsx_xflags & FS_XFLAG_PROJINHERIT)) {
+        if (dryrun)
+            projid = PROJID_FIRST;
+        else if (!(projid = allocate_projid(fd, permdir + ".pa-jail-projid")))
+            return 0;
+        if (verbose)
+            fprintf(verbosefile, "chattr -p %u +P %s\n", projid, dir.c_str());
+        fsx.fsx_projid = projid;
+        fsx.fsx_xflags |= FS_XFLAG_PROJINHERIT;
+        if (!dryrun && ioctl(fd, FS_IOC_FSSETXATTR, &fsx) != 0) {
+            perror_fail("chattr %s: %s\n", dir.c_str());
+            return 0;
+        }
+    }
+
+    // always set limits, so none linger from an earlier run
+    struct if_dqblk dq;
+    memset(&dq, 0, sizeof(dq));
+    dq.dqb_bhardlimit = dq.dqb_bsoftlimit =
+        (std::max(bytes_limit, (off_t) 0) + QIF_DQBLKSIZE - 1) / QIF_DQBLKSIZE;
+    dq.dqb_ihardlimit = dq.dqb_isoftlimit = std::max(inodes_limit, (off_t) 0);
+    dq.dqb_valid = QIF_LIMITS;
+    if (verbose)
+        fprintf(verbosefile, "setquota -P %u 0 %llu 0 %llu %s\n", projid,
+                (unsigned long long) dq.dqb_bhardlimit,
+                (unsigned long long) dq.dqb_ihardlimit, dir.c_str());
+    if (!dryrun && quota_ctl(fd, Q_SETQUOTA, projid, &dq) != 0)
+        perror_fail("setquota %s: %s\n", dir.c_str());
+    return projid;
+#else
+    (void) fd, (void) dir, (void) permdir, (void) bytes_limit, (void) inodes_limit;
+    return 0;
+#endif
+}
+
+static void write_jail_usage(int usagefd) {
+    jailusage u;
+    if (usagefd < 0 || !jail_usage(jail_quotafd, jail_projid, u))
+        return;
+    char buf[256];
+    int len = snprintf(buf, sizeof(buf), "{\"bytes\":%llu,\"inodes\":%llu,\"bytes_limit\":%llu,\"inodes_limit\":%llu}\n",
+                       u.bytes, u.inodes, u.bytes_limit, u.inodes_limit);
+    ssize_t w = write(usagefd, buf, len);
+    (void) w;
+}
+
+static int du_command(const char* arg, pajailconf& jailconf) {
+    std::string root = path_endslash(check_filename(absolute(arg)));
+    int dirfd = open(root.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dirfd == -1)
+        perror_die(root);
+    DIR* dir = fdopendir(dirfd);
+    if (!dir)
+        perror_die(root);
+
+    std::vector<std::pair<std::string, jailusage> > jails;
+    bool any_projects = false;
+    while (struct dirent* de = readdir(dir)) {
+        if (de->d_type != DT_DIR || de->d_name[0] == '.'
+            || !jailconf.allow_jail(root + de->d_name + "/"))
+            continue;
+        int fd = openat(dirfd, de->d_name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+        if (fd == -1)
+            continue;
+        jailusage u;
+        uint32_t projid = jail_project(fd);
+        any_projects = any_projects || projid != 0;
+        if (jail_usage(fd, projid, u))
+            jails.push_back(std::make_pair(std::string(de->d_name), u));
+        close(fd);
+    }
+    closedir(dir);
+
+    if (jails.empty() && !any_projects) {
+        fprintf(stderr, "%s: No jails with project quotas\n", root.c_str());
+        return 1;
+    }
+    std::sort(jails.begin(), jails.end(),
+              [](const std::pair<std::string, jailusage>& a,
+                 const std::pair<std::string, jailusage>& b) {
+                  return a.second.bytes > b.second.bytes;
+              });
+    for (auto& j : jails) {
+        printf("%llu\t%llu", (j.second.bytes + 1023) >> 10, j.second.inodes);
+        if (j.second.bytes_limit || j.second.inodes_limit)
+            printf("\t%llu\t%llu", (j.second.bytes_limit + 1023) >> 10,
+                   j.second.inodes_limit);
+        else
+            printf("\t-\t-");
+        printf("\t%s%s\n", root.c_str(), j.first.c_str());
+    }
+    return 0;
+}
+
+
+// jail directory
+
+struct jaildirinfo {
+    std::string dir;
+    std::string parent;
     int parentfd;
+    int dirfd;
     std::string component;
     bool allowed;
     std::string permdir;
@@ -1107,6 +2694,7 @@ struct jaildirinfo {
     void chown_home();
     void chown_recursive(const std::string& dir, uid_t owner, gid_t group);
     void remove();
+    void mount_tmpfs(off_t size);
 
 private:
     void chown_recursive(int dirfd, std::string& dirbuf, uid_t owner,
@@ -1117,7 +2705,7 @@ private:
 jaildirinfo::jaildirinfo(const char* str, const std::string& skeletonstr,
                          jailaction action, pajailconf& jailconf)
     : dir(check_filename(absolute(str))),
-      parentfd(-1), allowed(false), dev(-1),
+      parentfd(-1), dirfd(-1), allowed(false), dev(-1),
       skeletondir(skeletonstr) {
     if (dir.empty() || dir == "/" || dir[0] != '/') {
         fprintf(stderr, "%s: Bad characters in filename\n", str);
@@ -1173,7 +2761,7 @@ jaildirinfo::jaildirinfo(const char* str, const std::string& skeletonstr,
                 fprintf(stderr, "mkdir %s: %s\n", thisdir.c_str(), strerror(errno));
                 exit(1);
             }
-            dirtable.insert(std::make_pair(thisdir, 0));
+            jail_paths[jail_paths.find(thisdir)].dir = 0;
             fd = openat(parentfd, component.c_str(), O_CLOEXEC | O_NOFOLLOW);
             // turn off suid+sgid on created root directory
             if (last_pos == dir.length() && (fd >= 0 || dryrun)
@@ -1209,7 +2797,9 @@ jaildirinfo::jaildirinfo(const char* str, const std::string& skeletonstr,
         }
         dev = s.st_dev;
     }
-    if (fd >= 0)
+    if (fd >= 0 && last_pos == dir.length())
+        dirfd = fd;
+    else if (fd >= 0)
         close(fd);
 }
 
@@ -1312,14 +2902,41 @@ void jaildirinfo::chown_recursive(int dirfd, std::string& dirbuf,
     delete home_map;
 }
 
+void jaildirinfo::mount_tmpfs(off_t size) {
+    // a tmpfs root persists across `pa-jail add` and `pa-jail run`
+    std::string mountpoint = path_noendslash(dir);
+    populate_mount_table();
+    auto it = mount_table.find(mountpoint);
+    if (it != mount_table.end() && it->second.type == "tmpfs")
+        return;
+
+    char buf[64];
+    sprintf(buf, "mode=0755,size=%lld", (long long) size);
+    mountslot ms("tmpfs", "tmpfs", buf);
+    if (ms.x_mount(mountpoint, ms.opts) != 0)
+        perror_die("mount " + mountpoint);
+    mount_table[mountpoint] = ms;
+
+    // reopen the jail directory: `dirfd` refers to the covered directory
+    if (!dryrun) {
+        int fd = openat(parentfd, component.c_str(), O_PATH | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+        struct stat s;
+        if (fd == -1 || fstat(fd, &s) != 0)
+            perror_die(mountpoint);
+        if (dirfd >= 0)
+            close(dirfd);
+        dirfd = fd;
+        dev = s.st_dev;
+    }
+}
+
 void jaildirinfo::remove() {
     remove_recursive(parentfd, component, path_endslash(dir));
 }
 
 void jaildirinfo::remove_recursive(int parentdirfd, std::string component,
                                    std::string dirname) {
-    auto it = dst_table.find(dirname);
-    if (it != dst_table.end() && it->second == 3) // unmounted file system
+    if (jail_paths[jail_paths.find(dirname)].dst == 3) // unmounted file system
         return;
 
     int dirfd = openat(parentdirfd, component.c_str(), O_RDONLY);
@@ -1357,574 +2974,4041 @@ void jaildirinfo::remove_recursive(int parentdirfd, std::string component,
 }
 
 
+// jail clone
+//
+// `pa-jail clone SRCJAIL DSTJAIL` copies a constructed jail, so that a
+// rerun need not construct it again. If SRCJAIL is the root of a btrfs
+// subvolume, DSTJAIL becomes a snapshot of it. Otherwise the main thread
+// walks the tree, creating directories, links, symlinks, and device
+// nodes, and hands open file pairs to worker threads that copy contents
+// with x_copy_data (by reflink where the file system allows). Ownership,
+// modes, times, and hard-link structure are preserved. Mount points
+// inside SRCJAIL are recreated empty, not crossed.
+
+struct clonejob {
+    int srcfd;
+    int dstfd;
+    std::string path;
+    struct stat st;
+};
 
-class jailownerinfo {
-  public:
-    uid_t owner;
-    gid_t group;
-    std::string owner_home;
-    std::string owner_sh;
+struct cloneinfo {
+    int srcrootfd;
+    int dstrootfd;
+    dev_t dev;
+    std::unordered_map<devino, std::string> links;
+    std::deque<clonejob> jobs;
+    bool done = false;
+    pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+    pthread_cond_t cond = PTHREAD_COND_INITIALIZER;
+
+    static const size_t max_jobs = 128;
+
+    void push(clonejob&& job);
+    static void* worker(void* arg);
+    void copy_tree(int srcfd, int dstfd, const std::string& path,
+                   const std::string& rel);
+};
 
-    jailownerinfo();
-    ~jailownerinfo();
-    void init(const char* owner_name);
-    void exec(int argc, char** argv, jaildirinfo& jaildir,
-              int inputfd, double timeout, bool foreground);
-    int exec_go();
+void cloneinfo::push(clonejob&& job) {
+    pthread_mutex_lock(&mutex);
+    while (jobs.size() >= max_jobs)
+        pthread_cond_wait(&cond, &mutex);
+    jobs.push_back(std::move(job));
+    pthread_cond_broadcast(&cond);
+    pthread_mutex_unlock(&mutex);
+}
 
-  private:
-    const char* newenv[5];
-    char** argv;
-    jaildirinfo* jaildir;
-    int inputfd;
-    struct timeval timeout;
-    fd_set readset;
-    fd_set writeset;
-    struct buffer {
-        char buf[8192];
-        size_t head;
-        size_t tail;
-        bool input_closed;
-        bool output_closed;
-        bool transfer_eof;
-        int rerrno;
-        buffer()
-            : head(0), tail(0), input_closed(false), output_closed(false),
-              transfer_eof(false), rerrno(0) {
+void* cloneinfo::worker(void* arg) {
+    cloneinfo* ci = static_cast<cloneinfo*>(arg);
+    pthread_mutex_lock(&ci->mutex);
+    while (1) {
+        while (ci->jobs.empty() && !ci->done)
+            pthread_cond_wait(&ci->cond, &ci->mutex);
+        if (ci->jobs.empty())
+            break;
+        clonejob job = std::move(ci->jobs.front());
+        ci->jobs.pop_front();
+        pthread_cond_broadcast(&ci->cond);
+        pthread_mutex_unlock(&ci->mutex);
+
+        struct timespec ts[2] = { job.st.st_atim, job.st.st_mtim };
+        bool ok = x_copy_data(job.srcfd, job.dstfd)
+            && fchown(job.dstfd, job.st.st_uid, job.st.st_gid) == 0
+            && fchmod(job.dstfd, job.st.st_mode & 07777) == 0
+            && futimens(job.dstfd, ts) == 0;
+        int saved_errno = errno;
+        close(job.srcfd);
+        close(job.dstfd);
+
+        pthread_mutex_lock(&ci->mutex);
+        if (!ok) {
+            errno = saved_errno;
+            perror_fail("cp %s: %s\n", job.path.c_str());
         }
-        void transfer_in(int from);
-        void transfer_out(int to);
-    };
-    buffer to_slave;
-    buffer from_slave;
-    bool has_stdin_termios;
-    struct termios stdin_termios;
-    int child_status;
+    }
+    pthread_mutex_unlock(&ci->mutex);
+    return nullptr;
+}
 
-    void start_sigpipe();
-    void block(int ptymaster);
-    int check_child_timeout(pid_t child, bool waitpid);
-    void wait_background(pid_t child, int ptymaster);
-    void exec_done(pid_t child, int exit_status) __attribute__((noreturn));
-};
+// Copy the contents of directory `srcfd` into the empty directory `dstfd`.
+// `path` names the destination for messages; `rel` is its name relative
+// to the destination root, for hard links.
+void cloneinfo::copy_tree(int srcfd, int dstfd, const std::string& path,
+                          const std::string& rel) {
+    int fd = dup(srcfd);
+    DIR* dir = fd == -1 ? nullptr : fdopendir(fd);
+    if (!dir) {
+        perror_fail("%s: %s\n", path.c_str());
+        return;
+    }
+    while (struct dirent* de = readdir(dir)) {
+        const char* name = de->d_name;
+        if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0)
+            continue;
+        std::string npath = path + name, nrel = rel + name;
+        struct stat st;
+        if (fstatat(srcfd, name, &st, AT_SYMLINK_NOFOLLOW) != 0) {
+            perror_fail("%s: %s\n", npath.c_str());
+            continue;
+        }
 
-jailownerinfo::jailownerinfo()
-    : owner(ROOT), group(ROOT), argv(), has_stdin_termios(false),
-      child_status(-1) {
+        int r = 0;
+        if (S_ISDIR(st.st_mode)) {
+            r = mkdirat(dstfd, name, 0700);
+            int s = -1, d = -1;
+            // don't cross mount points
+            if (r == 0 && st.st_dev == dev
+                && ((s = openat(srcfd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC)) == -1
+                    || (d = openat(dstfd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC)) == -1))
+                r = -1;
+            if (s >= 0 && d >= 0)
+                copy_tree(s, d, npath + "/", nrel + "/");
+            // set the mode last, in case it is read-only; a mount point
+            // is copied empty, but with its owner and mode
+            struct timespec ts[2] = { st.st_atim, st.st_mtim };
+            if (d >= 0
+                && (fchown(d, st.st_uid, st.st_gid) != 0
+                    || fchmod(d, st.st_mode & 07777) != 0
+                    || futimens(d, ts) != 0))
+                r = -1;
+            else if (r == 0 && d == -1
+                     && (fchownat(dstfd, name, st.st_uid, st.st_gid, AT_SYMLINK_NOFOLLOW) != 0
+                         || fchmodat(dstfd, name, st.st_mode & 07777, 0) != 0
+                         || utimensat(dstfd, name, ts, AT_SYMLINK_NOFOLLOW) != 0))
+                r = -1;
+            if (s >= 0)
+                close(s);
+            if (d >= 0)
+                close(d);
+        } else if (S_ISREG(st.st_mode)) {
+            if (st.st_nlink > 1) {
+                auto di = std::make_pair(st.st_dev, st.st_ino);
+                auto it = links.find(di);
+                if (it != links.end()) {
+                    if (linkat(dstrootfd, it->second.c_str(), dstfd, name, 0) != 0)
+                        perror_fail("ln %s: %s\n", npath.c_str());
+                    continue;
+                }
+                links.insert(std::make_pair(di, nrel));
+            }
+            // the file may have been replaced by a FIFO since fstatat;
+            // open without blocking and check
+            clonejob job;
+            job.srcfd = openat(srcfd, name, O_RDONLY | O_NOFOLLOW | O_NOCTTY | O_NONBLOCK | O_CLOEXEC);
+            job.dstfd = -1;
+            struct stat fst;
+            if (job.srcfd >= 0
+                && (fstat(job.srcfd, &fst) != 0 || !S_ISREG(fst.st_mode))) {
+                close(job.srcfd);
+                job.srcfd = -1;
+                errno = EINVAL;
+            }
+            if (job.srcfd >= 0) {
+                fcntl(job.srcfd, F_SETFL, fcntl(job.srcfd, F_GETFL) & ~O_NONBLOCK);
+                st = fst;
+                job.dstfd = openat(dstfd, name, O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW | O_CLOEXEC, 0600);
+            }
+            if (job.dstfd == -1) {
+                perror_fail("%s: %s\n", npath.c_str());
+                if (job.srcfd >= 0)
+                    close(job.srcfd);
+                continue;
+            }
+            job.path = npath;
+            job.st = st;
+            push(std::move(job));
+            continue;
+        } else if (S_ISLNK(st.st_mode)) {
+            char lnk[PATH_MAX];
+            ssize_t l = readlinkat(srcfd, name, lnk, sizeof(lnk) - 1);
+            if (l >= 0)
+                lnk[l] = '\0';
+            r = l < 0 ? -1 : symlinkat(lnk, dstfd, name);
+        } else
+            // device nodes, FIFOs, sockets
+            r = mknodat(dstfd, name, st.st_mode & (S_IFMT | 07777), st.st_rdev);
+
+        if (r == 0 && !S_ISDIR(st.st_mode)) {
+            struct timespec ts[2] = { st.st_atim, st.st_mtim };
+            r = fchownat(dstfd, name, st.st_uid, st.st_gid, AT_SYMLINK_NOFOLLOW);
+            if (r == 0 && !S_ISLNK(st.st_mode))
+                r = fchmodat(dstfd, name, st.st_mode & 07777, 0);
+            if (r == 0)
+                r = utimensat(dstfd, name, ts, AT_SYMLINK_NOFOLLOW);
+        }
+        if (r != 0)
+            perror_fail("%s: %s\n", npath.c_str());
+    }
+    closedir(dir);
 }
 
-jailownerinfo::~jailownerinfo() {
-    delete[] argv;
+// If `srcfd` is the root of a btrfs subvolume, replace the empty
+// destination directory with a snapshot of it.
+static bool clone_snapshot(int srcfd, jaildirinfo& dst) {
+#if __linux__ && defined(BTRFS_IOC_SNAP_CREATE_V2)
+    struct statfs sfs;
+    struct stat st;
+    if (fstatfs(srcfd, &sfs) != 0
+        || sfs.f_type != BTRFS_SUPER_MAGIC
+        || fstat(srcfd, &st) != 0
+        || st.st_ino != BTRFS_FIRST_FREE_OBJECTID
+        || unlinkat(dst.parentfd, dst.component.c_str(), AT_REMOVEDIR) != 0)
+        return false;
+    struct btrfs_ioctl_vol_args_v2 args;
+    memset(&args, 0, sizeof(args));
+    args.fd = srcfd;
+    strncpy(args.name, dst.component.c_str(), sizeof(args.name) - 1);
+    if (ioctl(dst.parentfd, BTRFS_IOC_SNAP_CREATE_V2, &args) == 0)
+        return true;
+    if (mkdirat(dst.parentfd, dst.component.c_str(), 0700) != 0)
+        perror_die(dst.dir);
+#else
+    (void) srcfd, (void) dst;
+#endif
+    return false;
 }
 
-static bool check_shell(const char* shell) {
-    bool found = false;
-    char* sh;
-    while (!found && (sh = getusershell()))
-        found = strcmp(sh, shell) == 0;
-    endusershell();
-    return found;
+static int clone_command(jaildirinfo& src, jaildirinfo& dst) {
+    std::string srcdir = path_noendslash(src.dir);
+    std::string dstdir = path_noendslash(dst.dir);
+    if (verbose)
+        fprintf(verbosefile, "cp -a --reflink=auto %s/. %s\n",
+                srcdir.c_str(), dstdir.c_str());
+    if (dryrun)
+        return 0;
+
+    int srcfd = openat(src.parentfd, src.component.c_str(), O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    if (srcfd == -1)
+        perror_die(srcdir);
+    int dstfd = openat(dst.parentfd, dst.component.c_str(), O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    DIR* dir = dstfd == -1 ? nullptr : fdopendir(dstfd);
+    if (!dir)
+        perror_die(dstdir);
+    while (struct dirent* de = readdir(dir))
+        if (strcmp(de->d_name, ".") != 0 && strcmp(de->d_name, "..") != 0)
+            die("%s: Destination jail not empty\n", dstdir.c_str());
+    closedir(dir);
+
+    if (clone_snapshot(srcfd, dst)) {
+        close(srcfd);
+        return 0;
+    }
+    dstfd = openat(dst.parentfd, dst.component.c_str(), O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    if (dstfd == -1)
+        perror_die(dstdir);
+
+    // a jail with its own project quota gets one too, with the same limits
+    jailusage u;
+    if (jail_usage(srcfd, jail_project(srcfd), u))
+        assign_jail_project(dstfd, dst.dir, dst.permdir, u.bytes_limit, u.inodes_limit);
+
+    struct stat st;
+    if (fstat(srcfd, &st) != 0)
+        perror_die(srcdir);
+    cloneinfo ci;
+    ci.srcrootfd = srcfd;
+    ci.dstrootfd = dstfd;
+    ci.dev = st.st_dev;
+
+    long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+    std::vector<pthread_t> workers(std::max(1L, std::min(ncpu, 8L)));
+    for (auto& w : workers)
+        if (int e = pthread_create(&w, nullptr, cloneinfo::worker, &ci))
+            die("pthread_create: %s\n", strerror(e));
+    mode_t old_umask = umask(0);
+    ci.copy_tree(srcfd, dstfd, dst.dir, "");
+    umask(old_umask);
+    pthread_mutex_lock(&ci.mutex);
+    ci.done = true;
+    pthread_cond_broadcast(&ci.cond);
+    pthread_mutex_unlock(&ci.mutex);
+    for (auto& w : workers)
+        pthread_join(w, nullptr);
+
+    struct timespec ts[2] = { st.st_atim, st.st_mtim };
+    if (fchown(dstfd, st.st_uid, st.st_gid) != 0
+        || fchmod(dstfd, st.st_mode & 07777) != 0
+        || futimens(dstfd, ts) != 0)
+        perror_fail("%s: %s\n", dstdir.c_str());
+    close(srcfd);
+    close(dstfd);
+    return exit_value;
 }
 
-void jailownerinfo::init(const char* owner_name) {
-    if (strlen(owner_name) >= 1024)
-        die("%s: Username too long\n", owner_name);
 
-    struct passwd* pwnam = getpwnam(owner_name);
-    if (!pwnam)
-        die("%s: No such user\n", owner_name);
+// result cache
+//
+// A cacheable run is keyed by the SHA-1 of its manifest, command, user,
+// the options that can change its result (timeout, output filter, limits,
+// environment), input trees (the jail home directory and --chown-user
+// directories), and stdin. A hit replays the stored output and exit status
+// without running. Entries are `KEY.log` plus `KEY.status`; the status
+// file is renamed into place last, so its presence marks a complete entry.
+// A hit touches the status file, and storing an entry evicts the least
+// recently used entries once the directory exceeds --cache-size. The cache
+// directory is opened as the caller and entries are written as the caller.
+
+#define RUNCACHE_DEFAULT_SIZE ((off_t) 256 << 20)
+
+struct runcache {
+    int dirfd;
+    std::string key;
+    std::string tmpsuffix;
+    bool input_known;
+    bool input_seen;
+    int logfd;
+    off_t max_size;
+
+    runcache()
+        : dirfd(-1), input_known(false), input_seen(false), logfd(-1),
+          max_size(RUNCACHE_DEFAULT_SIZE) {
+    }
+    bool enabled() const {
+        return dirfd >= 0;
+    }
+    void open_dir(const std::string& dir);
+    void compute_key(const std::string& contents, const std::string& user,
+                     const std::string& command,
+                     const std::vector<std::string>& trees,
+                     const std::string& options,
+                     const std::string& extra, int inputfd);
+    // Copy a cached run's output to stdout, passing each piece written to
+    // `output`, and set `exit_status`. Returns false if there is no entry.
+    bool replay(int& exit_status,
+                const std::function<void(const char*, size_t)>& output);
+    void start();
+    void tee(const char* buf, size_t n);
+    void finish(int exit_status);
 
-    owner = pwnam->pw_uid;
-    group = pwnam->pw_gid;
-    if (strcmp(pwnam->pw_dir, "/") == 0)
-        owner_home = "/home/nobody";
-    else if (strncmp(pwnam->pw_dir, "/home/", 6) == 0)
-        owner_home = pwnam->pw_dir;
-    else
-        die("%s: Home directory %s not under /home\n", owner_name, pwnam->pw_dir);
+  private:
+    int openat_entry(const char* suffix);
+    void trim();
+    void hash_tree(sha1_context& ctx, int dirfd, const std::string& dirname);
+};
 
-    if (strcmp(pwnam->pw_shell, "/bin/bash") == 0
-        || strcmp(pwnam->pw_shell, "/bin/sh") == 0
-        || check_shell(pwnam->pw_shell))
-        owner_sh = pwnam->pw_shell;
-    else
-        die("%s: Shell %s not allowed by /etc/shells\n", owner_name, pwnam->pw_shell);
+static runcache run_cache;
 
-    if (owner == ROOT)
-        die("%s: Jail user cannot be root\n", owner_name);
+void runcache::open_dir(const std::string& dir) {
+    dirfd = open(dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dirfd == -1)
+        perror_die(dir);
 }
 
-#if __linux__
-extern "C" {
-static int exec_clone_function(void* arg) {
-    jailownerinfo* jailowner = static_cast<jailownerinfo*>(arg);
-    return jailowner->exec_go();
-}
-}
-#endif
+void runcache::hash_tree(sha1_context& ctx, int dirfd,
+                         const std::string& dirname) {
+    DIR* dir = fdopendir(dirfd);
+    if (!dir)
+        perror_die(dirname);
+    std::vector<std::string> names;
+    while (struct dirent* de = readdir(dir))
+        if (strcmp(de->d_name, ".") != 0 && strcmp(de->d_name, "..") != 0)
+            names.push_back(de->d_name);
+    std::sort(names.begin(), names.end());
 
-static void write_pid(int p) {
-    if (pidfd >= 0) {
-        lseek(pidfd, 0, SEEK_SET);
-        char buf[1024];
-        int l = sprintf(buf, "%d\n", p);
-        ssize_t w = write(pidfd, buf, l);
-        if (w != l || ftruncate(pidfd, l) != 0)
-            perror_die(pidfilename);
+    for (auto& name : names) {
+        std::string path = dirname + name;
+        struct stat st;
+        if (fstatat(dirfd, name.c_str(), &st, AT_SYMLINK_NOFOLLOW) != 0)
+            perror_die(path);
+        char hdr[64];
+        int hdrlen = sprintf(hdr, "%o %lld ", (unsigned) st.st_mode,
+                             S_ISREG(st.st_mode) ? (long long) st.st_size : 0LL);
+        ctx.update(hdr, hdrlen);
+        ctx.update(name.c_str(), name.length() + 1);
+        if (S_ISREG(st.st_mode)) {
+            int fd = openat(dirfd, name.c_str(), O_RDONLY | O_CLOEXEC | O_NOFOLLOW);
+            if (fd == -1)
+                perror_die(path);
+            char buf[32768];
+            ssize_t nr;
+            while ((nr = read(fd, buf, sizeof(buf))) > 0)
+                ctx.update(buf, nr);
+            if (nr == -1)
+                perror_die(path);
+            close(fd);
+        } else if (S_ISLNK(st.st_mode)) {
+            char lnkbuf[4096];
+            ssize_t nr = readlinkat(dirfd, name.c_str(), lnkbuf, sizeof(lnkbuf));
+            if (nr == -1)
+                perror_die(path);
+            ctx.update(lnkbuf, nr);
+        } else if (S_ISDIR(st.st_mode)) {
+            int subdirfd = openat(dirfd, name.c_str(), O_RDONLY | O_CLOEXEC | O_NOFOLLOW | O_DIRECTORY);
+            if (subdirfd == -1)
+                perror_die(path);
+            hash_tree(ctx, subdirfd, path + "/");
+        }
+        ctx.update("\n", 1);
     }
+    closedir(dir);
 }
 
-void jailownerinfo::exec(int argc, char** argv, jaildirinfo& jaildir,
-                         int inputfd, double timeout, bool foreground) {
-    // adjust environment; make sure we have a PATH
-    char homebuf[8192];
-    sprintf(homebuf, "HOME=%s", owner_home.c_str());
-    const char* path = "PATH=/usr/local/bin:/bin:/usr/bin";
-    const char* lang = "LANG=C";
-    const char* ld_library_path = NULL;
-    {
-        extern char** environ;
-        for (char** eptr = environ; *eptr; ++eptr)
-            if (strncmp(*eptr, "PATH=", 5) == 0)
-                path = *eptr;
-            else if (strncmp(*eptr, "LANG=", 5) == 0)
-                lang = *eptr;
-            else if (strncmp(*eptr, "LD_LIBRARY_PATH=", 16) == 0)
-                ld_library_path = *eptr;
+void runcache::compute_key(const std::string& contents,
+                           const std::string& user,
+                           const std::string& command,
+                           const std::vector<std::string>& trees,
+                           const std::string& options,
+                           const std::string& extra, int inputfd) {
+    sha1_context ctx;
+    ctx.update("pa-jail-runcache 2\n", 19);
+    ctx.update(user.c_str(), user.length() + 1);
+    ctx.update(command.c_str(), command.length() + 1);
+    ctx.update(options.c_str(), options.length() + 1);
+    ctx.update(extra.c_str(), extra.length() + 1);
+    ctx.update(contents.c_str(), contents.length() + 1);
+
+    for (auto& tree : trees) {
+        ctx.update(tree.c_str(), tree.length() + 1);
+        int fd = open(tree.c_str(), O_RDONLY | O_CLOEXEC | O_NOFOLLOW | O_DIRECTORY);
+        if (fd >= 0)
+            hash_tree(ctx, fd, path_endslash(tree));
+        else if (errno != ENOENT)
+            perror_die(tree);
     }
-    int newenvpos = 0;
-    newenv[newenvpos++] = path;
-    newenv[newenvpos++] = lang;
-    if (ld_library_path)
-        newenv[newenvpos++] = ld_library_path;
-    newenv[newenvpos++] = homebuf;
-    newenv[newenvpos++] = NULL;
 
-    // create command
-    delete[] this->argv;
-    this->argv = new char*[5 + argc - (optind + 2)];
-    if (!this->argv)
-        die("Out of memory\n");
-    int newargvpos = 0;
-    std::string command;
-    this->argv[newargvpos++] = (char*) owner_sh.c_str();
-    this->argv[newargvpos++] = (char*) "-l";
-    this->argv[newargvpos++] = (char*) "-c";
+    // stdin: a regular file or /dev/null is known in advance; otherwise
+    // the run is cached only if no input arrives
+    struct stat st;
+    if (fstat(inputfd, &st) != 0)
+        perror_die("stdin");
+    ctx.update("stdin\n", 6);
+    if (S_ISREG(st.st_mode)) {
+        off_t off = 0;
+        char buf[32768];
+        ssize_t nr;
+        while ((nr = pread(inputfd, buf, sizeof(buf), off)) > 0) {
+            ctx.update(buf, nr);
+            off += nr;
+        }
+        input_known = nr == 0;
+    } else if (S_ISCHR(st.st_mode) && st.st_rdev == makedev(1, 3))
+        input_known = true;
+    else if (isatty(inputfd)) {
+        // interactive runs are never cached
+        close(dirfd);
+        dirfd = -1;
+        return;
+    }
+
+    key = ctx.hexdigest();
+    char buf[64];
+    sprintf(buf, ".tmp%d", (int) getpid());
+    tmpsuffix = buf;
+}
+
+int runcache::openat_entry(const char* suffix) {
+    int fd = openat(dirfd, (key + suffix).c_str(),
+                    O_RDONLY | O_CLOEXEC | O_NOFOLLOW | O_NONBLOCK);
+    struct stat st;
+    if (fd >= 0
+        && (fstat(fd, &st) != 0
+            || !S_ISREG(st.st_mode)
+            || st.st_uid != caller_owner)) {
+        close(fd);
+        fd = -1;
+    }
+    return fd;
+}
+
+bool runcache::replay(int& exit_status,
+                      const std::function<void(const char*, size_t)>& output) {
+    if (!enabled() || dryrun)
+        return false;
+    int statusfd = openat_entry(".status");
+    if (statusfd == -1)
+        return false;
+    char buf[32768];
+    ssize_t nr = read(statusfd, buf, sizeof(buf) - 1);
+    close(statusfd);
+    if (nr <= 0 || (buf[nr] = 0, sscanf(buf, "%d", &exit_status) != 1))
+        return false;
+    int logfd = openat_entry(".log");
+    if (logfd == -1)
+        return false;
+
+    if (verbose)
+        fprintf(verbosefile, "cached %s\n", key.c_str());
+    // mark the entry recently used
+    (void) utimensat(dirfd, (key + ".status").c_str(), NULL, AT_SYMLINK_NOFOLLOW);
+    while ((nr = read(logfd, buf, sizeof(buf))) > 0) {
+        ssize_t off = 0;
+        while (off != nr) {
+            ssize_t nw = write(STDOUT_FILENO, buf + off, nr - off);
+            if (nw == -1 && errno != EINTR && errno != EAGAIN)
+                exit(125);
+            else if (nw > 0) {
+                output(buf + off, nw);
+                off += nw;
+            }
+        }
+    }
+    close(logfd);
+    return true;
+}
+
+void runcache::start() {
+    if (!enabled())
+        return;
+    logfd = openat(dirfd, (key + ".log" + tmpsuffix).c_str(),
+                   O_WRONLY | O_CLOEXEC | O_CREAT | O_TRUNC | O_NOFOLLOW, 0660);
+}
+
+void runcache::tee(const char* buf, size_t n) {
+    while (logfd >= 0 && n != 0) {
+        ssize_t nw = write(logfd, buf, n);
+        if (nw > 0)
+            buf += nw, n -= nw;
+        else if (nw == -1 && errno != EINTR) {
+            close(logfd);
+            logfd = -1;
+            unlinkat(dirfd, (key + ".log" + tmpsuffix).c_str(), 0);
+        }
+    }
+}
+
+void runcache::finish(int exit_status) {
+    if (logfd < 0)
+        return;
+    close(logfd);
+    logfd = -1;
+    std::string logtmp = key + ".log" + tmpsuffix;
+    // timeouts, kills, and runs that consumed unexpected input are not
+    // deterministic
+    if (exit_status >= 124 || (!input_known && input_seen)) {
+        unlinkat(dirfd, logtmp.c_str(), 0);
+        return;
+    }
+    std::string statustmp = key + ".status" + tmpsuffix;
+    int fd = openat(dirfd, statustmp.c_str(),
+                    O_WRONLY | O_CLOEXEC | O_CREAT | O_TRUNC | O_NOFOLLOW, 0660);
+    char buf[32];
+    int len = sprintf(buf, "%d\n", exit_status);
+    if (fd == -1
+        || write(fd, buf, len) != len
+        || renameat(dirfd, logtmp.c_str(), dirfd, (key + ".log").c_str()) != 0
+        || renameat(dirfd, statustmp.c_str(), dirfd, (key + ".status").c_str()) != 0) {
+        unlinkat(dirfd, logtmp.c_str(), 0);
+        unlinkat(dirfd, statustmp.c_str(), 0);
+    }
+    if (fd >= 0)
+        close(fd);
+    trim();
+}
+
+void runcache::trim() {
+    struct entry {
+        time_t used = 0;
+        off_t size = 0;
+        bool complete = false;
+    };
+    std::unordered_map<std::string, entry> entries;
+    off_t total = 0;
+    time_t now = time(NULL);
+
+    int fd = dup(dirfd);
+    DIR* dir = fd >= 0 ? fdopendir(fd) : nullptr;
+    if (!dir) {
+        if (fd >= 0)
+            close(fd);
+        return;
+    }
+    rewinddir(dir);
+    while (struct dirent* de = readdir(dir)) {
+        const char* dot = strchr(de->d_name, '.');
+        struct stat st;
+        if (!dot || dot == de->d_name
+            || fstatat(dirfd, de->d_name, &st, AT_SYMLINK_NOFOLLOW) != 0
+            || !S_ISREG(st.st_mode))
+            continue;
+        // temporary files left by runs that died
+        if (strstr(dot, ".tmp")) {
+            if (st.st_mtime < now - 86400)
+                unlinkat(dirfd, de->d_name, 0);
+            continue;
+        }
+        entry& e = entries[std::string(de->d_name, dot - de->d_name)];
+        e.size += st.st_blocks * 512;
+        total += st.st_blocks * 512;
+        if (strcmp(dot, ".status") == 0) {
+            e.used = st.st_mtime;
+            e.complete = true;
+        }
+    }
+    closedir(dir);
+    if (total <= max_size)
+        return;
+
+    // evict down to 90% of the cap, least recently used first
+    std::vector<std::pair<time_t, std::string>> order;
+    for (auto& it : entries)
+        order.push_back(std::make_pair(it.second.complete ? it.second.used : 0,
+                                       it.first));
+    std::sort(order.begin(), order.end());
+    off_t goal = max_size - max_size / 10;
+    for (auto& o : order) {
+        if (total <= goal)
+            break;
+        // remove the status first, so a concurrent replay never sees a
+        // status without its log
+        unlinkat(dirfd, (o.second + ".status").c_str(), 0);
+        unlinkat(dirfd, (o.second + ".log").c_str(), 0);
+        total -= entries[o.second].size;
+    }
+}
+
+
+// host-wide run scheduler
+//
+// When /etc/pa-jail.conf says `maxruns N`, runs coordinate through a
+// shared-memory table in /run/pa-jail. A run takes a slot, waits until
+// fewer than N runs are active and no fairer run is waiting, then runs at
+// the nice and I/O priority for its class. Among waiters, interactive runs
+// go first, then runs whose user, and then whose group (usually the pset),
+// has the fewest active runs, then the oldest. Each slot is guarded by an
+// OFD lock on one byte of the table file, so slots of processes that died
+// are reclaimed. `pa-jail sched` prints the table.
+
+#define SCHED_FILE "/run/pa-jail/sched"
+#define SCHED_MAGIC 0x7061736BU
+#define SCHED_NSLOTS 512
+
+enum { sched_free = 0, sched_waiting = 1, sched_running = 2 };
+enum { sched_interactive = 0, sched_batch = 1, sched_nclasses };
+static const char* const sched_class_names[] = { "interactive", "batch" };
+static const int sched_class_nice[] = { 0, 10 };
+static const int sched_class_ioprio[] = { 4, 7 }; // best-effort levels
+
+struct sched_slot {
+    int state;
+    int rclass;
+    uint64_t seq;
+    uid_t uid;
+    char group[64];
+    char jail[128];
+    struct timespec enqueued;
+    struct timespec started;
+};
+
+struct sched_table {
+    uint32_t magic;
+    uint32_t nslots;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    int maxruns;
+    uint64_t seq;
+    uint64_t admitted[sched_nclasses];
+    double total_wait[sched_nclasses];
+    double max_wait[sched_nclasses];
+    sched_slot slots[SCHED_NSLOTS];
+};
+
+struct runsched {
+    int fd = -1;
+    sched_table* t = nullptr;
+    int slot = -1;
+    int rclass = sched_interactive;
+    std::string group;
+
+    bool open(int maxruns);
+    bool enabled() const {
+        return t != nullptr;
+    }
+    double admit(const std::string& jail);
+    void release();
+    int status();
+
+  private:
+    void lock();
+    bool slot_alive(int i);
+    void reap();
+    bool fairest(int i);
+};
+
+static runsched run_sched;
+
+static double timespec_diff(const struct timespec& a, const struct timespec& b) {
+    return (a.tv_sec - b.tv_sec) + (a.tv_nsec - b.tv_nsec) / 1e9;
+}
+
+bool runsched::open(int maxruns) {
+    if (mkdir("/run/pa-jail", 0700) != 0 && errno != EEXIST)
+        return perror_fail("%s: %s\n", "/run/pa-jail"), false;
+    fd = ::open(SCHED_FILE, O_RDWR | O_CREAT | O_CLOEXEC | O_NOFOLLOW, 0600);
+    struct stat st;
+    if (fd == -1 || flock(fd, LOCK_EX) != 0 || fstat(fd, &st) != 0)
+        return perror_fail("%s: %s\n", SCHED_FILE), false;
+    if (st.st_size != sizeof(sched_table)
+        && ftruncate(fd, sizeof(sched_table)) != 0)
+        return perror_fail("%s: %s\n", SCHED_FILE), false;
+    void* m = mmap(nullptr, sizeof(sched_table), PROT_READ | PROT_WRITE,
+                   MAP_SHARED, fd, 0);
+    if (m == MAP_FAILED)
+        return perror_fail("%s: %s\n", SCHED_FILE), false;
+    t = static_cast<sched_table*>(m);
+
+    // initialize a new table under the file lock
+    if (t->magic != SCHED_MAGIC || t->nslots != SCHED_NSLOTS) {
+        memset(t, 0, sizeof(*t));
+        pthread_mutexattr_t ma;
+        pthread_mutexattr_init(&ma);
+        pthread_mutexattr_setpshared(&ma, PTHREAD_PROCESS_SHARED);
+        pthread_mutexattr_setrobust(&ma, PTHREAD_MUTEX_ROBUST);
+        pthread_mutex_init(&t->mutex, &ma);
+        pthread_mutexattr_destroy(&ma);
+        pthread_condattr_t ca;
+        pthread_condattr_init(&ca);
+        pthread_condattr_setpshared(&ca, PTHREAD_PROCESS_SHARED);
+        pthread_condattr_setclock(&ca, CLOCK_MONOTONIC);
+        pthread_cond_init(&t->cond, &ca);
+        pthread_condattr_destroy(&ca);
+        t->nslots = SCHED_NSLOTS;
+        t->magic = SCHED_MAGIC;
+    }
+    t->maxruns = maxruns;
+    flock(fd, LOCK_UN);
+    return true;
+}
+
+void runsched::lock() {
+    if (pthread_mutex_lock(&t->mutex) == EOWNERDEAD)
+        pthread_mutex_consistent(&t->mutex);
+}
+
+bool runsched::slot_alive(int i) {
+    struct flock fl;
+    memset(&fl, 0, sizeof(fl));
+    fl.l_type = F_WRLCK;
+    fl.l_whence = SEEK_SET;
+    fl.l_start = i;
+    fl.l_len = 1;
+    return i == slot
+        || (fcntl(fd, F_OFD_GETLK, &fl) == 0 && fl.l_type != F_UNLCK);
+}
+
+void runsched::reap() {
+    for (int i = 0; i != SCHED_NSLOTS; ++i)
+        if (t->slots[i].state != sched_free && !slot_alive(i))
+            t->slots[i].state = sched_free;
+}
+
+bool runsched::fairest(int i) {
+    std::vector<const sched_slot*> running;
+    for (int j = 0; j != SCHED_NSLOTS; ++j)
+        if (t->slots[j].state == sched_running)
+            running.push_back(&t->slots[j]);
+    if ((int) running.size() >= t->maxruns)
+        return false;
+
+    // fewer active runs for the same user, then group, go first
+    auto rank = [&](const sched_slot& s) {
+        int ur = 0, gr = 0;
+        for (auto r : running) {
+            ur += r->uid == s.uid;
+            gr += strcmp(r->group, s.group) == 0;
+        }
+        return std::make_pair(ur, gr);
+    };
+    const sched_slot& me = t->slots[i];
+    auto merank = rank(me);
+    for (int j = 0; j != SCHED_NSLOTS; ++j) {
+        const sched_slot& s = t->slots[j];
+        if (j == i || s.state != sched_waiting)
+            continue;
+        if (s.rclass != me.rclass) {
+            if (s.rclass < me.rclass)
+                return false;
+            continue;
+        }
+        auto srank = rank(s);
+        if (srank < merank || (srank == merank && s.seq < me.seq))
+            return false;
+    }
+    return true;
+}
+
+// Wait for admission. Returns the number of seconds waited.
+double runsched::admit(const std::string& jail) {
+    lock();
+    reap();
+    for (int i = 0; i != SCHED_NSLOTS && slot < 0; ++i) {
+        struct flock fl;
+        memset(&fl, 0, sizeof(fl));
+        fl.l_type = F_WRLCK;
+        fl.l_whence = SEEK_SET;
+        fl.l_start = i;
+        fl.l_len = 1;
+        if (t->slots[i].state == sched_free
+            && fcntl(fd, F_OFD_SETLK, &fl) == 0)
+            slot = i;
+    }
+    if (slot < 0) {
+        // table full: run unscheduled rather than fail
+        pthread_mutex_unlock(&t->mutex);
+        return 0;
+    }
+
+    sched_slot& s = t->slots[slot];
+    memset(&s, 0, sizeof(s));
+    s.rclass = rclass;
+    s.seq = ++t->seq;
+    s.uid = caller_owner;
+    snprintf(s.group, sizeof(s.group), "%s", group.c_str());
+    snprintf(s.jail, sizeof(s.jail), "%s", jail.c_str());
+    clock_gettime(CLOCK_MONOTONIC, &s.enqueued);
+    s.state = sched_waiting;
+
+    while (!fairest(slot)) {
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        ++ts.tv_sec;            // recheck for dead runs every second
+        if (pthread_cond_timedwait(&t->cond, &t->mutex, &ts) == EOWNERDEAD)
+            pthread_mutex_consistent(&t->mutex);
+        reap();
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &s.started);
+    s.state = sched_running;
+    double wait = timespec_diff(s.started, s.enqueued);
+    ++t->admitted[rclass];
+    t->total_wait[rclass] += wait;
+    t->max_wait[rclass] = std::max(t->max_wait[rclass], wait);
+    pthread_cond_broadcast(&t->cond);
+    pthread_mutex_unlock(&t->mutex);
+
+    // apply class priorities, inherited by the jailed command
+    if (setpriority(PRIO_PROCESS, 0, sched_class_nice[rclass]) != 0)
+        perror_fail("%s: %s\n", "setpriority");
+#ifdef SYS_ioprio_set
+    syscall(SYS_ioprio_set, 1 /* IOPRIO_WHO_PROCESS */, 0,
+            (2 /* IOPRIO_CLASS_BE */ << 13) | sched_class_ioprio[rclass]);
+#endif
+    return wait;
+}
+
+void runsched::release() {
+    if (!t || slot < 0)
+        return;
+    lock();
+    t->slots[slot].state = sched_free;
+    pthread_cond_broadcast(&t->cond);
+    pthread_mutex_unlock(&t->mutex);
+    struct flock fl;
+    memset(&fl, 0, sizeof(fl));
+    fl.l_type = F_UNLCK;
+    fl.l_whence = SEEK_SET;
+    fl.l_start = slot;
+    fl.l_len = 1;
+    fcntl(fd, F_OFD_SETLK, &fl);
+    slot = -1;
+}
+
+int runsched::status() {
+    lock();
+    reap();
+    sched_table copy;
+    memcpy(&copy, t, sizeof(copy));
+    pthread_mutex_unlock(&t->mutex);
+
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    int nrunning = 0, nwaiting = 0;
+    std::vector<const sched_slot*> slots;
+    for (int i = 0; i != SCHED_NSLOTS; ++i)
+        if (copy.slots[i].state != sched_free) {
+            slots.push_back(&copy.slots[i]);
+            nrunning += copy.slots[i].state == sched_running;
+            nwaiting += copy.slots[i].state == sched_waiting;
+        }
+    std::sort(slots.begin(), slots.end(),
+              [](const sched_slot* a, const sched_slot* b) {
+                  return a->seq < b->seq;
+              });
+
+    printf("maxruns %d\nrunning %d\nwaiting %d\n",
+           copy.maxruns, nrunning, nwaiting);
+    for (int c = 0; c != sched_nclasses; ++c)
+        printf("%s admitted %llu mean_wait %.3f max_wait %.3f\n",
+               sched_class_names[c], (unsigned long long) copy.admitted[c],
+               copy.admitted[c] ? copy.total_wait[c] / copy.admitted[c] : 0.0,
+               copy.max_wait[c]);
+    for (auto s : slots) {
+        double age = timespec_diff(now, s->state == sched_running ? s->started : s->enqueued);
+        printf("%s\t%s\t%.3f\t%s\t%s\t%s\n",
+               s->state == sched_running ? "running" : "waiting",
+               sched_class_names[s->rclass], age, uid_to_name(s->uid),
+               s->group[0] ? s->group : "-", s->jail);
+    }
+    return 0;
+}
+
+// output sanitizer
+//
+// `--sanitize MODE` filters command output in the relay, before it reaches
+// the log. `utf8` replaces invalid UTF-8 with U+FFFD; `sgr` also removes
+// control characters other than tab, newline, carriage return, and
+// backspace, plus every escape sequence except SGR (colors); `text` removes
+// SGR too. Sequences and characters split across reads are handled. Runs
+// of printable ASCII, the common case, are found 16 bytes at a time with
+// SSE2 and copied unchanged.
+
+enum sanitize_mode {
+    sanitize_raw, sanitize_utf8, sanitize_sgr, sanitize_text
+};
+
+class outfilter {
+  public:
+    sanitize_mode mode = sanitize_raw;
+
+    // Filter `n` bytes from `in` into `out`, which must have room for
+    // max_output(`n`) bytes. Returns the number of bytes written.
+    size_t run(const char* in, size_t n, char* out);
+    // Flush an incomplete UTF-8 character at end of input.
+    size_t finish(char* out);
+    // Bound on the output of run(`n`) followed by finish(). A byte makes
+    // at most 3 bytes, except that a held CSI sequence or partial UTF-8
+    // character from an earlier call can be released along with it.
+    static size_t max_output(size_t n) {
+        return 3 * n + seq_max + 4;
+    }
+
+  private:
+    enum { s_ground, s_esc, s_csi, s_string, s_string_esc };
+    enum { seq_max = 64 };
+    int state = s_ground;
+    unsigned char utf8[4];      // partial UTF-8 character
+    int utf8_len = 0;
+    int utf8_need = 0;
+    char seq[seq_max];          // pending CSI sequence (`sgr` mode)
+    int seq_len = 0;
+
+    bool keep_escapes() const {
+        return mode == sanitize_utf8;
+    }
+    size_t byte(unsigned char ch, char* out);
+    size_t codepoint(uint32_t cp, char* out);
+};
+
+static inline size_t plain_prefix(const unsigned char* s, size_t n) {
+    size_t i = 0;
+#if defined(__SSE2__)
+    const __m128i lo = _mm_set1_epi8(0x1F), del = _mm_set1_epi8(0x7F);
+    const __m128i nl = _mm_set1_epi8('\n'), cr = _mm_set1_epi8('\r'),
+        tab = _mm_set1_epi8('\t');
+    for (; i + 16 <= n; i += 16) {
+        __m128i x = _mm_loadu_si128((const __m128i*) (s + i));
+        // bytes >= 0x80 are negative, so "<= 0x1F" catches them too
+        __m128i special = _mm_or_si128(_mm_cmpgt_epi8(lo, x) /* < 0x1F */,
+                                       _mm_or_si128(_mm_cmpeq_epi8(x, lo),
+                                                    _mm_cmpeq_epi8(x, del)));
+        __m128i ok = _mm_or_si128(_mm_cmpeq_epi8(x, nl),
+                                  _mm_or_si128(_mm_cmpeq_epi8(x, cr),
+                                               _mm_cmpeq_epi8(x, tab)));
+        unsigned mask = _mm_movemask_epi8(_mm_andnot_si128(ok, special));
+        if (mask)
+            return i + __builtin_ctz(mask);
+    }
+#endif
+    for (; i != n; ++i) {
+        unsigned char ch = s[i];
+        if ((ch < 0x20 && ch != '\n' && ch != '\r' && ch != '\t')
+            || ch >= 0x7F)
+            break;
+    }
+    return i;
+}
+
+size_t outfilter::run(const char* in, size_t n, char* out) {
+    const unsigned char* s = (const unsigned char*) in;
+    char* o = out;
+    size_t i = 0;
+    while (i != n) {
+        if (state == s_ground && utf8_need == 0) {
+            size_t k = plain_prefix(s + i, n - i);
+            memcpy(o, s + i, k);
+            o += k;
+            i += k;
+            if (i == n)
+                break;
+        }
+        o += byte(s[i], o);
+        ++i;
+    }
+    return o - out;
+}
+
+size_t outfilter::finish(char* out) {
+    size_t n = 0;
+    if (utf8_need) {
+        utf8_need = utf8_len = 0;
+        n = codepoint(0xFFFD, out);
+    }
+    return n;
+}
+
+size_t outfilter::codepoint(uint32_t cp, char* out) {
+    if (cp < 0x80) {
+        out[0] = cp;
+        return 1;
+    } else if (cp < 0x800) {
+        out[0] = 0xC0 | (cp >> 6);
+        out[1] = 0x80 | (cp & 0x3F);
+        return 2;
+    } else if (cp < 0x10000) {
+        out[0] = 0xE0 | (cp >> 12);
+        out[1] = 0x80 | ((cp >> 6) & 0x3F);
+        out[2] = 0x80 | (cp & 0x3F);
+        return 3;
+    } else {
+        out[0] = 0xF0 | (cp >> 18);
+        out[1] = 0x80 | ((cp >> 12) & 0x3F);
+        out[2] = 0x80 | ((cp >> 6) & 0x3F);
+        out[3] = 0x80 | (cp & 0x3F);
+        return 4;
+    }
+}
+
+size_t outfilter::byte(unsigned char ch, char* out) {
+    size_t n = 0;
+
+    // continue a UTF-8 character
+    if (utf8_need) {
+        // reject overlong forms, surrogates, and values above U+10FFFF
+        // at the second byte, as a validating decoder would
+        bool ok = (ch & 0xC0) == 0x80;
+        if (ok && utf8_len == 1) {
+            unsigned char b0 = utf8[0];
+            ok = !((b0 == 0xE0 && ch < 0xA0) || (b0 == 0xED && ch > 0x9F)
+                   || (b0 == 0xF0 && ch < 0x90) || (b0 == 0xF4 && ch > 0x8F));
+        }
+        if (ok) {
+            utf8[utf8_len++] = ch;
+            if (--utf8_need == 0) {
+                uint32_t cp = utf8[0] & (0x7F >> utf8_len);
+                for (int i = 1; i < utf8_len; ++i)
+                    cp = (cp << 6) | (utf8[i] & 0x3F);
+                utf8_len = 0;
+                // C1 controls are control characters too
+                if (cp < 0xA0 && !keep_escapes())
+                    return 0;
+                return codepoint(cp, out);
+            }
+            return 0;
+        }
+        utf8_need = utf8_len = 0;
+        n = codepoint(0xFFFD, out);
+    }
+
+    switch (state) {
+    case s_ground:
+        if (ch >= 0xC2 && ch <= 0xF4) {
+            utf8[0] = ch;
+            utf8_len = 1;
+            utf8_need = ch < 0xE0 ? 1 : ch < 0xF0 ? 2 : 3;
+        } else if (ch >= 0x80)
+            n += codepoint(0xFFFD, out + n);
+        else if (keep_escapes() || ch == '\b' || ch == '\t' || ch == '\n'
+                 || ch == '\r' || (ch >= 0x20 && ch < 0x7F))
+            out[n++] = ch;
+        else if (ch == 0x1B)
+            state = s_esc;
+        break;
+    case s_esc:
+        if (ch == '[') {
+            seq[0] = 0x1B;
+            seq[1] = '[';
+            seq_len = 2;
+            state = s_csi;
+        } else if (ch == ']' || ch == 'P' || ch == 'X' || ch == '^' || ch == '_')
+            state = s_string;
+        else if (ch < 0x20 || ch > 0x2F)
+            state = ch == 0x1B ? s_esc : s_ground;
+        break;
+    case s_csi:
+        if (ch >= 0x40 && ch <= 0x7E) {
+            // keep well-formed SGR sequences in `sgr` mode
+            if (ch == 'm' && mode == sanitize_sgr && seq_len > 0) {
+                bool ok = true;
+                for (int i = 2; i < seq_len; ++i)
+                    ok = ok && ((seq[i] >= '0' && seq[i] <= '9')
+                                || seq[i] == ';' || seq[i] == ':');
+                if (ok) {
+                    memcpy(out + n, seq, seq_len);
+                    n += seq_len;
+                    out[n++] = 'm';
+                }
+            }
+            state = s_ground;
+        } else if (ch >= 0x20 && ch <= 0x3F) {
+            if (seq_len > 0 && seq_len < (int) sizeof(seq))
+                seq[seq_len++] = ch;
+            else
+                seq_len = 0;    // too long: drop it
+        } else
+            state = ch == 0x1B ? s_esc : s_ground;
+        break;
+    case s_string:
+        if (ch == 0x07)
+            state = s_ground;
+        else if (ch == 0x1B)
+            state = s_string_esc;
+        break;
+    case s_string_esc:
+        state = ch == 0x1B ? s_string_esc : s_ground;
+        break;
+    }
+    return n;
+}
+
+
+// Scan input for the kill sequence ESC ^C, which may span reads: `esc`
+// records whether the previous read ended with ESC.
+static bool scan_kill_sequence(const char* s, size_t n, bool& esc) {
+    if (n == 0)
+        return false;
+    if (esc && s[0] == '\x03')
+        return true;
+    for (const char* e = s, *end = s + n;
+         (e = (const char*) memchr(e, '\x1b', end - e)) && e + 1 < end; ++e)
+        if (e[1] == '\x03')
+            return true;
+    esc = s[n - 1] == '\x1b';
+    return false;
+}
+
+static outfilter output_filter;
+
+// expected output comparison
+//
+// `--expect FILE` compares the command's output, as it arrives, against
+// FILE and writes a verdict to the `--verdict` file at exit. Both sides
+// are normalized first according to `--expect-ws`: `exact` compares bytes,
+// except that CRLF counts as LF (the pty turns output newlines into CRLF);
+// `trailing` (the default) ignores whitespace at ends of lines and blank
+// lines at the end; `all` treats any run of whitespace as one space and
+// ignores leading and trailing whitespace. `--expect-stop` kills the
+// command at the first difference. The verdict is JSON; on a mismatch it
+// gives the position in the normalized output and up to
+// `expect_context` bytes of each side around it, cut at character
+// boundaries, with invalid UTF-8 replaced by U+FFFD.
+
+enum expect_ws_mode {
+    expect_ws_exact, expect_ws_trailing, expect_ws_all
+};
+
+static const size_t expect_context = 160;
+
+class expectnorm {
+  public:
+    expect_ws_mode mode = expect_ws_trailing;
+
+    void feed(const char* s, size_t n, std::string& out);
+    // Flush a carriage return held at the end of input.
+    void finish(std::string& out);
+
+  private:
+    std::string pending_ws;
+    size_t pending_nl = 0;
+    bool any = false;
+    bool pending_cr = false;
+};
+
+void expectnorm::feed(const char* s, size_t n, std::string& out) {
+    if (mode == expect_ws_exact) {
+        for (const char* end = s + n; s != end; ++s) {
+            if (pending_cr && *s != '\n')
+                out.push_back('\r');
+            pending_cr = *s == '\r';
+            if (!pending_cr)
+                out.push_back(*s);
+        }
+        return;
+    }
+    for (const char* end = s + n; s != end; ++s) {
+        char ch = *s;
+        bool ws = ch == ' ' || ch == '\t' || ch == '\r' || ch == '\n'
+            || ch == '\v' || ch == '\f';
+        if (mode == expect_ws_all) {
+            if (ws)
+                pending_nl = 1;
+            else {
+                if (pending_nl && any)
+                    out.push_back(' ');
+                pending_nl = 0;
+                any = true;
+                out.push_back(ch);
+            }
+        } else if (ch == '\n') {
+            pending_ws.clear();
+            ++pending_nl;
+        } else if (ws)
+            pending_ws.push_back(ch);
+        else {
+            out.append(pending_nl, '\n');
+            out.append(pending_ws);
+            pending_nl = 0;
+            pending_ws.clear();
+            out.push_back(ch);
+        }
+    }
+}
+
+void expectnorm::finish(std::string& out) {
+    if (pending_cr)
+        out.push_back('\r');
+    pending_cr = false;
+}
+
+class expectcmp {
+  public:
+    expectnorm norm;
+    bool stop = false;
+
+    bool enabled() const {
+        return verdictfd >= 0;
+    }
+    void open(const std::string& expectfile, const std::string& verdictfile);
+    // Compare more output. Returns false if `--expect-stop` should stop
+    // the command.
+    bool feed(const char* s, size_t n);
+    void finish();
+
+  private:
+    int verdictfd = -1;
+    std::string expected;       // normalized
+    std::string actual;         // normalized output not yet compared
+    size_t pos = 0;             // normalized bytes that matched
+    std::string before;         // up to `expect_context` bytes before `pos`
+    bool mismatch = false;
+    std::string after;          // actual output from the mismatch on
+    size_t actual_length = 0;
+    bool stopped = false;
+
+    void compare();
+};
+
+void expectcmp::open(const std::string& expectfile, const std::string& verdictfile) {
+    int fd = ::open(expectfile.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd == -1)
+        perror_die(expectfile);
+    std::string raw;
+    char buf[8192];
+    ssize_t nr;
+    while ((nr = read(fd, buf, sizeof(buf))) > 0)
+        raw.append(buf, nr);
+    if (nr == -1)
+        perror_die(expectfile);
+    close(fd);
+    norm.feed(raw.data(), raw.length(), expected);
+    norm.finish(expected);
+    expect_ws_mode mode = norm.mode;
+    norm = expectnorm();
+    norm.mode = mode;
+
+    verdictfd = ::open(verdictfile.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+    if (verdictfd == -1)
+        perror_die(verdictfile);
+}
+
+bool expectcmp::feed(const char* s, size_t n) {
+    if (verdictfd < 0)
+        return true;
+    norm.feed(s, n, actual);
+    compare();
+    return !stopped;
+}
+
+void expectcmp::compare() {
+    actual_length += actual.length();
+    if (mismatch) {
+        after.append(actual, 0, expect_context - std::min(after.length(), expect_context));
+        actual.clear();
+        return;
+    }
+
+    // compare as much as possible
+    size_t k = 0, m = std::min(actual.length(), expected.length() - pos);
+    while (k != m && actual[k] == expected[pos + k])
+        ++k;
+    if (k != actual.length()) {
+        mismatch = true;
+        after = actual.substr(k, expect_context);
+    }
+    before.append(actual, 0, k);
+    if (before.length() > expect_context)
+        before.erase(0, before.length() - expect_context);
+    pos += k;
+    actual.clear();
+    stopped = mismatch && stop;
+}
+
+// Return the length of the valid UTF-8 character at `s`, or 0.
+static size_t utf8_char_length(const unsigned char* s, size_t n) {
+    if (s[0] < 0x80)
+        return 1;
+    size_t len = s[0] < 0xC2 ? 0 : s[0] < 0xE0 ? 2 : s[0] < 0xF0 ? 3
+        : s[0] < 0xF5 ? 4 : 0;
+    if (len == 0 || len > n)
+        return 0;
+    for (size_t i = 1; i != len; ++i)
+        if ((s[i] & 0xC0) != 0x80)
+            return 0;
+    // overlong forms, surrogates, and values above U+10FFFF
+    if ((s[0] == 0xE0 && s[1] < 0xA0) || (s[0] == 0xED && s[1] > 0x9F)
+        || (s[0] == 0xF0 && s[1] < 0x90) || (s[0] == 0xF4 && s[1] > 0x8F))
+        return 0;
+    return len;
+}
+
+// Return `len` or less, so that `s.substr(0, len)` does not end in the
+// middle of a UTF-8 character.
+static size_t utf8_cut(const std::string& s, size_t len) {
+    len = std::min(len, s.length());
+    size_t p = len;
+    while (p != 0 && len - p < 3 && (s[p - 1] & 0xC0) == 0x80)
+        --p;
+    if (p != 0 && (unsigned char) s[p - 1] >= 0xC0
+        && utf8_char_length((const unsigned char*) &s[p - 1], len - p + 1) == 0)
+        return p - 1;
+    return len;
+}
+
+static void json_append_string(std::string& out, const std::string& s) {
+    out.push_back('"');
+    const unsigned char* p = (const unsigned char*) s.data();
+    const unsigned char* end = p + s.length();
+    for (; p != end; ++p) {
+        unsigned char ch = *p;
+        if (ch == '"' || ch == '\\') {
+            out.push_back('\\');
+            out.push_back(ch);
+        } else if (ch == '\n')
+            out += "\\n";
+        else if (ch == '\t')
+            out += "\\t";
+        else if (ch < 0x20 || ch == 0x7F) {
+            char buf[8];
+            sprintf(buf, "\\u%04x", ch);
+            out += buf;
+        } else if (ch < 0x80)
+            out.push_back(ch);
+        else if (size_t len = utf8_char_length(p, end - p)) {
+            out.append((const char*) p, len);
+            p += len - 1;
+        } else
+            out += "\\ufffd";
+    }
+    out.push_back('"');
+}
+
+void expectcmp::finish() {
+    if (verdictfd < 0)
+        return;
+    norm.finish(actual);
+    compare();
+    // output that ended early is a mismatch too
+    bool match = !mismatch && pos == expected.length();
+    static const char* const mode_names[] = {"exact", "trailing", "all"};
+    char buf[256];
+    sprintf(buf, "{\"match\":%s,\"whitespace\":\"%s\",\"expected_length\":%zu,\"actual_length\":%zu",
+            match ? "true" : "false", mode_names[norm.mode],
+            expected.length(), actual_length);
+    std::string out = buf;
+    if (!match) {
+        size_t line = 1 + std::count(expected.begin(), expected.begin() + pos, '\n');
+        size_t linestart = expected.rfind('\n', pos ? pos - 1 : 0);
+        linestart = linestart == std::string::npos || !pos ? 0 : linestart + 1;
+        sprintf(buf, ",\"offset\":%zu,\"line\":%zu,\"column\":%zu,\"stopped\":%s",
+                pos, line, pos - linestart + 1, stopped ? "true" : "false");
+        out += buf;
+        // context cut at `expect_context` bytes starts and ends on
+        // character boundaries
+        size_t bskip = 0;
+        while (before.length() == expect_context && bskip < 3
+               && (before[bskip] & 0xC0) == 0x80)
+            ++bskip;
+        std::string exp = expected.substr(pos, expect_context);
+        if (exp.length() == expect_context)
+            exp.erase(utf8_cut(exp, exp.length()));
+        std::string act = after;
+        if (act.length() == expect_context)
+            act.erase(utf8_cut(act, act.length()));
+        out += ",\"before\":";
+        json_append_string(out, before.substr(bskip));
+        out += ",\"expected\":";
+        json_append_string(out, exp);
+        out += ",\"actual\":";
+        json_append_string(out, act);
+    }
+    out += "}\n";
+    if (write(verdictfd, out.data(), out.length()) != (ssize_t) out.length())
+        perror_fail("%s: %s\n", "verdict");
+    close(verdictfd);
+    verdictfd = -1;
+}
+
+static expectcmp run_expect;
+
+// terminal screen model
+//
+// `--screen FILE` keeps a VT100/xterm-style model of the 80x24 pty screen
+// plus up to `screen_scrollback_max` lines of scrollback, fed the same
+// bytes that go to the log. While output changes, a snapshot is written
+// to FILE at most once per second and again at exit (via rename, so
+// readers never see a partial file). The snapshot is JSON: `offset` is
+// the log offset it reflects, and each screen and scrollback line is text
+// with SGR sequences for colors and attributes. A client that joins late
+// renders the snapshot and then the log from `offset`. The model handles
+// cursor movement, erasing, insert/delete, scroll regions, SGR, and the
+// alternate screen; other sequences are parsed and ignored. Line feed
+// also returns the cursor, as the pty does no output processing. Every
+// character is one column wide.
+
+static const size_t screen_scrollback_max = 1000;
+
+class vtscreen {
+  public:
+    vtscreen(int rows, int cols);
+    bool enabled() const {
+        return dirfd >= 0;
+    }
+    bool dirty() const {
+        return dirfd >= 0 && changed;
+    }
+    void open(const std::string& path);
+    void feed(const char* s, size_t n);
+    void snapshot(off_t offset);
+    void maybe_snapshot(off_t offset);
+
+  private:
+    enum {
+        a_fgshift = 0, a_bgshift = 9, a_colormask = 0x1FF,
+        a_bold = 1 << 18, a_faint = 1 << 19, a_italic = 1 << 20,
+        a_underline = 1 << 21, a_blink = 1 << 22, a_inverse = 1 << 23
+    };
+    enum { s_ground, s_esc, s_csi, s_string, s_string_esc, s_charset };
+    struct cell {
+        uint32_t ch;
+        uint32_t attr;
+    };
+    typedef std::vector<cell> line;
+
+    int rows;
+    int cols;
+    std::vector<line> lines;
+    std::vector<line> saved_main;
+    std::deque<line> scrollback;
+    int cr = 0;
+    int cc = 0;
+    bool wrap_pending = false;
+    uint32_t attr = 0;
+    int top = 0;
+    int bottom;
+    int saved_cr = 0;
+    int saved_cc = 0;
+    uint32_t saved_attr = 0;
+    int state = s_ground;
+    std::string params;
+    uint32_t utf8_cp = 0;
+    int utf8_need = 0;
+    bool changed = false;
+    struct timeval last_snapshot = {0, 0};
+    int dirfd = -1;
+    std::string name;
+
+    line blank_line() const {
+        return line(cols, cell{' ', 0});
+    }
+    void put(uint32_t ch);
+    void control(unsigned char ch);
+    void escape(unsigned char ch);
+    void csi(unsigned char final);
+    void sgr(const std::vector<int>& p);
+    void linefeed();
+    void reverse_index();
+    void scroll_up(int t, int b, int n, bool save);
+    void scroll_down(int t, int b, int n);
+    void erase(int r, int c1, int c2);
+    void set_alternate(bool on);
+    void reset();
+    void render(std::string& out, const line& l) const;
+};
+
+vtscreen::vtscreen(int rows, int cols)
+    : rows(rows), cols(cols), lines(rows, line(cols, cell{' ', 0})),
+      bottom(rows - 1) {
+}
+
+void vtscreen::open(const std::string& path) {
+    size_t slash = path.rfind('/');
+    std::string dir = slash == std::string::npos ? "." : path.substr(0, slash + 1);
+    name = slash == std::string::npos ? path : path.substr(slash + 1);
+    if (name.empty())
+        die("%s: Bad screen file name\n", path.c_str());
+    dirfd = ::open(dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dirfd == -1)
+        perror_die(dir);
+}
+
+void vtscreen::feed(const char* s, size_t n) {
+    for (const unsigned char* p = (const unsigned char*) s; n; ++p, --n) {
+        unsigned char ch = *p;
+        switch (state) {
+        case s_ground:
+            if (utf8_need) {
+                if ((ch & 0xC0) == 0x80) {
+                    utf8_cp = (utf8_cp << 6) | (ch & 0x3F);
+                    if (--utf8_need == 0)
+                        put(utf8_cp);
+                    break;
+                }
+                utf8_need = 0;
+                put(0xFFFD);
+            }
+            if (ch == 0x1B)
+                state = s_esc;
+            else if (ch < 0x20 || ch == 0x7F)
+                control(ch);
+            else if (ch < 0x80)
+                put(ch);
+            else if (ch >= 0xC2 && ch <= 0xDF)
+                utf8_cp = ch & 0x1F, utf8_need = 1;
+            else if (ch >= 0xE0 && ch <= 0xEF)
+                utf8_cp = ch & 0x0F, utf8_need = 2;
+            else if (ch >= 0xF0 && ch <= 0xF4)
+                utf8_cp = ch & 0x07, utf8_need = 3;
+            else
+                put(0xFFFD);
+            break;
+        case s_esc:
+            escape(ch);
+            break;
+        case s_csi:
+            if (ch >= 0x20 && ch <= 0x3F) {
+                if (params.length() < 64)
+                    params.push_back(ch);
+            } else if (ch >= 0x40 && ch <= 0x7E) {
+                csi(ch);
+                state = s_ground;
+            } else if (ch == 0x1B)
+                state = s_esc;
+            else if (ch == 0x18 || ch == 0x1A)
+                state = s_ground;
+            else
+                control(ch);
+            break;
+        case s_string:
+            // OSC, DCS, PM, APC: ignore through BEL or ST
+            if (ch == 0x07 || ch == 0x18 || ch == 0x1A)
+                state = s_ground;
+            else if (ch == 0x1B)
+                state = s_string_esc;
+            break;
+        case s_string_esc:
+            state = ch == 0x1B ? s_string_esc : s_ground;
+            break;
+        case s_charset:
+            state = s_ground;
+            break;
+        }
+    }
+}
+
+void vtscreen::put(uint32_t ch) {
+    if (wrap_pending) {
+        wrap_pending = false;
+        cc = 0;
+        linefeed();
+    }
+    lines[cr][cc] = cell{ch, attr};
+    if (cc == cols - 1)
+        wrap_pending = true;
+    else
+        ++cc;
+    changed = true;
+}
+
+void vtscreen::control(unsigned char ch) {
+    if (ch == '\r')
+        cc = 0;
+    else if (ch == '\n' || ch == '\v' || ch == '\f') {
+        cc = 0;
+        linefeed();
+    } else if (ch == '\b') {
+        if (cc > 0 && !wrap_pending)
+            --cc;
+    } else if (ch == '\t')
+        cc = std::min(cols - 1, (cc / 8 + 1) * 8);
+    else
+        return;
+    wrap_pending = false;
+    changed = true;
+}
+
+void vtscreen::escape(unsigned char ch) {
+    state = s_ground;
+    if (ch == '[') {
+        params.clear();
+        state = s_csi;
+    } else if (ch == ']' || ch == 'P' || ch == '^' || ch == '_')
+        state = s_string;
+    else if (ch == '(' || ch == ')' || ch == '*' || ch == '+' || ch == '#')
+        state = s_charset;
+    else if (ch == '7') {
+        saved_cr = cr;
+        saved_cc = cc;
+        saved_attr = attr;
+    } else if (ch == '8') {
+        cr = saved_cr;
+        cc = saved_cc;
+        attr = saved_attr;
+        wrap_pending = false;
+    } else if (ch == 'D')
+        linefeed();
+    else if (ch == 'E') {
+        cc = 0;
+        linefeed();
+    } else if (ch == 'M')
+        reverse_index();
+    else if (ch == 'c')
+        reset();
+    else if (ch == 0x1B)
+        state = s_esc;
+    changed = true;
+}
+
+void vtscreen::csi(unsigned char final) {
+    // parse parameters; sub-parameters (`:`) are treated as parameters
+    char private_mode = 0;
+    std::vector<int> p;
+    size_t i = 0;
+    if (!params.empty() && params[0] >= 0x3C && params[0] <= 0x3F)
+        private_mode = params[i++];
+    p.push_back(0);
+    for (; i != params.length(); ++i)
+        if (params[i] >= '0' && params[i] <= '9')
+            p.back() = std::min(p.back() * 10 + (params[i] - '0'), 9999);
+        else if (params[i] == ';' || params[i] == ':')
+            p.push_back(0);
+        else
+            return;             // intermediate bytes: unsupported
+    int n = std::max(p[0], 1);
+    auto arg = [&](size_t k, int dflt) {
+        return k < p.size() && p[k] ? p[k] : dflt;
+    };
+
+    if (private_mode) {
+        if (private_mode == '?' && (final == 'h' || final == 'l'))
+            for (int m : p)
+                if (m == 47 || m == 1047 || m == 1049)
+                    set_alternate(final == 'h');
+        changed = true;
+        return;
+    }
+
+    switch (final) {
+    case 'A':
+        cr = std::max(cr - n, cr >= top ? top : 0);
+        break;
+    case 'B':
+    case 'e':
+        cr = std::min(cr + n, cr <= bottom ? bottom : rows - 1);
+        break;
+    case 'C':
+    case 'a':
+        cc = std::min(cc + n, cols - 1);
+        break;
+    case 'D':
+        cc = std::max(cc - n, 0);
+        break;
+    case 'E':
+        cr = std::min(cr + n, rows - 1);
+        cc = 0;
+        break;
+    case 'F':
+        cr = std::max(cr - n, 0);
+        cc = 0;
+        break;
+    case 'G':
+    case '`':
+        cc = std::min(n, cols) - 1;
+        break;
+    case 'd':
+        cr = std::min(n, rows) - 1;
+        break;
+    case 'H':
+    case 'f':
+        cr = std::min(arg(0, 1), rows) - 1;
+        cc = std::min(arg(1, 1), cols) - 1;
+        break;
+    case 'J':
+        if (p[0] == 0) {
+            erase(cr, cc, cols);
+            for (int r = cr + 1; r < rows; ++r)
+                erase(r, 0, cols);
+        } else if (p[0] == 1) {
+            for (int r = 0; r < cr; ++r)
+                erase(r, 0, cols);
+            erase(cr, 0, cc + 1);
+        } else {
+            for (int r = 0; r < rows; ++r)
+                erase(r, 0, cols);
+            if (p[0] == 3)
+                scrollback.clear();
+        }
+        break;
+    case 'K':
+        if (p[0] == 0)
+            erase(cr, cc, cols);
+        else if (p[0] == 1)
+            erase(cr, 0, cc + 1);
+        else
+            erase(cr, 0, cols);
+        break;
+    case 'L':
+        if (cr >= top && cr <= bottom)
+            scroll_down(cr, bottom, n);
+        cc = 0;
+        break;
+    case 'M':
+        if (cr >= top && cr <= bottom)
+            scroll_up(cr, bottom, n, false);
+        cc = 0;
+        break;
+    case 'S':
+        scroll_up(top, bottom, n, true);
+        break;
+    case 'T':
+        scroll_down(top, bottom, n);
+        break;
+    case 'P': {
+        line& l = lines[cr];
+        n = std::min(n, cols - cc);
+        l.erase(l.begin() + cc, l.begin() + cc + n);
+        l.insert(l.end(), n, cell{' ', 0});
+        break;
+    }
+    case '@': {
+        line& l = lines[cr];
+        n = std::min(n, cols - cc);
+        l.insert(l.begin() + cc, n, cell{' ', 0});
+        l.resize(cols);
+        break;
+    }
+    case 'X':
+        erase(cr, cc, std::min(cc + n, cols));
+        break;
+    case 'm':
+        sgr(p);
+        break;
+    case 'r': {
+        int t = arg(0, 1) - 1, b = std::min(arg(1, rows), rows) - 1;
+        if (t < b) {
+            top = t;
+            bottom = b;
+            cr = cc = 0;
+        }
+        break;
+    }
+    case 's':
+        saved_cr = cr;
+        saved_cc = cc;
+        break;
+    case 'u':
+        cr = saved_cr;
+        cc = saved_cc;
+        break;
+    default:
+        return;
+    }
+    wrap_pending = false;
+    changed = true;
+}
+
+void vtscreen::sgr(const std::vector<int>& p) {
+    for (size_t i = 0; i < p.size(); ++i) {
+        int x = p[i];
+        if (x == 0)
+            attr = 0;
+        else if (x >= 1 && x <= 5)
+            attr |= x == 1 ? a_bold : x == 2 ? a_faint : x == 3 ? a_italic
+                : x == 4 ? a_underline : a_blink;
+        else if (x == 7)
+            attr |= a_inverse;
+        else if (x == 22)
+            attr &= ~(a_bold | a_faint);
+        else if (x == 23)
+            attr &= ~a_italic;
+        else if (x == 24)
+            attr &= ~a_underline;
+        else if (x == 25)
+            attr &= ~a_blink;
+        else if (x == 27)
+            attr &= ~a_inverse;
+        else if ((x >= 30 && x <= 39) || (x >= 40 && x <= 49)
+                 || (x >= 90 && x <= 97) || (x >= 100 && x <= 107)) {
+            int shift = (x >= 40 && x <= 49) || x >= 100 ? a_bgshift : a_fgshift;
+            int color = 0;
+            if (x % 10 == 9)
+                color = 0;
+            else if (x % 10 != 8)
+                color = x % 10 + (x >= 90 ? 8 : 0) + 1;
+            else if (i + 2 < p.size() && p[i + 1] == 5) {
+                color = std::min(p[i + 2], 255) + 1;
+                i += 2;
+            } else if (i + 4 < p.size() && p[i + 1] == 2) {
+                // direct color: nearest entry in the 6x6x6 color cube
+                color = 16 + 36 * (std::min(p[i + 2], 255) / 51)
+                    + 6 * (std::min(p[i + 3], 255) / 51)
+                    + std::min(p[i + 4], 255) / 51 + 1;
+                i += 4;
+            } else
+                break;
+            attr = (attr & ~(a_colormask << shift)) | (color << shift);
+        }
+    }
+}
+
+void vtscreen::linefeed() {
+    if (cr == bottom)
+        scroll_up(top, bottom, 1, true);
+    else if (cr < rows - 1)
+        ++cr;
+}
+
+void vtscreen::reverse_index() {
+    if (cr == top)
+        scroll_down(top, bottom, 1);
+    else if (cr > 0)
+        --cr;
+}
+
+void vtscreen::scroll_up(int t, int b, int n, bool save) {
+    n = std::min(n, b - t + 1);
+    for (int i = 0; i < n; ++i) {
+        if (save && t == 0 && saved_main.empty()) {
+            scrollback.push_back(std::move(lines[t]));
+            if (scrollback.size() > screen_scrollback_max)
+                scrollback.pop_front();
+        }
+        lines.erase(lines.begin() + t);
+        lines.insert(lines.begin() + b, blank_line());
+    }
+}
+
+void vtscreen::scroll_down(int t, int b, int n) {
+    n = std::min(n, b - t + 1);
+    for (int i = 0; i < n; ++i) {
+        lines.erase(lines.begin() + b);
+        lines.insert(lines.begin() + t, blank_line());
+    }
+}
+
+void vtscreen::erase(int r, int c1, int c2) {
+    for (int c = c1; c < c2; ++c)
+        lines[r][c] = cell{' ', 0};
+}
+
+void vtscreen::set_alternate(bool on) {
+    if (on == !saved_main.empty())
+        return;
+    if (on) {
+        saved_main.swap(lines);
+        lines.assign(rows, blank_line());
+    } else
+        lines.swap(saved_main), saved_main.clear();
+    wrap_pending = false;
+}
+
+void vtscreen::reset() {
+    lines.assign(rows, blank_line());
+    saved_main.clear();
+    cr = cc = top = 0;
+    bottom = rows - 1;
+    attr = 0;
+    wrap_pending = false;
+}
+
+// Append a JSON-escaped SGR sequence selecting `attr`.
+static void append_sgr(std::string& out, uint32_t attr) {
+    char buf[64];
+    int len = sprintf(buf, "\\u001b[0");
+    static const char flagcodes[] = "123457";
+    for (int i = 0; i < 6; ++i)
+        if (attr & (1 << (18 + i)))
+            len += sprintf(&buf[len], ";%c", flagcodes[i]);
+    for (int shift = 0; shift <= 9; shift += 9)
+        if (int color = (attr >> shift) & 0x1FF) {
+            --color;
+            int base = shift ? 40 : 30;
+            if (color < 8)
+                len += sprintf(&buf[len], ";%d", base + color);
+            else if (color < 16)
+                len += sprintf(&buf[len], ";%d", base + 60 + color - 8);
+            else
+                len += sprintf(&buf[len], ";%d;5;%d", base + 8, color);
+        }
+    buf[len++] = 'm';
+    out.append(buf, len);
+}
+
+// Append `l` as a JSON string, with SGR sequences for attributes.
+void vtscreen::render(std::string& out, const line& l) const {
+    int end = cols;
+    while (end > 0 && l[end - 1].ch == ' ' && l[end - 1].attr == 0)
+        --end;
+    out.push_back('"');
+    uint32_t a = 0;
+    char buf[8];
+    for (int c = 0; c < end; ++c) {
+        if (l[c].attr != a) {
+            append_sgr(out, l[c].attr);
+            a = l[c].attr;
+        }
+        uint32_t ch = l[c].ch;
+        if (ch == '"' || ch == '\\') {
+            out.push_back('\\');
+            out.push_back(ch);
+        } else if (ch < 0x80)
+            out.push_back(ch);
+        else if (ch < 0x800) {
+            buf[0] = 0xC0 | (ch >> 6);
+            buf[1] = 0x80 | (ch & 0x3F);
+            out.append(buf, 2);
+        } else if (ch < 0x10000) {
+            buf[0] = 0xE0 | (ch >> 12);
+            buf[1] = 0x80 | ((ch >> 6) & 0x3F);
+            buf[2] = 0x80 | (ch & 0x3F);
+            out.append(buf, 3);
+        } else {
+            buf[0] = 0xF0 | (ch >> 18);
+            buf[1] = 0x80 | ((ch >> 12) & 0x3F);
+            buf[2] = 0x80 | ((ch >> 6) & 0x3F);
+            buf[3] = 0x80 | (ch & 0x3F);
+            out.append(buf, 4);
+        }
+    }
+    if (a)
+        out += "\\u001b[0m";
+    out.push_back('"');
+}
+
+void vtscreen::snapshot(off_t offset) {
+    if (dirfd < 0)
+        return;
+    std::string out;
+    char buf[256];
+    sprintf(buf, "{\"offset\":%lld,\"rows\":%d,\"cols\":%d,\"cursor\":[%d,%d],\"alternate\":%s,\"scrollback\":[",
+            (long long) offset, rows, cols, cr, cc,
+            saved_main.empty() ? "false" : "true");
+    out = buf;
+    for (size_t i = 0; i != scrollback.size(); ++i) {
+        if (i)
+            out.push_back(',');
+        render(out, scrollback[i]);
+    }
+    out += "],\"screen\":[";
+    for (int r = 0; r != rows; ++r) {
+        if (r)
+            out.push_back(',');
+        render(out, lines[r]);
+    }
+    out += "]}\n";
+
+    std::string tmpname = name + ".tmp";
+    int fd = openat(dirfd, tmpname.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+    if (fd == -1
+        || write(fd, out.data(), out.length()) != (ssize_t) out.length()
+        || renameat(dirfd, tmpname.c_str(), dirfd, name.c_str()) != 0)
+        perror_fail("%s: %s\n", name.c_str());
+    if (fd >= 0)
+        close(fd);
+    changed = false;
+    gettimeofday(&last_snapshot, NULL);
+}
+
+void vtscreen::maybe_snapshot(off_t offset) {
+    struct timeval now, delta = {1, 0}, next;
+    if (!dirty())
+        return;
+    gettimeofday(&now, NULL);
+    timeradd(&last_snapshot, &delta, &next);
+    if (!timercmp(&now, &next, <))
+        snapshot(offset);
+}
+
+static vtscreen run_screen(24, 80);
+
+// run event stream
+//
+// `--events SOCKET` publishes the run's lifecycle on a Unix stream socket
+// as JSON lines: `constructing`, `queued`, `started` (with the pid from
+// the pid file), `output` (with the log offset reached), `timeout`, and
+// `exited` (with status, resource usage, and `last_exit`, the time the
+// jail's last process was reaped). A client that connects late
+// first receives the earlier events; of the `output` events, only the
+// latest is kept. With --multi, `job-started`, `job-timeout`, and
+// `job-exited` events carry the command's index. The socket is created as
+// the caller and removed when the run ends. Slow clients are disconnected
+// rather than waited for.
+
+class runevents {
+  public:
+    bool enabled() const {
+        return lfd >= 0;
+    }
+    int fd() const {
+        return lfd;
+    }
+    void open(const std::string& path);
+    void emit(const char* event, const char* fmt = nullptr, ...);
+    void output(off_t offset);
+    void accept();
+    void disown();
+    void close();
+
+  private:
+    int lfd = -1;
+    int dirfd = -1;
+    std::string name;
+    std::string history;
+    std::string last_output;
+    off_t output_offset = 0;
+    std::vector<int> clients;
+
+    std::string line(const char* event, const char* fmt, ...);
+    std::string vline(const char* event, const char* fmt, va_list val);
+    void send(const std::string& str);
+};
+
+void runevents::open(const std::string& path) {
+    size_t slash = path.rfind('/');
+    std::string dir = slash == std::string::npos ? "." : path.substr(0, slash + 1);
+    name = slash == std::string::npos ? path : path.substr(slash + 1);
+    dirfd = ::open(dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dirfd == -1)
+        perror_die(dir);
+
+    struct sockaddr_un sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sun_family = AF_UNIX;
+    if (name.empty() || name.length() >= sizeof(sa.sun_path))
+        die("%s: Bad socket name\n", path.c_str());
+    memcpy(sa.sun_path, name.data(), name.length());
+
+    // replace a stale socket, but nothing else
+    struct stat st;
+    if (fstatat(dirfd, name.c_str(), &st, AT_SYMLINK_NOFOLLOW) == 0
+        && S_ISSOCK(st.st_mode))
+        unlinkat(dirfd, name.c_str(), 0);
+
+    // bind relative to the directory, so long paths work
+    lfd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    int cwdfd = ::open(".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (lfd == -1 || cwdfd == -1 || fchdir(dirfd) != 0)
+        perror_die(path);
+    if (bind(lfd, (struct sockaddr*) &sa, sizeof(sa)) != 0
+        || listen(lfd, 64) != 0)
+        perror_die(path);
+    if (fchdir(cwdfd) != 0)
+        perror_die(".");
+    ::close(cwdfd);
+}
+
+std::string runevents::line(const char* event, const char* fmt, ...) {
+    va_list val;
+    va_start(val, fmt);
+    std::string str = vline(event, fmt, val);
+    va_end(val);
+    return str;
+}
+
+std::string runevents::vline(const char* event, const char* fmt, va_list val) {
+    struct timeval now;
+    gettimeofday(&now, NULL);
+    char buf[512];
+    int len = snprintf(buf, sizeof(buf), "{\"event\":\"%s\",\"time\":%ld.%03ld",
+                       event, (long) now.tv_sec, (long) now.tv_usec / 1000);
+    if (fmt) {
+        buf[len++] = ',';
+        len += vsnprintf(&buf[len], sizeof(buf) - len - 2, fmt, val);
+        len = std::min(len, (int) sizeof(buf) - 3);
+    }
+    buf[len++] = '}';
+    buf[len++] = '\n';
+    return std::string(buf, len);
+}
+
+void runevents::send(const std::string& str) {
+    for (auto it = clients.begin(); it != clients.end(); ) {
+        ssize_t w = ::send(*it, str.data(), str.length(), MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (w == (ssize_t) str.length())
+            ++it;
+        else {
+            ::close(*it);
+            it = clients.erase(it);
+        }
+    }
+}
+
+void runevents::accept() {
+    if (lfd < 0)
+        return;
+    int cfd;
+    while ((cfd = accept4(lfd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+        std::string replay = history + last_output;
+        if (::send(cfd, replay.data(), replay.length(), MSG_NOSIGNAL | MSG_DONTWAIT)
+            == (ssize_t) replay.length())
+            clients.push_back(cfd);
+        else
+            ::close(cfd);
+    }
+}
+
+void runevents::emit(const char* event, const char* fmt, ...) {
+    if (lfd < 0)
+        return;
+    accept();
+    va_list val;
+    va_start(val, fmt);
+    std::string str = vline(event, fmt, val);
+    va_end(val);
+    history += str;
+    send(str);
+}
+
+void runevents::output(off_t offset) {
+    if (lfd < 0 || offset == output_offset)
+        return;
+    output_offset = offset;
+    accept();
+    last_output = line("output", "\"offset\":%lld", (long long) offset);
+    send(last_output);
+}
+
+// Forget the socket without removing it (another process owns it now).
+void runevents::disown() {
+    if (lfd >= 0) {
+        ::close(lfd);
+        ::close(dirfd);
+        lfd = dirfd = -1;
+    }
+}
+
+void runevents::close() {
+    if (lfd < 0)
+        return;
+    accept();
+    for (int c : clients)
+        ::close(c);
+    clients.clear();
+    ::close(lfd);
+    unlinkat(dirfd, name.c_str(), 0);
+    ::close(dirfd);
+    lfd = dirfd = -1;
+}
+
+static runevents run_events;
+
+static void cleanup_events(void) {
+    run_events.close();
+}
+
+class jailownerinfo {
+  public:
+    uid_t owner;
+    gid_t group;
+    std::string owner_home;
+    std::string owner_sh;
+
+    jailownerinfo();
+    ~jailownerinfo();
+    void init(const char* owner_name);
+    void exec(int argc, char** argv, jaildirinfo& jaildir,
+              int inputfd, double timeout, bool foreground);
+    int exec_go();
+
+  private:
+    std::vector<const char*> newenv;
+    char** argv;
+    jaildirinfo* jaildir;
+    int inputfd;
+    struct timeval timeout;
+    fd_set readset;
+    fd_set writeset;
+    struct buffer {
+        char buf[8192];
+        size_t head;
+        size_t tail;
+        bool input_closed;
+        bool output_closed;
+        bool transfer_eof;
+        int rerrno;
+        outfilter* filter;
+        buffer()
+            : head(0), tail(0), input_closed(false), output_closed(false),
+              transfer_eof(false), rerrno(0), filter(nullptr) {
+        }
+        void transfer_in(int from);
+        void transfer_out(int to);
+    };
+    buffer to_slave;
+    buffer from_slave;
+    bool has_stdin_termios;
+    struct termios stdin_termios;
+    int child_status;
+    int child_pidfd = -1;
+    bool reap_pending = false;
+    struct timeval last_exit = {0, 0};
+
+    double timeout_length;
+    pid_t jailpid;
+    off_t output_offset = 0;
+    bool log_seekable = false;
+    std::vector<std::string> multi_commands;
+
+    int make_pty(char** ptyslavename);
+    void exec_child(const char* ptyslavename, int ptymaster, char** argv)
+        __attribute__((noreturn));
+    void switch_identity(uid_t uid, gid_t gid);
+    void start_sigpipe();
+    void block(int ptymaster);
+    int check_child_timeout(pid_t child, bool waitpid);
+    int reap(pid_t child);
+    void kill_namespace(bool graceful);
+    void wait_background(pid_t child, int ptymaster);
+    void exec_done(pid_t child, int exit_status) __attribute__((noreturn));
+    void multi_background() __attribute__((noreturn));
+  public:
+    void start_output();
+    bool note_output(const char* s, size_t n);
+    void finish(int exit_status) __attribute__((noreturn));
+};
+
+jailownerinfo::jailownerinfo()
+    : owner(ROOT), group(ROOT), argv(), has_stdin_termios(false),
+      child_status(-1) {
+}
+
+jailownerinfo::~jailownerinfo() {
+    delete[] argv;
+}
+
+static bool check_shell(const char* shell) {
+    bool found = false;
+    char* sh;
+    while (!found && (sh = getusershell()))
+        found = strcmp(sh, shell) == 0;
+    endusershell();
+    return found;
+}
+
+void jailownerinfo::init(const char* owner_name) {
+    if (strlen(owner_name) >= 1024)
+        die("%s: Username too long\n", owner_name);
+
+    struct passwd* pwnam = getpwnam(owner_name);
+    if (!pwnam)
+        die("%s: No such user\n", owner_name);
+
+    owner = pwnam->pw_uid;
+    group = pwnam->pw_gid;
+    if (strcmp(pwnam->pw_dir, "/") == 0)
+        owner_home = "/home/nobody";
+    else if (strncmp(pwnam->pw_dir, "/home/", 6) == 0)
+        owner_home = pwnam->pw_dir;
+    else
+        die("%s: Home directory %s not under /home\n", owner_name, pwnam->pw_dir);
+
+    if (strcmp(pwnam->pw_shell, "/bin/bash") == 0
+        || strcmp(pwnam->pw_shell, "/bin/sh") == 0
+        || check_shell(pwnam->pw_shell))
+        owner_sh = pwnam->pw_shell;
+    else
+        die("%s: Shell %s not allowed by /etc/shells\n", owner_name, pwnam->pw_shell);
+
+    if (owner == ROOT)
+        die("%s: Jail user cannot be root\n", owner_name);
+}
+
+#if __linux__
+extern "C" {
+static int exec_clone_function(void* arg) {
+    jailownerinfo* jailowner = static_cast<jailownerinfo*>(arg);
+    return jailowner->exec_go();
+}
+}
+#endif
+
+static void write_pid(int p) {
+    if (pidfd >= 0) {
+        lseek(pidfd, 0, SEEK_SET);
+        char buf[1024];
+        int l = sprintf(buf, "%d\n", p);
+        ssize_t w = write(pidfd, buf, l);
+        if (w != l || ftruncate(pidfd, l) != 0)
+            perror_die(pidfilename);
+    }
+}
+
+static std::string jail_command(int argc, char** argv) {
     if (optind + 3 == argc)
-        command = argv[optind + 2];
-    else {
-        command = shell_quote(argv[optind + 2]);
-        for (int i = optind + 3; i < argc; ++i)
-            command += std::string(" ") + shell_quote(argv[i]);
+        return argv[optind + 2];
+    std::string command = shell_quote(argv[optind + 2]);
+    for (int i = optind + 3; i < argc; ++i)
+        command += std::string(" ") + shell_quote(argv[i]);
+    return command;
+}
+
+void jailownerinfo::exec(int argc, char** argv, jaildirinfo& jaildir,
+                         int inputfd, double timeout, bool foreground) {
+    // adjust environment; make sure we have a PATH
+    char homebuf[8192];
+    sprintf(homebuf, "HOME=%s", owner_home.c_str());
+    const char* path = "PATH=/usr/local/bin:/bin:/usr/bin";
+    const char* lang = "LANG=C";
+    const char* ld_library_path = NULL;
+    {
+        extern char** environ;
+        for (char** eptr = environ; *eptr; ++eptr)
+            if (strncmp(*eptr, "PATH=", 5) == 0)
+                path = *eptr;
+            else if (strncmp(*eptr, "LANG=", 5) == 0)
+                lang = *eptr;
+            else if (strncmp(*eptr, "LD_LIBRARY_PATH=", 16) == 0)
+                ld_library_path = *eptr;
+    }
+    // route compilers through ccache when the jail has its links
+    std::string ccache_path;
+    struct stat st;
+    if (!buildcache_dir.empty()) {
+        if (stat((dstroot + "/usr/lib/ccache").c_str(), &st) == 0
+            && S_ISDIR(st.st_mode)) {
+            ccache_path = "PATH=/usr/lib/ccache:" + std::string(path + 5);
+            path = ccache_path.c_str();
+        } else if (!quiet)
+            fprintf(stderr, "[buildcache]: No /usr/lib/ccache in jail, compilers not wrapped\n");
+    }
+    newenv.clear();
+    newenv.push_back(path);
+    newenv.push_back(lang);
+    if (ld_library_path)
+        newenv.push_back(ld_library_path);
+    newenv.push_back(homebuf);
+    for (auto& e : jail_env)
+        newenv.push_back(e.c_str());
+    newenv.push_back(NULL);
+
+    // create command
+    delete[] this->argv;
+    this->argv = new char*[5 + argc - (optind + 2)];
+    if (!this->argv)
+        die("Out of memory\n");
+    int newargvpos = 0;
+    std::string command;
+    this->argv[newargvpos++] = (char*) owner_sh.c_str();
+    this->argv[newargvpos++] = (char*) "-l";
+    this->argv[newargvpos++] = (char*) "-c";
+    command = jail_command(argc, argv);
+    this->argv[newargvpos++] = const_cast<char*>(command.c_str());
+    this->argv[newargvpos++] = NULL;
+
+    // with --multi, each argument is a separate command
+    multi_commands.clear();
+    if (multi_dirfd >= 0)
+        for (int i = optind + 2; i < argc; ++i)
+            multi_commands.push_back(argv[i]);
+
+    // store other arguments
+    this->jaildir = &jaildir;
+    this->inputfd = inputfd;
+    this->timeout_length = timeout;
+    if (timeout > 0) {
+        struct timeval now, delta;
+        gettimeofday(&now, 0);
+        delta.tv_sec = (long) timeout;
+        delta.tv_usec = (long) ((timeout - delta.tv_sec) * 1000000);
+        timeradd(&now, &delta, &this->timeout);
+    } else
+        timerclear(&this->timeout);
+
+    // enter the jail
+#if __linux__
+    char* new_stack = (char*) malloc(256 * 1024);
+    if (!new_stack)
+        die("Out of memory\n");
+    if (verbose)
+        fprintf(stderr, "-clone-\n");
+    int child = clone(exec_clone_function, new_stack + 256 * 1024,
+                      CLONE_NEWIPC | CLONE_NEWNS | CLONE_NEWPID, this);
+    if (child == -1)
+        perror_die("clone");
+    int child_waitflags = __WALL;
+#else
+    int child = fork();
+    if (child == 0)
+        exit(exec_go());
+    int child_waitflags = 0;
+#endif
+    if (child == -1)
+        perror_die("fork");
+    write_pid(child);
+    run_events.disown();
+
+    // we don't need file descriptors any more
+    close(STDIN_FILENO);
+    close(STDOUT_FILENO);
+    close(STDERR_FILENO);
+
+    int exit_status = 0;
+    if (foreground) {
+        int r = setresgid(caller_group, caller_group, caller_group);
+        (void) r;
+        r = setresuid(caller_owner, caller_owner, caller_owner);
+        (void) r;
+        exit_status = x_waitpid(child, child_waitflags).second;
+    } else
+        pidfd = -1;
+    exit(exit_status);
+}
+
+int jailownerinfo::exec_go() {
+    // our pid outside the namespace, as in the pid file
+    char pidbuf[32];
+    ssize_t pidlen = readlink("/proc/self", pidbuf, sizeof(pidbuf) - 1);
+    pidbuf[std::max(pidlen, (ssize_t) 0)] = '\0';
+    jailpid = atoi(pidbuf);
+
+    // wait for a run slot; the timeout starts at admission
+    if (run_sched.enabled()) {
+        run_events.emit("queued");
+        double wait = run_sched.admit(jaildir->dir);
+        if (timerisset(&timeout)) {
+            struct timeval delta;
+            delta.tv_sec = (long) wait;
+            delta.tv_usec = (long) ((wait - delta.tv_sec) * 1000000);
+            timeradd(&timeout, &delta, &timeout);
+        }
+    }
+
+#if __linux__
+    mount_status = 2;
+
+    // ensure we truly have a private mount namespace: no shared mounts
+    // (some Linux distros, such as Ubuntu 15.10, have / a shared mount
+    // by default, which means mount changes propagate despite CLONE_NEWFS.
+    // This undoes the shared mount)
+    if (verbose)
+        fprintf(verbosefile, "mount --make-rslave /\n");
+    if (mount("none", "/", NULL, MS_REC | MS_SLAVE, NULL) != 0)
+        perror_die("mount --make-rslave /");
+
+    populate_mount_table();     // ensure we know how to mount /proc
+    for (size_t i = 0; i != delayed_mounts.size(); i += 2)
+        handle_mount(delayed_mounts[i], delayed_mounts[i+1], true);
+    handle_mount("/proc", jaildir->dir + "proc", true);
+    handle_mount("/dev/pts", jaildir->dir + "dev/pts", true);
+    if (!tmp_mountopts.empty()) {
+        // per-jail /tmp limits
+        mountslot& ms = mount_table["/tmp"];
+        if (ms.type != "tmpfs")
+            ms = mountslot("tmpfs", "tmpfs", "nosuid,nodev,mode=1777");
+        for (auto& opt : tmp_mountopts)
+            ms.add_mountopt(opt.c_str());
+    }
+    handle_mount("/tmp", jaildir->dir + "tmp", true);
+    handle_mount("/run", jaildir->dir + "run", true);
+#endif
+
+    // chroot, remount /proc
+    if (verbose)
+        fprintf(verbosefile, "cd %s\n", jaildir->dir.c_str());
+    if (!dryrun && chdir(jaildir->dir.c_str()) != 0)
+        perror_die(jaildir->dir);
+    if (verbose)
+        fprintf(verbosefile, "chroot .\n");
+    if (!dryrun && chroot(".") != 0)
+        perror_die("chroot");
+
+    // create a pty
+    int ptymaster = -1;
+    char* ptyslavename = NULL;
+    if (verbose)
+        fprintf(verbosefile, "su %s\nmake-pty\n", uid_to_name(owner));
+    if (!dryrun) {
+        // change effective uid/gid, but save root for later
+        if (setresgid(group, group, ROOT) != 0)
+            perror_die("setresgid");
+        if (setresuid(owner, owner, ROOT) != 0)
+            perror_die("setresuid");
+        if (multi_commands.empty())
+            ptymaster = make_pty(&ptyslavename);
+    }
+
+    // change into their home directory
+    if (verbose)
+        fprintf(verbosefile, "cd %s\n", owner_home.c_str());
+    if (!dryrun && chdir(owner_home.c_str()) != 0)
+        perror_die(owner_home);
+
+    // check that shell exists
+    if (!dryrun) {
+        int f = open(owner_sh.c_str(), O_RDONLY);
+        if (f < 0)
+            perror_die(owner_sh);
+        close(f);
+    }
+
+    if (verbose) {
+        for (int i = 0; newenv[i]; ++i)
+            fprintf(verbosefile, "%s ", newenv[i]);
+        for (int i = 0; this->argv[i]; ++i)
+            fprintf(verbosefile, i ? " %s" : "%s", shell_quote(this->argv[i]).c_str());
+        fprintf(verbosefile, "\n");
     }
-    this->argv[newargvpos++] = const_cast<char*>(command.c_str());
-    this->argv[newargvpos++] = NULL;
 
-    // store other arguments
-    this->jaildir = &jaildir;
-    this->inputfd = inputfd;
-    if (timeout > 0) {
-        struct timeval now, delta;
-        gettimeofday(&now, 0);
-        delta.tv_sec = (long) timeout;
-        delta.tv_usec = (long) ((timeout - delta.tv_sec) * 1000000);
-        timeradd(&now, &delta, &this->timeout);
+    if (!dryrun && !multi_commands.empty()) {
+        start_sigpipe();
+        run_events.emit("started", "\"pid\":%d", jailpid);
+        multi_background();
+    } else if (!dryrun) {
+        start_sigpipe();
+        pid_t child = x_fork_pidfd(&child_pidfd);
+        if (child < 0)
+            perror_die("fork");
+        else if (child == 0)
+            exec_child(ptyslavename, ptymaster, this->argv);
+        run_events.emit("started", "\"pid\":%d", jailpid);
+        wait_background(child, ptymaster);
+    }
+
+    return 0;
+}
+
+int jailownerinfo::make_pty(char** ptyslavename) {
+    int ptymaster;
+    if ((ptymaster = posix_openpt(O_RDWR | O_CLOEXEC)) == -1)
+        perror_die("posix_openpt");
+    if (grantpt(ptymaster) == -1)
+        perror_die("grantpt");
+    if (unlockpt(ptymaster) == -1)
+        perror_die("unlockpt");
+    if ((*ptyslavename = ptsname(ptymaster)) == NULL)
+        perror_die("ptsname");
+    return ptymaster;
+}
+
+void jailownerinfo::exec_child(const char* ptyslavename, int ptymaster,
+                               char** argv) {
+    close(sigpipe[0]);
+    close(sigpipe[1]);
+
+    // reduce privileges permanently
+    if (setresgid(group, group, group) != 0)
+        perror_die("setresgid");
+    if (setresuid(owner, owner, owner) != 0)
+        perror_die("setresuid");
+
+    if (setsid() == -1)
+        perror_die("setsid");
+
+    int ptyslave = open(ptyslavename, O_RDWR);
+    if (ptyslave == -1)
+        perror_die(ptyslavename);
+#ifdef TIOCGWINSZ
+    struct winsize ws;
+    ioctl(ptyslave, TIOCGWINSZ, &ws);
+    ws.ws_row = 24;
+    ws.ws_col = 80;
+    ioctl(ptyslave, TIOCSWINSZ, &ws);
+#endif
+    struct termios tty;
+    if (tcgetattr(ptyslave, &tty) >= 0) {
+        tty.c_oflag = 0; // no NL->NLCR xlation, no other proc.
+        tcsetattr(ptyslave, TCSANOW, &tty);
+    }
+    dup2(ptyslave, STDIN_FILENO);
+    dup2(ptyslave, STDOUT_FILENO);
+    dup2(ptyslave, STDERR_FILENO);
+    close(ptymaster);
+    close(ptyslave);
+
+    // restore all signals to their default actions
+    // (e.g., PHP may have ignored SIGPIPE; don't want that
+    // to propagate to student code!)
+    for (int sig = 1; sig < NSIG; ++sig)
+        signal(sig, SIG_DFL);
+
+    execve(argv[0], (char* const*) argv, (char* const*) newenv.data());
+    fprintf(stderr, "exec %s: %s\n", owner_sh.c_str(), strerror(errno));
+    exit(126);
+}
+
+extern "C" {
+void sighandler(int signo) {
+    if (signo == SIGTERM)
+        got_sigterm = 1;
+    char c = (char) signo;
+    ssize_t w = write(sigpipe[1], &c, 1);
+    (void) w;
+}
+
+void cleanup_pidfd(void) {
+    if (pidfd >= 0)
+        write_pid(0);
+}
+}
+
+static void make_nonblocking(int fd) {
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+}
+
+// Return the file offset where the next write to `fd` lands, or -1 if
+// `fd` is not a seekable file. An append-mode log (the usual runner
+// setup) already holds earlier lines, so its offset is its size.
+static off_t write_offset(int fd) {
+    struct stat st;
+    int flags = fcntl(fd, F_GETFL, 0);
+    if (flags != -1 && (flags & O_APPEND)
+        && fstat(fd, &st) == 0 && S_ISREG(st.st_mode))
+        return st.st_size;
+    return lseek(fd, 0, SEEK_CUR);
+}
+
+// Empty the signal pipe. Returns true if SIGCHLD was among the signals.
+static bool drain_sigpipe() {
+    char buf[128];
+    ssize_t nr;
+    bool chld = false;
+    while ((nr = read(sigpipe[0], buf, sizeof(buf))) > 0)
+        chld = chld || memchr(buf, SIGCHLD, nr) != nullptr;
+    return chld;
+}
+
+void jailownerinfo::start_sigpipe() {
+    int r = pipe(sigpipe);
+    if (r != 0)
+        perror_die("pipe");
+    make_nonblocking(inputfd);
+    make_nonblocking(STDOUT_FILENO);
+    make_nonblocking(sigpipe[0]);
+    make_nonblocking(sigpipe[1]);
+
+    struct sigaction sa;
+    sa.sa_handler = sighandler;
+    sigemptyset(&sa.sa_mask);
+    sa.sa_flags = 0;
+    sigaction(SIGCHLD, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+
+    FD_ZERO(&readset);
+    FD_ZERO(&writeset);
+}
+
+void jailownerinfo::buffer::transfer_in(int from) {
+    // filtered input can grow up to threefold, so needs more room
+    size_t need = filter ? outfilter::max_output(256) : 1;
+    if (sizeof(buf) - tail < need && head != 0) {
+        memmove(buf, &buf[head], tail - head);
+        tail -= head;
+        head = 0;
+    }
+
+    if (from >= 0 && !input_closed && sizeof(buf) - tail >= need) {
+        ssize_t nr;
+        if (filter) {
+            char raw[sizeof(buf) / 3];
+            nr = read(from, raw, (sizeof(buf) - tail - outfilter::max_output(0)) / 3);
+            if (nr > 0)
+                tail += filter->run(raw, nr, &buf[tail]);
+        } else {
+            nr = read(from, &buf[tail], sizeof(buf) - tail);
+            if (nr > 0)
+                tail += nr;
+        }
+        if (nr == 0)
+            input_closed = true;
+        else if (nr == -1 && errno != EINTR && errno != EAGAIN) {
+            input_closed = true;
+            rerrno = errno;
+        }
+        if (input_closed && filter)
+            tail += filter->finish(&buf[tail]);
+    }
+
+    if (input_closed && transfer_eof && tail != sizeof(buf)) {
+        buf[tail] = VEOF;
+        ++tail;
+        transfer_eof = false;
+    }
+}
+
+void jailownerinfo::buffer::transfer_out(int to) {
+    if (to >= 0 && !output_closed && head != tail) {
+        ssize_t nw = write(to, &buf[head], tail - head);
+        if (nw != 0 && nw != -1)
+            head += nw;
+        else if (errno != EINTR && errno != EAGAIN)
+            output_closed = true;
+    }
+}
+
+void jailownerinfo::block(int ptymaster) {
+    int maxfd = sigpipe[0];
+    FD_SET(sigpipe[0], &readset);
+    if (run_events.enabled()) {
+        FD_SET(run_events.fd(), &readset);
+        maxfd < run_events.fd() && (maxfd = run_events.fd());
+    }
+    if (child_pidfd >= 0) {
+        FD_SET(child_pidfd, &readset);
+        maxfd < child_pidfd && (maxfd = child_pidfd);
+    }
+
+    if (!to_slave.input_closed && !to_slave.output_closed) {
+        FD_SET(inputfd, &readset);
+        maxfd < inputfd && (maxfd = inputfd);
     } else
-        timerclear(&this->timeout);
+        FD_CLR(inputfd, &readset);
+    if (!to_slave.output_closed && to_slave.head != to_slave.tail) {
+        FD_SET(ptymaster, &writeset);
+        maxfd < ptymaster && (maxfd = ptymaster);
+    } else
+        FD_CLR(ptymaster, &writeset);
 
-    // enter the jail
-#if __linux__
-    char* new_stack = (char*) malloc(256 * 1024);
-    if (!new_stack)
-        die("Out of memory\n");
-    if (verbose)
-        fprintf(stderr, "-clone-\n");
-    int child = clone(exec_clone_function, new_stack + 256 * 1024,
-                      CLONE_NEWIPC | CLONE_NEWNS | CLONE_NEWPID, this);
-    if (child == -1)
-        perror_die("clone");
-    int child_waitflags = __WALL;
+    if (!from_slave.input_closed && !from_slave.output_closed) {
+        FD_SET(ptymaster, &readset);
+        maxfd < ptymaster && (maxfd = ptymaster);
+    } else
+        FD_CLR(ptymaster, &readset);
+    if (!from_slave.output_closed && from_slave.head != from_slave.tail) {
+        FD_SET(STDOUT_FILENO, &writeset);
+        maxfd < STDOUT_FILENO && (maxfd = STDOUT_FILENO);
+    } else
+        FD_CLR(STDOUT_FILENO, &writeset);
+
+    struct timeval delay = {3600, 0};
+    if (timerisset(&timeout)) {
+        gettimeofday(&delay, 0);
+        timersub(&timeout, &delay, &delay);
+    }
+    // wake up to write a pending screen snapshot
+    if (run_screen.dirty() && delay.tv_sec >= 1)
+        delay = {1, 0};
+    select(maxfd + 1, &readset, &writeset, NULL, &delay);
+
+    // only reap when something exited: the child's pidfd is readable,
+    // or SIGCHLD reported an orphan (we are the PID namespace's init)
+    if (FD_ISSET(sigpipe[0], &readset) && drain_sigpipe())
+        reap_pending = true;
+    if (child_pidfd >= 0 && FD_ISSET(child_pidfd, &readset))
+        reap_pending = true;
+}
+
+// Reap exited processes without blocking, noting when the last one went.
+// Sets `child_status` once `child` is reaped. Returns 1 if processes
+// remain, 0 if none do, and -1 on error.
+int jailownerinfo::reap(pid_t child) {
+#ifdef __WALL
+    int flags = WNOHANG | __WALL;
 #else
-    int child = fork();
-    if (child == 0)
-        exit(exec_go());
-    int child_waitflags = 0;
+    int flags = WNOHANG;
 #endif
-    if (child == -1)
-        perror_die("fork");
-    write_pid(child);
+    std::pair<pid_t, int> xr;
+    while ((xr = x_waitpid(-1, flags)).first > 0) {
+        gettimeofday(&last_exit, NULL);
+        if (xr.first == child) {
+            child_status = xr.second;
+            if (child_pidfd >= 0) {
+                FD_CLR(child_pidfd, &readset);
+                close(child_pidfd);
+            }
+            child_pidfd = -1;
+        }
+    }
+    if (errno == EAGAIN)
+        return 1;
+    return errno == ECHILD ? 0 : -1;
+}
 
-    // we don't need file descriptors any more
-    close(STDIN_FILENO);
-    close(STDOUT_FILENO);
-    close(STDERR_FILENO);
+int jailownerinfo::check_child_timeout(pid_t child, bool waitpid) {
+    if (reap_pending) {
+        reap_pending = false;
+        if (reap(child) < 0)
+            return 125;
+    }
 
-    int exit_status = 0;
-    if (foreground) {
-        int r = setresgid(caller_group, caller_group, caller_group);
-        (void) r;
-        r = setresuid(caller_owner, caller_owner, caller_owner);
-        (void) r;
-        exit_status = x_waitpid(child, child_waitflags).second;
-    } else
-        pidfd = -1;
-    exit(exit_status);
+    if (child_status >= 0 && waitpid)
+        return child_status;
+
+    if (got_sigterm)
+        return 128 + SIGTERM;
+
+    struct timeval now;
+    if (timerisset(&timeout)
+        && gettimeofday(&now, NULL) == 0
+        && timercmp(&now, &timeout, >))
+        return 124;
+
+    errno = EAGAIN;
+    return -1;
+}
+
+void jailownerinfo::wait_background(pid_t child, int ptymaster) {
+    // go back to being the caller
+    // XXX (preserve the saved root identity just in case)
+    if (setresuid(ROOT, ROOT, ROOT) != 0
+        || setresgid(caller_group, caller_group, ROOT) != 0
+        || setresuid(caller_owner, caller_owner, ROOT) != 0) {
+        perror("setresuid");
+        exec_done(child, 127);
+    }
+
+    // if input is a tty, put it in non-canonical mode
+    struct termios tty;
+    if (tcgetattr(STDIN_FILENO, &stdin_termios) >= 0) {
+        has_stdin_termios = true;
+        tty = stdin_termios;
+        // Noncanonical mode, disable signals, no echoing
+        tty.c_lflag &= ~(ICANON | ISIG | ECHO);
+        // Character-at-a-time input with blocking
+        tty.c_cc[VMIN] = 1;
+        tty.c_cc[VTIME] = 0;
+        (void) tcsetattr(STDIN_FILENO, TCSAFLUSH, &tty);
+    }
+
+    if (tcgetattr(ptymaster, &tty) >= 0) {
+        // blocking reads please (well, block for up to 0.5sec)
+        // the 0.5sec wait means we avoid long race conditions
+        tty.c_cc[VMIN] = 1;
+        tty.c_cc[VTIME] = 5;
+        // disable echo so we don't read our own input
+        tty.c_lflag &= ~ECHO;
+        tcsetattr(ptymaster, TCSANOW, &tty);
+    }
+    make_nonblocking(ptymaster);
+    fflush(stdout);
+    start_output();
+    to_slave.transfer_eof = true;
+    if (output_filter.mode != sanitize_raw)
+        from_slave.filter = &output_filter;
+    run_cache.start();
+    bool input_esc = false;
+
+    while (1) {
+        block(ptymaster);
+        run_events.accept();
+        size_t old_pending = to_slave.tail - to_slave.head;
+        to_slave.transfer_in(inputfd);
+        size_t nread = to_slave.tail - to_slave.head - old_pending;
+        if (nread != 0)
+            run_cache.input_seen = true;
+        // only new input needs scanning for the kill sequence
+        if (scan_kill_sequence(&to_slave.buf[to_slave.tail - nread], nread,
+                               input_esc))
+            exec_done(child, 128 + SIGTERM);
+        to_slave.transfer_out(ptymaster);
+        from_slave.transfer_in(ptymaster);
+        size_t old_head = from_slave.head;
+        from_slave.transfer_out(STDOUT_FILENO);
+        if (from_slave.head != old_head) {
+            run_cache.tee(&from_slave.buf[old_head], from_slave.head - old_head);
+            if (!note_output(&from_slave.buf[old_head], from_slave.head - old_head))
+                exec_done(child, 128 + SIGTERM);
+        }
+        run_screen.maybe_snapshot(output_offset);
+
+        // check child and timeout
+        // (only wait for child if read done/failed)
+        int exit_status = check_child_timeout(child, from_slave.input_closed);
+        if (exit_status != -1)
+            exec_done(child, exit_status);
+
+        // if child has not died, and read produced error, report it
+        if (from_slave.input_closed && from_slave.rerrno != EIO) {
+            fprintf(stderr, "read: %s\n", strerror(from_slave.rerrno));
+            exec_done(child, 125);
+        }
+    }
 }
 
-int jailownerinfo::exec_go() {
 #if __linux__
-    mount_status = 2;
+// Stop every process left in the jail and reap them all. We are init of
+// the jail's PID namespace, so kill(-1) reaches exactly the jail's
+// processes. A graceful stop sends SIGTERM first, and SIGKILL only to
+// processes still running after `kill_grace` seconds.
+void jailownerinfo::kill_namespace(bool graceful) {
+    // signaling the jail user's processes needs root; the saved UID is
+    // still root
+    bool was_root = geteuid() == ROOT;
+    if (!was_root && seteuid(ROOT) != 0)
+        return;
 
-    // ensure we truly have a private mount namespace: no shared mounts
-    // (some Linux distros, such as Ubuntu 15.10, have / a shared mount
-    // by default, which means mount changes propagate despite CLONE_NEWFS.
-    // This undoes the shared mount)
-    if (verbose)
-        fprintf(verbosefile, "mount --make-rslave /\n");
-    if (mount("none", "/", NULL, MS_REC | MS_SLAVE, NULL) != 0)
-        perror_die("mount --make-rslave /");
+    if (graceful && kill(-1, SIGTERM) == 0) {
+        struct timeval now, delta, deadline;
+        gettimeofday(&now, NULL);
+        delta.tv_sec = (long) kill_grace;
+        delta.tv_usec = (long) ((kill_grace - delta.tv_sec) * 1000000);
+        timeradd(&now, &delta, &deadline);
+        while (reap(-1) > 0 && timercmp(&now, &deadline, <)) {
+            fd_set rset;
+            FD_ZERO(&rset);
+            FD_SET(sigpipe[0], &rset);
+            timersub(&deadline, &now, &delta);
+            select(sigpipe[0] + 1, &rset, NULL, NULL, &delta);
+            drain_sigpipe();
+            gettimeofday(&now, NULL);
+        }
+    }
 
-    populate_mount_table();     // ensure we know how to mount /proc
-    for (size_t i = 0; i != delayed_mounts.size(); i += 2)
-        handle_mount(delayed_mounts[i], delayed_mounts[i+1], true);
-    handle_mount("/proc", jaildir->dir + "proc", true);
-    handle_mount("/dev/pts", jaildir->dir + "dev/pts", true);
-    handle_mount("/tmp", jaildir->dir + "tmp", true);
-    handle_mount("/run", jaildir->dir + "run", true);
+    if (kill(-1, SIGKILL) == 0) {
+        std::pair<pid_t, int> xr;
+        while ((xr = x_waitpid(-1, __WALL)).first > 0)
+            gettimeofday(&last_exit, NULL);
+    } else
+        reap(-1);
+
+    if (!was_root && seteuid(caller_owner) != 0)
+        exit(127);
+}
 #endif
 
-    // chroot, remount /proc
-    if (verbose)
-        fprintf(verbosefile, "cd %s\n", jaildir->dir.c_str());
-    if (!dryrun && chdir(jaildir->dir.c_str()) != 0)
-        perror_die(jaildir->dir);
-    if (verbose)
-        fprintf(verbosefile, "chroot .\n");
-    if (!dryrun && chroot(".") != 0)
-        perror_die("chroot");
+void jailownerinfo::exec_done(pid_t child, int exit_status) {
+    const char* xmsg = nullptr;
+    if (exit_status == 124 && !quiet)
+        xmsg = "...timed out";
+    if (exit_status == 128 + SIGTERM && !quiet)
+        xmsg = "...terminated";
+    if (xmsg)
+        printf(isatty(STDOUT_FILENO) ? "\n\x1b[3;7;31m%s\x1b[0m\n" : "\n%s\n",
+               xmsg);
+    fflush(stdout);
+#if __linux__
+    (void) child;
+    if (exit_status == 124)
+        run_events.emit("timeout");
+    kill_namespace(exit_status == 124 || exit_status == 128 + SIGTERM);
+#else
+    if (exit_status >= 124)
+        kill(child, SIGKILL);
+    if (exit_status == 124)
+        run_events.emit("timeout");
+#endif
+    run_cache.finish(exit_status);
+    finish(exit_status);
+}
 
-    // create a pty
-    int ptymaster = -1;
-    char* ptyslavename = NULL;
-    if (verbose)
-        fprintf(verbosefile, "su %s\nmake-pty\n", uid_to_name(owner));
-    if (!dryrun) {
-        // change effective uid/gid, but save root for later
-        if (setresgid(group, group, ROOT) != 0)
-            perror_die("setresgid");
-        if (setresuid(owner, owner, ROOT) != 0)
-            perror_die("setresuid");
-        // create pty
-        if ((ptymaster = posix_openpt(O_RDWR)) == -1)
-            perror_die("posix_openpt");
-        if (grantpt(ptymaster) == -1)
-            perror_die("grantpt");
-        if (unlockpt(ptymaster) == -1)
-            perror_die("unlockpt");
-        if ((ptyslavename = ptsname(ptymaster)) == NULL)
-            perror_die("ptsname");
-    }
+// Offsets reported to --events and --screen are log file offsets. A
+// seekable log already holds earlier lines and also gets our own
+// messages, so the offset comes from the log itself.
+void jailownerinfo::start_output() {
+    off_t pos = write_offset(STDOUT_FILENO);
+    log_seekable = pos >= 0;
+    if (log_seekable)
+        output_offset = pos;
+}
 
-    // change into their home directory
-    if (verbose)
-        fprintf(verbosefile, "cd %s\n", owner_home.c_str());
-    if (!dryrun && chdir(owner_home.c_str()) != 0)
-        perror_die(owner_home);
+// Account for `n` bytes of command output just written to stdout. Returns
+// false if `--expect-stop` should stop the command.
+bool jailownerinfo::note_output(const char* s, size_t n) {
+    run_screen.feed(s, n);
+    bool ok = run_expect.feed(s, n);
+    off_t pos = log_seekable ? lseek(STDOUT_FILENO, 0, SEEK_CUR) : -1;
+    if (pos >= 0)
+        output_offset = pos;
+    else {
+        log_seekable = false;
+        output_offset += n;
+    }
+    run_events.output(output_offset);
+    return ok;
+}
 
-    // check that shell exists
-    if (!dryrun) {
-        int f = open(owner_sh.c_str(), O_RDONLY);
-        if (f < 0)
-            perror_die(owner_sh);
-        close(f);
+// Write the run's reports (screen snapshot, verdict, `exited` event,
+// usage) and exit. Cached runs that are replayed finish here too.
+void jailownerinfo::finish(int exit_status) {
+    if (run_screen.dirty())
+        run_screen.snapshot(output_offset);
+    run_expect.finish();
+    if (run_events.enabled()) {
+        struct rusage ru;
+        getrusage(RUSAGE_CHILDREN, &ru);
+        char lastbuf[64] = "";
+        if (timerisset(&last_exit))
+            sprintf(lastbuf, ",\"last_exit\":%ld.%03ld",
+                    (long) last_exit.tv_sec, (long) last_exit.tv_usec / 1000);
+        run_events.emit("exited", "\"status\":%d,\"utime\":%ld.%03ld,\"stime\":%ld.%03ld,\"maxrss\":%ld%s",
+                        exit_status,
+                        (long) ru.ru_utime.tv_sec, (long) ru.ru_utime.tv_usec / 1000,
+                        (long) ru.ru_stime.tv_sec, (long) ru.ru_stime.tv_usec / 1000,
+                        ru.ru_maxrss, lastbuf);
+        run_events.close();
+    }
+    run_sched.release();
+    // reading project quotas needs root; the saved UID is still root
+    if (usagefd >= 0 && seteuid(ROOT) == 0) {
+        write_jail_usage(usagefd);
+        if (seteuid(caller_owner) != 0)
+            exit(127);
     }
+    if (has_stdin_termios)
+        (void) tcsetattr(STDIN_FILENO, TCSAFLUSH, &stdin_termios);
+    exit(exit_status);
+}
 
-    if (verbose) {
-        for (int i = 0; newenv[i]; ++i)
-            fprintf(verbosefile, "%s ", newenv[i]);
-        for (int i = 0; this->argv[i]; ++i)
-            fprintf(verbosefile, i ? " %s" : "%s", shell_quote(this->argv[i]).c_str());
-        fprintf(verbosefile, "\n");
+
+// Multiple commands (--multi): run each argument as its own command, at
+// most `multi_parallel` at a time, each with its own pty and timeout.
+// Output for command N goes to N.out in the --multi directory and its
+// exit status to N.status; a summary line is printed as each finishes.
+
+void jailownerinfo::switch_identity(uid_t uid, gid_t gid) {
+    // the saved UID stays root so we can switch back
+    if (setresuid(ROOT, ROOT, ROOT) != 0
+        || setresgid(gid, gid, ROOT) != 0
+        || setresuid(uid, uid, ROOT) != 0) {
+        perror("setresuid");
+        exit(127);
     }
+}
+
+void jailownerinfo::multi_background() {
+    struct job {
+        pid_t pid = -1;
+        int pidfd = -1;
+        int ptymaster = -1;
+        int outfd = -1;
+        int status = -1;
+        bool timed_out = false;
+        struct timeval start;
+        struct timeval deadline;
+        struct timeval kill_deadline;
+        struct timeval drain_deadline;  // set once the command exits
+        buffer from_slave;
+    };
+    std::vector<job> jobs(multi_commands.size());
+    size_t next = 0, nrunning = 0, nfinished = 0;
+    int exit_status = 0;
+
+    switch_identity(caller_owner, caller_group);
+
+    // the commands run as the jail user, so signaling them needs root
+    auto signal_job = [&](job& j, int signo) {
+        if (seteuid(ROOT) != 0)
+            return;
+        kill(-j.pid, signo);
+        kill(j.pid, signo);
+        if (seteuid(caller_owner) != 0)
+            exit(127);
+    };
+
+    while (nfinished != jobs.size()) {
+        // start commands up to the concurrency limit
+        while (next != jobs.size() && (int) nrunning < multi_parallel
+               && !got_sigterm) {
+            job& j = jobs[next];
+            char fname[64];
+            sprintf(fname, "%zu.out", next);
+            j.outfd = openat(multi_dirfd, fname, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+            if (j.outfd == -1)
+                perror_die(fname);
+
+            switch_identity(owner, group);
+            char* ptyslavename;
+            j.ptymaster = make_pty(&ptyslavename);
+            const char* argv[5] = {
+                owner_sh.c_str(), "-l", "-c", multi_commands[next].c_str(), NULL
+            };
+            j.pid = x_fork_pidfd(&j.pidfd);
+            if (j.pid == 0)
+                exec_child(ptyslavename, j.ptymaster, (char**) argv);
+            else if (j.pid < 0)
+                perror_die("fork");
+            switch_identity(caller_owner, caller_group);
 
-    if (!dryrun) {
-        start_sigpipe();
-        pid_t child = fork();
-        if (child < 0)
-            perror_die("fork");
-        else if (child == 0) {
-            close(sigpipe[0]);
-            close(sigpipe[1]);
-
-            // reduce privileges permanently
-            if (setresgid(group, group, group) != 0)
-                perror_die("setresgid");
-            if (setresuid(owner, owner, owner) != 0)
-                perror_die("setresuid");
-
-            if (setsid() == -1)
-                perror_die("setsid");
-
-            int ptyslave = open(ptyslavename, O_RDWR);
-            if (ptyslave == -1)
-                perror_die(ptyslavename);
-#ifdef TIOCGWINSZ
-            struct winsize ws;
-            ioctl(ptyslave, TIOCGWINSZ, &ws);
-            ws.ws_row = 24;
-            ws.ws_col = 80;
-            ioctl(ptyslave, TIOCSWINSZ, &ws);
-#endif
             struct termios tty;
-            if (tcgetattr(ptyslave, &tty) >= 0) {
-                tty.c_oflag = 0; // no NL->NLCR xlation, no other proc.
-                tcsetattr(ptyslave, TCSANOW, &tty);
+            if (tcgetattr(j.ptymaster, &tty) >= 0) {
+                tty.c_lflag &= ~ECHO;
+                tcsetattr(j.ptymaster, TCSANOW, &tty);
             }
-            dup2(ptyslave, STDIN_FILENO);
-            dup2(ptyslave, STDOUT_FILENO);
-            dup2(ptyslave, STDERR_FILENO);
-            close(ptymaster);
-            close(ptyslave);
-
-            // restore all signals to their default actions
-            // (e.g., PHP may have ignored SIGPIPE; don't want that
-            // to propagate to student code!)
-            for (int sig = 1; sig < NSIG; ++sig)
-                signal(sig, SIG_DFL);
-
-            if (execve(this->argv[0], (char* const*) this->argv,
-                       (char* const*) newenv) != 0) {
-                fprintf(stderr, "exec %s: %s\n", owner_sh.c_str(), strerror(errno));
-                exit(126);
+            make_nonblocking(j.ptymaster);
+            // no input: reading stdin gets end of file
+            ssize_t w = write(j.ptymaster, "\x04", 1);
+            (void) w;
+            gettimeofday(&j.start, NULL);
+            timerclear(&j.deadline);
+            timerclear(&j.kill_deadline);
+            timerclear(&j.drain_deadline);
+            if (timeout_length > 0) {
+                struct timeval delta;
+                delta.tv_sec = (long) timeout_length;
+                delta.tv_usec = (long) ((timeout_length - delta.tv_sec) * 1000000);
+                timeradd(&j.start, &delta, &j.deadline);
             }
-        } else
-            wait_background(child, ptymaster);
+            run_events.emit("job-started", "\"job\":%zu", next);
+            ++next;
+            ++nrunning;
+        }
+
+        // wait for output, exits, or the nearest deadline
+        fd_set rset;
+        FD_ZERO(&rset);
+        FD_SET(sigpipe[0], &rset);
+        int maxfd = sigpipe[0];
+        if (run_events.enabled()) {
+            FD_SET(run_events.fd(), &rset);
+            maxfd = std::max(maxfd, run_events.fd());
+        }
+        struct timeval now, delay = {3600, 0};
+        gettimeofday(&now, NULL);
+        for (auto& j : jobs)
+            if (j.ptymaster >= 0) {
+                if (!j.from_slave.input_closed) {
+                    FD_SET(j.ptymaster, &rset);
+                    maxfd = std::max(maxfd, j.ptymaster);
+                }
+                if (j.pidfd >= 0) {
+                    FD_SET(j.pidfd, &rset);
+                    maxfd = std::max(maxfd, j.pidfd);
+                }
+                struct timeval* dl = nullptr;
+                if (timerisset(&j.deadline) && !j.timed_out)
+                    dl = &j.deadline;
+                else if (timerisset(&j.kill_deadline))
+                    dl = &j.kill_deadline;
+                if (timerisset(&j.drain_deadline)
+                    && (!dl || timercmp(&j.drain_deadline, dl, <)))
+                    dl = &j.drain_deadline;
+                if (dl) {
+                    struct timeval d;
+                    if (timercmp(dl, &now, >))
+                        timersub(dl, &now, &d);
+                    else
+                        timerclear(&d);
+                    if (timercmp(&d, &delay, <))
+                        delay = d;
+                }
+            }
+        select(maxfd + 1, &rset, NULL, NULL, &delay);
+        run_events.accept();
+        bool exited = FD_ISSET(sigpipe[0], &rset) && drain_sigpipe();
+        for (auto& j : jobs)
+            if (j.pidfd >= 0 && FD_ISSET(j.pidfd, &rset))
+                exited = true;
+
+        // collect exits
+        std::pair<pid_t, int> xr;
+        while (exited && (xr = x_waitpid(-1, WNOHANG)).first > 0) {
+            gettimeofday(&last_exit, NULL);
+            for (auto& j : jobs)
+                if (j.pid == xr.first && j.status < 0) {
+                    j.status = !j.timed_out ? xr.second
+                        : (got_sigterm ? 128 + SIGTERM : 124);
+                    // give processes it left behind a moment to finish
+                    // output, then stop waiting for the pty
+                    struct timeval delta = {1, 0};
+                    timeradd(&last_exit, &delta, &j.drain_deadline);
+                    if (j.pidfd >= 0)
+                        close(j.pidfd);
+                    j.pidfd = -1;
+                }
+        }
+
+        gettimeofday(&now, NULL);
+        for (size_t i = 0; i != jobs.size(); ++i) {
+            job& j = jobs[i];
+            if (j.ptymaster < 0)
+                continue;
+
+            // copy output until the pty has nothing more; once the output
+            // file fails, keep reading but discard
+            buffer& b = j.from_slave;
+            size_t ohead, otail;
+            do {
+                ohead = b.head;
+                otail = b.tail;
+                b.transfer_in(j.ptymaster);
+                b.transfer_out(j.outfd);
+                if (b.output_closed)
+                    b.head = b.tail = 0;
+            } while (!b.input_closed
+                     && (b.head != ohead || b.tail != otail));
+
+            // enforce timeout and termination: SIGTERM, then SIGKILL after
+            // `kill_grace` seconds. The job's process group is signaled
+            // even after the command exits, since it may have left
+            // background processes behind
+            if (!j.timed_out
+                && (got_sigterm
+                    || (timerisset(&j.deadline)
+                        && timercmp(&now, &j.deadline, >)))) {
+                j.timed_out = true;
+                struct timeval delta;
+                delta.tv_sec = (long) kill_grace;
+                delta.tv_usec = (long) ((kill_grace - delta.tv_sec) * 1000000);
+                timeradd(&now, &delta, &j.kill_deadline);
+                signal_job(j, SIGTERM);
+            } else if (timerisset(&j.kill_deadline)
+                       && !timercmp(&now, &j.kill_deadline, <)) {
+                timerclear(&j.kill_deadline);
+                signal_job(j, SIGKILL);
+            }
+            if (timerisset(&j.drain_deadline) && !b.input_closed
+                && !timercmp(&now, &j.drain_deadline, <)) {
+                signal_job(j, SIGKILL);
+                b.input_closed = true;
+            }
+
+            // finished when the command exited and its output drained
+            if (j.status >= 0
+                && (j.from_slave.input_closed || j.from_slave.output_closed)) {
+                char fname[64], buf[64];
+                sprintf(fname, "%zu.status", i);
+                int fd = openat(multi_dirfd, fname, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+                int len = sprintf(buf, "%d\n", j.status);
+                if (fd < 0 || write(fd, buf, len) != len)
+                    perror_fail("%s: %s\n", fname);
+                if (fd >= 0)
+                    close(fd);
+                struct timeval elapsed;
+                timersub(&now, &j.start, &elapsed);
+                printf("%zu\t%d\t%ld.%03ld\t%s\n", i, j.status,
+                       (long) elapsed.tv_sec, (long) elapsed.tv_usec / 1000,
+                       multi_commands[i].c_str());
+                fflush(stdout);
+                close(j.ptymaster);
+                close(j.outfd);
+                j.ptymaster = j.outfd = -1;
+                if (j.timed_out && j.status == 124)
+                    run_events.emit("job-timeout", "\"job\":%zu", i);
+                run_events.emit("job-exited", "\"job\":%zu,\"status\":%d", i, j.status);
+                if (j.status != 0 && exit_status == 0)
+                    exit_status = 1;
+                --nrunning;
+                ++nfinished;
+            }
+        }
+
+        // on SIGTERM, commands not yet started are never run
+        if (got_sigterm && nrunning == 0) {
+            exit_status = 128 + SIGTERM;
+            break;
+        }
     }
 
-    return 0;
+    exec_done(-1, exit_status);
 }
 
-extern "C" {
-void sighandler(int signo) {
-    if (signo == SIGTERM)
-        got_sigterm = 1;
-    char c = (char) signo;
-    ssize_t w = write(sigpipe[1], &c, 1);
-    (void) w;
+
+// file-access tracing
+//
+// `pa-jail trace` runs a command under ptrace, with a seccomp filter that
+// stops the tracee only for path-based file, stat, and exec system calls.
+// Every other system call runs at full speed. Paths that were accessed
+// successfully (or failed with something other than ENOENT) are written
+// out as a sorted, deduplicated manifest.
+
+#if __linux__
+#if defined(__x86_64__)
+# define TRACE_AUDIT_ARCH AUDIT_ARCH_X86_64
+#elif defined(__aarch64__)
+# define TRACE_AUDIT_ARCH AUDIT_ARCH_AARCH64
+#endif
+#endif
+
+#ifdef TRACE_AUDIT_ARCH
+struct tracesyscall {
+    long nr;
+    int dirfd_arg;              // -1 if path is relative to cwd
+    int path_arg;
+    bool exec;
+};
+
+static const tracesyscall tracesyscalls[] = {
+#ifdef __NR_open
+    { __NR_open, -1, 0, false },
+#endif
+#ifdef __NR_stat
+    { __NR_stat, -1, 0, false },
+#endif
+#ifdef __NR_lstat
+    { __NR_lstat, -1, 0, false },
+#endif
+#ifdef __NR_access
+    { __NR_access, -1, 0, false },
+#endif
+#ifdef __NR_readlink
+    { __NR_readlink, -1, 0, false },
+#endif
+#ifdef __NR_openat2
+    { __NR_openat2, 0, 1, false },
+#endif
+#ifdef __NR_faccessat2
+    { __NR_faccessat2, 0, 1, false },
+#endif
+#ifdef __NR_statx
+    { __NR_statx, 0, 1, false },
+#endif
+    { __NR_openat, 0, 1, false },
+    { __NR_newfstatat, 0, 1, false },
+    { __NR_faccessat, 0, 1, false },
+    { __NR_readlinkat, 0, 1, false },
+    { __NR_execve, -1, 0, true },
+    { __NR_execveat, 0, 1, true }
+};
+
+struct tracee {
+    const tracesyscall* sc;
+    std::string path;
+};
+
+static void install_trace_filter() {
+    std::vector<struct sock_filter> f;
+    f.push_back((struct sock_filter) BPF_STMT(BPF_LD | BPF_W | BPF_ABS, offsetof(struct seccomp_data, arch)));
+    f.push_back((struct sock_filter) BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, TRACE_AUDIT_ARCH, 1, 0));
+    f.push_back((struct sock_filter) BPF_STMT(BPF_RET | BPF_K, SECCOMP_RET_ALLOW));
+    f.push_back((struct sock_filter) BPF_STMT(BPF_LD | BPF_W | BPF_ABS, offsetof(struct seccomp_data, nr)));
+    size_t n = sizeof(tracesyscalls) / sizeof(tracesyscalls[0]);
+    for (size_t i = 0; i != n; ++i)
+        f.push_back((struct sock_filter) BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, (__u32) tracesyscalls[i].nr, (__u8) (n - i), 0));
+    f.push_back((struct sock_filter) BPF_STMT(BPF_RET | BPF_K, SECCOMP_RET_ALLOW));
+    f.push_back((struct sock_filter) BPF_STMT(BPF_RET | BPF_K, SECCOMP_RET_TRACE));
+    struct sock_fprog prog;
+    prog.len = f.size();
+    prog.filter = f.data();
+    if (prctl(PR_SET_NO_NEW_PRIVS, 1, 0, 0, 0) != 0
+        || prctl(PR_SET_SECCOMP, SECCOMP_MODE_FILTER, &prog) != 0)
+        perror_die("seccomp");
 }
 
-void cleanup_pidfd(void) {
-    if (pidfd >= 0)
-        write_pid(0);
+static bool trace_getregs(pid_t pid, unsigned long long args[8]) {
+#if defined(__x86_64__)
+    struct user_regs_struct regs;
+#else
+    struct user_pt_regs regs;
+#endif
+    struct iovec iov;
+    iov.iov_base = &regs;
+    iov.iov_len = sizeof(regs);
+    if (ptrace(PTRACE_GETREGSET, pid, (void*) NT_PRSTATUS, &iov) != 0)
+        return false;
+#if defined(__x86_64__)
+    args[0] = regs.rdi, args[1] = regs.rsi, args[2] = regs.rdx;
+    args[3] = regs.r10, args[4] = regs.r8, args[5] = regs.r9;
+    args[6] = regs.rax;         // return value at syscall exit
+    args[7] = regs.orig_rax;    // system call number
+#else
+    for (int i = 0; i != 6; ++i)
+        args[i] = regs.regs[i];
+    args[6] = regs.regs[0];
+    args[7] = regs.regs[8];
+#endif
+    return true;
 }
+
+static std::string trace_readstring(pid_t pid, unsigned long long addr) {
+    std::string s;
+    char buf[4096];
+    while (s.length() < 4096) {
+        size_t n = 4096 - (addr & 4095);
+        struct iovec local = { buf, n }, remote = { (void*) addr, n };
+        ssize_t nr = process_vm_readv(pid, &local, 1, &remote, 1, 0);
+        if (nr <= 0)
+            break;
+        size_t len = strnlen(buf, nr);
+        s.append(buf, len);
+        if (len < (size_t) nr)
+            return s;
+        addr += nr;
+    }
+    return std::string();
 }
 
-static void make_nonblocking(int fd) {
-    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+static bool trace_excluded(const std::string& path,
+                           const std::vector<std::string>& excludes) {
+    static const char* const prefixes[] = {
+        "/home/", "/tmp/", "/proc/", "/sys/", "/dev/pts/", "/run/"
+    };
+    for (auto p : prefixes)
+        if (path.compare(0, strlen(p), p) == 0)
+            return true;
+    for (auto& x : excludes)
+        if (fnmatch(x.c_str(), path.c_str(), 0) == 0)
+            return true;
+    struct stat st;
+    return lstat(path.c_str(), &st) != 0;
 }
 
-void jailownerinfo::start_sigpipe() {
-    int r = pipe(sigpipe);
-    if (r != 0)
-        perror_die("pipe");
-    make_nonblocking(inputfd);
-    make_nonblocking(STDOUT_FILENO);
-    make_nonblocking(sigpipe[0]);
-    make_nonblocking(sigpipe[1]);
+static int trace_command(char** argv, const std::string& outfile,
+                         const std::vector<std::string>& excludes) {
+    std::vector<std::string> files, existing;
+    if (!outfile.empty() && outfile != "-")
+        if (FILE* f = fopen(outfile.c_str(), "r")) {
+            char buf[BUFSIZ];
+            while (fgets(buf, sizeof(buf), f)) {
+                buf[strcspn(buf, "\n")] = 0;
+                if (buf[0])
+                    existing.push_back(buf);
+            }
+            fclose(f);
+        }
 
-    struct sigaction sa;
-    sa.sa_handler = sighandler;
-    sigemptyset(&sa.sa_mask);
-    sa.sa_flags = 0;
-    sigaction(SIGCHLD, &sa, NULL);
-    sigaction(SIGTERM, &sa, NULL);
+    pid_t child = fork();
+    if (child == 0) {
+        if (ptrace(PTRACE_TRACEME, 0, 0, 0) != 0)
+            perror_die("ptrace");
+        raise(SIGSTOP);
+        install_trace_filter();
+        execvp(argv[0], argv);
+        fprintf(stderr, "%s: %s\n", argv[0], strerror(errno));
+        _exit(errno == ENOENT ? 127 : 126);
+    } else if (child < 0)
+        perror_die("fork");
 
-    FD_ZERO(&readset);
-    FD_ZERO(&writeset);
+    int status;
+    if (waitpid(child, &status, 0) != child || !WIFSTOPPED(status))
+        die("%s: Could not trace\n", argv[0]);
+    if (ptrace(PTRACE_SETOPTIONS, child, 0,
+               PTRACE_O_TRACESECCOMP | PTRACE_O_TRACESYSGOOD
+               | PTRACE_O_TRACEFORK | PTRACE_O_TRACEVFORK
+               | PTRACE_O_TRACECLONE | PTRACE_O_TRACEEXEC
+               | PTRACE_O_EXITKILL) != 0)
+        perror_die("ptrace");
+    ptrace(PTRACE_CONT, child, 0, 0);
+
+    std::unordered_map<pid_t, tracee> tracees;
+    int exit_status = 125;
+    while (1) {
+        pid_t pid = waitpid(-1, &status, __WALL);
+        if (pid == -1 && errno == EINTR)
+            continue;
+        else if (pid == -1)
+            break;
+        if (WIFEXITED(status) || WIFSIGNALED(status)) {
+            if (pid == child)
+                exit_status = WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+            tracees.erase(pid);
+            continue;
+        }
+
+        int sig = WSTOPSIG(status), event = status >> 16, cont_sig = 0;
+        __ptrace_request cont_op = PTRACE_CONT;
+        unsigned long long args[8];
+        if (sig == SIGTRAP && event == PTRACE_EVENT_SECCOMP) {
+            // syscall entry: remember the path, stop again at exit
+            const tracesyscall* sc = nullptr;
+            if (trace_getregs(pid, args))
+                for (auto& x : tracesyscalls)
+                    if ((unsigned long long) x.nr == args[7])
+                        sc = &x;
+            tracee& t = tracees[pid];
+            t.sc = nullptr;
+            if (sc) {
+                std::string path = trace_readstring(pid, args[sc->path_arg]);
+                if (!path.empty() && path[0] != '/') {
+                    char lnk[64], buf[4096];
+                    int dirfd = sc->dirfd_arg < 0 ? AT_FDCWD : (int) args[sc->dirfd_arg];
+                    if (dirfd == AT_FDCWD)
+                        sprintf(lnk, "/proc/%d/cwd", (int) pid);
+                    else
+                        sprintf(lnk, "/proc/%d/fd/%d", (int) pid, dirfd);
+                    ssize_t nr = readlink(lnk, buf, sizeof(buf));
+                    path = nr > 0 ? std::string(buf, nr) + "/" + path : std::string();
+                }
+                if (!path.empty()) {
+                    t.sc = sc;
+                    t.path = path;
+                    cont_op = PTRACE_SYSCALL;
+                }
+            }
+        } else if (sig == (SIGTRAP | 0x80)) {
+            // syscall exit
+            auto it = tracees.find(pid);
+            if (it != tracees.end() && it->second.sc && trace_getregs(pid, args)) {
+                long r = (long) args[6];
+                if ((r >= 0 || (r != -ENOENT && r != -ENOTDIR))
+                    && !it->second.path.empty())
+                    files.push_back(path_normalize(it->second.path));
+                it->second.sc = nullptr;
+            }
+        } else if (sig == SIGTRAP && event != 0) {
+            // fork, clone, exec
+            auto it = tracees.find(pid);
+            if (event == PTRACE_EVENT_EXEC && it != tracees.end() && it->second.sc) {
+                // executed files carry their libraries via [elf]
+                files.push_back(path_normalize(it->second.path) + " [elf]");
+                it->second.sc = nullptr;
+            }
+        } else if (sig != SIGSTOP || tracees.count(pid))
+            cont_sig = sig;
+        else
+            tracees[pid].sc = nullptr; // initial stop of new tracee
+        ptrace(cont_op, pid, 0, (void*) (long) cont_sig);
+    }
+
+    for (auto& f : files)
+        if (!f.empty() && f[0] == '/'
+            && !trace_excluded(f.substr(0, f.find(' ')), excludes))
+            existing.push_back(f);
+    std::sort(existing.begin(), existing.end());
+    existing.erase(std::unique(existing.begin(), existing.end()), existing.end());
+    FILE* out = stdout;
+    if (!outfile.empty() && outfile != "-" && !(out = fopen(outfile.c_str(), "w")))
+        perror_die(outfile);
+    for (auto it = existing.begin(); it != existing.end(); ++it)
+        // skip `F` if followed by `F [elf]`
+        if (it + 1 == existing.end()
+            || it[1].length() != it->length() + 6
+            || it[1].compare(0, it->length() + 1, *it + " ") != 0)
+            fprintf(out, "%s\n", it->c_str());
+    if (out != stdout)
+        fclose(out);
+    return exit_status;
 }
+#else
+static int trace_command(char** argv, const std::string&,
+                         const std::vector<std::string>&) {
+    die("%s: pa-jail trace is not supported on this platform\n", argv[0]);
+}
+#endif
 
-void jailownerinfo::buffer::transfer_in(int from) {
-    if (tail == sizeof(buf) && head != 0) {
-        memmove(buf, &buf[head], tail - head);
-        tail -= head;
-        head = 0;
+// checkout
+//
+// `pa-jail checkout REPODIR COMMIT[:SUBDIR] DEST` writes the tree of COMMIT
+// (or its SUBDIR) into DEST, reading REPODIR's object store directly, so
+// no `.git` is created in the jail. It runs entirely as the caller. With
+// `--blob-cache DIR`, blob contents are kept in DIR by object ID and each
+// file is reflinked (or copied) from there, so unchanged files cost no
+// decompression on later runs. Files are never hard-linked to the cache,
+// since jailed commands can modify and chown them.
+
+struct checkoutinfo {
+    gitrepo repo;
+    int cachefd = -1;
+    unsigned long nfiles = 0;
+    unsigned long ncached = 0;
+};
+
+static bool checkout_name_ok(const std::string& name) {
+    return !name.empty() && name != "." && name != ".."
+        && name.find('/') == std::string::npos
+        && strcasecmp(name.c_str(), ".git") != 0;
+}
+
+// Return a read-only fd for blob `oid`'s contents in the blob cache,
+// adding it if necessary.
+static int checkout_cached_blob(checkoutinfo& ci, const gitoid& oid) {
+    std::string hex = oid.hex();
+    std::string fn = hex.substr(0, 2) + "/" + hex.substr(2);
+    int fd = openat(ci.cachefd, fn.c_str(), O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+    if (fd >= 0) {
+        ++ci.ncached;
+        return fd;
     }
 
-    if (from >= 0 && !input_closed && tail != sizeof(buf)) {
-        ssize_t nr = read(from, &buf[tail], sizeof(buf) - tail);
-        if (nr != 0 && nr != -1)
-            tail += nr;
-        else if (nr == 0)
-            input_closed = true;
-        else if (nr == -1 && errno != EINTR && errno != EAGAIN) {
-            input_closed = true;
-            rerrno = errno;
-        }
+    gitobj_type type;
+    std::string data;
+    if (!ci.repo.read(oid, type, data) || type != gitobj_blob)
+        return -1;
+    if (mkdirat(ci.cachefd, hex.substr(0, 2).c_str(), 0777) != 0 && errno != EEXIST)
+        return -1;
+    char tmpfn[64];
+    sprintf(tmpfn, "%s.%d.tmp", fn.c_str(), (int) getpid());
+    fd = openat(ci.cachefd, tmpfn, O_RDWR | O_CREAT | O_TRUNC | O_NOFOLLOW | O_CLOEXEC, 0444);
+    if (fd == -1)
+        return -1;
+    if (write(fd, data.data(), data.length()) != (ssize_t) data.length()
+        || renameat(ci.cachefd, tmpfn, ci.cachefd, fn.c_str()) != 0) {
+        int saved_errno = errno;
+        close(fd);
+        unlinkat(ci.cachefd, tmpfn, 0);
+        errno = saved_errno;
+        return -1;
     }
+    lseek(fd, 0, SEEK_SET);
+    return fd;
+}
 
-    if (input_closed && transfer_eof && tail != sizeof(buf)) {
-        buf[tail] = VEOF;
-        ++tail;
-        transfer_eof = false;
+static void checkout_blob(checkoutinfo& ci, int dirfd, const std::string& path,
+                          const gittree_entry& e) {
+    if (unlinkat(dirfd, e.name.c_str(), 0) != 0 && errno != ENOENT) {
+        perror_fail("%s: %s\n", path.c_str());
+        return;
+    }
+
+    gitobj_type type;
+    std::string data;
+    if (e.is_symlink()) {
+        if (!ci.repo.read(e.oid, type, data) || type != gitobj_blob)
+            die("%s: %s\n", path.c_str(), ci.repo.error().c_str());
+        if (symlinkat(data.c_str(), dirfd, e.name.c_str()) != 0)
+            perror_fail("%s: %s\n", path.c_str());
+        return;
+    }
+
+    ++ci.nfiles;
+    int srcfd = -1;
+    if (ci.cachefd >= 0 && (srcfd = checkout_cached_blob(ci, e.oid)) == -1)
+        perror_fail("%s: %s\n", "blob cache");
+    if (srcfd == -1
+        && (!ci.repo.read(e.oid, type, data) || type != gitobj_blob))
+        die("%s: %s\n", path.c_str(), ci.repo.error().c_str());
+
+    int fd = openat(dirfd, e.name.c_str(),
+                    O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW | O_CLOEXEC,
+                    e.mode == 0100755 ? 0777 : 0666);
+    bool ok = fd >= 0;
+    if (ok && srcfd >= 0)
+        ok = x_copy_data(srcfd, fd);
+    else if (ok)
+        ok = write(fd, data.data(), data.length()) == (ssize_t) data.length();
+    if (!ok)
+        perror_fail("%s: %s\n", path.c_str());
+    if (fd >= 0)
+        close(fd);
+    if (srcfd >= 0)
+        close(srcfd);
+}
+
+static void checkout_tree(checkoutinfo& ci, int dirfd, const std::string& path,
+                          const gitoid& tree) {
+    std::vector<gittree_entry> entries;
+    if (!ci.repo.read_tree(tree, entries))
+        die("%s: %s\n", path.c_str(), ci.repo.error().c_str());
+    for (auto& e : entries) {
+        std::string epath = path + "/" + e.name;
+        if (!checkout_name_ok(e.name)) {
+            fprintf(stderr, "%s: Bad file name, skipping\n", epath.c_str());
+            continue;
+        }
+        if (verbose)
+            fprintf(verbosefile, "%06o %s %s\n", e.mode, e.oid.hex().c_str(), epath.c_str());
+        if (e.is_tree() || e.is_submodule()) {
+            int subfd = -1;
+            if ((mkdirat(dirfd, e.name.c_str(), 0777) != 0 && errno != EEXIST)
+                || (!e.is_submodule()
+                    && (subfd = openat(dirfd, e.name.c_str(), O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC)) == -1))
+                perror_fail("%s: %s\n", epath.c_str());
+            else if (subfd >= 0) {
+                checkout_tree(ci, subfd, epath, e.oid);
+                close(subfd);
+            }
+        } else
+            checkout_blob(ci, dirfd, epath, e);
     }
 }
 
-void jailownerinfo::buffer::transfer_out(int to) {
-    if (to >= 0 && !output_closed && head != tail) {
-        ssize_t nw = write(to, &buf[head], tail - head);
-        if (nw != 0 && nw != -1)
-            head += nw;
-        else if (errno != EINTR && errno != EAGAIN)
-            output_closed = true;
+static int checkout_command(const std::string& repodir, const std::string& spec,
+                            const std::string& dest, const std::string& blobcache) {
+    checkoutinfo ci;
+    if (!ci.repo.open(repodir))
+        die("%s\n", ci.repo.error().c_str());
+
+    size_t colon = spec.find(':');
+    std::string commit = spec.substr(0, colon), subdir;
+    if (colon != std::string::npos)
+        subdir = spec.substr(colon + 1);
+    gitoid oid, tree;
+    gittree_entry top;
+    if (!ci.repo.resolve(commit, oid)
+        || !ci.repo.commit_tree(oid, tree)
+        || !ci.repo.lookup_path(tree, subdir, top))
+        die("%s\n", ci.repo.error().c_str());
+    if (!top.is_tree())
+        die("%s: Not a directory\n", spec.c_str());
+
+    if (!blobcache.empty()) {
+        if (mkdir(blobcache.c_str(), 0777) != 0 && errno != EEXIST)
+            perror_die(blobcache);
+        ci.cachefd = open(blobcache.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (ci.cachefd == -1)
+            perror_die(blobcache);
     }
+    if (mkdir(dest.c_str(), 0777) != 0 && errno != EEXIST)
+        perror_die(dest);
+    int destfd = open(dest.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (destfd == -1)
+        perror_die(dest);
+
+    checkout_tree(ci, destfd, dest, top.oid);
+    close(destfd);
+    if (verbose)
+        fprintf(verbosefile, "checkout %s: %lu files, %lu from blob cache\n",
+                oid.hex().c_str(), ci.nfiles, ci.ncached);
+    return exit_value;
 }
 
-void jailownerinfo::block(int ptymaster) {
-    int maxfd = sigpipe[0];
-    FD_SET(sigpipe[0], &readset);
-
-    if (!to_slave.input_closed && !to_slave.output_closed) {
-        FD_SET(inputfd, &readset);
-        maxfd < inputfd && (maxfd = inputfd);
-    } else
-        FD_CLR(inputfd, &readset);
-    if (!to_slave.output_closed && to_slave.head != to_slave.tail) {
-        FD_SET(ptymaster, &writeset);
-        maxfd < ptymaster && (maxfd = ptymaster);
-    } else
-        FD_CLR(ptymaster, &writeset);
+// overlays
+//
+// `pa-jail overlay [--overlay-cache DIR] TARBALL DEST` unpacks a pset
+// overlay into a checkout, then carries out the `rm:` lines of the
+// `.gitcheckout` file in DEST. With a cache, each tarball is unpacked by
+// `tar` only once, into DIR/DIGEST (the SHA-1 of the tarball), and copied
+// from there by reflink where possible; nothing is decompressed again.
+// Each cached tree's size is recorded in DIR/DIGEST.size; once the cache
+// exceeds --cache-size, the least recently used trees are removed.
+// `rm:` paths are relative to DEST and may not leave it. Runs as the
+// caller.
+
+#define OVERLAY_CACHE_DEFAULT_SIZE ((off_t) 1 << 30)
+static off_t overlay_cache_size = OVERLAY_CACHE_DEFAULT_SIZE;
+
+static std::string file_sha1(const std::string& fn) {
+    int fd = open(fn.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd == -1)
+        perror_die(fn);
+    sha1_context ctx;
+    char buf[65536];
+    ssize_t nr;
+    while ((nr = read(fd, buf, sizeof(buf))) > 0 || (nr == -1 && errno == EINTR))
+        if (nr > 0)
+            ctx.update(buf, nr);
+    if (nr == -1)
+        perror_die(fn);
+    close(fd);
+    return ctx.hexdigest();
+}
 
-    if (!from_slave.input_closed && !from_slave.output_closed) {
-        FD_SET(ptymaster, &readset);
-        maxfd < ptymaster && (maxfd = ptymaster);
-    } else
-        FD_CLR(ptymaster, &readset);
-    if (!from_slave.output_closed && from_slave.head != from_slave.tail) {
-        FD_SET(STDOUT_FILENO, &writeset);
-        maxfd < STDOUT_FILENO && (maxfd = STDOUT_FILENO);
-    } else
-        FD_CLR(STDOUT_FILENO, &writeset);
+static int x_tar_extract(const std::string& tarball, const std::string& dir) {
+    if (verbose)
+        fprintf(verbosefile, "tar -xf %s -C %s\n",
+                shell_quote(tarball).c_str(), shell_quote(dir).c_str());
+    pid_t p = fork();
+    if (p == 0) {
+        const char* args[] = {
+            "tar", "-xf", tarball.c_str(), "-C", dir.c_str(), nullptr
+        };
+        execvp("tar", (char**) args);
+        perror("tar");
+        _exit(127);
+    } else if (p == -1)
+        perror_die("fork");
+    return x_waitpid(p, 0).second;
+}
 
-    struct timeval delay = {3600, 0};
-    if (timerisset(&timeout)) {
-        gettimeofday(&delay, 0);
-        timersub(&timeout, &delay, &delay);
+// Remove `name` in `dirfd`, recursively, without following symlinks.
+static void x_rm_rf(int dirfd, const char* name, const std::string& path) {
+    if (unlinkat(dirfd, name, 0) == 0 || errno == ENOENT)
+        return;
+    if (errno != EISDIR && errno != EPERM) {
+        perror_fail("rm %s: %s\n", path.c_str());
+        return;
     }
-    select(maxfd + 1, &readset, &writeset, NULL, &delay);
-
-    if (FD_ISSET(sigpipe[0], &readset)) {
-        char buf[128];
-        while (read(sigpipe[0], buf, sizeof(buf)) > 0)
-            /* skip */;
+    int fd = openat(dirfd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    DIR* dir = fd == -1 ? nullptr : fdopendir(fd);
+    if (!dir) {
+        perror_fail("rm %s: %s\n", path.c_str());
+        return;
     }
+    // a read-only directory (say, from a tarball) must be emptied too
+    struct stat st;
+    if (fstat(fd, &st) == 0 && (st.st_mode & 0700) != 0700)
+        (void) fchmod(fd, (st.st_mode & 07777) | 0700);
+    while (struct dirent* de = readdir(dir))
+        if (strcmp(de->d_name, ".") != 0 && strcmp(de->d_name, "..") != 0)
+            x_rm_rf(fd, de->d_name, path + "/" + de->d_name);
+    closedir(dir);
+    if (unlinkat(dirfd, name, AT_REMOVEDIR) != 0)
+        perror_fail("rm %s: %s\n", path.c_str());
 }
 
-int jailownerinfo::check_child_timeout(pid_t child, bool waitpid) {
-    std::pair<pid_t, int> xr;
-    do {
-        xr = x_waitpid(-1, WNOHANG);
-        if (xr.first == child)
-            child_status = xr.second;
-    } while (xr.first != -1);
-    if (errno != EAGAIN && errno != ECHILD)
-        return 125;
-
-    if (child_status >= 0 && waitpid)
-        return child_status;
-
-    if (got_sigterm)
-        return 128 + SIGTERM;
-
-    struct timeval now;
-    if (timerisset(&timeout)
-        && gettimeofday(&now, NULL) == 0
-        && timercmp(&now, &timeout, >))
-        return 124;
+static void overlay_copy_tree(int srcfd, int dstfd, const std::string& path) {
+    int fd = dup(srcfd);
+    DIR* dir = fd == -1 ? nullptr : fdopendir(fd);
+    if (!dir)
+        perror_die(path);
+    while (struct dirent* de = readdir(dir)) {
+        const char* name = de->d_name;
+        if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0)
+            continue;
+        std::string npath = path + "/" + name;
+        struct stat st, dst;
+        if (fstatat(srcfd, name, &st, AT_SYMLINK_NOFOLLOW) != 0) {
+            perror_fail("%s: %s\n", npath.c_str());
+            continue;
+        }
+        bool dst_exists = fstatat(dstfd, name, &dst, AT_SYMLINK_NOFOLLOW) == 0;
+        if (verbose)
+            fprintf(verbosefile, "%s %s\n", S_ISDIR(st.st_mode) ? "mkdir" : "cp",
+                    npath.c_str());
+        if (dst_exists
+            && (!S_ISDIR(st.st_mode) || !S_ISDIR(dst.st_mode))) {
+            // like tar, replace what is there
+            if (S_ISDIR(dst.st_mode))
+                x_rm_rf(dstfd, name, npath);
+            else if (unlinkat(dstfd, name, 0) != 0)
+                perror_fail("rm %s: %s\n", npath.c_str());
+            dst_exists = false;
+        }
 
-    errno = EAGAIN;
-    return -1;
+        if (S_ISDIR(st.st_mode)) {
+            // like tar, a directory gets its mode and modification time
+            // once its contents are in place, so read-only directories work
+            if (!dst_exists && mkdirat(dstfd, name, 0700) != 0) {
+                perror_fail("mkdir %s: %s\n", npath.c_str());
+                continue;
+            }
+            int s = openat(srcfd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+            int d = openat(dstfd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+            if (s >= 0 && d >= 0) {
+                if (dst_exists && (dst.st_mode & 0700) != 0700)
+                    (void) fchmod(d, (dst.st_mode & 07777) | 0700);
+                overlay_copy_tree(s, d, npath);
+                struct timespec ts[2] = { st.st_mtim, st.st_mtim };
+                if (fchmod(d, st.st_mode & 07777) != 0
+                    || futimens(d, ts) != 0)
+                    perror_fail("%s: %s\n", npath.c_str());
+            } else
+                perror_fail("%s: %s\n", npath.c_str());
+            if (s >= 0)
+                close(s);
+            if (d >= 0)
+                close(d);
+        } else if (S_ISREG(st.st_mode)) {
+            int s = openat(srcfd, name, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+            int d = openat(dstfd, name, O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW | O_CLOEXEC,
+                           st.st_mode & 0777);
+            // keep tarball modification times, which `make` may depend on
+            struct timespec ts[2] = { st.st_mtim, st.st_mtim };
+            if (s == -1 || d == -1 || !x_copy_data(s, d) || futimens(d, ts) != 0)
+                perror_fail("%s: %s\n", npath.c_str());
+            if (s >= 0)
+                close(s);
+            if (d >= 0)
+                close(d);
+        } else if (S_ISLNK(st.st_mode)) {
+            char lnk[PATH_MAX];
+            ssize_t l = readlinkat(srcfd, name, lnk, sizeof(lnk) - 1);
+            if (l >= 0)
+                lnk[l] = '\0';
+            if (l < 0 || symlinkat(lnk, dstfd, name) != 0)
+                perror_fail("%s: %s\n", npath.c_str());
+        }
+    }
+    closedir(dir);
 }
 
-void jailownerinfo::wait_background(pid_t child, int ptymaster) {
-    // go back to being the caller
-    // XXX (preserve the saved root identity just in case)
-    if (setresuid(ROOT, ROOT, ROOT) != 0
-        || setresgid(caller_group, caller_group, ROOT) != 0
-        || setresuid(caller_owner, caller_owner, ROOT) != 0) {
-        perror("setresuid");
-        exec_done(child, 127);
+// Return the disk usage of the tree at `dirfd`.
+static off_t tree_size(int dirfd) {
+    off_t size = 0;
+    int fd = dup(dirfd);
+    DIR* dir = fd == -1 ? nullptr : fdopendir(fd);
+    if (!dir) {
+        if (fd >= 0)
+            close(fd);
+        return 0;
+    }
+    while (struct dirent* de = readdir(dir)) {
+        struct stat st;
+        if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0
+            || fstatat(dirfd, de->d_name, &st, AT_SYMLINK_NOFOLLOW) != 0)
+            continue;
+        size += st.st_blocks * 512;
+        int sub;
+        if (S_ISDIR(st.st_mode)
+            && (sub = openat(dirfd, de->d_name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC)) >= 0) {
+            size += tree_size(sub);
+            close(sub);
+        }
     }
+    closedir(dir);
+    return size;
+}
 
-    // if input is a tty, put it in non-canonical mode
-    struct termios tty;
-    if (tcgetattr(STDIN_FILENO, &stdin_termios) >= 0) {
-        has_stdin_termios = true;
-        tty = stdin_termios;
-        // Noncanonical mode, disable signals, no echoing
-        tty.c_lflag &= ~(ICANON | ISIG | ECHO);
-        // Character-at-a-time input with blocking
-        tty.c_cc[VMIN] = 1;
-        tty.c_cc[VTIME] = 0;
-        (void) tcsetattr(STDIN_FILENO, TCSAFLUSH, &tty);
+// Remove least recently used trees from the overlay cache until it is
+// under 90% of `overlay_cache_size`. A tree's directory modification time
+// is its last use. Trees used in the last minute, and trees whose size is
+// not yet recorded, are left alone; so are temporary directories less than
+// a day old.
+static void overlay_trim_cache(const std::string& cachedir) {
+    int dirfd = open(cachedir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    int fd = dirfd == -1 ? -1 : dup(dirfd);
+    DIR* dir = fd == -1 ? nullptr : fdopendir(fd);
+    if (!dir) {
+        if (fd >= 0)
+            close(fd);
+        if (dirfd >= 0)
+            close(dirfd);
+        return;
+    }
+    std::vector<std::pair<time_t, std::pair<std::string, off_t>>> order;
+    off_t total = 0;
+    time_t now = time(NULL);
+    while (struct dirent* de = readdir(dir)) {
+        const char* dot = strchr(de->d_name, '.');
+        struct stat st;
+        if (!dot || dot == de->d_name)
+            continue;
+        std::string digest(de->d_name, dot - de->d_name);
+        if (strstr(dot, ".tmp")) {
+            if (fstatat(dirfd, de->d_name, &st, AT_SYMLINK_NOFOLLOW) == 0
+                && st.st_mtime < now - 86400)
+                x_rm_rf(dirfd, de->d_name, path_endslash(cachedir) + de->d_name);
+            continue;
+        }
+        if (strcmp(dot, ".size") != 0
+            || fstatat(dirfd, digest.c_str(), &st, AT_SYMLINK_NOFOLLOW) != 0
+            || !S_ISDIR(st.st_mode))
+            continue;
+        int sfd = openat(dirfd, de->d_name, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+        char buf[32];
+        ssize_t nr = sfd == -1 ? -1 : read(sfd, buf, sizeof(buf) - 1);
+        if (sfd >= 0)
+            close(sfd);
+        if (nr <= 0)
+            continue;
+        buf[nr] = '\0';
+        off_t size = strtoll(buf, nullptr, 10);
+        total += size;
+        if (st.st_mtime < now - 60)
+            order.push_back(std::make_pair(st.st_mtime, std::make_pair(digest, size)));
     }
+    closedir(dir);
 
-    if (tcgetattr(ptymaster, &tty) >= 0) {
-        // blocking reads please (well, block for up to 0.5sec)
-        // the 0.5sec wait means we avoid long race conditions
-        tty.c_cc[VMIN] = 1;
-        tty.c_cc[VTIME] = 5;
-        // disable echo so we don't read our own input
-        tty.c_lflag &= ~ECHO;
-        tcsetattr(ptymaster, TCSANOW, &tty);
+    if (total > overlay_cache_size) {
+        std::sort(order.begin(), order.end());
+        off_t goal = overlay_cache_size - overlay_cache_size / 10;
+        for (auto& o : order) {
+            if (total <= goal)
+                break;
+            // move the tree aside first, so no copy starts from it
+            const std::string& digest = o.second.first;
+            std::string tmp = digest + "." + std::to_string((long) getpid()) + ".rm.tmp";
+            unlinkat(dirfd, (digest + ".size").c_str(), 0);
+            if (renameat(dirfd, digest.c_str(), dirfd, tmp.c_str()) == 0)
+                x_rm_rf(dirfd, tmp.c_str(), path_endslash(cachedir) + tmp);
+            total -= o.second.second;
+        }
     }
-    make_nonblocking(ptymaster);
-    fflush(stdout);
-    to_slave.transfer_eof = true;
+    close(dirfd);
+}
 
-    while (1) {
-        block(ptymaster);
-        to_slave.transfer_in(inputfd);
-        if (to_slave.head != to_slave.tail
-            && memmem(&to_slave.buf[to_slave.head], to_slave.tail - to_slave.head,
-                      "\x1b\x03", 2) != NULL)
-            exec_done(child, 128 + SIGTERM);
-        to_slave.transfer_out(ptymaster);
-        from_slave.transfer_in(ptymaster);
-        from_slave.transfer_out(STDOUT_FILENO);
+// Carry out `rm:` lines from DEST/.gitcheckout.
+static void overlay_gitcheckout(int destfd, const std::string& dest) {
+    int fd = openat(destfd, ".gitcheckout", O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+    if (fd == -1)
+        return;
+    std::string text;
+    char buf[8192];
+    ssize_t nr;
+    while ((nr = read(fd, buf, sizeof(buf))) > 0)
+        text.append(buf, nr);
+    close(fd);
 
-        // check child and timeout
-        // (only wait for child if read done/failed)
-        int exit_status = check_child_timeout(child, from_slave.input_closed);
-        if (exit_status != -1)
-            exec_done(child, exit_status);
+    size_t pos = 0;
+    while (pos < text.length()) {
+        size_t nl = std::min(text.find('\n', pos), text.length());
+        std::string line = text.substr(pos, nl - pos);
+        pos = nl + 1;
+        if (line.compare(0, 3, "rm:") != 0)
+            continue;
 
-        // if child has not died, and read produced error, report it
-        if (from_slave.input_closed && from_slave.rerrno != EIO) {
-            fprintf(stderr, "read: %s\n", strerror(from_slave.rerrno));
-            exec_done(child, 125);
+        // walk to the parent directory, refusing `..` and symlinks
+        std::vector<std::string> comps;
+        bool ok = true;
+        for (size_t p = 3; p < line.length(); ) {
+            size_t slash = std::min(line.find('/', p), line.length());
+            std::string comp = line.substr(p, slash - p);
+            if (comp == "..")
+                ok = false;
+            else if (!comp.empty() && comp != ".")
+                comps.push_back(comp);
+            p = slash + 1;
+        }
+        if (!ok || comps.empty()) {
+            fprintf(stderr, "%s/.gitcheckout: Bad rm: %s\n", dest.c_str(), line.c_str() + 3);
+            continue;
+        }
+        if (verbose)
+            fprintf(verbosefile, "rm -rf %s\n", shell_quote(line.substr(3)).c_str());
+        int dirfd = dup(destfd);
+        for (size_t i = 0; i + 1 < comps.size() && dirfd >= 0; ++i) {
+            int next = openat(dirfd, comps[i].c_str(), O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+            close(dirfd);
+            dirfd = next;
+        }
+        if (dirfd >= 0) {
+            x_rm_rf(dirfd, comps.back().c_str(), dest + "/" + line.substr(3));
+            close(dirfd);
         }
     }
 }
 
-void jailownerinfo::exec_done(pid_t child, int exit_status) {
-    const char* xmsg = nullptr;
-    if (exit_status == 124 && !quiet)
-        xmsg = "...timed out";
-    if (exit_status == 128 + SIGTERM && !quiet)
-        xmsg = "...terminated";
-    if (xmsg)
-        printf(isatty(STDOUT_FILENO) ? "\n\x1b[3;7;31m%s\x1b[0m\n" : "\n%s\n",
-               xmsg);
-#if __linux__
-    (void) child;
-#else
-    if (exit_status >= 124)
-        kill(child, SIGKILL);
-#endif
-    fflush(stdout);
-    if (has_stdin_termios)
-        (void) tcsetattr(STDIN_FILENO, TCSAFLUSH, &stdin_termios);
-    exit(exit_status);
+static int overlay_command(const std::string& tarball, const std::string& dest,
+                           const std::string& cachedir) {
+    int destfd = open(dest.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (destfd == -1)
+        perror_die(dest);
+
+    if (cachedir.empty()) {
+        if (x_tar_extract(tarball, dest) != 0)
+            die("%s: Cannot unpack\n", tarball.c_str());
+    } else {
+        std::string digest = file_sha1(tarball);
+        if (mkdir(cachedir.c_str(), 0777) != 0 && errno != EEXIST)
+            perror_die(cachedir);
+        std::string cached = path_endslash(cachedir) + digest;
+        int cachefd = open(cached.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (cachefd == -1) {
+            // unpack into a temporary directory and rename it into place
+            std::string tmp = cached + "." + std::to_string((long) getpid()) + ".tmp";
+            x_rm_rf(AT_FDCWD, tmp.c_str(), tmp);
+            if (mkdir(tmp.c_str(), 0777) != 0)
+                perror_die(tmp);
+            if (x_tar_extract(tarball, tmp) != 0) {
+                x_rm_rf(AT_FDCWD, tmp.c_str(), tmp);
+                die("%s: Cannot unpack\n", tarball.c_str());
+            }
+            int tmpfd = open(tmp.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+            off_t size = tmpfd == -1 ? 0 : tree_size(tmpfd);
+            if (tmpfd >= 0)
+                close(tmpfd);
+            if (rename(tmp.c_str(), cached.c_str()) != 0) {
+                // another process won the race
+                x_rm_rf(AT_FDCWD, tmp.c_str(), tmp);
+            } else {
+                std::string sizefile = cached + ".size";
+                FILE* f = fopen(sizefile.c_str(), "w");
+                if (!f || fprintf(f, "%lld\n", (long long) size) < 0
+                    || fclose(f) != 0)
+                    perror_fail("%s: %s\n", sizefile.c_str());
+            }
+            cachefd = open(cached.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+            if (cachefd == -1)
+                perror_die(cached);
+        }
+        // mark the tree as recently used
+        (void) futimens(cachefd, nullptr);
+        overlay_copy_tree(cachefd, destfd, dest);
+        close(cachefd);
+        overlay_trim_cache(cachedir);
+    }
+
+    // removal problems are reported, but are not errors
+    int status = exit_value;
+    overlay_gitcheckout(destfd, dest);
+    close(destfd);
+    return status;
 }
 
 
@@ -1932,15 +7016,59 @@ static __attribute__((noreturn)) void usage(jailaction action = do_start) {
     if (action == do_start) {
         fprintf(stderr, "Usage: pa-jail add [-nh] [-f FILES | -F DATA] [-S SKELETON] JAILDIR [USER]\n\
        pa-jail run [--fg] [-nqh] [-T TIMEOUT] [-p PIDFILE] [-i INPUT] \\\n\
-                   [-f FILES | -F DATA] [-S SKELETON] JAILDIR USER COMMAND\n\
+                   [--cache CACHEDIR] [-f FILES | -F DATA] [-S SKELETON] \\\n\
+                   JAILDIR USER COMMAND\n\
        pa-jail mv SOURCE DEST\n\
-       pa-jail rm [-nf] JAILDIR\n");
+       pa-jail clone SOURCE DEST\n\
+       pa-jail rm [-nf] JAILDIR\n\
+       pa-jail trace [-o OUTFILE] [-x PATTERN] COMMAND...\n\
+       pa-jail du DIR\n\
+       pa-jail sched\n\
+       pa-jail checkout [--blob-cache DIR] REPODIR COMMIT[:SUBDIR] DEST\n\
+       pa-jail overlay [--overlay-cache DIR] TARBALL DEST\n");
+    } else if (action == do_overlay) {
+        fprintf(stderr, "Usage: pa-jail overlay [--overlay-cache DIR] TARBALL DEST\n\
+Unpack TARBALL into DEST, then remove the files named by `rm:` lines in\n\
+DEST/.gitcheckout. Runs as the caller.\n\
+\n\
+      --overlay-cache DIR  unpack each tarball once into DIR, copy from there\n\
+      --cache-size SIZE    evict cached tarballs beyond SIZE bytes (default 1G)\n\
+  -V, --verbose     print actions as well as running them\n");
+    } else if (action == do_checkout) {
+        fprintf(stderr, "Usage: pa-jail checkout [--blob-cache DIR] REPODIR COMMIT[:SUBDIR] DEST\n\
+Write the files of COMMIT (or its SUBDIR) in git repository REPODIR into\n\
+DEST, without creating a repository there. Runs as the caller.\n\
+\n\
+      --blob-cache DIR  keep file contents in DIR and reflink from there\n\
+  -V, --verbose     print files as they are written\n");
+    } else if (action == do_sched) {
+        fprintf(stderr, "Usage: pa-jail sched\n\
+Print the state of the host-wide run scheduler: limits, queue depth, wait\n\
+times by class, and active and waiting runs.\n");
+    } else if (action == do_du) {
+        fprintf(stderr, "Usage: pa-jail du DIR\n\
+Print the disk usage of each jail in DIR, as reported by project quotas.\n\
+Columns are KiB used, inodes used, KiB limit, inode limit, and jail.\n");
+    } else if (action == do_clone) {
+        fprintf(stderr, "Usage: pa-jail clone [-n] SOURCE DEST\n\
+Copy the jail SOURCE to DEST, which must not exist or be empty. SOURCE\n\
+and DEST must be allowed by /etc/pa-jail.conf. Uses a btrfs snapshot if\n\
+SOURCE is a subvolume, and otherwise reflinks file contents if possible.\n\
+\n\
+  -n, --dry-run     print the actions that would be taken, don't run them\n\
+  -V, --verbose     print actions as well as running them\n");
     } else if (action == do_mv) {
         fprintf(stderr, "Usage: pa-jail mv [-n] SOURCE DEST\n\
 Safely move a jail from SOURCE to DEST. SOURCE and DEST must be allowed\n\
 by /etc/pa-jail.conf.\n\
 \n\
   -n, --dry-run     print the actions that would be taken, don't run them\n");
+    } else if (action == do_trace) {
+        fprintf(stderr, "Usage: pa-jail trace [-o OUTFILE] [-x PATTERN] COMMAND...\n\
+Run COMMAND and print the files it accesses as a jail manifest.\n\
+\n\
+  -o, --output OUTFILE  add files to the manifest in OUTFILE\n\
+  -x, --exclude PATTERN exclude files matching PATTERN\n");
     } else if (action == do_rm) {
         fprintf(stderr, "Usage: pa-jail rm [-nf] JAILDIR\n\
 Unmount and remove a jail. Like `rm -r[f] --one-file-system JAILDIR`.\n\
@@ -1965,8 +7093,32 @@ Run COMMAND as USER in the JAILDIR jail. JAILDIR must be allowed by\n\
             fprintf(stderr, "  -p, --pid-file PIDFILE\n\
   -i, --input INPUTSOCKET\n\
   -T, --timeout TIMEOUT\n\
-      --fg\n");
+      --fg\n\
+      --cache CACHEDIR  replay output of an identical earlier run\n\
+      --cache-key KEY   additional data for the cache key\n\
+      --cache-size SIZE evict cached runs beyond SIZE bytes (default 256M)\n\
+      --buildcache-key KEY  [buildcache] subdirectory for this run's source\n\
+      --tmp-size SIZE   limit the jail's /tmp to SIZE bytes\n\
+      --tmp-inodes N    limit the jail's /tmp to N inodes\n");
         }
+        fprintf(stderr, "      --tmpfs-root SIZE build the jail in a SIZE-byte tmpfs\n\
+      --disk-limit SIZE limit the jail to SIZE bytes (project quota)\n\
+      --inode-limit N   limit the jail to N inodes (project quota)\n");
+        if (action == do_run)
+            fprintf(stderr, "      --usage-file FILE write the jail's disk usage to FILE\n\
+      --sched-class CLASS  `interactive` (default) or `batch`\n\
+      --sched-group GROUP  fair-share group for the scheduler\n\
+      --multi DIR       run each COMMAND separately; output to DIR/N.out\n\
+      --max-parallel N  run at most N --multi commands at once (default 4)\n\
+      --kill-grace SECS on timeout, wait SECS after SIGTERM before SIGKILL\n\
+                        (default 1)\n\
+      --events SOCKET   publish run events on Unix socket SOCKET\n\
+      --screen FILE     keep a terminal screen snapshot in FILE\n\
+      --sanitize MODE   filter output: `utf8`, `sgr`, or `text`\n\
+      --expect FILE     compare output with FILE, write result to --verdict\n\
+      --verdict FILE    write --expect result to FILE\n\
+      --expect-ws MODE  whitespace: `exact`, `trailing` (default), or `all`\n\
+      --expect-stop     stop the command when output differs\n");
         fprintf(stderr, "  -n, --dry-run     print the actions that would be taken, don't run them\n\
   -V, --verbose     print actions as well as running them\n");
     }
@@ -1993,6 +7145,28 @@ static struct option longoptions_run[] = {
     { "input", required_argument, NULL, 'i' },
     { "chown-home", no_argument, NULL, 'h' },
     { "chown-user", required_argument, NULL, 'u' },
+    { "cache", required_argument, NULL, 'c' },
+    { "cache-key", required_argument, NULL, 'k' },
+    { "cache-size", required_argument, NULL, 'Y' },
+    { "buildcache-key", required_argument, NULL, 'A' },
+    { "tmpfs-root", required_argument, NULL, 'R' },
+    { "tmp-size", required_argument, NULL, 'z' },
+    { "tmp-inodes", required_argument, NULL, 'N' },
+    { "disk-limit", required_argument, NULL, 'D' },
+    { "inode-limit", required_argument, NULL, 'I' },
+    { "usage-file", required_argument, NULL, 'U' },
+    { "sched-class", required_argument, NULL, 'C' },
+    { "sched-group", required_argument, NULL, 'G' },
+    { "multi", required_argument, NULL, 'M' },
+    { "max-parallel", required_argument, NULL, 'P' },
+    { "kill-grace", required_argument, NULL, 'L' },
+    { "events", required_argument, NULL, 'E' },
+    { "screen", required_argument, NULL, 'W' },
+    { "sanitize", required_argument, NULL, 'Z' },
+    { "expect", required_argument, NULL, 'X' },
+    { "verdict", required_argument, NULL, 'J' },
+    { "expect-ws", required_argument, NULL, 'K' },
+    { "expect-stop", no_argument, NULL, 'O' },
     { NULL, 0, NULL, 0 }
 };
 
@@ -2004,11 +7178,34 @@ static struct option longoptions_rm[] = {
     { NULL, 0, NULL, 0 }
 };
 
+static struct option longoptions_trace[] = {
+    { "verbose", no_argument, NULL, 'V' },
+    { "help", no_argument, NULL, 'H' },
+    { "output", required_argument, NULL, 'o' },
+    { "exclude", required_argument, NULL, 'x' },
+    { NULL, 0, NULL, 0 }
+};
+
+static struct option longoptions_checkout[] = {
+    { "verbose", no_argument, NULL, 'V' },
+    { "help", no_argument, NULL, 'H' },
+    { "blob-cache", required_argument, NULL, 'B' },
+    { NULL, 0, NULL, 0 }
+};
+
+static struct option longoptions_overlay[] = {
+    { "verbose", no_argument, NULL, 'V' },
+    { "help", no_argument, NULL, 'H' },
+    { "overlay-cache", required_argument, NULL, 'B' },
+    { "cache-size", required_argument, NULL, 'Y' },
+    { NULL, 0, NULL, 0 }
+};
+
 static struct option* longoptions_action[] = {
-    longoptions_before, longoptions_run, longoptions_run, longoptions_rm, longoptions_before
+    longoptions_before, longoptions_run, longoptions_run, longoptions_rm, longoptions_before, longoptions_trace, longoptions_before, longoptions_before, longoptions_checkout, longoptions_overlay, longoptions_before
 };
 static const char* shortoptions_action[] = {
-    "+Vn", "VnS:f:F:p:T:qi:hu:", "VnS:f:F:p:T:qi:hu:", "Vnf", "Vn"
+    "+Vn", "VnS:f:F:p:T:qi:hu:", "VnS:f:F:p:T:qi:hu:", "Vnf", "Vn", "+Vo:x:", "V", "V", "V", "V", "Vn"
 };
 
 int main(int argc, char** argv) {
@@ -2016,8 +7213,12 @@ int main(int argc, char** argv) {
     jailaction action = do_start;
     bool chown_home = false, foreground = false;
     double timeout = -1;
-    std::string inputarg, linkarg, contents;
-    std::vector<std::string> chown_user_args;
+    std::string inputarg, linkarg, contents, cachearg, cachekeyarg;
+    std::vector<std::string> chown_user_args, trace_excludes;
+    std::string traceoutarg;
+    off_t tmpfs_root_size = 0, disk_limit = 0, inode_limit = 0;
+    std::string usagearg, multiarg, eventsarg, screenarg;
+    std::string expectarg, verdictarg, blobcachearg;
 
     int ch;
     while (1) {
@@ -2069,6 +7270,99 @@ int main(int argc, char** argv) {
                 quiet = true;
             else if (ch == 'u')
                 chown_user_args.push_back(optarg);
+            else if (ch == 'c')
+                cachearg = optarg;
+            else if (ch == 'k')
+                cachekeyarg = optarg;
+            else if (ch == 'A') {
+                buildcache_key = optarg;
+                if (buildcache_key.empty() || buildcache_key.length() > 64
+                    || buildcache_key[0] == '.'
+                    || buildcache_key.find_first_not_of("ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789._-") != std::string::npos)
+                    usage();
+            }
+            else if (ch == 'Y') {
+                off_t& size = action == do_overlay ? overlay_cache_size
+                    : run_cache.max_size;
+                if ((size = parse_size(optarg)) <= 0)
+                    usage();
+            }
+            else if (ch == 'R') {
+                if ((tmpfs_root_size = parse_size(optarg)) <= 0)
+                    usage();
+            } else if (ch == 'D' || ch == 'I') {
+                if (((ch == 'D' ? disk_limit : inode_limit) = parse_size(optarg)) <= 0)
+                    usage();
+            } else if (ch == 'U')
+                usagearg = optarg;
+            else if (ch == 'C') {
+                if (strcmp(optarg, "interactive") == 0)
+                    run_sched.rclass = sched_interactive;
+                else if (strcmp(optarg, "batch") == 0)
+                    run_sched.rclass = sched_batch;
+                else
+                    usage();
+            } else if (ch == 'G')
+                run_sched.group = optarg;
+            else if (ch == 'M')
+                multiarg = optarg;
+            else if (ch == 'E')
+                eventsarg = optarg;
+            else if (ch == 'W')
+                screenarg = optarg;
+            else if (ch == 'X')
+                expectarg = optarg;
+            else if (ch == 'J')
+                verdictarg = optarg;
+            else if (ch == 'K') {
+                if (strcmp(optarg, "exact") == 0)
+                    run_expect.norm.mode = expect_ws_exact;
+                else if (strcmp(optarg, "trailing") == 0)
+                    run_expect.norm.mode = expect_ws_trailing;
+                else if (strcmp(optarg, "all") == 0)
+                    run_expect.norm.mode = expect_ws_all;
+                else
+                    usage();
+            } else if (ch == 'O')
+                run_expect.stop = true;
+            else if (ch == 'Z') {
+                if (strcmp(optarg, "raw") == 0)
+                    output_filter.mode = sanitize_raw;
+                else if (strcmp(optarg, "utf8") == 0)
+                    output_filter.mode = sanitize_utf8;
+                else if (strcmp(optarg, "sgr") == 0)
+                    output_filter.mode = sanitize_sgr;
+                else if (strcmp(optarg, "text") == 0)
+                    output_filter.mode = sanitize_text;
+                else
+                    usage();
+            }
+            else if (ch == 'P') {
+                char* end;
+                multi_parallel = strtol(optarg, &end, 10);
+                if (end == optarg || *end || multi_parallel <= 0)
+                    usage();
+            }
+            else if (ch == 'L') {
+                char* end;
+                kill_grace = strtod(optarg, &end);
+                if (end == optarg || *end || kill_grace < 0)
+                    usage();
+            }
+            else if (ch == 'z' || ch == 'N') {
+                off_t n = parse_size(optarg);
+                if (n <= 0)
+                    usage();
+                char buf[64];
+                sprintf(buf, "%s=%lld", ch == 'z' ? "size" : "nr_inodes", (long long) n);
+                tmp_mountopts.push_back(buf);
+            }
+            else if (ch == 'o')
+                traceoutarg = optarg;
+            else if (ch == 'B')
+                blobcachearg = optarg;
+            else if (ch == 'x')
+                trace_excludes.push_back(optarg);
             else if (ch == 'T') {
                 char* end;
                 timeout = strtod(optarg, &end);
@@ -2085,11 +7379,23 @@ int main(int argc, char** argv) {
             action = do_rm;
         else if (strcmp(argv[optind], "mv") == 0)
             action = do_mv;
+        else if (strcmp(argv[optind], "clone") == 0)
+            action = do_clone;
         else if (strcmp(argv[optind], "init") == 0
                  || strcmp(argv[optind], "add") == 0)
             action = do_add;
         else if (strcmp(argv[optind], "run") == 0)
             action = do_run;
+        else if (strcmp(argv[optind], "trace") == 0)
+            action = do_trace;
+        else if (strcmp(argv[optind], "du") == 0)
+            action = do_du;
+        else if (strcmp(argv[optind], "sched") == 0)
+            action = do_sched;
+        else if (strcmp(argv[optind], "checkout") == 0)
+            action = do_checkout;
+        else if (strcmp(argv[optind], "overlay") == 0)
+            action = do_overlay;
         else
             usage();
         argc -= optind;
@@ -2102,16 +7408,44 @@ int main(int argc, char** argv) {
         action = do_add;
     if ((action == do_rm && optind + 1 != argc)
         || (action == do_mv && optind + 2 != argc)
+        || (action == do_clone && optind + 2 != argc)
+        || (action == do_du && optind + 1 != argc)
+        || (action == do_sched && optind != argc)
+        || (action == do_checkout && optind + 3 != argc)
+        || (action == do_overlay && optind + 2 != argc)
         || (action == do_add && optind != argc - 1 && optind + 2 != argc)
         || (action == do_run && optind + 3 > argc)
         || (action == do_rm && (!linkarg.empty() || !contents.empty() || !inputarg.empty()))
         || (action == do_mv && (!linkarg.empty() || !contents.empty() || !inputarg.empty()))
-        || !argv[optind][0]
-        || (action == do_mv && !argv[optind+1][0]))
+        || (action == do_clone && (!linkarg.empty() || !contents.empty() || !inputarg.empty()))
+        || (action != do_sched && !argv[optind][0])
+        || ((action == do_mv || action == do_clone) && !argv[optind+1][0]))
         usage();
     if (verbose && !dryrun)
         verbosefile = stderr;
 
+    // trace runs entirely as the caller
+    if (action == do_trace) {
+        if (optind == argc)
+            usage(action);
+        if (setresgid(getgid(), getgid(), getgid()) != 0
+            || setresuid(getuid(), getuid(), getuid()) != 0)
+            perror_die("setresuid");
+        exit(trace_command(argv + optind, traceoutarg, trace_excludes));
+    }
+
+    // so do checkout and overlay
+    if (action == do_checkout || action == do_overlay) {
+        if (setresgid(getgid(), getgid(), getgid()) != 0
+            || setresuid(getuid(), getuid(), getuid()) != 0)
+            perror_die("setresuid");
+        if (action == do_checkout)
+            exit(checkout_command(argv[optind], argv[optind + 1],
+                                  argv[optind + 2], blobcachearg));
+        else
+            exit(overlay_command(argv[optind], argv[optind + 1], blobcachearg));
+    }
+
     // parse user
     jailownerinfo jailuser;
     if ((action == do_add || action == do_run) && optind + 1 < argc)
@@ -2140,6 +7474,41 @@ int main(int argc, char** argv) {
         atexit(cleanup_pidfd);
     }
 
+    // open usage file as current user
+    if (!usagearg.empty() && action == do_run && !dryrun) {
+        usagefd = open(usagearg.c_str(), O_WRONLY | O_CLOEXEC | O_CREAT | O_TRUNC, 0666);
+        if (usagefd == -1)
+            perror_die(usagearg);
+    }
+
+    // create event socket as current user
+    if (!eventsarg.empty() && action == do_run && !dryrun) {
+        run_events.open(eventsarg);
+        atexit(cleanup_events);
+    }
+
+    // read expected output and create verdict file as current user
+    if (expectarg.empty() != verdictarg.empty())
+        usage();
+    if (!expectarg.empty() && action == do_run && !dryrun)
+        run_expect.open(expectarg, verdictarg);
+
+    // open screen snapshot directory as current user
+    if (!screenarg.empty() && action == do_run && !dryrun)
+        run_screen.open(screenarg);
+
+    // open --multi output directory as current user
+    if (!multiarg.empty() && action == do_run && !dryrun) {
+        multi_dirfd = open(multiarg.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (multi_dirfd == -1)
+            perror_die(multiarg);
+    }
+
+    // open cache directory as current user
+    // (cached runs replay a single command's output, so not with --multi)
+    if (!cachearg.empty() && action == do_run && !dryrun && multiarg.empty())
+        run_cache.open_dir(cachearg);
+
     // escalate so that the real (not just effective) UID/GID is root. this is
     // so that the system processes will execute as root
     caller_owner = getuid();
@@ -2162,6 +7531,14 @@ int main(int argc, char** argv) {
     //   dynamically created if necessary
     // - try to eliminate TOCTTOU
     pajailconf jailconf;
+    if (action == do_du)
+        exit(du_command(argv[optind], jailconf));
+    int maxruns = jailconf.number("maxruns");
+    if (action == do_sched) {
+        if (maxruns <= 0)
+            die("/etc/pa-jail.conf: Scheduler disabled (no `maxruns`)\n");
+        exit(run_sched.open(maxruns) ? run_sched.status() : 1);
+    }
     jaildirinfo jaildir(argv[optind], linkarg, action, jailconf);
 
     // move the sandbox if asked
@@ -2180,6 +7557,33 @@ int main(int argc, char** argv) {
             die("%s: Destination jail disabled by /etc/pa-jail.conf\n%s",
                 newpath.c_str(), jailconf.allowance_dir_fail_message().c_str());
 
+        // a tmpfs root cannot be renamed; move the mount instead. A mount
+        // whose parent has shared propagation (the systemd default)
+        // cannot be moved; then detach the tmpfs, discarding its
+        // contents, and rename the empty mount point
+        std::string root = path_noendslash(jaildir.dir);
+        populate_mount_table();
+        if (mount_table.find(root) != mount_table.end()) {
+            if (verbose)
+                fprintf(verbosefile, "mkdir -m 0755 %s\nmount --move %s %s\n", newpath.c_str(), root.c_str(), newpath.c_str());
+            if (!dryrun && mkdirat(jaildir.parentfd, newpath.c_str(), 0755) != 0)
+                die("mkdir %s: %s\n", newpath.c_str(), strerror(errno));
+            if (dryrun
+                || mount(root.c_str(), newpath.c_str(), NULL, MS_MOVE, NULL) == 0) {
+                if (verbose)
+                    fprintf(verbosefile, "rmdir %s\n", root.c_str());
+                if (!dryrun && unlinkat(jaildir.parentfd, jaildir.component.c_str(), AT_REMOVEDIR) != 0)
+                    die("rmdir %s: %s\n", root.c_str(), strerror(errno));
+                exit(0);
+            } else if (errno != EINVAL)
+                die("mv %s %s: %s\n", root.c_str(), newpath.c_str(), strerror(errno));
+            if (verbose)
+                fprintf(verbosefile, "rmdir %s\numount -l %s\n", newpath.c_str(), root.c_str());
+            if (unlinkat(jaildir.parentfd, newpath.c_str(), AT_REMOVEDIR) != 0
+                || umount2(root.c_str(), MNT_DETACH) != 0)
+                die("umount %s: %s\n", root.c_str(), strerror(errno));
+        }
+
         if (verbose)
             fprintf(verbosefile, "mv %s%s %s\n", jaildir.parent.c_str(), jaildir.component.c_str(), newpath.c_str());
         if (!dryrun && renameat(jaildir.parentfd, jaildir.component.c_str(), jaildir.parentfd, newpath.c_str()) != 0)
@@ -2187,27 +7591,80 @@ int main(int argc, char** argv) {
         exit(0);
     }
 
+    // copy the sandbox if asked
+    if (action == do_clone) {
+        std::string dst = path_endslash(check_filename(absolute(argv[optind + 1])));
+        if (dst.compare(0, jaildir.dir.length(), jaildir.dir) == 0
+            || jaildir.dir.compare(0, dst.length(), dst) == 0)
+            die("%s: Clone destination overlaps source\n", argv[optind + 1]);
+        jaildirinfo dstdir(argv[optind + 1], std::string(), do_add, jailconf);
+        exit(clone_command(jaildir, dstdir));
+    }
+
     // kill the sandbox if asked
     if (action == do_rm) {
         // unmount EVERYTHING mounted in the jail!
         // INCLUDING MY HOME DIRECTORY
         jaildir.dir = path_endslash(jaildir.dir);
+        std::string root = path_noendslash(jaildir.dir);
+        if (jaildir.dirfd >= 0) // would keep a tmpfs root busy
+            close(jaildir.dirfd);
         populate_mount_table();
+        std::vector<mount_table_type::iterator> mounts;
         for (auto it = mount_table.begin(); it != mount_table.end(); ++it)
-            if (it->first.length() >= jaildir.dir.length()
-                && memcmp(it->first.data(), jaildir.dir.data(),
-                          jaildir.dir.length()) == 0)
-                handle_umount(it);
+            if ((it->first.length() >= jaildir.dir.length()
+                 && memcmp(it->first.data(), jaildir.dir.data(),
+                           jaildir.dir.length()) == 0)
+                || it->first == root)
+                mounts.push_back(it);
+        // unmount nested mounts first; a tmpfs root goes last
+        std::sort(mounts.begin(), mounts.end(),
+                  [](const mount_table_type::iterator& a,
+                     const mount_table_type::iterator& b) {
+                      return a->first.length() > b->first.length();
+                  });
+        for (auto it : mounts)
+            handle_umount(it);
+        struct stat s;
+        if (!mounts.empty() && mounts.back()->first == root && !dryrun
+            && fstatat(jaildir.parentfd, jaildir.component.c_str(), &s,
+                       AT_SYMLINK_NOFOLLOW) == 0)
+            jaildir.dev = s.st_dev;
         // remove the jail
         jaildir.remove();
         exit(0);
     }
 
+    // maybe mount a RAM-backed jail root
+    if (tmpfs_root_size > 0)
+        jaildir.mount_tmpfs(tmpfs_root_size);
+
+    // charge the jail to its own project quota
+    if (jaildir.dirfd >= 0) {
+        int fd = openat(jaildir.parentfd, jaildir.component.c_str(), O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+        if (fd >= 0
+            && (jail_projid = assign_jail_project(fd, jaildir.dir, jaildir.permdir, disk_limit, inode_limit)))
+            jail_quotafd = fd;
+        else {
+            if (fd >= 0)
+                close(fd);
+            if (disk_limit > 0 || inode_limit > 0)
+                fprintf(stderr, "%s: Project quotas not enabled, limits ignored\n", jaildir.dir.c_str());
+        }
+    }
+
+    // operate relative to the jail directory from now on
+    if (jaildir.dirfd >= 0)
+        dirfd_anchor(jaildir.dir, jaildir.dirfd);
+
     // check skeleton directory
     if (!jaildir.skeletondir.empty()) {
         if (v_ensuredir(jaildir.skeletondir, 0755, true) < 0)
             perror_die(jaildir.skeletondir);
         linkdir = path_noendslash(jaildir.skeletondir);
+        int linkfd = open(linkdir.c_str(), O_PATH | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+        if (linkfd >= 0)
+            dirfd_anchor(linkdir, linkfd);
     }
 
     // create the home directory
@@ -2241,15 +7698,57 @@ int main(int argc, char** argv) {
         jaildir.chown_recursive(f, jailuser.owner, jailuser.group);
     }
 
+    // maybe replay a cached run
+    if (run_cache.enabled() && optind + 2 < argc) {
+        std::vector<std::string> trees(chown_user_args);
+        trees.insert(trees.begin(), jaildir.dir + jailuser.owner_home.substr(1));
+        // options that can change the output or exit status
+        char optbuf[256];
+        sprintf(optbuf, "timeout %.17g\nkill-grace %.17g\nsanitize %d\nquiet %d\ntmpfs-root %lld\ndisk-limit %lld\ninode-limit %lld\n",
+                timeout, kill_grace, (int) output_filter.mode, (int) quiet,
+                (long long) tmpfs_root_size, (long long) disk_limit,
+                (long long) inode_limit);
+        std::string options = optbuf;
+        for (auto& o : tmp_mountopts)
+            options += "tmp " + o + "\n";
+        for (auto& e : jail_env)
+            options += "env " + e + "\n";
+        // --expect-stop can cut the output short
+        if (!expectarg.empty())
+            options += "expect " + file_sha1(expectarg) + " "
+                + std::to_string((int) run_expect.norm.mode) + " "
+                + std::to_string((int) run_expect.stop) + "\n";
+        run_cache.compute_key(contents, argv[optind + 1],
+                              jail_command(argc, argv), trees, options,
+                              cachekeyarg, inputfd);
+        int exit_status;
+        fflush(stdout);
+        jailuser.start_output();
+        if (run_cache.replay(exit_status, [&](const char* s, size_t n) {
+                    (void) jailuser.note_output(s, n);
+                }))
+            jailuser.finish(exit_status);
+    }
+
+    // join the run scheduler; admission happens in the jail's init process
+    if (maxruns > 0 && optind + 2 < argc && !dryrun)
+        run_sched.open(maxruns);
+
     // construct the jail
+    if (optind + 2 < argc)
+        run_events.emit("constructing");
     mount_status = optind + 2 < argc;
     dstroot = path_noendslash(jaildir.dir);
     assert(dstroot != "/");
+    elfcache_file = jaildir.permdir + ".pa-jail-elfcache";
+    buildcache_owner = jailuser.owner;
+    buildcache_group = jailuser.group;
     if (!contents.empty()) {
         mode_t old_umask = umask(0);
         if (construct_jail(jaildir.dev, contents) != 0)
             exit(1);
         umask(old_umask);
+        trim_buildcache();
     }
 
     // close `parentfd`
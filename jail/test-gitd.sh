@@ -0,0 +1,73 @@
+#! /bin/sh
+# test-gitd.sh -- compare pa-gitd's answers with git's
+# Run from the jail directory (`make check`).
+
+set -e
+dir=`mktemp -d`
+trap 'test -n "$pid" && kill $pid 2>/dev/null; rm -rf "$dir"' EXIT
+failures=0
+
+query () {
+    python3 - "$dir/sock" "$dir/repo" "$@" <<'EOF'
+import socket, sys
+s = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+s.connect(sys.argv[1])
+s.sendall(b"".join(a.encode() + b"\0" for a in sys.argv[2:]))
+s.shutdown(socket.SHUT_WR)
+data = b""
+while True:
+    x = s.recv(65536)
+    if not x:
+        break
+    data += x
+sys.stdout.write(data.decode())
+EOF
+}
+
+check () {
+    expected=`(echo ok; git -C "$dir/repo" "$@")`
+    actual=`query "$@"`
+    if test "$expected" != "$actual"; then
+        echo "FAIL: $*" 1>&2
+        echo "$expected" | sed 's/^/  git: /' 1>&2
+        echo "$actual" | sed 's/^/  pa-gitd: /' 1>&2
+        failures=`expr $failures + 1`
+    fi
+}
+
+check_unsupported () {
+    case `query "$@"` in
+    unsupported*) ;;
+    *) echo "FAIL: $* should be unsupported" 1>&2; failures=`expr $failures + 1`;;
+    esac
+}
+
+# a history whose commits all share one timestamp, with a merge, so
+# `log` order depends only on how ties are broken
+export GIT_AUTHOR_DATE="1500000000 +0000" GIT_COMMITTER_DATE="1500000000 +0000"
+export GIT_AUTHOR_NAME=t GIT_AUTHOR_EMAIL=t@x GIT_COMMITTER_NAME=t GIT_COMMITTER_EMAIL=t@x
+git init -q -b main "$dir/repo"
+cd "$dir/repo"
+mkdir a b
+for i in 1 2 3; do echo $i > a/f$i; git add a; git commit -q -m "a$i"; done
+git checkout -q -b side HEAD~2
+for i in 1 2 3; do echo $i > b/g$i; git add b; git commit -q -m "b$i"; done
+git checkout -q main
+git merge -q --no-edit side
+echo 4 > a/f4; git add a; git commit -q -m a4
+cd - >/dev/null
+
+./pa-gitd --root "$dir" --workers 1 "$dir/sock" &
+pid=$!
+for i in 1 2 3 4 5 6 7 8 9 10; do test -S "$dir/sock" && break; sleep 0.1; done
+
+for pass in loose packed; do
+    check log --format=%H HEAD
+    check log -n3 --format=%H HEAD
+    check log --format=%H main side
+    check log --format=%H HEAD -- b
+    check_unsupported log --simplify-merges --format=%H HEAD
+    git -C "$dir/repo" gc -q
+done
+
+test $failures = 0 && echo "test-gitd: ok"
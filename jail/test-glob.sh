@@ -0,0 +1,46 @@
+#! /bin/sh
+# test-glob.sh -- check which directories glob manifest entries open
+# Run from the jail directory (`make check`) as root. `pa-jail add -n`
+# needs a JAILDIR allowed by /etc/pa-jail.conf; set PA_JAIL_TEST_JAIL if
+# /srv/jails is not. Nothing is created there.
+
+jail="${PA_JAIL_TEST_JAIL:-/srv/jails/test-glob}"
+if test `id -u` != 0; then
+    echo "test-glob: skipped (not root)"
+    exit 0
+fi
+
+# `pa-jail trace` does not report paths under /tmp
+dir=`mktemp -d /var/tmp/test-glob.XXXXXX` || exit 1
+trap 'rm -rf "$dir"' EXIT
+failures=0
+mkdir -p "$dir/src/lib/x" "$dir/src/lib2" "$dir/src/other/deep"
+touch "$dir/src/lib/libfoo.so" "$dir/src/lib/x/libbar.so" \
+    "$dir/src/lib2/libbaz.so" "$dir/src/other/deep/libno.so"
+
+# check PATTERN COPIED OPENED: the files `add` copies for `src/PATTERN`,
+# and the paths under `src/` it touches, which include the contents of
+# every directory it opened
+check () {
+    rm -f "$dir/out"
+    copied=`./pa-jail trace -o "$dir/out" ./pa-jail add -n -F "$dir/src/$1" "$jail" 2>&1 \
+        | sed -n "s,^cp -p $dir/src/\([^ ]*\) .*,\1,p" | sort | tr '\n' ' '`
+    opened=`sed -n "s,^$dir/src/,,p" "$dir/out" | tr '\n' ' '`
+    if test "$copied" != "$2" -o "$opened" != "$3"; then
+        echo "FAIL: $1" 1>&2
+        echo "  copied: $copied (expected $2)" 1>&2
+        echo "  touched: $opened (expected $3)" 1>&2
+        failures=`expr $failures + 1`
+    fi
+}
+
+check 'lib*/lib*.so' 'lib/libfoo.so lib2/libbaz.so ' \
+    'lib lib/libfoo.so lib/x lib2 lib2/libbaz.so other '
+check 'lib*/**/libbar.so' 'lib/x/libbar.so ' \
+    'lib lib/libfoo.so lib/x lib/x/libbar.so lib2 lib2/libbaz.so other '
+check 'lib/*.so' 'lib/libfoo.so ' \
+    'lib lib/libfoo.so lib/x '
+check '**/libno.so' 'other/deep/libno.so ' \
+    'lib lib/libfoo.so lib/x lib/x/libbar.so lib2 lib2/libbaz.so other other/deep other/deep/libno.so '
+
+test $failures = 0 && echo "test-glob: ok"
@@ -45,32 +45,43 @@ if (!$Repo || !$Commit || !$Info->can_view_repo_contents || !@$_REQUEST["file"])
     exit;
 
 // file
-$result = Contact::repo_gitrun($Repo, "git cat-file blob $Commit:" . escapeshellarg($_REQUEST["file"]));
-if ($result === null || $result === "") {
-    $sizeresult = Contact::repo_gitrun($Repo, "git cat-file -s $Commit:" . escapeshellarg($_REQUEST["file"]));
-    if (trim($sizeresult) !== "0")
-        exit;
-}
+$blob = Contact::repo_gitd_blob($Repo, "$Commit:" . $_REQUEST["file"]);
+if ($blob === null)
+    exit;
+else if ($blob)
+    list($size, $content_type, $stream) = $blob;
+else {
+    $result = Contact::repo_gitquery($Repo, array("cat-file", "blob", "$Commit:" . $_REQUEST["file"]));
+    if ($result === null || $result === "") {
+        $sizeresult = Contact::repo_gitquery($Repo, array("cat-file", "-s", "$Commit:" . $_REQUEST["file"]));
+        if (trim($sizeresult) !== "0")
+            exit;
+    }
 
-// filetype determination
-$slash = strrpos($_REQUEST["file"], "/");
-$filename = substr($_REQUEST["file"], $slash === false ? 0 : $slash + 1);
-$dot = strrpos($filename, ".");
-$ext = ($dot === false ? "" : strtolower(substr($filename, $dot + 1)));
+    // filetype determination; pa-gitd's `blob` makes the same choice
+    $slash = strrpos($_REQUEST["file"], "/");
+    $filename = substr($_REQUEST["file"], $slash === false ? 0 : $slash + 1);
+    $dot = strrpos($filename, ".");
+    $ext = ($dot === false ? "" : strtolower(substr($filename, $dot + 1)));
+
+    if ($ext == "pdf" && substr($result, 0, 5) === "%PDF-")
+        $content_type = "application/pdf";
+    else if ($ext == "txt" || strcasecmp($filename, "README") == 0)
+        $content_type = "text/plain";
+    else if ($ext == "png" && substr($result, 0, 8) === "\x89PNG\x0d\x0a\x1a\x0a")
+        $content_type = "image/png";
+    else if ($ext == "gif" && (substr($result, 0, 6) === "GIF87a"
+                               || substr($result, 0, 6) === "GIF89a"))
+        $content_type = "image/gif";
+    else if ($ext == "html")
+        $content_type = "text/html";
+    else
+        $content_type = "application/octet-stream";
+    $size = strlen($result);
+}
 
-if ($ext == "pdf" && substr($result, 0, 5) === "%PDF-")
-    header("Content-Type: application/pdf");
-else if ($ext == "txt" || strcasecmp($filename, "README") == 0)
-    header("Content-Type: text/plain");
-else if ($ext == "png" && substr($result, 0, 8) === "\x89PNG\x0d\x0a\x1a\x0a")
-    header("Content-Type: image/png");
-else if ($ext == "gif" && (substr($result, 0, 6) === "GIF87a"
-                           || substr($result, 0, 6) === "GIF89a"))
-    header("Content-Type: image/gif");
-else if ($ext == "html")
-    header("Content-Type: text/html");
-else
-    header("Content-Type: application/octet-stream");
+header("Content-Type: $content_type");
+header("Content-Length: $size");
 
 // when commit is named, object doesn't change
 if (@$_REQUEST["commit"]) {
@@ -79,4 +90,9 @@ if (@$_REQUEST["commit"]) {
     header("Expires: " . gmdate("D, d M Y H:i:s", time() + 315576000) . " GMT");
 }
 
-echo $result;
+// stream the spooled pa-gitd blob rather than holding it in memory
+if ($blob) {
+    fpassthru($stream);
+    fclose($stream);
+} else
+    echo $result;
@@ -111,6 +111,7 @@ else if (!$Info->can_view_repo_contents && !$Me->isPC)
 $Queueid = cvtint(defval($_REQUEST, "queueid", -1));
 $checkt = cvtint(defval($_REQUEST, "check"));
 $Offset = cvtint(defval($_REQUEST, "offset", -1));
+$Screen = !!@$_REQUEST["screen"];
 
 
 // maybe eval
@@ -126,12 +127,12 @@ function runner_eval($runner, $info, $answer) {
 
 // checkup
 if ($checkt > 0
-    && $answer = ContactView::runner_json($Info, $checkt, $Offset)) {
+    && $answer = ContactView::runner_json($Info, $checkt, $Offset, $Screen)) {
     if ($answer->status == "working" && @$_POST["stop"]) {
         ContactView::runner_write($Info, $checkt, "\x1b\x03");
         $now = microtime(true);
         do {
-            $answer = ContactView::runner_json($Info, $checkt, $Offset);
+            $answer = ContactView::runner_json($Info, $checkt, $Offset, $Screen);
         } while ($answer->status == "working" && microtime(true) - $now < 0.1);
     }
     if ($answer->status != "working" && $Queueid > 0)
@@ -246,7 +247,7 @@ try {
 
     // recent
     if (@$_REQUEST["check"] == "recent" && count($rs->logged_checkts))
-        $Conf->ajaxExit(ContactView::runner_json($Info, $rs->logged_checkts[0], $Offset));
+        $Conf->ajaxExit(ContactView::runner_json($Info, $rs->logged_checkts[0], $Offset, $Screen));
     else if (@$_REQUEST["check"] == "recent")
         quit("no logs yet");
 
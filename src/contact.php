@@ -1421,32 +1421,99 @@ class Contact {
         return shell_exec("cd $repodir && $command");
     }
 
+    // Ask `pa-gitd` (see jail/pa-gitd.cc), if $Opt["gitd_socket"] names
+    // its socket, to run the read-only git command `$args`. Returns what
+    // git would print, or false if the daemon can't answer.
+    static private function repo_gitd_open($repo, $args) {
+        global $Opt, $ConfSitePATH;
+        if (!@$Opt["gitd_socket"]
+            || !($f = @stream_socket_client("unix://" . $Opt["gitd_socket"], $errno, $errstr, 1)))
+            return false;
+        $request = "$ConfSitePATH/repo/repo$repo->cacheid\0";
+        foreach ($args as $a)
+            $request .= str_replace("REPO", "repo" . $repo->repoid, $a) . "\0";
+        fwrite($f, $request);
+        stream_socket_shutdown($f, STREAM_SHUT_WR);
+        return $f;
+    }
+
+    static function repo_gitd($repo, $args) {
+        if (!($f = self::repo_gitd_open($repo, $args)))
+            return false;
+        $result = stream_get_contents($f);
+        fclose($f);
+        if (substr($result, 0, 3) === "ok\n")
+            return (string) substr($result, 3) === "" ? null : substr($result, 3);
+        else if (substr($result, 0, 6) === "error ")
+            return null;
+        else
+            return false;
+    }
+
+    // Open blob `$spec` (`COMMIT:PATH`) through pa-gitd for streaming.
+    // Returns `array(SIZE, CONTENT-TYPE, STREAM)`, null if there is no such
+    // blob, or false if the daemon can't answer. The blob is spooled to a
+    // temporary stream (on disk if large) and its length checked before
+    // returning, so a slow web client never holds up pa-gitd and a short
+    // transfer is noticed before any headers are sent.
+    static function repo_gitd_blob($repo, $spec) {
+        if (!($f = self::repo_gitd_open($repo, array("blob", $spec))))
+            return false;
+        $status = fgets($f);
+        if ($status === "ok\n"
+            && preg_match('/\A(\d+) (\S+)\n\z/', (string) fgets($f), $m)
+            && ($spool = fopen("php://temp/maxmemory:" . (2 << 20), "w+b"))) {
+            $n = stream_copy_to_stream($f, $spool);
+            fclose($f);
+            if ($n !== +$m[1]) {
+                fclose($spool);
+                return false;
+            }
+            rewind($spool);
+            return array(+$m[1], $m[2], $spool);
+        }
+        fclose($f);
+        return substr($status, 0, 6) === "error " ? null : false;
+    }
+
+    static function repo_gitquery($repo, $args, $shell_suffix = "") {
+        $result = self::repo_gitd($repo, $args);
+        if ($result === false)
+            $result = self::repo_gitrun($repo, "git " . join(" ", array_map("escapeshellarg", $args)) . $shell_suffix);
+        return $result;
+    }
+
     static function repo_ls_files($repo, $tree, $files = array()) {
-        $suffix = "";
+        $args = array("ls-tree", "-r", "--name-only", $tree);
         if (is_string($files))
             $files = array($files);
         foreach ($files as $f)
-            $suffix .= " " . escapeshellarg(preg_replace(',/+\z,', '', $f));
-        $result = self::repo_gitrun($repo, "git ls-tree -r --name-only $tree" . $suffix);
+            $args[] = preg_replace(',/+\z,', '', $f);
+        $result = self::repo_gitquery($repo, $args);
         $x = explode("\n", $result);
         if (count($x) && $x[count($x) - 1] == "")
             array_pop($x);
         return $x;
     }
 
-    static function repo_author_emails($repo, $pset = null, $limit = null) {
+    static private function repo_log_args($pset, $limit, $format, $head) {
+        $args = array("log");
+        if ($limit)
+            $args[] = "-n$limit";
+        array_push($args, "--simplify-merges", "--format=$format", $head);
         if (is_object($pset) && $pset->directory_noslash !== "")
-            $dir = " -- " . escapeshellarg($pset->directory_noslash);
+            array_push($args, "--", $pset->directory_noslash);
         else if (is_string($pset) && $pset !== "")
-            $dir = " -- " . escapeshellarg($pset);
-        else
-            $dir = "";
-        $limit = $limit ? " -n$limit" : "";
+            array_push($args, "--", $pset);
+        return $args;
+    }
+
+    static function repo_author_emails($repo, $pset = null, $limit = null) {
         $users = array();
         $heads = explode(" ", $repo->heads);
         $heads[0] = "REPO/master";
         foreach ($heads as $h) {
-            $result = self::repo_gitrun($repo, "git log$limit --simplify-merges --format=%ae $h$dir");
+            $result = self::repo_gitquery($repo, self::repo_log_args($pset, $limit, "%ae", $h));
             foreach (explode("\n", $result) as $line)
                 if ($line !== "")
                     $users[strtolower($line)] = $line;
@@ -1455,18 +1522,11 @@ class Contact {
     }
 
     static function repo_recent_commits($repo, $pset = null, $limit = null) {
-        if (is_object($pset) && $pset->directory_noslash !== "")
-            $dir = " -- " . escapeshellarg($pset->directory_noslash);
-        else if (is_string($pset) && $pset !== "")
-            $dir = " -- " . escapeshellarg($pset);
-        else
-            $dir = "";
-        $limit = $limit ? " -n$limit" : "";
         $list = array();
         $heads = explode(" ", $repo->heads);
         $heads[0] = "REPO/master";
         foreach ($heads as $h) {
-            $result = self::repo_gitrun($repo, "git log$limit --simplify-merges --format='%ct %H %s' $h$dir");
+            $result = self::repo_gitquery($repo, self::repo_log_args($pset, $limit, "%ct %H %s", $h));
             foreach (explode("\n", $result) as $line)
                 if (preg_match(',\A(\S+)\s+(\S+)\s+(.*)\z,', $line, $m)
                     && !isset($list[$m[2]]))
@@ -1505,8 +1565,8 @@ class Contact {
         if ($pset && $Conf->setting("__gitignore_pset{$pset->id}_at", 0) < $Now - 900) {
             $hrepo = self::handout_repo($pset, $repo);
             if ($pset->directory_slash !== "")
-                $result = self::repo_gitrun($repo, "git show repo{$hrepo->repoid}/master:" . escapeshellarg($pset->directory_slash) . ".gitignore 2>/dev/null");
-            $result .= self::repo_gitrun($repo, "git show repo{$hrepo->repoid}/master:.gitignore 2>/dev/null");
+                $result = self::repo_gitquery($repo, array("show", "repo{$hrepo->repoid}/master:{$pset->directory_slash}.gitignore"), " 2>/dev/null");
+            $result .= self::repo_gitquery($repo, array("show", "repo{$hrepo->repoid}/master:.gitignore"), " 2>/dev/null");
             $Conf->save_setting("__gitignore_pset{$pset->id}_at", $Now);
             $Conf->save_setting("gitignore_pset{$pset->id}", 1, $result);
         }
@@ -1537,6 +1597,18 @@ class Contact {
     }
 
     static private function _repo_prepare_truncated_handout($repo, $base, $pset) {
+        global $ConfSitePATH;
+        // pa-gitfetch writes the commit directly, reusing the handout's tree
+        $pa_gitfetch = "$ConfSitePATH/jail/pa-gitfetch";
+        if (is_executable($pa_gitfetch)) {
+            $branch = trim(shell_exec(escapeshellarg($pa_gitfetch) . " truncate "
+                                      . escapeshellarg("$ConfSitePATH/repo/repo$repo->cacheid") . " "
+                                      . escapeshellarg($base) . " "
+                                      . escapeshellarg($pset->directory_noslash)));
+            if (preg_match('/\Atruncated_[0-9a-f]{40}\z/', $branch))
+                return $branch;
+        }
+
         $commit = trim(self::repo_gitrun($repo, "git log --format=%H -n1 $base"));
         $check_tag = trim(self::repo_gitrun($repo, "test -f .git/refs/heads/truncated_$commit && echo yes"));
         if ($check_tag == "yes")
@@ -1604,13 +1676,12 @@ class Contact {
         $diff_files = array();
         assert($pset); // code remains for `!$pset`; maybe revive it?
 
-        $psetdir = $pset ? escapeshellarg($pset->directory_noslash) : null;
         if (isset($repo->truncated_psetdir) && $pset
             && defval($repo->truncated_psetdir, $pset->id)) {
             $repodir = "";
             $truncpfx = $pset->directory_noslash . "/";
         } else {
-            $repodir = $psetdir . "/"; // Some gits don't do `git show HASH:./FILE`!
+            $repodir = $pset->directory_noslash . "/"; // Some gits don't do `git show HASH:./FILE`!
             $truncpfx = "";
         }
 
@@ -1630,17 +1701,17 @@ class Contact {
         $pset_diffs = self::pset_diffinfo($pset, $repo);
         foreach ($pset_diffs as $diffinfo)
             if ($diffinfo->full && ($fname = self::unquote_filename_regex($diffinfo->regex)) !== false) {
-                $result = self::repo_gitrun($repo, "git show $hash:${repodir}$fname");
+                $result = self::repo_gitquery($repo, array("show", "$hash:{$repodir}$fname"));
                 $fdiff = array();
                 foreach (explode("\n", $result) as $idx => $line)
                     $fdiff[] = array("+", 0, $idx + 1, $line);
                 self::save_repo_diff($diff_files, "{$pset->directory_slash}$fname", $fdiff, $diffinfo, count($fdiff) ? 1 : 0);
             }
 
-        $command = "git diff --name-only $base $hash";
+        $args = array("diff", "--name-only", $base, $hash);
         if ($pset && !$truncpfx)
-            $command .= " -- " . escapeshellarg($pset->directory_noslash);
-        $result = self::repo_gitrun($repo, $command);
+            array_push($args, "--", $pset->directory_noslash);
+        $result = self::repo_gitquery($repo, $args);
 
         $files = array();
         foreach (explode("\n", $result) as $line)
@@ -1654,10 +1725,27 @@ class Contact {
                     && (!@$options["needfiles"]
                         || !@$options["needfiles"][$truncpfx . $line]))
                     continue;
-                $files[] = escapeshellarg(quotemeta($line));
+                $files[] = $line;
             }
 
+        // pa-gitd computes the records itself and caches them by blob pair
+        $records = null;
         if (count($files)) {
+            $args = array("diff-records", "--max-lines=" . DiffInfo::MAXLINES);
+            if (@$options["wdiff"])
+                $args[] = "-w";
+            array_push($args, $base, $hash, "--");
+            $result = self::repo_gitd($repo, array_merge($args, $files));
+            if (is_string($result))
+                $records = json_decode($result, true);
+        }
+        if (is_array($records)) {
+            foreach ($records as $f) {
+                $file = $truncpfx . $f["file"];
+                self::save_repo_diff($diff_files, $file, $f["diff"], self::find_diffinfo($pset_diffs, $file), $f["blineno"]);
+            }
+        } else if (count($files)) {
+            $files = array_map(function ($f) { return escapeshellarg(quotemeta($f)); }, $files);
             $command = "git diff";
             if (@$options["wdiff"])
                 $command .= " -w";
@@ -184,6 +184,10 @@ class ContactView {
             unlink($lockfn);
             unlink($logfn . ".in");
         }
+        if ($json->done
+            && ($du = @file_get_contents($logfn . ".du"))
+            && ($du = json_decode($du)))
+            $json->disk_usage = $du;
         return $json;
     }
 
@@ -243,7 +247,7 @@ class ContactView {
                               "timestamp" => $checkt);
     }
 
-    static function runner_json($info, $checkt, $offset = -1) {
+    static function runner_json($info, $checkt, $offset = -1, $screen = false) {
         if (ctype_digit($checkt))
             $logfn = self::runner_logfile($info, $checkt);
         else if (preg_match(',\.(\d+)\.log(?:\.lock|\.pid)?\z,', $checkt, $m)) {
@@ -252,6 +256,17 @@ class ContactView {
         } else
             return false;
 
+        // a client starting from scratch can take the screen snapshot
+        // and only the output after it
+        $snapshot = null;
+        if ($screen && $offset < 0
+            && ($snapshot = @file_get_contents($logfn . ".screen"))
+            && ($snapshot = json_decode($snapshot))
+            && is_int(@$snapshot->offset))
+            $offset = $snapshot->offset;
+        else
+            $snapshot = null;
+
         $data = @file_get_contents($logfn, false, null, $offset);
         if ($data === false)
             return (object) array("error" => true, "message" => "No such log");
@@ -261,6 +276,8 @@ class ContactView {
         $json->data = $data;
         $json->offset = max($offset, 0);
         $json->lastoffset = $json->offset + strlen($data);
+        if ($snapshot)
+            $json->screen = $snapshot;
         self::runner_status_json($info, $checkt, $json);
         return $json;
     }
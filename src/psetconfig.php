@@ -64,6 +64,10 @@ class Pset {
     public $run_skeletondir;
     public $run_jailfiles;
     public $run_binddir;
+    public $run_tmpfs_root;
+    public $run_tmp_size;
+    public $run_disk_limit;
+    public $run_sanitize;
     public $run_timeout;
 
     public $diffs = array();
@@ -196,6 +200,10 @@ class Pset {
         if ($this->run_timeout === null) // default run_timeout is 10m
             $this->run_timeout = 600;
         $this->run_binddir = self::cstr($p, "run_binddir");
+        $this->run_tmpfs_root = self::cstr($p, "run_tmpfs_root");
+        $this->run_tmp_size = self::cstr($p, "run_tmp_size");
+        $this->run_disk_limit = self::cstr($p, "run_disk_limit");
+        $this->run_sanitize = self::cstr($p, "run_sanitize");
 
         // diffs
         if (is_array(@$p->diffs) || is_object(@$p->diffs)) {
@@ -374,6 +382,8 @@ class RunnerConfig {
     public $queue;
     public $nconcurrent;
     public $priority;
+    public $cacheable;
+    public $sched_class;
 
     public function __construct($name, $r) {
         $loc = array("runners", $name);
@@ -399,6 +409,8 @@ class RunnerConfig {
         $this->queue = Pset::cstr($loc, $r, "queue");
         $this->nconcurrent = Pset::cint($loc, $r, "nconcurrent");
         $this->priority = Pset::cnum($loc, $r, "priority");
+        $this->cacheable = Pset::cbool($loc, $r, "cacheable");
+        $this->sched_class = Pset::cstr($loc, $r, "sched_class");
     }
 }
 
@@ -128,7 +128,10 @@ class RunnerState {
 
         // create jail
         $this->remove_old_jails();
-        if ($this->run_and_log("jail/pa-jail init " . escapeshellarg($this->jaildir) . " " . escapeshellarg($this->username)))
+        $command = "jail/pa-jail init";
+        if (($tmpfsroot = $this->pset->run_tmpfs_root ? : @$Opt["run_tmpfs_root"]))
+            $command .= " --tmpfs-root " . escapeshellarg($tmpfsroot);
+        if ($this->run_and_log($command . " " . escapeshellarg($this->jaildir) . " " . escapeshellarg($this->username)))
             throw new RunnerException("can't initialize jail");
 
         // check out code
@@ -162,6 +165,27 @@ class RunnerState {
             $command .= " -T" . $this->pset->run_timeout;
         if ($this->inputfifo)
             $command .= " -i" . escapeshellarg($this->inputfifo);
+        if (($tmpsize = $this->pset->run_tmp_size ? : @$Opt["run_tmp_size"]))
+            $command .= " --tmp-size " . escapeshellarg($tmpsize);
+        if (($disklimit = $this->pset->run_disk_limit ? : @$Opt["run_disk_limit"]))
+            $command .= " --disk-limit " . escapeshellarg($disklimit);
+        if (($sanitize = $this->pset->run_sanitize ? : @$Opt["run_sanitize"]))
+            $command .= " --sanitize " . escapeshellarg($sanitize);
+        $command .= " --usage-file " . escapeshellarg($this->logfile . ".du");
+        // a [buildcache] is shared only among runs on the same repository
+        $command .= " --buildcache-key repo" . $this->repo->repoid;
+        if (@$Opt["run_events"])
+            $command .= " --events " . escapeshellarg($this->logfile . ".sock");
+        $command .= " --screen " . escapeshellarg($this->logfile . ".screen");
+        $schedclass = $this->runner->sched_class ? : ($this->runner->eval ? "batch" : "interactive");
+        $command .= " --sched-class " . escapeshellarg($schedclass)
+            . " --sched-group " . escapeshellarg("pset" . $this->pset->id);
+        if ($this->runner->cacheable) {
+            $cachedir = @$Opt["run_cachedir"] ? : $ConfSitePATH . "/log/runcache";
+            if (is_dir($cachedir) || mkdir($cachedir, 02770, true))
+                $command .= " --cache " . escapeshellarg($cachedir)
+                    . " --cache-key " . escapeshellarg($this->runner->name);
+        }
         $command .= " " . escapeshellarg($homedir)
             . " " . escapeshellarg($this->username)
             . " " . escapeshellarg($this->runner->command);
@@ -183,7 +207,7 @@ class RunnerState {
     }
 
     private function checkout_code() {
-        global $ConfSitePATH, $Now;
+        global $ConfSitePATH, $Opt;
 
         $checkoutdir = $this->jailhomedir . "/repo";
         if (isset($this->repo->truncated_psetdir)
@@ -197,23 +221,17 @@ class RunnerState {
 
         $repodir = $ConfSitePATH . "/repo/repo" . $this->repo->cacheid;
 
-        // need a branch to check out a specific commit
-        $branch = "jailcheckout_$Now";
-        if ($this->run_and_log("cd " . escapeshellarg($repodir) . " && git branch $branch " . $this->info->commit_hash()))
-            throw new RunnerException("can't create branch for checkout");
-
         // make the checkout
-        $status = $this->run_and_log("cd " . escapeshellarg($checkoutdir) . " && "
-                                     . "if test ! -d .git; then git init --shared=group; fi && "
-                                     . "git fetch " . escapeshellarg($repodir) . " $branch && "
-                                     . "git reset --hard " . $this->info->commit_hash());
-
-        $this->run_and_log("cd " . escapeshellarg($repodir) . " && git branch -D $branch");
-
-        if ($status)
+        $command = "jail/pa-jail checkout";
+        if (($blobcache = @$Opt["run_blobcache"]))
+            $command .= " --blob-cache " . escapeshellarg($blobcache);
+        $command .= " " . escapeshellarg($repodir)
+            . " " . $this->info->commit_hash()
+            . " " . escapeshellarg($checkoutdir);
+        if ($this->run_and_log($command))
             throw new RunnerException("can't check out code into jail");
 
-        if ($this->run_and_log("cd " . escapeshellarg($checkoutdir) . " && rm -rf .git .gitcheckout"))
+        if ($this->run_and_log("cd " . escapeshellarg($checkoutdir) . " && rm -rf .gitcheckout"))
             throw new RunnerException("can't clean up checkout in jail");
 
         // create overlay
@@ -222,19 +240,18 @@ class RunnerState {
     }
 
     public function checkout_overlay($checkoutdir, $overlayfile) {
-        global $ConfSitePATH;
+        global $ConfSitePATH, $Opt;
 
         if ($overlayfile[0] != "/")
             $overlayfile = $ConfSitePATH . "/" . $overlayfile;
         $overlayfile = $this->expand($overlayfile);
-        if ($this->run_and_log("cd " . escapeshellarg($checkoutdir) . " && tar -xf " . escapeshellarg($overlayfile)))
+        // unpacks the overlay, then handles `.gitcheckout` `rm:` lines
+        $command = "jail/pa-jail overlay";
+        if (($overlaycache = @$Opt["run_overlaycache"]))
+            $command .= " --overlay-cache " . escapeshellarg($overlaycache);
+        if ($this->run_and_log($command . " " . escapeshellarg($overlayfile)
+                               . " " . escapeshellarg($checkoutdir)))
             throw new RunnerException("can't unpack overlay");
-
-        $checkout_instructions = @file_get_contents($checkoutdir . "/.gitcheckout");
-        if ($checkout_instructions)
-            foreach (explode("\n", $checkout_instructions) as $text)
-                if (substr($text, 0, 3) === "rm:")
-                    $this->run_and_log("cd " . escapeshellarg($checkoutdir) . " && rm -rf " . escapeshellarg(substr($text, 3)));
     }
 
     private function add_run_settings($s) {